@@ -1,5 +1,8 @@
 #include "bluetrax.h"
 
+#include <math.h>
+#include <time.h>
+
 /**
  * Taken from
  * https://raw.github.com/writefaruq/bluez/devel/tools/hciconfig.c
@@ -110,7 +113,7 @@ char *bluetrax_get_minor_device_name(int major, int minor)
       }
       break;
     case 5:	/* peripheral */ {
-                                   static char cls_str[48];
+                                   static __thread char cls_str[48];
 
                                    cls_str[0] = '\0';
 
@@ -199,3 +202,191 @@ char *bluetrax_get_minor_device_name(int major, int minor)
   }
   return "Unknown (reserved) minor device class";
 }
+
+size_t bluetrax_scan_record_size(int type)
+{
+  switch (type) {
+    case EVT_INQUIRY_COMPLETE:
+      return sizeof(bluetrax_inquiry_complete_t);
+    case EVT_INQUIRY_RESULT:
+      return sizeof(bluetrax_inquiry_result_t);
+    case EVT_INQUIRY_RESULT_WITH_RSSI:
+      return sizeof(bluetrax_inquiry_result_with_rssi_t);
+    case BLUETRAX_TRACE:
+      return sizeof(bluetrax_trace_t);
+  }
+  return 0;
+}
+
+int bluetrax_read_scan_record(FILE *file, bluetrax_scan_record_t *record)
+{
+  size_t size;
+
+  record->type = fgetc(file);
+  if (record->type == EOF)
+    return 0;
+
+  size = bluetrax_scan_record_size(record->type);
+  if (size == 0)
+    return -1;
+
+  if (1 != fread(&record->data, size, 1, file))
+    return 0;
+
+  return 1;
+}
+
+const char *bluetrax_hop_name(int hop)
+{
+  static const char *names[BLUETRAX_TRACE_HOPS] = {
+    "total", "dispatch", "commit", "send", "ingest", "visible"
+  };
+
+  return hop >= 0 && hop < BLUETRAX_TRACE_HOPS ? names[hop] : "?";
+}
+
+int64_t bluetrax_trace_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Bucket for a latency, and the longest latency in a bucket; see
+ * bluetrax_latency_t.
+ */
+static int latency_bucket(int64_t usec)
+{
+  int e, i;
+
+  if (usec < 8)
+    return usec < 0 ? 0 : (int)usec;
+  e = 63 - __builtin_clzll(usec);
+  i = 4 * (e - 1) + (int)((usec >> (e - 2)) & 3);
+  return i < BLUETRAX_LATENCY_BUCKETS ? i : BLUETRAX_LATENCY_BUCKETS - 1;
+}
+
+static int64_t latency_bucket_max(int i)
+{
+  int e = i / 4 + 1;
+
+  if (i < 8)
+    return i;
+  return ((int64_t)(5 + i % 4) << (e - 2)) - 1;
+}
+
+void bluetrax_latency_add(bluetrax_latency_t *latency, int64_t usec)
+{
+  ++latency->count[latency_bucket(usec)];
+}
+
+uint64_t bluetrax_latency_count(const bluetrax_latency_t *latency)
+{
+  uint64_t n = 0;
+  int i;
+
+  for (i = 0; i < BLUETRAX_LATENCY_BUCKETS; ++i)
+    n += latency->count[i];
+  return n;
+}
+
+int64_t bluetrax_latency_quantile(const bluetrax_latency_t *latency, double q)
+{
+  uint64_t n = bluetrax_latency_count(latency), seen = 0;
+  int i;
+
+  if (n == 0)
+    return 0;
+  for (i = 0; i < BLUETRAX_LATENCY_BUCKETS - 1; ++i) {
+    seen += latency->count[i];
+    if (seen >= q * n && seen > 0)
+      break;
+  }
+  return latency_bucket_max(i);
+}
+
+void bluetrax_latency_format(const bluetrax_latency_t *latency, char *buf,
+    size_t size)
+{
+  snprintf(buf, size, "n=%llu p50=%.3fms p90=%.3fms p99=%.3fms max=%.3fms",
+      (unsigned long long)bluetrax_latency_count(latency),
+      bluetrax_latency_quantile(latency, 0.5) / 1e3,
+      bluetrax_latency_quantile(latency, 0.9) / 1e3,
+      bluetrax_latency_quantile(latency, 0.99) / 1e3,
+      bluetrax_latency_quantile(latency, 1) / 1e3);
+}
+
+void bluetrax_latency_add_trace(bluetrax_latency_t *latency,
+    const int64_t *hop, int last)
+{
+  int i, prev = BLUETRAX_HOP_HCI;
+
+  if (hop[BLUETRAX_HOP_HCI] == 0)
+    return;
+  for (i = BLUETRAX_HOP_HCI + 1; i <= last && i < BLUETRAX_TRACE_HOPS; ++i) {
+    if (hop[i] == 0)
+      continue;
+    bluetrax_latency_add(&latency[i], hop[i] - hop[prev]);
+    prev = i;
+  }
+  if (prev != BLUETRAX_HOP_HCI)
+    bluetrax_latency_add(&latency[0], hop[prev] - hop[BLUETRAX_HOP_HCI]);
+}
+
+uint64_t bluetrax_mix64(uint64_t h)
+{
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+uint64_t bluetrax_hash_bdaddr(const bdaddr_t *bdaddr)
+{
+  uint64_t h = 0;
+  int i;
+
+  for (i = 0; i < 6; ++i)
+    h = h << 8 | bdaddr->b[i];
+  return bluetrax_mix64(h);
+}
+
+void bluetrax_hll_add(unsigned char *registers, uint32_t bits, uint64_t h)
+{
+  uint64_t rest = h << bits;
+  unsigned char rank = 1;
+
+  while (rank <= 64 - bits && !(rest & (1ULL << 63))) {
+    rest <<= 1;
+    ++rank;
+  }
+  if (registers[h >> (64 - bits)] < rank)
+    registers[h >> (64 - bits)] = rank;
+}
+
+double bluetrax_hll_estimate(const unsigned char *registers, uint32_t bits)
+{
+  double m = (double)(1 << bits), sum = 0, alpha, estimate;
+  int i, zeros = 0;
+
+  for (i = 0; i < (1 << bits); ++i) {
+    sum += ldexp(1.0, -registers[i]);
+    zeros += registers[i] == 0;
+  }
+
+  switch (bits) {
+    case 4: alpha = 0.673; break;
+    case 5: alpha = 0.697; break;
+    case 6: alpha = 0.709; break;
+    default: alpha = 0.7213 / (1 + 1.079 / m);
+  }
+
+  estimate = alpha * m * m / sum;
+  if (estimate <= 2.5 * m && zeros > 0)
+    estimate = m * log(m / zeros);
+  return estimate;
+}
@@ -1,6 +1,8 @@
 #ifndef _BLUETRAX_H_
 #define _BLUETRAX_H_
 
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <bluetooth/bluetooth.h>
@@ -41,6 +43,83 @@ typedef struct {
   int8_t         rssi;
 } __attribute__((packed)) bluetrax_inquiry_result_with_rssi_t;
 
+/**
+ * Type byte for a trace record. The other record types are the HCI event codes
+ * that they correspond to; this is the code for vendor specific events, which
+ * the scanner never records.
+ */
+#define BLUETRAX_TRACE 0xff
+
+/**
+ * The points at which a batch of records is stamped on its way from the
+ * adapter to a query. The first is where each batch's latency starts from, and
+ * the last is never written into the record; it is the time at which the
+ * reader that takes it in makes the batch visible to queries.
+ */
+enum {
+  BLUETRAX_HOP_HCI,       /* kernel's timestamp for the batch's first frame */
+  BLUETRAX_HOP_DISPATCH,  /* bluetrax_scan handled that frame */
+  BLUETRAX_HOP_COMMIT,    /* bluetrax_scan wrote the batch out */
+  BLUETRAX_HOP_SEND,      /* bluetrax_upload sent it */
+  BLUETRAX_HOP_INGEST,    /* bluetrax_collect wrote it to the sensor's file */
+  BLUETRAX_HOP_VISIBLE,   /* e.g. bluetrax_detections put it in a partition */
+  BLUETRAX_TRACE_HOPS
+};
+
+/**
+ * Record written by bluetrax_scan --trace after a batch of records, with the
+ * times at which the batch passed each hop so far. The programs downstream
+ * fill in their hops as the record goes by; a hop that the batch has not been
+ * through (e.g. a file that was copied rather than uploaded) is 0. The time is
+ * that of the batch's last frame, so the records stay in time order.
+ *
+ * The times are in microseconds since the epoch, on the clock of the machine
+ * that wrote them, so latencies between machines are only as good as their
+ * clocks' agreement.
+ */
+typedef struct {
+  struct timeval time;
+  int64_t        hop[BLUETRAX_HOP_VISIBLE];
+} __attribute__((packed)) bluetrax_trace_t;
+
+/**
+ * Any of the records written by bluetrax_scan. In the file, each record is
+ * preceded by a byte that gives its type, which is the HCI event code that it
+ * corresponds to (EVT_INQUIRY_COMPLETE, etc.).
+ *
+ * All of the record types start with the time, so data.complete.time is valid
+ * for any type.
+ */
+typedef struct {
+  int type;
+  union {
+    bluetrax_inquiry_complete_t         complete;
+    bluetrax_inquiry_result_t           result;
+    bluetrax_inquiry_result_with_rssi_t result_with_rssi;
+    bluetrax_trace_t                    trace;
+  } data;
+} bluetrax_scan_record_t;
+
+/**
+ * Longest record written by bluetrax_scan, with its type byte.
+ */
+#define BLUETRAX_MAX_RECORD_SIZE (1 + sizeof(bluetrax_trace_t))
+
+/**
+ * Header for each frame in a file written by 'hcidump -w' (hcidump's own
+ * format, which is the default). The header is followed by len bytes of the
+ * frame, starting with the packet type byte (e.g. HCI_EVENT_PKT). The len
+ * field is little endian (use btohs); in is 1 for frames received from the
+ * controller and 0 for frames sent to it.
+ */
+typedef struct {
+  uint16_t len;
+  uint8_t  in;
+  uint8_t  pad;
+  uint32_t ts_sec;
+  uint32_t ts_usec;
+} __attribute__((packed)) bluetrax_hcidump_hdr_t;
+
 /**
  * Record for the basic scan.
  */
@@ -52,8 +131,114 @@ typedef struct {
 /**
  * String for the minor device class.
  *
- * @return pointer to string in static storage
+ * @return pointer to string in static storage; the storage is thread local, so
+ *         this can be called from several threads at once
  */
 char *bluetrax_get_minor_device_name(int major, int minor);
 
+/**
+ * Size of the record that follows a type byte in bluetrax_scan output.
+ *
+ * @return size in bytes, or 0 if type is not a known record type
+ */
+size_t bluetrax_scan_record_size(int type);
+
+/**
+ * Read the next record written by bluetrax_scan.
+ *
+ * If the file ends part way through a record, which is normal when reading a
+ * file that bluetrax_scan is still writing to, this returns 0 and the partial
+ * record should be read again later, from the same offset. To tell this from
+ * a clean end of file, check record->type, which is EOF only in the latter.
+ *
+ * @return 1 if a record was read; 0 at end of file; -1 if the type byte is not
+ *         a known record type, in which case the rest of the file can't be read
+ */
+int bluetrax_read_scan_record(FILE *file, bluetrax_scan_record_t *record);
+
+/**
+ * Histogram of latencies in microseconds, with buckets that grow in
+ * proportion to the latency: bucket 0 has latencies of 0 or less (which happen
+ * only when clocks disagree), buckets 1 to 7 have 1 to 7us, and then each
+ * power of 2 is split into 4 buckets, so a latency is known to within 25%. The
+ * last bucket, from about 2 hours, has all of the longer ones too.
+ */
+#define BLUETRAX_LATENCY_BUCKETS 128
+
+typedef struct {
+  uint32_t count[BLUETRAX_LATENCY_BUCKETS];
+} bluetrax_latency_t;
+
+/**
+ * Name of a hop, for reports. The histogram for BLUETRAX_HOP_HCI, which has no
+ * latency of its own, is used for the latency from end to end, so its name is
+ * "total".
+ */
+const char *bluetrax_hop_name(int hop);
+
+/**
+ * Current time, in microseconds since the epoch, as for a hop.
+ */
+int64_t bluetrax_trace_now(void);
+
+void bluetrax_latency_add(bluetrax_latency_t *latency, int64_t usec);
+
+uint64_t bluetrax_latency_count(const bluetrax_latency_t *latency);
+
+/**
+ * Upper bound of the bucket that holds the given quantile.
+ *
+ * @param q in [0, 1]
+ *
+ * @return microseconds; 0 if there are no latencies
+ */
+int64_t bluetrax_latency_quantile(const bluetrax_latency_t *latency,
+    double q);
+
+/**
+ * Summarize a histogram on one line, with its count and its p50, p90, p99
+ * and maximum, in milliseconds, for a log message.
+ */
+void bluetrax_latency_format(const bluetrax_latency_t *latency, char *buf,
+    size_t size);
+
+/**
+ * Add the latencies of each hop in a trace record to latency[hop], from the
+ * last hop before it that has a time, and the latency from the HCI hop to the
+ * last one with a time to latency[0].
+ *
+ * @param latency array of BLUETRAX_TRACE_HOPS histograms
+ *
+ * @param hop times, as in the record, with BLUETRAX_TRACE_HOPS entries
+ *
+ * @param last only add hops up to and including this one
+ */
+void bluetrax_latency_add_trace(bluetrax_latency_t *latency,
+    const int64_t *hop, int last);
+
+/**
+ * The splitmix64 finalizer, which spreads any 64 bit value evenly over the
+ * 64 bits of the result.
+ */
+uint64_t bluetrax_mix64(uint64_t h);
+
+/**
+ * 64 bit hash of a device address, for sketches and for spreading devices
+ * over shards or tables; the same in every program, so that their sketches
+ * can be merged.
+ */
+uint64_t bluetrax_hash_bdaddr(const bdaddr_t *bdaddr);
+
+/**
+ * Add a hashed device to a HyperLogLog sketch, which has 2^bits one byte
+ * registers.
+ */
+void bluetrax_hll_add(unsigned char *registers, uint32_t bits, uint64_t h);
+
+/**
+ * Estimate the number of distinct devices in a HyperLogLog sketch of 2^bits
+ * registers, with the usual linear counting correction for small counts.
+ */
+double bluetrax_hll_estimate(const unsigned char *registers, uint32_t bits);
+
 #endif /* guard */
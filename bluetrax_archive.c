@@ -0,0 +1,903 @@
+/*
+ * Columnar archive of bluetrax_scan records, which can be queried without
+ * decoding it.
+ *
+ * --encode reads bluetrax_scan output and writes the archive, in blocks of up
+ * to --block records. In each block, the devices are replaced by ids into a
+ * dictionary of the block's distinct (address, class) pairs, sorted by address,
+ * and the times by their offsets from the block's earliest time, and each field
+ * is stored as a fixed width column. A record is then 8 bytes rather than up
+ * to 27, and --decode gives back the same records (except for trace records,
+ * which are dropped).
+ *
+ * Queries run on the encoded columns, and decode only the records they write:
+ * - a block whose time span is outside --start to --end is skipped, and one
+ *   that is inside it is taken whole, without looking at its times; otherwise,
+ *   the range is turned into one of offsets, and compared with the time column
+ * - --addr (a full address or an OUI prefix, as for bluetrax_search) is looked
+ *   up in each block's dictionary, where it is a range of ids; a block that
+ *   does not have it is skipped, and otherwise only the id column is compared
+ * - --count counts the matching detections of each device on the id column,
+ *   and looks the ids up in the dictionary once per block
+ * - --distinct takes the devices straight from the dictionary for a block that
+ *   is wholly in the time range, without looking at its records at all
+ * Without --count or --distinct, the matching records are written in
+ * bluetrax_scan format, e.g. for bluetrax_scan_unpack.
+ *
+ * Format: the magic number and a reserved word, then the blocks. Each block is
+ * an archive_block_t header and then its columns:
+ *   delta (uint32 for each record): time minus the block's base, in us
+ *   id (uint16 for each record): index in the dictionary, or NO_DEVICE for
+ *     an 'inquiry complete' record
+ *   type (uint8 for each record): the record type
+ *   rssi (int8 for each record): 0 if the type has no RSSI
+ *   dictionary (9 bytes for each device): address, most significant byte
+ *     first, and the 3 class bytes, as in the records; sorted
+ * and then padding to a multiple of 8 bytes, so the columns are aligned. All
+ * numbers are in the host's byte order, as in bluetrax_scan output.
+ */
+#include "bluetrax.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Identifies (and versions) the format.
+ */
+#define ARCHIVE_MAGIC 0x52415442 /* "BTAR" */
+
+#define DEFAULT_BLOCK 16384
+
+/**
+ * Ids are 16 bits, and one value is kept for records with no device.
+ */
+#define MAX_BLOCK 65535
+#define NO_DEVICE 0xffff
+
+#define DICTIONARY_ENTRY_SIZE 9
+
+typedef struct {
+  uint32_t size;          /* of the block, with this header and padding */
+  uint32_t num_records;
+  uint32_t num_devices;   /* in the dictionary */
+  uint32_t span;          /* largest delta */
+  int64_t  base;          /* earliest time in the block, in microseconds */
+} archive_block_t;
+
+/**
+ * The columns of a block, in place.
+ */
+typedef struct {
+  const archive_block_t *header;
+  const uint32_t        *delta;
+  const uint16_t        *id;
+  const uint8_t         *type;
+  const int8_t          *rssi;
+  const uint8_t         *dictionary;
+} block_columns_t;
+
+/**
+ * Size of a block with n records and d devices, with its header and padding.
+ */
+static size_t block_size(size_t n, size_t d) {
+  size_t size = sizeof(archive_block_t) + n * 8 + d * DICTIONARY_ENTRY_SIZE;
+
+  return (size + 7) & ~(size_t)7;
+}
+
+/**
+ * Find the columns of a block that starts at data, checking that it fits in
+ * the size bytes that are there.
+ *
+ * @return 0 if it is valid
+ */
+static int get_columns(const uint8_t *data, size_t size,
+    block_columns_t *block) {
+  const archive_block_t *header = (const archive_block_t *)data;
+  const uint8_t *p;
+
+  if (size < sizeof(archive_block_t) || header->num_records > MAX_BLOCK ||
+      header->num_devices > header->num_records ||
+      header->size != block_size(header->num_records, header->num_devices) ||
+      header->size > size)
+    return -1;
+
+  p = data + sizeof(archive_block_t);
+  block->header = header;
+  block->delta = (const uint32_t *)p;
+  p += header->num_records * sizeof(uint32_t);
+  block->id = (const uint16_t *)p;
+  p += header->num_records * sizeof(uint16_t);
+  block->type = p;
+  p += header->num_records;
+  block->rssi = (const int8_t *)p;
+  p += header->num_records;
+  block->dictionary = p;
+  return 0;
+}
+
+/**
+ * Address as a number, most significant byte first, from a dictionary entry.
+ */
+static uint64_t entry_addr(const uint8_t *entry) {
+  uint64_t addr = 0;
+  int i;
+
+  for (i = 0; i < 6; ++i)
+    addr = addr << 8 | entry[i];
+  return addr;
+}
+
+/**
+ * Rebuild record i of a block.
+ */
+static void decode_record(const block_columns_t *block, uint32_t i,
+    bluetrax_scan_record_t *record) {
+  const uint8_t *entry;
+  int64_t time = block->header->base + block->delta[i];
+  int k;
+
+  bzero(record, sizeof(*record));
+  record->type = block->type[i];
+  record->data.complete.time.tv_sec = time / 1000000;
+  record->data.complete.time.tv_usec = time % 1000000;
+  if (block->id[i] == NO_DEVICE)
+    return;
+
+  /* a result with rssi starts like a result */
+  entry = block->dictionary + block->id[i] * DICTIONARY_ENTRY_SIZE;
+  for (k = 0; k < 6; ++k)
+    record->data.result.bdaddr.b[k] = entry[5 - k];
+  memcpy(record->data.result.dev_class, entry + 6, 3);
+  if (record->type == EVT_INQUIRY_RESULT_WITH_RSSI)
+    record->data.result_with_rssi.rssi = block->rssi[i];
+}
+
+static void write_record(FILE *out, bluetrax_scan_record_t *record) {
+  putc(record->type, out);
+  fwrite(&record->data, bluetrax_scan_record_size(record->type), 1, out);
+}
+
+/*
+ * Encoding.
+ */
+
+/**
+ * A record waiting to be written, with the key that its id comes from.
+ */
+typedef struct {
+  uint8_t  key[DICTIONARY_ENTRY_SIZE];
+  uint32_t row;
+} pending_key_t;
+
+typedef struct {
+  uint32_t       max_records;
+  uint32_t       num_records;
+  int64_t       *time;
+  uint8_t       *type;
+  int8_t        *rssi;
+  pending_key_t *keys;        /* for the records with devices */
+  uint32_t       num_keys;
+  uint16_t      *id;
+  uint8_t       *buf;         /* for the block as written */
+} encoder_t;
+
+static int compare_keys(const void *a, const void *b) {
+  const pending_key_t *x = a, *y = b;
+  int c = memcmp(x->key, y->key, DICTIONARY_ENTRY_SIZE);
+
+  if (c)
+    return c;
+  return x->row < y->row ? -1 : x->row > y->row;
+}
+
+/**
+ * Write the records in the encoder as a block.
+ *
+ * @return 0 if no errors
+ */
+static int write_block(FILE *out, encoder_t *e) {
+  archive_block_t header;
+  block_columns_t block;
+  uint8_t *dictionary;
+  int64_t base;
+  uint32_t i, d = 0;
+
+  if (e->num_records == 0)
+    return 0;
+
+  /* the dictionary is the distinct keys, in order */
+  qsort(e->keys, e->num_keys, sizeof(pending_key_t), compare_keys);
+  dictionary = e->buf + sizeof(header) + e->num_records * 8;
+  for (i = 0; i < e->num_keys; ++i) {
+    if (i == 0 || memcmp(e->keys[i].key, e->keys[i - 1].key,
+          DICTIONARY_ENTRY_SIZE)) {
+      memcpy(dictionary + d * DICTIONARY_ENTRY_SIZE, e->keys[i].key,
+          DICTIONARY_ENTRY_SIZE);
+      ++d;
+    }
+    e->id[e->keys[i].row] = d - 1;
+  }
+
+  base = e->time[0];
+  for (i = 1; i < e->num_records; ++i)
+    if (e->time[i] < base)
+      base = e->time[i];
+
+  header.size = block_size(e->num_records, d);
+  header.num_records = e->num_records;
+  header.num_devices = d;
+  header.span = 0;
+  header.base = base;
+  memcpy(e->buf, &header, sizeof(header));
+  get_columns(e->buf, header.size, &block);
+  for (i = 0; i < e->num_records; ++i) {
+    ((uint32_t *)block.delta)[i] = e->time[i] - base;
+    if (block.delta[i] > header.span)
+      header.span = block.delta[i];
+  }
+  memcpy(e->buf, &header, sizeof(header));
+  memcpy((uint16_t *)block.id, e->id, e->num_records * sizeof(uint16_t));
+  memcpy((uint8_t *)block.type, e->type, e->num_records);
+  memcpy((int8_t *)block.rssi, e->rssi, e->num_records);
+  bzero(dictionary + d * DICTIONARY_ENTRY_SIZE, e->buf + header.size -
+      (dictionary + d * DICTIONARY_ENTRY_SIZE));
+
+  e->num_records = 0;
+  e->num_keys = 0;
+  return 1 == fwrite(e->buf, header.size, 1, out) ? 0 : -1;
+}
+
+/**
+ * Read bluetrax_scan records and write the archive.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int encode(FILE *in, FILE *out, uint32_t max_records) {
+  bluetrax_scan_record_t record;
+  encoder_t e;
+  pending_key_t *key;
+  uint32_t header[2] = { ARCHIVE_MAGIC, 0 };
+  unsigned long num_records = 0, num_blocks = 0, num_traces = 0;
+  int64_t time, min_time = 0, max_time = 0;
+  int rc, k;
+
+  bzero(&e, sizeof(e));
+  e.max_records = max_records;
+  e.time = malloc(max_records * sizeof(int64_t));
+  e.type = malloc(max_records);
+  e.rssi = malloc(max_records);
+  e.keys = malloc(max_records * sizeof(pending_key_t));
+  e.id = malloc(max_records * sizeof(uint16_t));
+  e.buf = malloc(block_size(max_records, max_records));
+  if (!e.time || !e.type || !e.rssi || !e.keys || !e.id || !e.buf) {
+    syslog(LOG_ERR, "malloc: %m");
+    return EXIT_FAILURE;
+  }
+  fwrite(header, sizeof(header), 1, out);
+
+  while (1 == (rc = bluetrax_read_scan_record(in, &record))) {
+    if (record.type == BLUETRAX_TRACE) {
+      ++num_traces;
+      continue;
+    }
+    time = (int64_t)record.data.complete.time.tv_sec * 1000000 +
+      record.data.complete.time.tv_usec;
+
+    /* the deltas must fit in 32 bits (about 71 minutes) */
+    if (e.num_records > 0 && (time - min_time > UINT32_MAX ||
+          max_time - time > UINT32_MAX)) {
+      if (write_block(out, &e))
+        break;
+      ++num_blocks;
+    }
+    if (e.num_records == 0 || time < min_time)
+      min_time = time;
+    if (e.num_records == 0 || time > max_time)
+      max_time = time;
+
+    e.time[e.num_records] = time;
+    e.type[e.num_records] = record.type;
+    e.rssi[e.num_records] = record.type == EVT_INQUIRY_RESULT_WITH_RSSI ?
+      record.data.result_with_rssi.rssi : 0;
+    e.id[e.num_records] = NO_DEVICE;
+    if (record.type != EVT_INQUIRY_COMPLETE) {
+      key = &e.keys[e.num_keys++];
+      for (k = 0; k < 6; ++k)
+        key->key[k] = record.data.result.bdaddr.b[5 - k];
+      memcpy(key->key + 6, record.data.result.dev_class, 3);
+      key->row = e.num_records;
+    }
+    ++num_records;
+
+    if (++e.num_records == e.max_records) {
+      if (write_block(out, &e))
+        break;
+      ++num_blocks;
+    }
+  }
+  if (e.num_records > 0 && 0 == write_block(out, &e))
+    ++num_blocks;
+
+  free(e.time);
+  free(e.type);
+  free(e.rssi);
+  free(e.keys);
+  free(e.id);
+  free(e.buf);
+
+  if (rc < 0) {
+    syslog(LOG_ERR, "unsupported tag: %d", record.type);
+    return EXIT_FAILURE;
+  } else if (ferror(in) || (rc == 0 && record.type != EOF)) {
+    syslog(LOG_ERR, "fread record: %m");
+    return EXIT_FAILURE;
+  } else if (ferror(out)) {
+    syslog(LOG_ERR, "fwrite: %m");
+    return EXIT_FAILURE;
+  }
+
+  syslog(LOG_INFO, "encoded %lu records in %lu blocks", num_records,
+      num_blocks);
+  if (num_traces > 0)
+    syslog(LOG_INFO, "dropped %lu trace records", num_traces);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Read the archive and write all of its records.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int decode(FILE *in, FILE *out) {
+  bluetrax_scan_record_t record;
+  block_columns_t block;
+  archive_block_t header;
+  uint32_t magic[2], i;
+  uint8_t *buf = NULL;
+  int rc = EXIT_SUCCESS;
+
+  if (1 != fread(magic, sizeof(magic), 1, in) || magic[0] != ARCHIVE_MAGIC) {
+    syslog(LOG_ERR, "not an archive");
+    return EXIT_FAILURE;
+  }
+
+  while (1 == fread(&header, sizeof(header), 1, in)) {
+    if (header.num_records > MAX_BLOCK ||
+        header.size != block_size(header.num_records, header.num_devices)) {
+      rc = EXIT_FAILURE;
+      break;
+    }
+    buf = realloc(buf, header.size);
+    if (buf == NULL) {
+      syslog(LOG_ERR, "realloc: %m");
+      return EXIT_FAILURE;
+    }
+    memcpy(buf, &header, sizeof(header));
+    if (1 != fread(buf + sizeof(header), header.size - sizeof(header), 1, in) ||
+        get_columns(buf, header.size, &block)) {
+      rc = EXIT_FAILURE;
+      break;
+    }
+    for (i = 0; i < header.num_records; ++i) {
+      decode_record(&block, i, &record);
+      write_record(out, &record);
+    }
+  }
+  free(buf);
+
+  if (rc != EXIT_SUCCESS || !feof(in))
+    syslog(LOG_ERR, "bad or truncated block");
+  return feof(in) ? rc : EXIT_FAILURE;
+}
+
+/*
+ * Queries.
+ */
+
+/**
+ * A full address (len 6) or OUI prefix (len 3), most significant byte first,
+ * as in the dictionary.
+ */
+typedef struct {
+  uint8_t bytes[6];
+  int     len;
+} pattern_t;
+
+/**
+ * Set of addresses, or map from address to count: open addressing, with
+ * addresses stored plus one, so 0 is empty.
+ */
+typedef struct {
+  uint64_t *keys;
+  uint64_t *counts;
+  size_t    size;     /* a power of 2 */
+  size_t    used;
+} addr_table_t;
+
+typedef struct {
+  pattern_t    *patterns;
+  int           num_patterns;
+  int64_t       start, end;   /* microseconds; end is exclusive */
+  enum { QUERY_RECORDS, QUERY_COUNT, QUERY_DISTINCT } mode;
+  uint8_t      *match;        /* ids that match the patterns, for a block */
+  uint32_t     *counts;       /* detections of each id, for a block */
+  addr_table_t  table;
+  unsigned long blocks, skipped, whole;
+  FILE         *out;
+} query_t;
+
+/**
+ * Parse a full address or OUI prefix in the usual colon separated form.
+ *
+ * @return 0 if the string is valid
+ */
+static int parse_pattern(const char *str, pattern_t *pattern) {
+  unsigned int b[6];
+  char end;
+  int n, i;
+
+  n = sscanf(str, "%2x:%2x:%2x:%2x:%2x:%2x%c",
+      &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end);
+  if ((n != 6 && n != 3) || (n == 3 && strlen(str) != 8))
+    return -1;
+  for (i = 0; i < n; ++i)
+    pattern->bytes[i] = b[i];
+  pattern->len = n;
+  return 0;
+}
+
+static int add_pattern(query_t *q, const char *str) {
+  q->patterns = realloc(q->patterns, (q->num_patterns + 1) *
+      sizeof(pattern_t));
+  if (q->patterns == NULL) {
+    syslog(LOG_ERR, "realloc: %m");
+    exit(EXIT_FAILURE);
+  }
+  if (parse_pattern(str, &q->patterns[q->num_patterns]))
+    return -1;
+  ++q->num_patterns;
+  return 0;
+}
+
+/**
+ * Read addresses from a file, one per line.
+ *
+ * @return 0 if no errors
+ */
+static int read_patterns(const char *path, query_t *q) {
+  FILE *file = fopen(path, "r");
+  char line[64];
+  unsigned long line_number = 0;
+
+  if (file == NULL) {
+    syslog(LOG_ERR, "%s: %m", path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    ++line_number;
+    line[strcspn(line, " \t\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
+    if (add_pattern(q, line)) {
+      syslog(LOG_ERR, "%s:%lu: bad address", path, line_number);
+      fclose(file);
+      return -1;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+/**
+ * Parse a time in seconds since the epoch, which may have a fractional part;
+ * it is rounded to the nearest microsecond, since e.g. 0.1 is a little less
+ * than that as a double.
+ *
+ * @return 0 if the time is valid
+ */
+static int parse_time(const char *str, int64_t *usec) {
+  char *end;
+  double t = strtod(str, &end);
+
+  if (end == str || *end != '\0' || t < 0)
+    return -1;
+  *usec = llround(t * 1e6);
+  return 0;
+}
+
+static void table_add(addr_table_t *t, uint64_t addr, uint64_t count) {
+  uint64_t *keys, *counts;
+  size_t i, j, size;
+
+  if (2 * (t->used + 1) > t->size) {
+    size = t->size ? 2 * t->size : 1024;
+    keys = calloc(size, sizeof(uint64_t));
+    counts = calloc(size, sizeof(uint64_t));
+    if (keys == NULL || counts == NULL) {
+      syslog(LOG_ERR, "calloc: %m");
+      exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < t->size; ++i) {
+      if (t->keys[i] == 0)
+        continue;
+      for (j = bluetrax_mix64(t->keys[i]) & (size - 1); keys[j];
+          j = (j + 1) & (size - 1))
+        ;
+      keys[j] = t->keys[i];
+      counts[j] = t->counts[i];
+    }
+    free(t->keys);
+    free(t->counts);
+    t->keys = keys;
+    t->counts = counts;
+    t->size = size;
+  }
+
+  for (i = bluetrax_mix64(addr + 1) & (t->size - 1); t->keys[i];
+      i = (i + 1) & (t->size - 1)) {
+    if (t->keys[i] == addr + 1) {
+      t->counts[i] += count;
+      return;
+    }
+  }
+  t->keys[i] = addr + 1;
+  t->counts[i] = count;
+  ++t->used;
+}
+
+/**
+ * First id in the block's dictionary whose first len bytes are not less than
+ * (or, if after, greater than) the given bytes.
+ */
+static uint32_t find_entry(const block_columns_t *block, const uint8_t *bytes,
+    int len, int after) {
+  uint32_t lo = 0, hi = block->header->num_devices, mid;
+  int c;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    c = memcmp(block->dictionary + mid * DICTIONARY_ENTRY_SIZE, bytes, len);
+    if (c < 0 || (after && c == 0))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * Mark the ids in the block that match the patterns; each pattern is a range
+ * of ids, because the dictionary is sorted.
+ *
+ * @return number of ids that match
+ */
+static uint32_t match_ids(query_t *q, const block_columns_t *block) {
+  uint32_t lo, hi, n = 0;
+  int i;
+
+  if (q->num_patterns == 0) {
+    memset(q->match, 1, block->header->num_devices);
+    return block->header->num_devices;
+  }
+  bzero(q->match, block->header->num_devices);
+  for (i = 0; i < q->num_patterns; ++i) {
+    lo = find_entry(block, q->patterns[i].bytes, q->patterns[i].len, 0);
+    hi = find_entry(block, q->patterns[i].bytes, q->patterns[i].len, 1);
+    for (; lo < hi; ++lo) {
+      n += !q->match[lo];
+      q->match[lo] = 1;
+    }
+  }
+  return n;
+}
+
+/**
+ * Run the query on one block.
+ */
+static void query_block(query_t *q, const block_columns_t *block) {
+  const archive_block_t *header = block->header;
+  bluetrax_scan_record_t record;
+  uint32_t i, id, from, width;
+  const uint8_t *entry;
+  int whole;
+
+  ++q->blocks;
+
+  /* the time range, as a range of deltas */
+  if (header->base + header->span < q->start || header->base >= q->end) {
+    ++q->skipped;
+    return;
+  }
+  whole = q->start <= header->base && header->base + header->span < q->end;
+
+  /* without --start or --end, the bound is INT64_MIN or INT64_MAX, so compare
+   * before subtracting, which could overflow; the block overlaps the range, so
+   * the differences that are taken fit */
+  from = q->start <= header->base ? 0 : (uint32_t)(q->start - header->base);
+  width = q->end > header->base + header->span ? header->span - from + 1 :
+    (uint32_t)(q->end - header->base) - from;
+  q->whole += whole;
+
+  if (match_ids(q, block) == 0 && (q->num_patterns > 0 ||
+        q->mode != QUERY_RECORDS)) {
+    ++q->skipped;
+    return;
+  }
+
+  switch (q->mode) {
+  case QUERY_DISTINCT:
+    if (whole) {
+      /* every device in the dictionary has a record in the block */
+      for (id = 0; id < header->num_devices; ++id)
+        if (q->match[id])
+          table_add(&q->table, entry_addr(block->dictionary +
+                id * DICTIONARY_ENTRY_SIZE), 0);
+      return;
+    }
+    /* fall through - take the devices that have matching records */
+  case QUERY_COUNT:
+    bzero(q->counts, header->num_devices * sizeof(uint32_t));
+    if (whole) {
+      for (i = 0; i < header->num_records; ++i) {
+        id = block->id[i];
+        if (id != NO_DEVICE && q->match[id])
+          ++q->counts[id];
+      }
+    } else {
+      for (i = 0; i < header->num_records; ++i) {
+        id = block->id[i];
+        if (block->delta[i] - from < width && id != NO_DEVICE && q->match[id])
+          ++q->counts[id];
+      }
+    }
+    for (id = 0; id < header->num_devices; ++id) {
+      if (q->counts[id] == 0)
+        continue;
+      entry = block->dictionary + id * DICTIONARY_ENTRY_SIZE;
+      table_add(&q->table, entry_addr(entry),
+          q->mode == QUERY_COUNT ? q->counts[id] : 0);
+    }
+    return;
+  case QUERY_RECORDS:
+    for (i = 0; i < header->num_records; ++i) {
+      id = block->id[i];
+      if (q->num_patterns > 0 && (id == NO_DEVICE || !q->match[id]))
+        continue;
+      if (!whole && block->delta[i] - from >= width)
+        continue;
+      decode_record(block, i, &record);
+      write_record(q->out, &record);
+    }
+    return;
+  }
+}
+
+/**
+ * Run the query on the blocks of an archive file.
+ *
+ * @return 0 if no errors
+ */
+static int query_file(query_t *q, const char *path) {
+  block_columns_t block;
+  const uint8_t *data;
+  struct stat st;
+  size_t offset;
+  int fd, rc = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    syslog(LOG_ERR, "%s: %m", path);
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  if (st.st_size < 2 * (off_t)sizeof(uint32_t)) {
+    syslog(LOG_ERR, "%s: not an archive", path);
+    close(fd);
+    return -1;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    syslog(LOG_ERR, "%s: mmap: %m", path);
+    return -1;
+  }
+  if (*(const uint32_t *)data != ARCHIVE_MAGIC) {
+    syslog(LOG_ERR, "%s: not an archive", path);
+    munmap((void *)data, st.st_size);
+    return -1;
+  }
+
+  for (offset = 2 * sizeof(uint32_t); offset < (size_t)st.st_size;
+      offset += block.header->size) {
+    if (get_columns(data + offset, st.st_size - offset, &block)) {
+      syslog(LOG_ERR, "%s: bad or truncated block at offset %lu", path,
+          (unsigned long)offset);
+      rc = -1;
+      break;
+    }
+    query_block(q, &block);
+  }
+
+  munmap((void *)data, st.st_size);
+  return rc;
+}
+
+static int compare_uint64(const void *a, const void *b) {
+  const uint64_t *x = a, *y = b;
+
+  return *x < *y ? -1 : *x > *y;
+}
+
+/**
+ * Write the devices and counts in the table, in order of address.
+ */
+static void write_counts(query_t *q) {
+  uint64_t *pairs, addr;
+  size_t i, n = 0;
+
+  pairs = malloc(2 * q->table.used * sizeof(uint64_t) + 1);
+  if (pairs == NULL) {
+    syslog(LOG_ERR, "malloc: %m");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < q->table.size; ++i) {
+    if (q->table.keys[i] == 0)
+      continue;
+    pairs[2 * n] = q->table.keys[i] - 1;
+    pairs[2 * n + 1] = q->table.counts[i];
+    ++n;
+  }
+  qsort(pairs, n, 2 * sizeof(uint64_t), compare_uint64);
+
+  fputs("bdaddr,detections\n", q->out);
+  for (i = 0; i < n; ++i) {
+    addr = pairs[2 * i];
+    fprintf(q->out, "%02X:%02X:%02X:%02X:%02X:%02X,%llu\n",
+        (int)(addr >> 40) & 0xff, (int)(addr >> 32) & 0xff,
+        (int)(addr >> 24) & 0xff, (int)(addr >> 16) & 0xff,
+        (int)(addr >> 8) & 0xff, (int)addr & 0xff,
+        (unsigned long long)pairs[2 * i + 1]);
+  }
+  free(pairs);
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s --encode|--decode [--file=file]\n"
+    "       %s [query options] archive...\n\n"
+    "Store bluetrax_scan output in a columnar archive, with a dictionary of\n"
+    "devices for each block, and query it without decoding it.\n\n"
+    "--encode: read bluetrax_scan output and write the archive\n"
+    "--decode: read an archive and write its records\n"
+    "--file file: name of file to read; if omitted, reads stdin\n"
+    "--block n: records per block, up to %d; default %d\n\n"
+    "Queries write the matching records, in bluetrax_scan format, unless\n"
+    "--count or --distinct is given.\n\n"
+    "--addr a: full address (00:11:22:33:44:55) or OUI prefix (00:11:22) to\n"
+    "  match; can be given more than once; default is all devices\n"
+    "--list file: file of addresses or prefixes to match, one per line\n"
+    "--start t: match records from time t, in seconds since the epoch\n"
+    "--end t: match records before time t\n"
+    "--count: write bdaddr,detections for each matching device\n"
+    "--distinct: write the number of distinct matching devices\n"
+    "--help: displays this message\n", argv[0], argv[0], MAX_BLOCK,
+    DEFAULT_BLOCK);
+}
+
+int main(int argc, char **argv)
+{
+  FILE *file = stdin;
+  query_t q;
+  long max_records = DEFAULT_BLOCK;
+  int opt, mode = 0, i, status = EXIT_SUCCESS;
+
+  static struct option options[] =
+  {
+    {"encode",   no_argument,       0, 'e'},
+    {"decode",   no_argument,       0, 'd'},
+    {"file",     required_argument, 0, 'f'},
+    {"block",    required_argument, 0, 'b'},
+    {"addr",     required_argument, 0, 'a'},
+    {"list",     required_argument, 0, 'l'},
+    {"start",    required_argument, 0, 's'},
+    {"end",      required_argument, 0, 'E'},
+    {"count",    no_argument,       0, 'c'},
+    {"distinct", no_argument,       0, 'u'},
+    {"help",     no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  bzero(&q, sizeof(q));
+  q.start = INT64_MIN;
+  q.end = INT64_MAX;
+  q.mode = QUERY_RECORDS;
+  q.out = stdout;
+
+  while ((opt=getopt_long(argc, argv, "+edf:b:a:l:s:E:cuh", options, NULL))
+      != -1) {
+    switch (opt) {
+    case 'e':
+    case 'd':
+      mode = opt;
+      break;
+    case 'f':
+      file = fopen(optarg, "r");
+      if (file == NULL) {
+        syslog(LOG_ERR, "failed to open input file: %s: %m", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'b':
+      max_records = atol(optarg);
+      break;
+    case 'a':
+      if (add_pattern(&q, optarg)) {
+        syslog(LOG_ERR, "bad address: %s", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'l':
+      if (read_patterns(optarg, &q))
+        exit(EXIT_FAILURE);
+      break;
+    case 's':
+    case 'E':
+      if (parse_time(optarg, opt == 's' ? &q.start : &q.end)) {
+        syslog(LOG_ERR, "bad time: %s", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'c':
+      q.mode = QUERY_COUNT;
+      break;
+    case 'u':
+      q.mode = QUERY_DISTINCT;
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (max_records < 1 || max_records > MAX_BLOCK || q.start >= q.end ||
+      (mode != 0 && optind != argc) || (mode == 0 && optind == argc)) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  if (mode == 'e')
+    return encode(file, stdout, max_records);
+  if (mode == 'd')
+    return decode(file, stdout);
+
+  q.match = malloc(MAX_BLOCK);
+  q.counts = malloc(MAX_BLOCK * sizeof(uint32_t));
+  if (q.match == NULL || q.counts == NULL) {
+    syslog(LOG_ERR, "malloc: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = optind; i < argc; ++i)
+    if (query_file(&q, argv[i]))
+      status = EXIT_FAILURE;
+
+  if (q.mode == QUERY_COUNT)
+    write_counts(&q);
+  else if (q.mode == QUERY_DISTINCT)
+    fprintf(q.out, "%lu\n", (unsigned long)q.table.used);
+  syslog(LOG_INFO, "%lu blocks: %lu skipped, %lu wholly in the time range",
+      q.blocks, q.skipped, q.whole);
+
+  return status;
+}
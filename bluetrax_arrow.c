@@ -0,0 +1,321 @@
+#include "bluetrax_arrow.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+
+/**
+ * Records are read from the cursor this many at a time and then spread out
+ * into the columns, so the records in between stay in the cache.
+ */
+#define CHUNK_RECORDS 256
+
+/**
+ * Arrow asks for buffers to be aligned to (and preferably padded to) 64 bytes.
+ */
+#define BUFFER_ALIGN 64
+
+enum { COLUMN_TYPE, COLUMN_TIME, COLUMN_BDADDR, COLUMN_CLASS, COLUMN_RSSI,
+  NUM_COLUMNS };
+
+static const struct {
+  const char *name;
+  const char *format;
+  int64_t     flags;
+} columns[NUM_COLUMNS] = {
+  { "type", "C", 0 },
+  { "time", "tsu:UTC", 0 },
+  { "bdaddr", "w:6", ARROW_FLAG_NULLABLE },
+  { "class", "I", ARROW_FLAG_NULLABLE },
+  { "rssi", "c", ARROW_FLAG_NULLABLE },
+};
+
+/**
+ * Everything for a schema, in one allocation.
+ */
+typedef struct {
+  struct ArrowSchema  children[NUM_COLUMNS];
+  struct ArrowSchema *child_pointers[NUM_COLUMNS];
+} schema_private_t;
+
+/**
+ * Everything for a batch. The struct array and its children share it, and it
+ * is freed when the last of them is released; the consumer may move a child
+ * out of the batch and release it on its own, perhaps in another thread.
+ */
+typedef struct {
+  int                refs;
+  void              *data;       /* all of the column buffers */
+  struct ArrowArray  children[NUM_COLUMNS];
+  struct ArrowArray *child_pointers[NUM_COLUMNS];
+  const void        *buffers[NUM_COLUMNS + 1][2];
+} batch_private_t;
+
+static void release_child_schema(struct ArrowSchema *schema) {
+  schema->release = NULL;
+}
+
+static void release_schema(struct ArrowSchema *schema) {
+  int i;
+
+  for (i = 0; i < schema->n_children; ++i)
+    if (schema->children[i]->release)
+      schema->children[i]->release(schema->children[i]);
+  free(schema->private_data);
+  schema->release = NULL;
+}
+
+int bluetrax_arrow_schema(struct ArrowSchema *schema) {
+  schema_private_t *private;
+  int i;
+
+  private = calloc(1, sizeof(*private));
+  if (private == NULL)
+    return -1;
+
+  for (i = 0; i < NUM_COLUMNS; ++i) {
+    private->children[i].format = columns[i].format;
+    private->children[i].name = columns[i].name;
+    private->children[i].flags = columns[i].flags;
+    private->children[i].release = release_child_schema;
+    private->child_pointers[i] = &private->children[i];
+  }
+
+  memset(schema, 0, sizeof(*schema));
+  schema->format = "+s";
+  schema->name = "";
+  schema->n_children = NUM_COLUMNS;
+  schema->children = private->child_pointers;
+  schema->release = release_schema;
+  schema->private_data = private;
+  return 0;
+}
+
+static void unref_batch(batch_private_t *private) {
+  if (__atomic_sub_fetch(&private->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(private->data);
+    free(private);
+  }
+}
+
+static void release_child_array(struct ArrowArray *array) {
+  unref_batch(array->private_data);
+  array->release = NULL;
+}
+
+static void release_array(struct ArrowArray *array) {
+  int i;
+
+  for (i = 0; i < array->n_children; ++i)
+    if (array->children[i]->release)
+      array->children[i]->release(array->children[i]);
+  unref_batch(array->private_data);
+  array->release = NULL;
+}
+
+static size_t align_size(size_t size) {
+  return (size + BUFFER_ALIGN - 1) & ~(size_t)(BUFFER_ALIGN - 1);
+}
+
+/**
+ * Decode records into row i onward of the columns.
+ */
+static void decode_records(bluetrax_scan_record_t *records, int n, int64_t i,
+    uint8_t *type, int64_t *time, uint8_t *bdaddr, uint32_t *class,
+    int8_t *rssi, uint8_t *valid, uint8_t *rssi_valid, int64_t *nulls,
+    int64_t *rssi_nulls) {
+  bluetrax_inquiry_result_t *result;
+  int j, k;
+
+  for (j = 0; j < n; ++j, ++i) {
+    type[i] = records[j].type;
+    time[i] = (int64_t)records[j].data.complete.time.tv_sec * 1000000 +
+      records[j].data.complete.time.tv_usec;
+
+    /* a result with rssi starts like a result */
+    result = &records[j].data.result;
+    if (records[j].type != EVT_INQUIRY_RESULT &&
+        records[j].type != EVT_INQUIRY_RESULT_WITH_RSSI) {
+      memset(bdaddr + 6 * i, 0, 6);
+      class[i] = 0;
+      ++*nulls;
+    } else {
+      for (k = 0; k < 6; ++k)
+        bdaddr[6 * i + k] = result->bdaddr.b[5 - k];
+      class[i] = result->dev_class[2] << 16 | result->dev_class[1] << 8 |
+        result->dev_class[0];
+      valid[i / 8] |= 1 << (i % 8);
+    }
+
+    if (records[j].type == EVT_INQUIRY_RESULT_WITH_RSSI) {
+      rssi[i] = records[j].data.result_with_rssi.rssi;
+      rssi_valid[i / 8] |= 1 << (i % 8);
+    } else {
+      rssi[i] = 0;
+      ++*rssi_nulls;
+    }
+  }
+}
+
+int bluetrax_arrow_next(bluetrax_cursor_t *cursor, int max,
+    struct ArrowArray *array) {
+  static const size_t widths[NUM_COLUMNS] = { 1, 8, 6, 4, 1 };
+  bluetrax_scan_record_t records[CHUNK_RECORDS];
+  batch_private_t *private;
+  size_t offsets[NUM_COLUMNS + 1], bitmap_size, size;
+  int64_t length = 0, nulls = 0, rssi_nulls = 0;
+  uint8_t *data, *valid, *rssi_valid;
+  int i, n;
+
+  if (max <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* space for a full batch; a short one just leaves some of it unused */
+  bitmap_size = align_size((max + 7) / 8);
+  size = 2 * bitmap_size;
+  for (i = 0; i < NUM_COLUMNS; ++i) {
+    offsets[i] = size;
+    size += align_size(widths[i] * max);
+  }
+  if (posix_memalign((void **)&data, BUFFER_ALIGN, size)) {
+    errno = ENOMEM;
+    return -1;
+  }
+  memset(data, 0, 2 * bitmap_size);
+  valid = data;
+  rssi_valid = data + bitmap_size;
+
+  while (length < max) {
+    n = bluetrax_cursor_next(cursor, records,
+        max - length < CHUNK_RECORDS ? max - length : CHUNK_RECORDS);
+    if (n < 0) {
+      free(data);
+      return -1;
+    }
+    if (n == 0)
+      break;
+    decode_records(records, n, length,
+        data + offsets[COLUMN_TYPE], (int64_t *)(data + offsets[COLUMN_TIME]),
+        data + offsets[COLUMN_BDADDR],
+        (uint32_t *)(data + offsets[COLUMN_CLASS]),
+        (int8_t *)(data + offsets[COLUMN_RSSI]), valid, rssi_valid, &nulls,
+        &rssi_nulls);
+    length += n;
+  }
+  if (length == 0) {
+    free(data);
+    return 0;
+  }
+
+  private = calloc(1, sizeof(*private));
+  if (private == NULL) {
+    free(data);
+    return -1;
+  }
+  private->refs = NUM_COLUMNS + 1;
+  private->data = data;
+
+  for (i = 0; i < NUM_COLUMNS; ++i) {
+    struct ArrowArray *child = &private->children[i];
+
+    private->buffers[i][0] = NULL;
+    private->buffers[i][1] = data + offsets[i];
+    child->length = length;
+    child->n_buffers = 2;
+    child->buffers = private->buffers[i];
+    child->release = release_child_array;
+    child->private_data = private;
+    private->child_pointers[i] = child;
+  }
+  private->buffers[COLUMN_BDADDR][0] = valid;
+  private->children[COLUMN_BDADDR].null_count = nulls;
+  private->buffers[COLUMN_CLASS][0] = valid;
+  private->children[COLUMN_CLASS].null_count = nulls;
+  private->buffers[COLUMN_RSSI][0] = rssi_valid;
+  private->children[COLUMN_RSSI].null_count = rssi_nulls;
+
+  /* the struct itself has no nulls, so no validity bitmap */
+  private->buffers[NUM_COLUMNS][0] = NULL;
+  memset(array, 0, sizeof(*array));
+  array->length = length;
+  array->n_buffers = 1;
+  array->n_children = NUM_COLUMNS;
+  array->buffers = private->buffers[NUM_COLUMNS];
+  array->children = private->child_pointers;
+  array->release = release_array;
+  array->private_data = private;
+  return length;
+}
+
+typedef struct {
+  bluetrax_cursor_t *cursor;
+  int                batch_size;
+  int                error;     /* errno from the last call that failed */
+} stream_private_t;
+
+static int stream_get_schema(struct ArrowArrayStream *stream,
+    struct ArrowSchema *schema) {
+  stream_private_t *private = stream->private_data;
+
+  if (bluetrax_arrow_schema(schema)) {
+    private->error = errno;
+    return errno;
+  }
+  return 0;
+}
+
+static int stream_get_next(struct ArrowArrayStream *stream,
+    struct ArrowArray *array) {
+  stream_private_t *private = stream->private_data;
+  int n;
+
+  n = bluetrax_arrow_next(private->cursor, private->batch_size, array);
+  if (n < 0) {
+    private->error = errno;
+    return errno;
+  }
+  if (n == 0) {
+    /* the end of the stream is a released array */
+    memset(array, 0, sizeof(*array));
+  }
+  return 0;
+}
+
+static const char *stream_get_last_error(struct ArrowArrayStream *stream) {
+  stream_private_t *private = stream->private_data;
+
+  return private->error ? strerror(private->error) : NULL;
+}
+
+static void stream_release(struct ArrowArrayStream *stream) {
+  stream_private_t *private = stream->private_data;
+
+  bluetrax_cursor_close(private->cursor);
+  free(private);
+  stream->release = NULL;
+}
+
+int bluetrax_arrow_stream(bluetrax_cursor_t *cursor, int batch_size,
+    struct ArrowArrayStream *stream) {
+  stream_private_t *private;
+
+  if (batch_size <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  private = calloc(1, sizeof(*private));
+  if (private == NULL)
+    return -1;
+  private->cursor = cursor;
+  private->batch_size = batch_size;
+
+  stream->get_schema = stream_get_schema;
+  stream->get_next = stream_get_next;
+  stream->get_last_error = stream_get_last_error;
+  stream->release = stream_release;
+  stream->private_data = private;
+  return 0;
+}
@@ -0,0 +1,112 @@
+#ifndef _BLUETRAX_ARROW_H_
+#define _BLUETRAX_ARROW_H_
+
+#include <stdint.h>
+
+#include "bluetrax_cursor.h"
+
+/**
+ * Export of records written by bluetrax_scan as Apache Arrow arrays, through
+ * the Arrow C data interface, so that an Arrow-aware engine in the same
+ * process (pyarrow, DuckDB, pandas, polars, ...) can use them without going
+ * through a file.
+ *
+ * Each batch is a struct array (which engines import as a record batch) with
+ * these columns:
+ * * type (uint8): the record type, as in the file (EVT_INQUIRY_COMPLETE, etc.)
+ * * time (timestamp[us, UTC])
+ * * bdaddr (fixed_size_binary[6]): in the usual order, i.e. the first byte is
+ *   the first byte that ba2str prints; null for EVT_INQUIRY_COMPLETE and
+ *   BLUETRAX_TRACE
+ * * class (uint32): the 24 bit class of device, as in the specification
+ *   (service classes in bits 13 to 23, major class in bits 8 to 12 and minor
+ *   class in bits 2 to 7); null for EVT_INQUIRY_COMPLETE and BLUETRAX_TRACE
+ * * rssi (int8): null unless the record is EVT_INQUIRY_RESULT_WITH_RSSI
+ *
+ * The records are decoded straight into the column buffers of the batch,
+ * which the batch owns; they are freed when the consumer releases it.
+ */
+
+/*
+ * The structs below are the ABI defined by the Arrow C data interface
+ * specification, which is meant to be copied into projects like this one.
+ */
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  const char *format;
+  const char *name;
+  const char *metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema **children;
+  struct ArrowSchema *dictionary;
+  void (*release)(struct ArrowSchema *);
+  void *private_data;
+};
+
+struct ArrowArray {
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void **buffers;
+  struct ArrowArray **children;
+  struct ArrowArray *dictionary;
+  void (*release)(struct ArrowArray *);
+  void *private_data;
+};
+
+#endif /* ARROW_C_DATA_INTERFACE */
+
+#ifndef ARROW_C_STREAM_INTERFACE
+#define ARROW_C_STREAM_INTERFACE
+
+struct ArrowArrayStream {
+  int (*get_schema)(struct ArrowArrayStream *, struct ArrowSchema *out);
+  int (*get_next)(struct ArrowArrayStream *, struct ArrowArray *out);
+  const char *(*get_last_error)(struct ArrowArrayStream *);
+  void (*release)(struct ArrowArrayStream *);
+  void *private_data;
+};
+
+#endif /* ARROW_C_STREAM_INTERFACE */
+
+/**
+ * Fill in the schema of the batches. The caller owns the schema and must
+ * release it (usually by handing it to the consumer, which does).
+ *
+ * @return 0 if no errors; -1 on error, with errno set
+ */
+int bluetrax_arrow_schema(struct ArrowSchema *schema);
+
+/**
+ * Read up to max records forward from the cursor into a new batch, and move
+ * the cursor past them. The caller owns the batch and must release it
+ * (usually by handing it to the consumer, which does).
+ *
+ * @return number of records in the batch; 0 at the end, in which case there
+ *         is no batch to release; -1 on error, with errno set
+ */
+int bluetrax_arrow_next(bluetrax_cursor_t *cursor, int max,
+    struct ArrowArray *array);
+
+/**
+ * Make a stream of batches of up to batch_size records each from the cursor,
+ * starting where it is now, for consumers that take a stream (e.g.
+ * pyarrow.RecordBatchReader or a DuckDB scan). The stream takes over the
+ * cursor, which it closes when it is released.
+ *
+ * @return 0 if no errors; -1 on error, with errno set, in which case the
+ *         cursor still belongs to the caller
+ */
+int bluetrax_arrow_stream(bluetrax_cursor_t *cursor, int batch_size,
+    struct ArrowArrayStream *stream);
+
+#endif /* guard */
@@ -0,0 +1,1638 @@
+/*
+ * The capture engine: see bluetrax_capture.h.
+ *
+ * Notes:
+ * - in order to be compliant with the Bluetooth specification [BTSPEC], there
+ *   is a Uniform(1.28s, 2.56s) delay between inquiry periods
+ * - 'Inquiry Complete' messages are recorded as well as Inquiry Response
+ *   messages; these mark the end of each inquiry; note that you can get the
+ *   start of the inquiry by subtracting the inquiry length, which is 1.28s
+ *   times the scan_length
+ * - the first 'complete' record is a dummy that marks the start of the scan,
+ *   according to gettimeofday; all other timings come from the HCI socket
+ * - with several adapters, each adapter is read by its own thread, and the
+ *   frames from all of them are merged in time order
+ * - with trace_interval, each batch of records (i.e. up to each flush) is
+ *   timed, from the kernel's timestamp for its first frame to when that frame
+ *   was handled and to when the batch was handed to the sink, and histograms
+ *   of those latencies are logged every hour; a trace record (see
+ *   bluetrax_trace_t) also follows a batch now and then, which the programs
+ *   downstream stamp with their own hops
+ *
+ * References:
+ *   [BTSPEC] Bluetooth Specification Version 4.0 (Core_V4.0.pdf)
+ *
+ * Based on:
+ * http://www.wensley.org.uk/c/inq/inq.c
+ * http://svn.assembla.com/svn/linuxmce/trunk/0710/VIPShared/PhoneDetection_Bluetooth_Linux.cpp
+ */
+#define _GNU_SOURCE /* for recvmmsg */
+#include "bluetrax_capture.h"
+#include "bluetrax_log.h"
+#include "bluetrax_recorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include <bluetooth/hci_lib.h>
+
+/**
+ * Assume something has gone wrong if the select blocks for longer than this, in
+ * seconds.
+ */
+#define SELECT_TIMEOUT 5*60
+
+/**
+ * Size of the buffer for records waiting to be written, in bytes. It must hold
+ * at least the records from one HCI frame, which is at most 255 responses.
+ */
+#define OUTPUT_BUFFER_SIZE (64*1024)
+
+/**
+ * Maximum number of frames to read from the HCI socket at once.
+ */
+#define RECV_BATCH_SIZE 16
+
+/**
+ * Default time to hold frames back, in microseconds, when merging frames from
+ * several adapters; see run_scan_devices.
+ */
+#define DEFAULT_REORDER_WINDOW 100000
+
+/**
+ * When replaying a file more than once, later passes are shifted forward by the
+ * span of the file plus this gap, in microseconds, which is the longest delay
+ * between inquiries.
+ */
+#define REPLAY_LOOP_GAP_USEC 2560000
+
+/**
+ * How often to log the latency histograms with tracing, in microseconds.
+ */
+#define LATENCY_REPORT_INTERVAL (3600 * 1000000LL)
+
+/**
+ * Records waiting to be handed to the sink, in the same format as the
+ * scanner's output file. Handlers append records here, rather than handing
+ * them over one at a time.
+ */
+typedef struct {
+  const bluetrax_capture_sink_t *sink;
+  int flush;                /* flush after the current frame(s) */
+  unsigned long batch_bytes; /* bytes of records since the last flush */
+  int64_t trace_interval;   /* as in the config */
+  int trace_replay;         /* time batches from when their frames were read,
+                               because the timestamps come from the file */
+  int64_t trace_hci;        /* with tracing, hops for the first frame since */
+  int64_t trace_dispatch;   /* the last flush that had records; 0 if none */
+  struct timeval trace_time; /* time of the last frame that had records */
+  bluetrax_latency_t latency[BLUETRAX_TRACE_HOPS]; /* since the last report */
+  int64_t last_trace, last_report;
+  int num_sources;          /* adapters whose frames are merged */
+  unsigned int completed;   /* those whose inquiries have completed since the
+                               last 'complete' record, by bit */
+  size_t size;
+  unsigned char data[OUTPUT_BUFFER_SIZE];
+} output_t;
+
+struct bluetrax_capture {
+  bluetrax_capture_config_t config;
+  bluetrax_capture_sink_t   sink;
+  int          sds[BLUETRAX_CAPTURE_MAX_DEVICES];
+  int          num_sds;
+  int          stop;         /* set by bluetrax_capture_stop; atomic */
+  int          stop_pipe[2]; /* to wake the capture when it is stopped */
+  output_t     out;
+};
+
+/**
+ * The stop flag is set from other threads and from signal handlers, so it is
+ * only read and written with these.
+ */
+static int stopped(bluetrax_capture_t *capture) {
+  return __atomic_load_n(&capture->stop, __ATOMIC_ACQUIRE);
+}
+
+static void set_stop(bluetrax_capture_t *capture, int stop) {
+  __atomic_store_n(&capture->stop, stop, __ATOMIC_RELEASE);
+}
+
+/**
+ * Frames read from the HCI socket in one go.
+ */
+typedef struct {
+  int num_frames;
+  struct timespec received; /* when they were read, for the flight recorder */
+  int len[RECV_BATCH_SIZE];
+  struct timeval tstamp[RECV_BATCH_SIZE];
+  unsigned char buf[RECV_BATCH_SIZE][HCI_MAX_FRAME_SIZE];
+} frame_batch_t;
+
+/**
+ * Send HCI command to exit periodic inquiry mode.
+ */
+static void stop_scan(int dev_sd) {
+  if (hci_send_cmd(dev_sd,
+        OGF_LINK_CTL, OCF_EXIT_PERIODIC_INQUIRY, 0, NULL) < 0) {
+    bluetrax_log(LOG_ERR, "failed to exit periodic inquiry state: %m");
+  }
+}
+
+/**
+ * Nanoseconds between two points on the monotonic clock.
+ */
+static long elapsed_nsec(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1000000000L +
+    (to->tv_nsec - from->tv_nsec);
+}
+
+/**
+ * Hand records to the sink's batch and record callbacks.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int deliver(const bluetrax_capture_sink_t *sink,
+    const unsigned char *data, size_t size) {
+  bluetrax_scan_record_t record;
+  size_t offset, record_size;
+
+  if (sink->batch && sink->batch(sink->arg, data, size))
+    return EXIT_FAILURE;
+
+  if (sink->record) {
+    for (offset = 0; offset < size; offset += 1 + record_size) {
+      record.type = data[offset];
+      record_size = bluetrax_scan_record_size(record.type);
+      memcpy(&record.data, data + offset + 1, record_size);
+      if (sink->record(sink->arg, &record))
+        return EXIT_FAILURE;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Hand buffered records to the sink, without ending the batch.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int write_output(output_t *out) {
+  struct timespec before, after;
+  int rc;
+
+  if (out->size == 0)
+    return EXIT_SUCCESS;
+
+  clock_gettime(CLOCK_MONOTONIC, &before);
+  rc = deliver(out->sink, out->data, out->size);
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  bluetrax_recorder_write(elapsed_nsec(&before, &after));
+  if (rc != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  out->size = 0;
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Call the sink's flush, if it has one.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int flush_sink(const bluetrax_capture_sink_t *sink) {
+  if (sink->flush && sink->flush(sink->arg))
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Log the latency histograms with tracing, and start new ones.
+ */
+static void report_latency(output_t *out) {
+  char summary[128];
+  int hop;
+
+  for (hop = 0; hop <= BLUETRAX_HOP_COMMIT; ++hop) {
+    if (bluetrax_latency_count(&out->latency[hop]) == 0)
+      continue;
+    bluetrax_latency_format(&out->latency[hop], summary, sizeof(summary));
+    bluetrax_log(LOG_NOTICE, "latency: %s: %s", bluetrax_hop_name(hop),
+        summary);
+  }
+  bzero(out->latency, sizeof(out->latency));
+}
+
+/**
+ * With tracing, time the batch that has just been handed to the sink, and
+ * write a trace record for it if it is time for one. The record is handed
+ * over and flushed on its own, after the batch, so that its commit hop is
+ * when the batch was in the sink.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int trace_batch(output_t *out) {
+  unsigned char buf[1 + sizeof(bluetrax_trace_t)];
+  bluetrax_trace_t record;
+  int64_t hop[BLUETRAX_TRACE_HOPS] = { 0 };
+  struct timespec before, after;
+  int rc;
+
+  hop[BLUETRAX_HOP_HCI] = out->trace_hci;
+  hop[BLUETRAX_HOP_DISPATCH] = out->trace_dispatch;
+  hop[BLUETRAX_HOP_COMMIT] = bluetrax_trace_now();
+  out->trace_hci = 0;
+  bluetrax_latency_add_trace(out->latency, hop, BLUETRAX_HOP_COMMIT);
+
+  if (out->last_report == 0)
+    out->last_report = hop[BLUETRAX_HOP_COMMIT];
+  else if (hop[BLUETRAX_HOP_COMMIT] - out->last_report >=
+      LATENCY_REPORT_INTERVAL) {
+    report_latency(out);
+    out->last_report = hop[BLUETRAX_HOP_COMMIT];
+  }
+
+  if (hop[BLUETRAX_HOP_COMMIT] - out->last_trace < out->trace_interval)
+    return EXIT_SUCCESS;
+  out->last_trace = hop[BLUETRAX_HOP_COMMIT];
+
+  record.time = out->trace_time;
+  memcpy(record.hop, hop, sizeof(record.hop));
+  buf[0] = BLUETRAX_TRACE;
+  memcpy(buf + 1, &record, sizeof(record));
+
+  clock_gettime(CLOCK_MONOTONIC, &before);
+  rc = deliver(out->sink, buf, sizeof(buf));
+  if (rc == EXIT_SUCCESS)
+    rc = flush_sink(out->sink);
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  bluetrax_recorder_write(elapsed_nsec(&before, &after));
+
+  return rc;
+}
+
+/**
+ * Hand buffered records to the sink and end the batch.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int flush_output(output_t *out) {
+  struct timespec before, after;
+  int rc;
+
+  out->flush = 0;
+  out->batch_bytes = 0;
+  if (write_output(out) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+  clock_gettime(CLOCK_MONOTONIC, &before);
+  rc = flush_sink(out->sink);
+  clock_gettime(CLOCK_MONOTONIC, &after);
+  bluetrax_recorder_write(elapsed_nsec(&before, &after));
+  if (rc != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  if (out->trace_hci == 0)
+    return EXIT_SUCCESS;
+  return trace_batch(out);
+}
+
+/**
+ * Call the sink's poll, if it has one.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int poll_sink(const bluetrax_capture_sink_t *sink) {
+  if (sink->poll && sink->poll(sink->arg))
+    return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Make room for size bytes of records at the end of the output buffer,
+ * writing out what is already there, if necessary.
+ *
+ * @return pointer to the space, which is now part of the buffer, or NULL on
+ *         error
+ */
+static unsigned char *reserve_output(output_t *out, size_t size) {
+  unsigned char *space;
+
+  if (out->size + size > sizeof(out->data) &&
+      write_output(out) != EXIT_SUCCESS)
+    return NULL;
+
+  space = out->data + out->size;
+  out->size += size;
+  out->batch_bytes += size;
+
+  return space;
+}
+
+/**
+ * Layout of the responses in an inquiry result event, and of the records that
+ * we write for them. Both kinds of event have the same fields that we want,
+ * except for the RSSI, but at different offsets.
+ */
+typedef struct {
+  const char *name;         /* for log messages */
+  uint8_t    type;          /* record type byte */
+  size_t     info_size;     /* size of each response in the event */
+  size_t     dev_class_offset;
+  int        rssi_offset;   /* -1 if the event has no RSSI */
+  size_t     record_size;
+} inquiry_result_format_t;
+
+/**
+ * Reference: [BTSPEC, volume 2, section 7.7.2, page 716]
+ */
+static const inquiry_result_format_t inquiry_result_format = {
+  "handle_inquiry_result", EVT_INQUIRY_RESULT,
+  sizeof(inquiry_info), offsetof(inquiry_info, dev_class), -1,
+  sizeof(bluetrax_inquiry_result_t)
+};
+
+/**
+ * Reference: [BTSPEC, volume 2, section 7.7.33, page 756]
+ */
+static const inquiry_result_format_t inquiry_result_with_rssi_format = {
+  "handle_inquiry_result_with_rssi", EVT_INQUIRY_RESULT_WITH_RSSI,
+  sizeof(inquiry_info_with_rssi), offsetof(inquiry_info_with_rssi, dev_class),
+  offsetof(inquiry_info_with_rssi, rssi),
+  sizeof(bluetrax_inquiry_result_with_rssi_t)
+};
+
+/**
+ * Record an EVT_INQUIRY_RESULT or EVT_INQUIRY_RESULT_WITH_RSSI message.
+ *
+ * For each response in the message, appends a byte with the record type and
+ * then a bluetrax_inquiry_result_t or bluetrax_inquiry_result_with_rssi_t
+ * structure (in binary format) to the output buffer. The records for all of the
+ * responses are built in place, in one contiguous block.
+ *
+ * @param out to append records to
+ *
+ * @param format layout of the message
+ *
+ * @param time that the message was received
+ *
+ * @param hdr the event header
+ *
+ * @param data all data after the header; length is at least hdr->plen 
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int handle_inquiry_results(output_t *out,
+    const inquiry_result_format_t *format,
+    struct timeval time, hci_event_hdr *hdr, unsigned char *data)
+{
+  int num_rsp, i;
+  unsigned char *info, *dest;
+  bluetrax_inquiry_result_with_rssi_t *record;
+
+  if (hdr->plen <= 0) {
+    BLUETRAX_LOG_LIMITED(LOG_ERR, "%s: bad plen: plen=%hhd", format->name,
+        hdr->plen);
+    return EXIT_FAILURE;
+  }
+
+  /* note: we never seem to get num_rsp > 1 here, but handle it anyway */
+  num_rsp = data[0];
+  bluetrax_log(LOG_DEBUG, "%s: num_rsp=%d", format->name, num_rsp);
+
+  /* sanity check */
+  if (hdr->plen != num_rsp * format->info_size + 1) {
+    BLUETRAX_LOG_LIMITED(LOG_ERR, "%s: bad plen: num_rsp=%d, plen=%hhd",
+        format->name, num_rsp, hdr->plen);
+    return EXIT_FAILURE;
+  }
+
+  dest = reserve_output(out, num_rsp * (1 + format->record_size));
+  if (dest == NULL)
+    return EXIT_FAILURE;
+
+  /* the records without RSSI are a prefix of the ones with it */
+  info = data + 1;
+  for (i = 0; i < num_rsp; ++i) {
+    dest[0] = format->type;
+    record = (bluetrax_inquiry_result_with_rssi_t *)(dest + 1);
+    record->time = time;
+    bacpy(&record->bdaddr, (bdaddr_t *)info);
+    memcpy(&record->dev_class, info + format->dev_class_offset,
+        sizeof(record->dev_class));
+    if (format->rssi_offset >= 0)
+      record->rssi = info[format->rssi_offset];
+
+    dest += 1 + format->record_size;
+    info += format->info_size;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Append a byte with value EVT_INQUIRY_COMPLETE and then a
+ * bluetrax_inquiry_complete_t structure (in binary format) to the output
+ * buffer.
+ */
+static int write_inquiry_complete(output_t *out,
+    bluetrax_inquiry_complete_t record)
+{
+  unsigned char *dest = reserve_output(out, 1 + sizeof(record));
+
+  if (dest == NULL)
+    return EXIT_FAILURE;
+
+  dest[0] = EVT_INQUIRY_COMPLETE;
+  memcpy(dest + 1, &record, sizeof(record));
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Called by handle_frame when we receive a complete EVT_INQUIRY_COMPLETE
+ * message.
+ *
+ * Appends a byte with value EVT_INQUIRY_COMPLETE and then a
+ * bluetrax_inquiry_complete_t structure (in binary format) to the output
+ * buffer.
+ *
+ * Reference: [BTSPEC, volume 2, section 7.7.1, page 715]
+ *
+ * @param out to append the record to
+ *
+ * @param time that the message was received
+ *
+ * @param hdr the event header
+ *
+ * @param data all data after the header; length is at least hdr->plen 
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int handle_inquiry_complete(output_t *out, int source,
+    struct timeval time, hci_event_hdr *hdr, unsigned char *data)
+{
+  bluetrax_inquiry_complete_t record;
+
+  bluetrax_log(LOG_DEBUG, "inquiry complete");
+
+  /* sanity check */
+  if (hdr->plen != 1) {
+    BLUETRAX_LOG_LIMITED(LOG_ERR,
+        "handle_inquiry_complete: bad plen: plen=%hhd", hdr->plen);
+    return EXIT_FAILURE;
+  }
+
+  /* check for errors; abort the scan if we get one */
+  errno = bt_error(data[0]);
+  if (errno != 0) {
+    bluetrax_log(LOG_ERR, "handle_inquiry_complete: error: %m");
+    return EXIT_FAILURE;
+  }
+
+  /* with several adapters, a cycle ends only once each of them has completed
+   * an inquiry, so that there is one stream of 'complete' records, and each
+   * cycle has at least one whole inquiry from every adapter */
+  out->completed |= 1u << source;
+  if (out->completed != (1u << out->num_sources) - 1)
+    return EXIT_SUCCESS;
+  out->completed = 0;
+
+  record.time = time;
+
+  return write_inquiry_complete(out, record);
+}
+
+/**
+ * Set up the socket so that we get the message that we are interested in, and
+ * put the device into periodic inquiry mode.
+ */
+static int start_scan(int dev_sd, int scan_length) {
+  int opt;
+  struct hci_filter flt;
+  periodic_inquiry_cp info_data;
+  periodic_inquiry_cp *info = &info_data;
+
+  opt = 1;
+  if (setsockopt(dev_sd, SOL_HCI, HCI_TIME_STAMP, &opt, sizeof(opt)) < 0) {
+    bluetrax_log(LOG_ERR, "failed to request data timestamps: %m");
+    return EXIT_FAILURE;
+  }
+
+  hci_filter_clear(&flt);
+  hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+  hci_filter_set_event(EVT_INQUIRY_RESULT, &flt);
+  hci_filter_set_event(EVT_INQUIRY_RESULT_WITH_RSSI, &flt);
+  hci_filter_set_event(EVT_INQUIRY_COMPLETE, &flt);
+  if (setsockopt(dev_sd, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+    bluetrax_log(LOG_ERR, "failed to set hci filter: %m");
+    return EXIT_FAILURE;
+  }
+
+  /* no limit on number of responses per scan */
+  info->num_rsp = 0x00;
+
+  /* use the global inquiry access code (GIAC), which has 0x338b9e as its lower
+   * address part (LAP) */
+  info->lap[0] = 0x33;
+  info->lap[1] = 0x8b;
+  info->lap[2] = 0x9e;
+
+  /* note: according to [BTSPEC, volume 2, section 7.1.3], we must have
+   *   max_period > min_period > length
+   * so we set these values to give us the shortest random delay between scans
+   * that is permitted by the specification
+   */
+  info->length = scan_length;
+  info->min_period = info->length + 1;
+  info->max_period = info->min_period + 1;
+
+  if (hci_send_cmd(dev_sd, OGF_LINK_CTL,
+        OCF_PERIODIC_INQUIRY, PERIODIC_INQUIRY_CP_SIZE, info) < 0)
+  {
+    bluetrax_log(LOG_ERR, "failed to request periodic inquiry: %m");
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Process one HCI frame, as read from the HCI socket or from a replay file.
+ *
+ * @param out to append records to; out->flush is set if the output should be
+ *        flushed after this frame
+ *
+ * @param tstamp time that the frame was received
+ *
+ * @param buf the frame, starting with the packet type byte
+ *
+ * @param len number of bytes in buf; frames that are too short to have an event
+ *        header are ignored
+ *
+ * @param flush end the batch after this frame; if 0, only when the inquiry
+ *        completes
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int handle_frame(output_t *out, int source, struct timeval tstamp,
+    unsigned char *buf, int len, int flush)
+{
+  int rc = EXIT_SUCCESS, flush_after_this_message;
+  hci_event_hdr *hdr;
+
+  if (len <= HCI_EVENT_HDR_SIZE)
+    return EXIT_SUCCESS;
+
+  if (buf[0] != HCI_EVENT_PKT) {
+    BLUETRAX_LOG_LIMITED(LOG_WARNING, "got non-HCI_EVENT_PKT: buf[0]=%hhd",
+        buf[0]);
+    return EXIT_SUCCESS;
+  }
+
+  hdr = (hci_event_hdr *)(buf + 1);
+  bluetrax_log(LOG_DEBUG, "HCI_EVENT_PKT: evt=%hhd, plen=%hhd", hdr->evt, hdr->plen);
+
+  /* check that we got all the data; if not, just call recvmsg again */
+  if (len != 1 + HCI_EVENT_HDR_SIZE + hdr->plen) {
+    /* this is not an error; recvmsg may have read part of a message,
+     * and if we call it again, it is clever enough get the rest */
+    BLUETRAX_LOG_LIMITED(LOG_DEBUG,
+        "partial read from recvmsg: len=%d, plen=%hhd", len, hdr->plen);
+    return EXIT_SUCCESS;
+  }
+
+  /* flush either after each message or upon completion of a scan */
+  flush_after_this_message = flush;
+
+  /* dispatch on event */
+  switch(hdr->evt) {
+    case EVT_INQUIRY_RESULT:
+      rc = handle_inquiry_results(out, &inquiry_result_format,
+          tstamp, hdr, buf + 3);
+      break;
+    case EVT_INQUIRY_RESULT_WITH_RSSI:
+      rc = handle_inquiry_results(out, &inquiry_result_with_rssi_format,
+          tstamp, hdr, buf + 3);
+      break;
+    case EVT_INQUIRY_COMPLETE:
+      flush_after_this_message = 1;
+      rc = handle_inquiry_complete(out, source, tstamp, hdr, buf + 3);
+      break;
+    case EVT_LE_META_EVENT:
+      /* the HCI filter keeps these out, but a --source does not filter */
+      break;
+    default:
+      BLUETRAX_LOG_LIMITED(LOG_WARNING, "unknown evt=%hhd", hdr->evt);
+      break;
+  }
+
+  if (rc == EXIT_SUCCESS && flush_after_this_message)
+    out->flush = 1;
+
+  return rc;
+}
+
+/**
+ * As for handle_frame, but also record the frame in the flight recorder, and
+ * note it for the batch's trace if it had records.
+ *
+ * @param received when the frame was read, on the real time clock
+ *
+ * @param source index of the adapter that the frame came from
+ */
+static int handle_recorded_frame(output_t *out, struct timespec *received,
+    int source, struct timeval tstamp, unsigned char *buf, int len, int flush)
+{
+  unsigned long batch_bytes = out->batch_bytes;
+  int rc;
+
+  bluetrax_recorder_frame(received, tstamp, buf, len, source);
+  rc = handle_frame(out, source, tstamp, buf, len, flush);
+  bluetrax_recorder_dispatched();
+
+  if (out->trace_interval >= 0 && out->batch_bytes != batch_bytes) {
+    if (out->trace_hci == 0) {
+      out->trace_hci = out->trace_replay ?
+        (int64_t)received->tv_sec * 1000000 + received->tv_nsec / 1000 :
+        (int64_t)tstamp.tv_sec * 1000000 + tstamp.tv_usec;
+      out->trace_dispatch = bluetrax_trace_now();
+    }
+    out->trace_time = tstamp;
+  }
+
+  return rc;
+}
+
+/**
+ * Wait for frames on the HCI socket and read as many as are ready, up to
+ * RECV_BATCH_SIZE, along with their timestamps.
+ *
+ * @param stop_fd if not -1, also wait on this descriptor, and return 0 when it
+ *        becomes readable
+ *
+ * @param wait_mask signal mask while waiting, as for pselect; may be NULL
+ *
+ * @param batch to read into; some frames may be too short to process, which
+ *        handle_frame ignores
+ *
+ * @return number of frames read; 0 if there are none to process, e.g. because
+ *         we got a signal; -1 on error
+ */
+static int receive_frames(int dev_sd, int stop_fd, const sigset_t *wait_mask,
+    frame_batch_t *batch)
+{
+  int rc, i;
+  fd_set readfds;
+  struct timespec select_timeout;
+  unsigned char control_buf[RECV_BATCH_SIZE][256]; /* arbitrary */
+  struct iovec iov[RECV_BATCH_SIZE];
+  struct mmsghdr msgs[RECV_BATCH_SIZE];
+  struct cmsghdr *cmsg;
+
+  /* set up arguments for select */
+  FD_ZERO(&readfds);
+  FD_SET(dev_sd, &readfds);
+  if (stop_fd >= 0)
+    FD_SET(stop_fd, &readfds);
+
+  select_timeout.tv_sec = SELECT_TIMEOUT;
+  select_timeout.tv_nsec = 0;
+
+  rc = pselect((dev_sd > stop_fd ? dev_sd : stop_fd) + 1, &readfds, NULL, NULL,
+      &select_timeout, wait_mask);
+
+  if (rc < 0 && errno != EINTR) {
+    bluetrax_log(LOG_ERR, "select failed: %m");
+    return -1;
+  } else if (rc == 0) {
+    bluetrax_log(LOG_ERR, "select timed out");
+    bluetrax_recorder_dump("stall: select timed out");
+    return -1;
+  } else if (rc < 0 || (stop_fd >= 0 && FD_ISSET(stop_fd, &readfds))) {
+    return 0;
+  }
+
+  /* OK; some data is ready */
+  bzero(msgs, sizeof(msgs));
+  for (i = 0; i < RECV_BATCH_SIZE; ++i) {
+    iov[i].iov_base = batch->buf[i];
+    iov[i].iov_len = sizeof(batch->buf[i]);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control_buf[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(control_buf[i]);
+  }
+
+  /* read everything that is ready, without waiting for more */
+  rc = recvmmsg(dev_sd, msgs, RECV_BATCH_SIZE, MSG_DONTWAIT, NULL);
+  if (rc < 0 && errno == ENOSYS) {
+    /* kernels before 2.6.33 don't have recvmmsg */
+    rc = recvmsg(dev_sd, &msgs[0].msg_hdr, 0);
+    msgs[0].msg_len = rc;
+    rc = rc < 0 ? -1 : 1;
+  }
+  if (rc < 0 && errno != EINTR && errno != EAGAIN) {
+    bluetrax_log(LOG_ERR, "recvmsg: %m");
+    return -1;
+  } else if (rc < 0) {
+    return 0;
+  }
+
+  /* process the message headers to get high-precision timestamps */
+  clock_gettime(CLOCK_REALTIME, &batch->received);
+  batch->num_frames = rc;
+  for (i = 0; i < batch->num_frames; ++i) {
+    batch->len[i] = msgs[i].msg_len;
+    bzero(&batch->tstamp[i], sizeof(batch->tstamp[i]));
+    cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+    while (cmsg) {
+      if ((cmsg->cmsg_level == SOL_HCI && cmsg->cmsg_type == HCI_CMSG_TSTAMP) ||
+          (cmsg->cmsg_level == SOL_SOCKET &&
+           cmsg->cmsg_type == SCM_TIMESTAMP)) {
+        batch->tstamp[i] = *((struct timeval *) CMSG_DATA(cmsg));
+      }
+      cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg);
+    }
+  }
+
+  return batch->num_frames;
+}
+
+/**
+ * The main select loop, for one adapter.
+ */
+static int run_scan(bluetrax_capture_t *capture) {
+  output_t *out = &capture->out;
+  int rc = EXIT_SUCCESS, num_frames, i;
+  frame_batch_t batch;
+
+  while (!stopped(capture))
+  {
+    bluetrax_recorder_waiting();
+    num_frames = receive_frames(capture->sds[0], capture->stop_pipe[0],
+        capture->config.wait_mask, &batch);
+    bluetrax_recorder_heartbeat();
+
+    if (poll_sink(&capture->sink) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+
+    if (num_frames < 0)
+      return EXIT_FAILURE;
+
+    /* process the messages themselves */
+    for (i = 0; i < num_frames && rc == EXIT_SUCCESS; ++i) {
+      rc = handle_recorded_frame(out, &batch.received, 0, batch.tstamp[i],
+          batch.buf[i], batch.len[i], capture->config.flush);
+    }
+    if (rc != EXIT_SUCCESS)
+      break;
+
+    if (out->flush && flush_output(out) != EXIT_SUCCESS)
+      return EXIT_FAILURE;
+  }
+
+  return rc;
+}
+
+/**
+ * A frame in the merge queue. Each capture thread takes nodes from its own
+ * pool, and the writer gives them back once it has handled them.
+ */
+typedef struct frame_node {
+  struct frame_node *next;
+  struct timeval tstamp;
+  struct timespec received;
+  int source;
+  int len;
+  unsigned char buf[HCI_MAX_FRAME_SIZE];
+} frame_node_t;
+
+/**
+ * Lock-free queue with many producers and one consumer; see Vyukov's intrusive
+ * MPSC node-based queue. Frames go from the capture threads to the writer in
+ * one of these, and back to each thread's pool in another. Pushing a frame
+ * never blocks or makes a system call.
+ */
+typedef struct {
+  frame_node_t *head;   /* most recently pushed; shared by producers */
+  frame_node_t *tail;   /* next to pop; only used by the consumer */
+  frame_node_t stub;
+} merge_queue_t;
+
+static void merge_queue_init(merge_queue_t *queue) {
+  queue->stub.next = NULL;
+  queue->head = queue->tail = &queue->stub;
+}
+
+static void merge_queue_push(merge_queue_t *queue, frame_node_t *node) {
+  frame_node_t *prev;
+
+  __atomic_store_n(&node->next, NULL, __ATOMIC_RELAXED);
+  prev = __atomic_exchange_n(&queue->head, node, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+/**
+ * @return next frame, or NULL if the queue is empty, or if a producer is part
+ *         way through a push (in which case, try again later)
+ */
+static frame_node_t *merge_queue_pop(merge_queue_t *queue) {
+  frame_node_t *tail = queue->tail;
+  frame_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &queue->stub) {
+    if (next == NULL)
+      return NULL;
+    queue->tail = tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+  if (next) {
+    queue->tail = next;
+    return tail;
+  }
+  if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+    return NULL;
+  merge_queue_push(queue, &queue->stub);
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next) {
+    queue->tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+/**
+ * Nodes to allocate for each capture thread up front. The pool only grows if
+ * more frames than this are held in the reorder window at once.
+ */
+#define FRAME_POOL_SIZE 64
+
+/**
+ * State for the capture thread for one adapter.
+ */
+typedef struct {
+  pthread_t thread;
+  bluetrax_capture_t *capture;
+  int source;           /* index of the adapter */
+  merge_queue_t *queue;
+  merge_queue_t pool;   /* free nodes, given back by the writer */
+  int wake_fd;          /* eventfd to wake the writer */
+  int rc;
+} capture_thread_t;
+
+/**
+ * @return a free node from the thread's pool, or a new one if it is empty; NULL
+ *         if out of memory
+ */
+static frame_node_t *get_frame_node(capture_thread_t *thread) {
+  frame_node_t *node = merge_queue_pop(&thread->pool);
+
+  return node ? node : malloc(sizeof(frame_node_t));
+}
+
+/**
+ * Free the nodes in a thread's pool, once the thread has finished and all of
+ * its nodes have been given back.
+ */
+static void free_frame_pool(capture_thread_t *thread) {
+  frame_node_t *node;
+
+  while ((node = merge_queue_pop(&thread->pool)))
+    free(node);
+}
+
+/**
+ * Wake the writer, which waits for frames on an eventfd.
+ */
+static void wake_writer(int wake_fd) {
+  uint64_t one = 1;
+
+  if (write(wake_fd, &one, sizeof(one)) < 0) {
+    /* the counter is full, so the writer will wake up anyway */
+  }
+}
+
+/**
+ * Capture thread: the run_scan loop for one adapter, except that frames go to
+ * the merge queue, instead of being handled here. The writer is woken once for
+ * each batch of frames read, and after a signal, so that it can poll the sink.
+ */
+static void *run_capture(void *arg) {
+  capture_thread_t *thread = arg;
+  bluetrax_capture_t *capture = thread->capture;
+  frame_batch_t batch;
+  frame_node_t *node;
+  int num_frames, i;
+
+  thread->rc = EXIT_SUCCESS;
+  while (!stopped(capture) && thread->rc == EXIT_SUCCESS) {
+    num_frames = receive_frames(capture->sds[thread->source],
+        capture->stop_pipe[0], capture->config.wait_mask, &batch);
+    if (num_frames < 0) {
+      thread->rc = EXIT_FAILURE;
+      break;
+    }
+    for (i = 0; i < num_frames; ++i) {
+      if (batch.len[i] <= HCI_EVENT_HDR_SIZE)
+        continue;
+      node = get_frame_node(thread);
+      if (node == NULL) {
+        bluetrax_log(LOG_ERR, "run_capture: malloc: %m");
+        thread->rc = EXIT_FAILURE;
+        break;
+      }
+      node->tstamp = batch.tstamp[i];
+      node->received = batch.received;
+      node->source = thread->source;
+      node->len = batch.len[i];
+      memcpy(node->buf, batch.buf[i], batch.len[i]);
+      merge_queue_push(thread->queue, node);
+    }
+    wake_writer(thread->wake_fd);
+  }
+
+  /* if one adapter fails, stop them all, so we can be restarted */
+  set_stop(capture, 1);
+  wake_writer(thread->wake_fd);
+
+  return NULL;
+}
+
+/**
+ * Min-heap of frames by time, for putting frames from several adapters in
+ * order before they are written.
+ */
+typedef struct {
+  frame_node_t **nodes;
+  size_t size;
+  size_t capacity;
+} frame_heap_t;
+
+static int timeval_before(struct timeval *a, struct timeval *b) {
+  return a->tv_sec < b->tv_sec ||
+    (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+static int frame_heap_push(frame_heap_t *heap, frame_node_t *node) {
+  frame_node_t **nodes;
+  size_t i, parent;
+
+  if (heap->size == heap->capacity) {
+    heap->capacity = heap->capacity ? 2 * heap->capacity : 256;
+    nodes = realloc(heap->nodes, heap->capacity * sizeof(frame_node_t *));
+    if (nodes == NULL)
+      return EXIT_FAILURE;
+    heap->nodes = nodes;
+  }
+
+  for (i = heap->size++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (!timeval_before(&node->tstamp, &heap->nodes[parent]->tstamp))
+      break;
+    heap->nodes[i] = heap->nodes[parent];
+  }
+  heap->nodes[i] = node;
+
+  return EXIT_SUCCESS;
+}
+
+static frame_node_t *frame_heap_pop(frame_heap_t *heap) {
+  frame_node_t *top = heap->nodes[0], *last = heap->nodes[--heap->size];
+  size_t i = 0, child;
+
+  for (;;) {
+    child = 2 * i + 1;
+    if (child >= heap->size)
+      break;
+    if (child + 1 < heap->size && timeval_before(
+          &heap->nodes[child + 1]->tstamp, &heap->nodes[child]->tstamp))
+      ++child;
+    if (!timeval_before(&heap->nodes[child]->tstamp, &last->tstamp))
+      break;
+    heap->nodes[i] = heap->nodes[child];
+    i = child;
+  }
+  heap->nodes[i] = last;
+
+  return top;
+}
+
+/**
+ * Scan with several adapters at once. Each adapter has a capture thread, and
+ * this thread merges their frames in time order and handles them.
+ *
+ * Frames are held back until they are reorder_window microseconds old, so that
+ * a frame from one adapter can't be written before an earlier frame from
+ * another adapter that is still in the queue. The HCI timestamps come from the
+ * system clock, so a frame that seems to be from the future (the clock has been
+ * set back) is written straight away.
+ *
+ * Between frames, this thread sleeps until a capture thread wakes it, the
+ * capture is stopped, or the earliest frame held back is due.
+ */
+static int run_scan_devices(bluetrax_capture_t *capture)
+{
+  capture_thread_t threads[BLUETRAX_CAPTURE_MAX_DEVICES];
+  output_t *out = &capture->out;
+  merge_queue_t queue;
+  frame_heap_t heap;
+  frame_node_t *node;
+  struct timeval now, due, future;
+  struct timespec timeout;
+  struct pollfd pfds[2];
+  uint64_t wakes;
+  long reorder_window = capture->config.reorder_window;
+  long long wait_usec;
+  int num_threads = 0, i, j, wake_fd, rc = EXIT_SUCCESS, stopping = 0;
+
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_fd < 0) {
+    bluetrax_log(LOG_ERR, "eventfd: %m");
+    return EXIT_FAILURE;
+  }
+
+  merge_queue_init(&queue);
+  bzero(&heap, sizeof(heap));
+
+  for (i = 0; i < capture->num_sds; ++i) {
+    threads[i].capture = capture;
+    threads[i].source = i;
+    threads[i].queue = &queue;
+    threads[i].wake_fd = wake_fd;
+    merge_queue_init(&threads[i].pool);
+    for (j = 0; j < FRAME_POOL_SIZE; ++j) {
+      node = malloc(sizeof(frame_node_t));
+      if (node == NULL)
+        break;
+      merge_queue_push(&threads[i].pool, node);
+    }
+    if (j < FRAME_POOL_SIZE) {
+      bluetrax_log(LOG_ERR, "run_scan_devices: malloc: %m");
+      free_frame_pool(&threads[i]);
+      rc = EXIT_FAILURE;
+      break;
+    }
+    if (0 != pthread_create(&threads[i].thread, NULL, run_capture,
+          &threads[i])) {
+      bluetrax_log(LOG_ERR, "pthread_create: %m");
+      free_frame_pool(&threads[i]);
+      rc = EXIT_FAILURE;
+      break;
+    }
+    ++num_threads;
+  }
+  if (rc != EXIT_SUCCESS)
+    set_stop(capture, 1);
+
+  /* signals are handled by the capture threads, in pselect */
+  pfds[0].fd = wake_fd;
+  pfds[0].events = POLLIN;
+  pfds[1].fd = capture->stop_pipe[0];
+  pfds[1].events = POLLIN;
+
+  for (;;) {
+    if (stopped(capture) && !stopping) {
+      /* wake up the capture threads and wait for their last frames */
+      stopping = 1;
+      if (1 != write(capture->stop_pipe[1], "", 1) && errno != EAGAIN)
+        bluetrax_log(LOG_ERR, "write stop pipe: %m");
+      for (i = 0; i < num_threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        if (threads[i].rc != EXIT_SUCCESS)
+          rc = EXIT_FAILURE;
+      }
+    }
+
+    if (poll_sink(&capture->sink) != EXIT_SUCCESS) {
+      rc = EXIT_FAILURE;
+      set_stop(capture, 1);
+    }
+
+    while ((node = merge_queue_pop(&queue))) {
+      if (frame_heap_push(&heap, node) != EXIT_SUCCESS) {
+        bluetrax_log(LOG_ERR, "frame_heap_push: out of memory");
+        merge_queue_push(&threads[node->source].pool, node);
+        rc = EXIT_FAILURE;
+        set_stop(capture, 1);
+      }
+    }
+
+    gettimeofday(&now, NULL);
+    due.tv_sec = now.tv_sec - reorder_window / 1000000;
+    due.tv_usec = now.tv_usec - reorder_window % 1000000;
+    if (due.tv_usec < 0) {
+      due.tv_sec -= 1;
+      due.tv_usec += 1000000;
+    }
+    future.tv_sec = now.tv_sec + 1;
+    future.tv_usec = now.tv_usec;
+
+    while (heap.size > 0 && (stopping ||
+          timeval_before(&heap.nodes[0]->tstamp, &due) ||
+          timeval_before(&future, &heap.nodes[0]->tstamp))) {
+      node = frame_heap_pop(&heap);
+      if (rc == EXIT_SUCCESS && handle_recorded_frame(out, &node->received,
+            node->source, node->tstamp, node->buf, node->len,
+            capture->config.flush) != EXIT_SUCCESS) {
+        rc = EXIT_FAILURE;
+        set_stop(capture, 1);
+      }
+      merge_queue_push(&threads[node->source].pool, node);
+    }
+
+    if (out->flush && flush_output(out) != EXIT_SUCCESS) {
+      rc = EXIT_FAILURE;
+      set_stop(capture, 1);
+    }
+
+    if (stopping)
+      break;
+    if (stopped(capture))
+      continue;
+
+    /* sleep until the earliest frame is due, or for more frames */
+    if (heap.size > 0) {
+      wait_usec = (heap.nodes[0]->tstamp.tv_sec - due.tv_sec) * 1000000LL +
+        (heap.nodes[0]->tstamp.tv_usec - due.tv_usec);
+      timeout.tv_sec = wait_usec / 1000000;
+      timeout.tv_nsec = wait_usec % 1000000 * 1000;
+    }
+    bluetrax_recorder_waiting();
+    if (ppoll(pfds, 2, heap.size > 0 ? &timeout : NULL, NULL) < 0 &&
+        errno != EINTR) {
+      bluetrax_log(LOG_ERR, "ppoll: %m");
+      rc = EXIT_FAILURE;
+      set_stop(capture, 1);
+    }
+    bluetrax_recorder_heartbeat();
+    if (read(wake_fd, &wakes, sizeof(wakes)) < 0) {
+      /* not woken by a capture thread */
+    }
+  }
+
+  free(heap.nodes);
+  for (i = 0; i < num_threads; ++i)
+    free_frame_pool(&threads[i]);
+  close(wake_fd);
+
+  return rc;
+}
+
+/**
+ * Microseconds between two points on the monotonic clock.
+ */
+static double elapsed_usec(struct timespec *from, struct timespec *to) {
+  return (to->tv_sec - from->tv_sec) * 1e6 +
+    (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+/**
+ * Wait until target on the monotonic clock, or until the capture is stopped,
+ * from this thread or another.
+ *
+ * @return nonzero if it was stopped
+ */
+static int wait_until(bluetrax_capture_t *capture, struct timespec *target) {
+  struct pollfd pfd;
+  struct timespec now, timeout;
+  int rc;
+
+  pfd.fd = capture->stop_pipe[0];
+  pfd.events = POLLIN;
+  while (!stopped(capture)) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout.tv_sec = target->tv_sec - now.tv_sec;
+    timeout.tv_nsec = target->tv_nsec - now.tv_nsec;
+    if (timeout.tv_nsec < 0) {
+      timeout.tv_sec -= 1;
+      timeout.tv_nsec += 1000000000L;
+    }
+    if (timeout.tv_sec < 0)
+      return 0;
+    bluetrax_recorder_waiting();
+    rc = ppoll(&pfd, 1, &timeout, NULL);
+    bluetrax_recorder_heartbeat();
+    if (rc > 0)
+      return stopped(capture);
+  }
+  return 1;
+}
+
+/**
+ * Replay frames from a file written by 'hcidump -w', instead of reading them
+ * from the HCI socket. Frames are paced according to their timestamps, divided
+ * by speed, and the output uses the timestamps from the file.
+ *
+ * At the end of each pass through the file, log the number of frames and the
+ * mean and maximum time taken to process a frame, in microseconds. Each pass
+ * is shifted forward in time so that output times keep increasing.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int replay_file(bluetrax_capture_t *capture)
+{
+  output_t *out = &capture->out;
+  FILE *in_file = capture->config.replay_file;
+  double speed = capture->config.speed;
+  int loops = capture->config.loops, flush = capture->config.flush;
+  int pass, len;
+  long offset_sec = 0, offset_usec = 0, span_usec = 0;
+  unsigned long num_frames;
+  double dispatch_usec, total_usec, max_usec;
+  unsigned char buf[HCI_MAX_FRAME_SIZE];
+  bluetrax_hcidump_hdr_t hdr;
+  bluetrax_inquiry_complete_t record;
+  struct timeval tstamp, first, last;
+  struct timespec wall_start, target, before, after, received;
+  long long due_nsec;
+
+  bzero(&first, sizeof(first));
+  bzero(&last, sizeof(last));
+
+  for (pass = 0; pass < loops && !stopped(capture); ++pass) {
+    num_frames = 0;
+    total_usec = max_usec = 0;
+
+    if (pass > 0) {
+      span_usec += (last.tv_sec - first.tv_sec) * 1000000L +
+        (last.tv_usec - first.tv_usec) + REPLAY_LOOP_GAP_USEC;
+      offset_sec = span_usec / 1000000L;
+      offset_usec = span_usec % 1000000L;
+      if (fseek(in_file, 0, SEEK_SET) != 0) {
+        bluetrax_log(LOG_ERR, "replay: failed to rewind for --loops: %m");
+        return EXIT_FAILURE;
+      }
+    }
+
+    while (!stopped(capture)) {
+      if (poll_sink(&capture->sink) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+      if (1 != fread(&hdr, sizeof(hdr), 1, in_file))
+        break;
+      len = btohs(hdr.len);
+      if (len > sizeof(buf)) {
+        bluetrax_log(LOG_ERR, "replay: bad frame length: len=%d", len);
+        return EXIT_FAILURE;
+      }
+      if (len != fread(buf, 1, len, in_file)) {
+        bluetrax_log(LOG_ERR, "replay: truncated frame: len=%d", len);
+        return EXIT_FAILURE;
+      }
+
+      /* skip commands that we sent to the controller */
+      if (!hdr.in || len <= HCI_EVENT_HDR_SIZE)
+        continue;
+
+      last.tv_sec = btohl(hdr.ts_sec);
+      last.tv_usec = btohl(hdr.ts_usec);
+      if (pass == 0 && num_frames == 0) {
+        first = last;
+        clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+        /* write a fake 'complete' record, as for a live scan */
+        record.time = first;
+        if (write_inquiry_complete(out, record) != EXIT_SUCCESS)
+          return EXIT_FAILURE;
+      }
+
+      tstamp.tv_sec = last.tv_sec + offset_sec;
+      tstamp.tv_usec = last.tv_usec + offset_usec;
+      if (tstamp.tv_usec >= 1000000) {
+        tstamp.tv_sec += 1;
+        tstamp.tv_usec -= 1000000;
+      }
+
+      /* wait until the frame is due */
+      if (speed > 0) {
+        due_nsec = wall_start.tv_nsec + (long long)(1000 *
+          ((tstamp.tv_sec - first.tv_sec) * 1e6 +
+           (tstamp.tv_usec - first.tv_usec)) / speed);
+        target.tv_sec = wall_start.tv_sec + due_nsec / 1000000000LL;
+        target.tv_nsec = due_nsec % 1000000000LL;
+        if (wait_until(capture, &target))
+          break;
+      }
+
+      clock_gettime(CLOCK_REALTIME, &received);
+      clock_gettime(CLOCK_MONOTONIC, &before);
+      if (handle_recorded_frame(out, &received, 0, tstamp, buf, len, flush)
+          != EXIT_SUCCESS ||
+          (out->flush && flush_output(out) != EXIT_SUCCESS))
+        return EXIT_FAILURE;
+      clock_gettime(CLOCK_MONOTONIC, &after);
+
+      dispatch_usec = elapsed_usec(&before, &after);
+      total_usec += dispatch_usec;
+      if (dispatch_usec > max_usec)
+        max_usec = dispatch_usec;
+      ++num_frames;
+    }
+
+    if (ferror(in_file)) {
+      bluetrax_log(LOG_ERR, "replay: fread: %m");
+      return EXIT_FAILURE;
+    }
+
+    bluetrax_log(LOG_NOTICE,
+        "replay: pass=%d, frames=%lu, mean_us=%.3f, max_us=%.3f",
+        pass, num_frames, num_frames > 0 ? total_usec / num_frames : 0.0,
+        max_usec);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * replay_file, with the config's wait mask.
+ */
+static int run_replay(bluetrax_capture_t *capture)
+{
+  sigset_t old_mask;
+  int rc;
+
+  /* there is no pselect here, so take the wait mask for the whole replay, as
+   * signals are only otherwise handled while waiting; this thread's mask is
+   * put back afterwards */
+  if (capture->config.wait_mask)
+    pthread_sigmask(SIG_SETMASK, capture->config.wait_mask, &old_mask);
+
+  rc = replay_file(capture);
+
+  if (capture->config.wait_mask)
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+  return rc;
+}
+
+/**
+ * Bind a local datagram socket at path to read frames from, instead of from an
+ * HCI socket. Each datagram is one frame, starting with the packet type byte,
+ * as on an HCI socket, and the kernel timestamps it, as for HCI frames.
+ *
+ * @return socket descriptor, or -1 on error
+ */
+static int open_source(const char *path) {
+  struct sockaddr_un addr;
+  int sd, opt = 1;
+
+  bzero(&addr, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  sd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (sd < 0)
+    return -1;
+
+  unlink(path);
+  if (bind(sd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      setsockopt(sd, SOL_SOCKET, SO_TIMESTAMP, &opt, sizeof(opt)) < 0) {
+    close(sd);
+    return -1;
+  }
+
+  return sd;
+}
+
+/**
+ * Callback for hci_for_each_dev: add dev_id to the list of devices to use,
+ * which is terminated by -1, and has room for BLUETRAX_CAPTURE_MAX_DEVICES of
+ * them; any more are left out, with a warning.
+ */
+static int add_device(int dd, int dev_id, long arg) {
+  int *dev_ids = (int *)arg;
+  int i;
+
+  for (i = 0; i < BLUETRAX_CAPTURE_MAX_DEVICES && dev_ids[i] >= 0; ++i)
+    ;
+  if (i < BLUETRAX_CAPTURE_MAX_DEVICES) {
+    dev_ids[i] = dev_id;
+    dev_ids[i + 1] = -1;
+  } else {
+    bluetrax_log(LOG_WARNING, "not scanning with hci%d: at most %d adapters",
+        dev_id, BLUETRAX_CAPTURE_MAX_DEVICES);
+  }
+
+  return 0;
+}
+
+/**
+ * Open the adapters in the config (or all that are up, or the default one),
+ * and put them into periodic inquiry mode.
+ *
+ * @return EXIT_SUCCESS if no errors; on error, none are left open
+ */
+static int open_devices(bluetrax_capture_t *capture) {
+  const bluetrax_capture_config_t *config = &capture->config;
+  int dev_ids[BLUETRAX_CAPTURE_MAX_DEVICES + 1];
+  int num_devices = config->num_devices, rc = EXIT_SUCCESS, sd, i;
+
+  if (config->all_devices) {
+    dev_ids[0] = -1;
+    hci_for_each_dev(HCI_UP, add_device, (long)dev_ids);
+    for (num_devices = 0; num_devices < BLUETRAX_CAPTURE_MAX_DEVICES &&
+        dev_ids[num_devices] >= 0; ++num_devices)
+      ;
+    if (num_devices == 0) {
+      bluetrax_log(LOG_ERR, "no Bluetooth devices are up");
+      return EXIT_FAILURE;
+    }
+  } else if (num_devices == 0) {
+    /* use the default bluetooth device */
+    dev_ids[0] = hci_get_route(NULL);
+    if (dev_ids[0] < 0) {
+      bluetrax_log(LOG_ERR, "hci_get_route: %m");
+      return EXIT_FAILURE;
+    }
+    num_devices = 1;
+  } else {
+    if (num_devices > BLUETRAX_CAPTURE_MAX_DEVICES)
+      num_devices = BLUETRAX_CAPTURE_MAX_DEVICES;
+    memcpy(dev_ids, config->dev_ids, num_devices * sizeof(int));
+  }
+
+  for (capture->num_sds = 0; capture->num_sds < num_devices;
+      ++capture->num_sds) {
+    sd = hci_open_dev(dev_ids[capture->num_sds]);
+    if (sd < 0) {
+      bluetrax_log(LOG_ERR, "hci_open_dev: hci%d: %m",
+          dev_ids[capture->num_sds]);
+      rc = EXIT_FAILURE;
+      break;
+    }
+    rc = start_scan(sd, config->scan_length);
+    if (rc != EXIT_SUCCESS) {
+      hci_close_dev(sd);
+      break;
+    }
+    capture->sds[capture->num_sds] = sd;
+  }
+
+  if (rc != EXIT_SUCCESS) {
+    for (i = 0; i < capture->num_sds; ++i) {
+      stop_scan(capture->sds[i]);
+      hci_close_dev(capture->sds[i]);
+    }
+    capture->num_sds = 0;
+  }
+
+  return rc;
+}
+
+void bluetrax_capture_config_init(bluetrax_capture_config_t *config) {
+  bzero(config, sizeof(*config));
+  config->speed = 1;
+  config->loops = 1;
+  config->scan_length = 8;
+  config->reorder_window = DEFAULT_REORDER_WINDOW;
+  config->trace_interval = -1;
+}
+
+bluetrax_capture_t *bluetrax_capture_start(
+    const bluetrax_capture_config_t *config,
+    const bluetrax_capture_sink_t *sink)
+{
+  bluetrax_capture_t *capture;
+  bluetrax_inquiry_complete_t record;
+
+  capture = calloc(1, sizeof(bluetrax_capture_t));
+  if (capture == NULL) {
+    bluetrax_log(LOG_ERR, "bluetrax_capture_start: calloc: %m");
+    return NULL;
+  }
+  capture->config = *config;
+  capture->sink = *sink;
+  capture->out.sink = &capture->sink;
+  capture->out.trace_interval = config->trace_interval;
+  capture->out.trace_replay = config->replay_file != NULL;
+
+  /* non-blocking, so a stop never blocks, even from a signal handler */
+  if (0 != pipe2(capture->stop_pipe, O_NONBLOCK | O_CLOEXEC)) {
+    bluetrax_log(LOG_ERR, "pipe: %m");
+    free(capture);
+    return NULL;
+  }
+
+  /* with replay, the first record comes from the file */
+  if (config->replay_file)
+    return capture;
+
+  if (config->num_sockets > 0) {
+    /* carry on with a scan that is already running */
+    capture->num_sds = config->num_sockets;
+    if (capture->num_sds > BLUETRAX_CAPTURE_MAX_DEVICES)
+      capture->num_sds = BLUETRAX_CAPTURE_MAX_DEVICES;
+    memcpy(capture->sds, config->sockets, capture->num_sds * sizeof(int));
+    return capture;
+  }
+
+  if (config->source_path) {
+    capture->sds[0] = open_source(config->source_path);
+    if (capture->sds[0] < 0) {
+      bluetrax_log(LOG_ERR, "failed to open source socket: %s: %m",
+          config->source_path);
+      bluetrax_capture_close(capture);
+      return NULL;
+    }
+    capture->num_sds = 1;
+  } else if (open_devices(capture) != EXIT_SUCCESS) {
+    bluetrax_capture_close(capture);
+    return NULL;
+  }
+
+  /* write a fake 'complete' record with the start time of the first scan; the
+   * buffer is empty, so this can't fail */
+  gettimeofday(&record.time, NULL);
+  write_inquiry_complete(&capture->out, record);
+
+  return capture;
+}
+
+int bluetrax_capture_run(bluetrax_capture_t *capture) {
+  char byte;
+  int rc;
+
+  capture->out.num_sources = capture->num_sds > 1 ? capture->num_sds : 1;
+  bluetrax_recorder_heartbeat();
+  if (capture->config.replay_file)
+    rc = run_replay(capture);
+  else if (capture->num_sds == 1)
+    rc = run_scan(capture);
+  else
+    rc = run_scan_devices(capture);
+
+  if (flush_output(&capture->out) != EXIT_SUCCESS)
+    rc = EXIT_FAILURE;
+  if (capture->config.trace_interval >= 0)
+    report_latency(&capture->out);
+  bluetrax_recorder_waiting();
+
+  /* ready to run again; the flag is cleared first, so that a stop that comes
+   * in the meantime leaves it set, rather than a byte in the pipe without it */
+  set_stop(capture, 0);
+  while (read(capture->stop_pipe[0], &byte, 1) == 1)
+    ;
+
+  return rc == EXIT_SUCCESS ? 0 : -1;
+}
+
+void bluetrax_capture_stop(bluetrax_capture_t *capture) {
+  int saved_errno = errno;
+
+  set_stop(capture, 1);
+  if (write(capture->stop_pipe[1], "", 1) < 0) {
+    /* the pipe is full, so the capture will wake up anyway */
+  }
+  errno = saved_errno;
+}
+
+int bluetrax_capture_flush(bluetrax_capture_t *capture) {
+  return flush_output(&capture->out) == EXIT_SUCCESS ? 0 : -1;
+}
+
+int bluetrax_capture_sockets(bluetrax_capture_t *capture, int *sockets) {
+  memcpy(sockets, capture->sds, capture->num_sds * sizeof(int));
+  return capture->num_sds;
+}
+
+void bluetrax_capture_close(bluetrax_capture_t *capture) {
+  int i;
+
+  /* a source socket is not an adapter */
+  if (!capture->config.source_path)
+    for (i = 0; i < capture->num_sds; ++i)
+      stop_scan(capture->sds[i]);
+
+  /* recovery:
+   * restart bluetooth
+   * I've seen toggling inqmode bring it back to life on my laptop after a
+   * period in which nothing was being detected; I've now seem this twice
+   * on my netbook: run
+   * hciconfig hci0 inqmode 0
+   * hciconfig hci0 inqmode 1
+   * and it seems to be happy again. It was detecting only some devices (a GPS
+   * logger but not my phone or computer) */
+
+  for (i = 0; i < capture->num_sds; ++i)
+    close(capture->sds[i]);
+  if (capture->config.source_path && capture->num_sds > 0)
+    unlink(capture->config.source_path);
+
+  close(capture->stop_pipe[0]);
+  close(capture->stop_pipe[1]);
+  free(capture);
+}
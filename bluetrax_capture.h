@@ -0,0 +1,159 @@
+#ifndef _BLUETRAX_CAPTURE_H_
+#define _BLUETRAX_CAPTURE_H_
+
+#include <signal.h>
+
+#include "bluetrax.h"
+
+/**
+ * The capture engine behind bluetrax_scan, for programs that want the records
+ * in their own process, without running the scanner and reading its output.
+ *
+ * The engine puts one or more adapters into periodic inquiry mode, reads their
+ * HCI frames and turns them into records, in bluetrax_scan's format, which it
+ * hands to a sink: a set of callbacks that the caller provides. The records
+ * are built in a buffer in place, and the sink is called on the thread that
+ * runs the capture, so there is no pipe, no copy into another process and no
+ * extra thread to wake, except with several adapters, which are read by a
+ * thread each, as in bluetrax_scan.
+ *
+ * A capture is started with bluetrax_capture_start, which opens the adapters,
+ * and run with bluetrax_capture_run, which does not return until the capture
+ * is stopped, with bluetrax_capture_stop (e.g. from another thread or a signal
+ * handler), or fails. It can then be run again, or closed with
+ * bluetrax_capture_close, which takes the adapters out of periodic inquiry
+ * mode.
+ *
+ * Messages go through bluetrax_log, and the frames through bluetrax_recorder,
+ * which only writes them out if bluetrax_recorder_open has been called.
+ */
+
+/**
+ * Maximum number of adapters to capture with at once.
+ */
+#define BLUETRAX_CAPTURE_MAX_DEVICES 8
+
+typedef struct {
+  /* the adapters to scan with, as for hci_devid; if there are none, and not
+   * all_devices, the first available adapter */
+  int          dev_ids[BLUETRAX_CAPTURE_MAX_DEVICES];
+  int          num_devices;
+  int          all_devices;     /* all adapters that are up */
+
+  /* or sockets that are already scanning, e.g. passed on by a re-exec; the
+   * first record is not written again */
+  int          sockets[BLUETRAX_CAPTURE_MAX_DEVICES];
+  int          num_sockets;
+
+  /* or a local datagram socket bound at this path, with a frame in each
+   * datagram, e.g. from bluetrax_loadgen; with sockets, they are this one */
+  const char  *source_path;
+
+  /* or frames from a file written by 'hcidump -w', at speed times real time
+   * (0 for as fast as possible), loops times over; must be seekable if loops
+   * is more than 1 */
+  FILE        *replay_file;
+  double       speed;
+  int          loops;
+
+  int          scan_length;     /* of each inquiry, in units of 1.28s */
+  int          flush;           /* end a batch after every frame, not just at
+                                   the end of each inquiry */
+  long         reorder_window;  /* with several adapters, how long to hold
+                                   frames back to merge them in time order, in
+                                   microseconds */
+  int64_t      trace_interval;  /* time batches, and write a trace record at
+                                   most this often, in microseconds; -1 not to */
+
+  /* signal mask while waiting for frames, as for pselect, so the caller can
+   * keep signals blocked except while the capture waits; NULL to leave the
+   * mask as it is */
+  const sigset_t *wait_mask;
+} bluetrax_capture_config_t;
+
+/**
+ * Where the records go. Each callback may be NULL, and returns 0, or nonzero
+ * to stop the capture with an error (in which case it should log why). They
+ * are called on the thread that runs the capture.
+ */
+typedef struct {
+  /* records, with their type bytes, exactly as bluetrax_scan writes them;
+   * only valid during the call. There may be several calls per batch. */
+  int  (*batch)(void *arg, const unsigned char *records, size_t size);
+
+  /* each record, decoded; only valid during the call */
+  int  (*record)(void *arg, const bluetrax_scan_record_t *record);
+
+  /* at the end of each batch, i.e. where bluetrax_scan flushes its file */
+  int  (*flush)(void *arg);
+
+  /* each time the capture wakes up, e.g. after a signal, before it handles
+   * any frames that it woke for */
+  int  (*poll)(void *arg);
+
+  void *arg;
+} bluetrax_capture_sink_t;
+
+typedef struct bluetrax_capture bluetrax_capture_t;
+
+/**
+ * Set the config to bluetrax_scan's defaults: the first available adapter,
+ * inquiries of length 8, a batch per inquiry, a reorder window of 100ms, one
+ * pass at real time for replay, and no tracing.
+ */
+void bluetrax_capture_config_init(bluetrax_capture_config_t *config);
+
+/**
+ * Open the adapters and put them into periodic inquiry mode, or open the
+ * source; the first record, an 'inquiry complete' record with the current
+ * time, which marks the start of the scan, is buffered for the sink.
+ *
+ * @param config copied
+ *
+ * @param sink copied
+ *
+ * @return NULL on error, which has been logged
+ */
+bluetrax_capture_t *bluetrax_capture_start(
+    const bluetrax_capture_config_t *config,
+    const bluetrax_capture_sink_t *sink);
+
+/**
+ * Capture until stopped, or until the replay ends; the records still buffered
+ * are handed to the sink before it returns. With trace_interval, the latency
+ * histograms are logged then, as well as every hour.
+ *
+ * @return 0 if no errors; -1 on error, which has been logged
+ */
+int bluetrax_capture_run(bluetrax_capture_t *capture);
+
+/**
+ * Ask the capture to stop as soon as it can. This may be called from any
+ * thread or from a signal handler.
+ */
+void bluetrax_capture_stop(bluetrax_capture_t *capture);
+
+/**
+ * Hand the records buffered so far to the sink, and end the batch. Only call
+ * this from the capture's own thread, e.g. in the sink's poll.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+int bluetrax_capture_flush(bluetrax_capture_t *capture);
+
+/**
+ * Get the sockets that the capture reads from, e.g. to pass them on.
+ *
+ * @param sockets array of at least BLUETRAX_CAPTURE_MAX_DEVICES
+ *
+ * @return number of sockets; 0 for replay
+ */
+int bluetrax_capture_sockets(bluetrax_capture_t *capture, int *sockets);
+
+/**
+ * Take the adapters out of periodic inquiry mode, close the sockets, and free
+ * the capture.
+ */
+void bluetrax_capture_close(bluetrax_capture_t *capture);
+
+#endif /* guard */
@@ -0,0 +1,1313 @@
+/*
+ * Collect the records from many sensors over TCP and write them to a file per
+ * sensor, in bluetrax_scan format.
+ *
+ * Each sensor connects (e.g. with bluetrax_upload), sends a line
+ *   BTX1 sensor live
+ * or
+ *   BTX1 sensor backfill
+ * and then the bytes of its records, as written by bluetrax_scan. Live records
+ * are appended to the file named after the sensor in the output directory;
+ * backfill (e.g. a spool uploaded after a sensor has been offline) goes to a
+ * new file, sensor.backfill.time, so that each file stays in time order. A
+ * new live connection from a sensor replaces any it already has, so a sensor
+ * that reconnects does not have to wait for the old connection to time out.
+ *
+ * Notes:
+ * - The connections are served in turn by weighted fair queuing: each turn
+ *   goes to the connection with data waiting that has had the least service
+ *   for its weight, so when backfill and live connections are both busy, the
+ *   live ones (with --live-weight times the weight) get most of the
+ *   collector. However much backfill there is, a live connection waits at
+ *   most about one turn per busy connection.
+ * - Sensors may only send as many bytes as the collector has given them
+ *   credit for, which it sends as 4 byte big endian counts of bytes: a window
+ *   of --window bytes to start with, and then more as it takes their data. So
+ *   a busy backfill connection has at most a window of data on its way, and a
+ *   sensor can tell how much the collector has taken. Sending more than the
+ *   credit is an error, and the collector drops the connection.
+ * - Only whole records are written, so a connection that drops part way
+ *   through a record does not leave a partial record in the file.
+ * - The work is split between --workers processes, which each have their own
+ *   listening socket on the port (with SO_REUSEPORT), so the kernel spreads
+ *   new connections between them. Each sensor belongs to one worker, chosen
+ *   by a hash of its name; a worker that gets a connection for a sensor that
+ *   belongs to another passes it on (over a unix socket) once it has read the
+ *   hello. So each sensor's files have a single writer, and the workers share
+ *   nothing on the way from the socket to the file. If a worker dies, the
+ *   parent process starts a new one; its sensors reconnect.
+ * - The workers keep a catalog of the sensors, with their connections and
+ *   how many records they have sent, in a file in the output directory
+ *   (.collect.catalog) that they all map into memory; --status prints it.
+ *   Each sensor's entry is only written by its worker, with a sequence
+ *   number that readers check to get a consistent copy, so updating it takes
+ *   no locks. The catalog is cleared when the collector starts, and stays
+ *   locked (with flock) while it runs, so a second collector on the same
+ *   directory fails, rather than sharing the port (and the sensors) with the
+ *   first; so does one on the same port, which is checked before the
+ *   workers' sockets are bound.
+ * - Trace records (from bluetrax_scan --trace) are stamped with the ingest
+ *   hop as they are written, and the catalog keeps histograms of each
+ *   sensor's latencies for each hop up to here, which --latency prints.
+ * - On SIGHUP, the live files are reopened, so they can be rotated.
+ */
+#define _GNU_SOURCE /* for accept4 and SO_REUSEPORT */
+#include "bluetrax.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/**
+ * Most bytes to take from a connection in one turn.
+ */
+#define QUANTUM (64 << 10)
+
+/**
+ * Longest record, with its type byte.
+ */
+#define MAX_RECORD_SIZE BLUETRAX_MAX_RECORD_SIZE
+
+/**
+ * Longest sensor name; names may only have letters, digits, '-', '_' and
+ * '.', and may not start with '.'.
+ */
+#define MAX_SENSOR_NAME 64
+
+/**
+ * Longest hello line.
+ */
+#define MAX_HELLO 128
+
+#define DEFAULT_PORT "7711"
+#define DEFAULT_WINDOW (256 << 10)
+#define DEFAULT_LIVE_WEIGHT 16
+
+#define MAX_EVENTS 64
+
+/**
+ * Name of the catalog file in the output directory, and the number of sensors
+ * it can hold.
+ */
+#define CATALOG_NAME ".collect.catalog"
+#define CATALOG_SLOTS 4096
+#define CATALOG_MAGIC "BTC2"
+
+/**
+ * How long to wait before starting a new worker after one dies, in seconds.
+ */
+#define RESTART_DELAY 1
+
+enum { SLOT_EMPTY, SLOT_CLAIMED, SLOT_NAMED };
+
+/**
+ * A sensor's entry in the catalog. It is written only by the worker that the
+ * sensor belongs to; seq is odd while it is being updated.
+ */
+typedef struct {
+  uint32_t state;                 /* SLOT_EMPTY, etc. */
+  uint32_t seq;
+  char     sensor[MAX_SENSOR_NAME + 1];
+  int32_t  worker;
+  uint32_t live;                  /* connections open */
+  uint32_t backfill;
+  uint64_t records;               /* records written since the start */
+  uint64_t bytes;
+  int64_t  last_sec;              /* time of the last record written */
+  int64_t  last_usec;
+  bluetrax_latency_t latency[BLUETRAX_HOP_INGEST + 1]; /* hops up to here */
+} catalog_slot_t;
+
+typedef struct {
+  char           magic[4];
+  uint32_t       num_slots;
+  uint32_t       num_workers;
+  uint32_t       pad;
+  catalog_slot_t slots[CATALOG_SLOTS];
+} catalog_t;
+
+typedef struct connection {
+  int                fd;
+  int                out_fd;      /* -1 until the hello has been read */
+  char               sensor[MAX_SENSOR_NAME + 1];
+  char               path[PATH_MAX];
+  int                live;
+  int                weight;
+  int                ready;       /* may have data waiting */
+  int                closing;     /* dropped; freed at the end of the turn */
+  int                handed_off;  /* passed on to the sensor's worker */
+  catalog_slot_t    *slot;
+  double             vtime;       /* service so far, divided by weight */
+  uint64_t           granted;     /* bytes of credit sent */
+  uint64_t           taken;       /* bytes read */
+  uint32_t           unsent;      /* credit not yet sent */
+  unsigned long      records;
+  time_t             start;
+  size_t             held;        /* bytes in buf */
+  unsigned char      buf[QUANTUM + MAX_HELLO];
+  struct connection *next;
+} connection_t;
+
+typedef struct {
+  const char   *dir;
+  int           window;
+  int           live_weight;
+  int           num_workers;
+  int           worker;           /* this worker's number */
+  int          *listen_fds;       /* a listening socket for each worker */
+  int          *handoff_fds;      /* [2 * i] to receive, [2 * i + 1] to send */
+  catalog_t    *catalog;
+  int           epoll_fd;
+  connection_t *connections;
+  double        vclock;           /* vtime of the last connection served */
+} collector_t;
+
+/**
+ * Tags for the epoll events that are not for connections.
+ */
+static int listen_tag, handoff_tag;
+
+/**
+ * Global flags set by signal handlers.
+ */
+static volatile sig_atomic_t request_stop = 0;
+static volatile sig_atomic_t request_reopen = 0;
+
+static void handle_signal(int signo) {
+  if (signo == SIGHUP)
+    request_reopen = 1;
+  else if (signo != SIGCHLD)
+    request_stop = 1;
+}
+
+/**
+ * Stop on SIGINT or SIGTERM; reopen live files on SIGHUP; and notice workers
+ * that die. The signals are blocked except while waiting in epoll_pwait (or
+ * sigsuspend, in the parent).
+ *
+ * @return true if no errors
+ */
+static int setup_signals(sigset_t *waitset) {
+  struct sigaction sa;
+  sigset_t blockset;
+
+  sa.sa_handler = handle_signal;
+  sa.sa_flags = 0;
+
+  return
+    0 == sigemptyset(&blockset) &&
+    0 == sigaddset(&blockset, SIGINT) &&
+    0 == sigaddset(&blockset, SIGTERM) &&
+    0 == sigaddset(&blockset, SIGHUP) &&
+    0 == sigaddset(&blockset, SIGCHLD) &&
+    0 == sigprocmask(SIG_BLOCK, &blockset, waitset) &&
+    0 == sigemptyset(&sa.sa_mask) &&
+    0 == sigaction(SIGINT, &sa, NULL) &&
+    0 == sigaction(SIGTERM, &sa, NULL) &&
+    0 == sigaction(SIGHUP, &sa, NULL) &&
+    0 == sigaction(SIGCHLD, &sa, NULL) &&
+    SIG_ERR != signal(SIGPIPE, SIG_IGN);
+}
+
+static int valid_sensor_name(const char *name) {
+  const char *p;
+
+  if (name[0] == '\0' || name[0] == '.' || strlen(name) > MAX_SENSOR_NAME)
+    return 0;
+  for (p = name; *p; ++p) {
+    if (!(('a' <= *p && *p <= 'z') || ('A' <= *p && *p <= 'Z') ||
+          ('0' <= *p && *p <= '9') || *p == '-' || *p == '_' || *p == '.'))
+      return 0;
+  }
+  return 1;
+}
+
+static int open_output(const char *path, int flags) {
+  return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | flags, 0644);
+}
+
+/**
+ * FNV-1a hash of a sensor name.
+ */
+static uint32_t hash_name(const char *name) {
+  uint32_t hash = 2166136261u;
+
+  for (; *name; ++name)
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
+  return hash;
+}
+
+/**
+ * Map the catalog file in the output directory into memory.
+ *
+ * @param create true to make a new, empty catalog, replacing any old one; the
+ *        file is then locked for as long as the collector (or any of its
+ *        workers) runs, and this fails if another collector has it locked
+ *
+ * @return NULL on error
+ */
+static catalog_t *open_catalog(const char *dir, int create, int num_workers) {
+  char path[PATH_MAX];
+  catalog_t *catalog;
+  struct stat st;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, CATALOG_NAME);
+  fd = create ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) :
+    open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    syslog(LOG_ERR, "failed to open catalog: %s: %m", path);
+    return NULL;
+  }
+
+  /* lock before clearing it, so a second collector can't wipe it either */
+  if (create && flock(fd, LOCK_EX | LOCK_NB)) {
+    if (errno == EWOULDBLOCK)
+      syslog(LOG_ERR, "another collector is running in %s", dir);
+    else
+      syslog(LOG_ERR, "flock: %s: %m", path);
+    close(fd);
+    return NULL;
+  }
+  if (create && (ftruncate(fd, 0) || ftruncate(fd, sizeof(catalog_t)))) {
+    syslog(LOG_ERR, "ftruncate: %s: %m", path);
+    close(fd);
+    return NULL;
+  }
+  if (fstat(fd, &st) || st.st_size < (off_t)sizeof(catalog_t)) {
+    syslog(LOG_ERR, "catalog is too short: %s", path);
+    close(fd);
+    return NULL;
+  }
+
+  catalog = mmap(NULL, sizeof(catalog_t),
+      create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  if (catalog == MAP_FAILED) {
+    syslog(LOG_ERR, "mmap: %s: %m", path);
+    close(fd);
+    return NULL;
+  }
+
+  /* the lock lasts as long as the descriptor, which is kept open */
+  if (!create)
+    close(fd);
+
+  if (create) {
+    catalog->num_slots = CATALOG_SLOTS;
+    catalog->num_workers = num_workers;
+    memcpy(catalog->magic, CATALOG_MAGIC, sizeof(catalog->magic));
+  } else if (memcmp(catalog->magic, CATALOG_MAGIC, sizeof(catalog->magic)) ||
+      catalog->num_slots != CATALOG_SLOTS) {
+    syslog(LOG_ERR, "not a catalog: %s", path);
+    munmap(catalog, sizeof(catalog_t));
+    return NULL;
+  }
+  return catalog;
+}
+
+/**
+ * Find the catalog entry for a sensor, adding it if it is not there. Only the
+ * sensor's worker adds it, so it can't be added twice, but workers adding
+ * different sensors can race for the same empty slot.
+ *
+ * @return NULL if the catalog is full
+ */
+static catalog_slot_t *catalog_slot(collector_t *collector,
+    const char *sensor) {
+  catalog_t *catalog = collector->catalog;
+  catalog_slot_t *slot;
+  uint32_t i, n, state;
+
+  i = hash_name(sensor) % CATALOG_SLOTS;
+  for (n = 0; n < CATALOG_SLOTS; ++n, i = (i + 1) % CATALOG_SLOTS) {
+    slot = &catalog->slots[i];
+    state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (state == SLOT_EMPTY) {
+      if (!__atomic_compare_exchange_n(&slot->state, &state, SLOT_CLAIMED, 0,
+            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        /* someone else got it; look at it again */
+        --n;
+        continue;
+      }
+      strcpy(slot->sensor, sensor);
+      slot->worker = collector->worker;
+      __atomic_store_n(&slot->state, SLOT_NAMED, __ATOMIC_RELEASE);
+      return slot;
+    }
+    while (state == SLOT_CLAIMED)
+      state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    if (!strcmp(slot->sensor, sensor))
+      return slot;
+  }
+  return NULL;
+}
+
+/**
+ * Start and finish an update to a catalog entry.
+ */
+static void begin_update(catalog_slot_t *slot) {
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end_update(catalog_slot_t *slot) {
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Count a connection opening (change 1) or closing (change -1).
+ */
+static void count_connection(connection_t *c, int change) {
+  if (c->slot == NULL)
+    return;
+  begin_update(c->slot);
+  if (c->live)
+    c->slot->live += change;
+  else
+    c->slot->backfill += change;
+  end_update(c->slot);
+}
+
+/**
+ * Take a consistent copy of a catalog entry.
+ */
+static void read_slot(catalog_slot_t *slot, catalog_slot_t *copy) {
+  uint32_t seq;
+
+  do {
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    memcpy(copy, slot, sizeof(*copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+}
+
+/**
+ * Print the catalog, as sensor,worker,live,backfill,records,bytes,last
+ */
+static int print_catalog(const char *dir) {
+  catalog_slot_t copy, *slot;
+  catalog_t *catalog;
+  char stamp[32];
+  time_t last;
+  uint32_t i;
+  struct tm tm;
+
+  catalog = open_catalog(dir, 0, 0);
+  if (catalog == NULL)
+    return EXIT_FAILURE;
+
+  printf("sensor,worker,live,backfill,records,bytes,last\n");
+  for (i = 0; i < CATALOG_SLOTS; ++i) {
+    slot = &catalog->slots[i];
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_NAMED)
+      continue;
+    read_slot(slot, &copy);
+
+    stamp[0] = '\0';
+    if (copy.records > 0) {
+      last = copy.last_sec;
+      localtime_r(&last, &tm);
+      strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+      snprintf(stamp + strlen(stamp), sizeof(stamp) - strlen(stamp), ".%06ld",
+          (long)copy.last_usec);
+    }
+    printf("%s,%d,%u,%u,%llu,%llu,%s\n", copy.sensor, copy.worker, copy.live,
+        copy.backfill, (unsigned long long)copy.records,
+        (unsigned long long)copy.bytes, stamp);
+  }
+  munmap(catalog, sizeof(catalog_t));
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Print the latency histograms in the catalog, as
+ * sensor,hop,count,p50_ms,p90_ms,p99_ms,max_ms
+ * where each quantile is the upper bound of the histogram bucket it falls in.
+ */
+static int print_latency(const char *dir) {
+  catalog_slot_t copy, *slot;
+  catalog_t *catalog;
+  bluetrax_latency_t *latency;
+  uint32_t i;
+  int hop;
+
+  catalog = open_catalog(dir, 0, 0);
+  if (catalog == NULL)
+    return EXIT_FAILURE;
+
+  printf("sensor,hop,count,p50_ms,p90_ms,p99_ms,max_ms\n");
+  for (i = 0; i < CATALOG_SLOTS; ++i) {
+    slot = &catalog->slots[i];
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_NAMED)
+      continue;
+    read_slot(slot, &copy);
+    for (hop = 0; hop <= BLUETRAX_HOP_INGEST; ++hop) {
+      latency = &copy.latency[hop];
+      if (bluetrax_latency_count(latency) == 0)
+        continue;
+      printf("%s,%s,%llu,%.3f,%.3f,%.3f,%.3f\n", copy.sensor,
+          bluetrax_hop_name(hop),
+          (unsigned long long)bluetrax_latency_count(latency),
+          bluetrax_latency_quantile(latency, 0.5) / 1e3,
+          bluetrax_latency_quantile(latency, 0.9) / 1e3,
+          bluetrax_latency_quantile(latency, 0.99) / 1e3,
+          bluetrax_latency_quantile(latency, 1) / 1e3);
+    }
+  }
+  munmap(catalog, sizeof(catalog_t));
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Send any credit that has not been sent yet. If the socket is full, which
+ * happens only if the sensor is not reading, wait for it to drain.
+ *
+ * @return 0 if no errors; -1 if the connection should be dropped
+ */
+static int send_credit(collector_t *collector, connection_t *c) {
+  struct epoll_event event;
+  uint32_t credit;
+  ssize_t n;
+
+  if (c->unsent == 0)
+    return 0;
+
+  credit = htonl(c->unsent);
+  n = send(c->fd, &credit, sizeof(credit), MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n == sizeof(credit)) {
+    c->granted += c->unsent;
+    c->unsent = 0;
+    event.events = EPOLLIN | EPOLLET;
+  } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  } else {
+    /* a 4 byte send is never split, short of an error */
+    syslog(LOG_ERR, "%s: failed to send credit: %m", c->sensor);
+    return -1;
+  }
+  event.data.ptr = c;
+  epoll_ctl(collector->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+  return 0;
+}
+
+static void drop_connection(connection_t *c) {
+  c->closing = 1;
+}
+
+/**
+ * Pass a connection on to the worker that its sensor belongs to, with what
+ * has been read from it so far.
+ *
+ * @return 0 if no errors; -1 if the connection should be dropped
+ */
+static int hand_off(collector_t *collector, connection_t *c, int worker) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+
+  bzero(&msg, sizeof(msg));
+  bzero(control, sizeof(control));
+  iov.iov_base = c->buf;
+  iov.iov_len = c->held;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &c->fd, sizeof(int));
+
+  if (sendmsg(collector->handoff_fds[2 * worker + 1], &msg,
+        MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+    syslog(LOG_ERR, "%s: failed to pass connection to worker %d: %m",
+        c->sensor, worker);
+    return -1;
+  }
+  c->handed_off = 1;
+  return 0;
+}
+
+/**
+ * Parse the hello line at the start of buf, and open the output file, or pass
+ * the connection on if the sensor belongs to another worker.
+ *
+ * @return 1 if it was read; 0 if there is not a whole line yet (or the
+ *         connection has been passed on); -1 if the connection should be
+ *         dropped
+ */
+static int read_hello(collector_t *collector, connection_t *c) {
+  char line[MAX_HELLO + 1], sensor[MAX_HELLO], kind[MAX_HELLO], stamp[32];
+  unsigned char *end;
+  connection_t *other;
+  struct tm tm;
+  size_t len;
+  int i;
+
+  end = memchr(c->buf, '\n', c->held);
+  if (end == NULL) {
+    if (c->held >= MAX_HELLO) {
+      syslog(LOG_ERR, "connection %d: hello too long", c->fd);
+      return -1;
+    }
+    return 0;
+  }
+  len = end - c->buf;
+  memcpy(line, c->buf, len);
+  line[len] = '\0';
+
+  if (2 != sscanf(line, "BTX1 %127s %127s", sensor, kind) ||
+      !valid_sensor_name(sensor) ||
+      (strcmp(kind, "live") && strcmp(kind, "backfill"))) {
+    syslog(LOG_ERR, "connection %d: bad hello: %s", c->fd, line);
+    return -1;
+  }
+  strcpy(c->sensor, sensor);
+
+  i = hash_name(sensor) % collector->num_workers;
+  if (i != collector->worker) {
+    if (hand_off(collector, c, i))
+      return -1;
+    drop_connection(c);
+    return 0;
+  }
+  c->held -= len + 1;
+  memmove(c->buf, end + 1, c->held);
+  c->live = !strcmp(kind, "live");
+  c->weight = c->live ? collector->live_weight : 1;
+
+  if (c->live) {
+    /* one live connection per sensor: the new one wins */
+    for (other = collector->connections; other; other = other->next) {
+      if (other != c && other->live && !other->closing &&
+          other->out_fd >= 0 && !strcmp(other->sensor, c->sensor)) {
+        syslog(LOG_NOTICE, "%s: new live connection replaces old one",
+            c->sensor);
+        drop_connection(other);
+      }
+    }
+    snprintf(c->path, sizeof(c->path), "%s/%s", collector->dir, c->sensor);
+    c->out_fd = open_output(c->path, 0);
+  } else {
+    localtime_r(&c->start, &tm);
+    strftime(stamp, sizeof(stamp), "%Y%m%dT%H%M%S", &tm);
+    for (i = 0; c->out_fd < 0 && i < 100; ++i) {
+      snprintf(c->path, sizeof(c->path), i ? "%s/%s.backfill.%s.%d" :
+          "%s/%s.backfill.%s", collector->dir, c->sensor, stamp, i);
+      c->out_fd = open_output(c->path, O_EXCL);
+      if (c->out_fd < 0 && errno != EEXIST)
+        break;
+    }
+  }
+  if (c->out_fd < 0) {
+    syslog(LOG_ERR, "%s: failed to open output file: %s: %m", c->sensor,
+        c->path);
+    return -1;
+  }
+
+  syslog(LOG_INFO, "%s: %s connection writing to %s", c->sensor, kind,
+      c->path);
+  c->slot = catalog_slot(collector, c->sensor);
+  if (c->slot == NULL)
+    syslog(LOG_WARNING, "%s: catalog is full", c->sensor);
+  count_connection(c, 1);
+  c->unsent = collector->window;
+  return send_credit(collector, c) ? -1 : 1;
+}
+
+/**
+ * Stamp the ingest hop on a trace record that is about to be written, and add
+ * its latencies to the sensor's histograms.
+ */
+static void stamp_trace(connection_t *c, unsigned char *record, int64_t now) {
+  int64_t hop[BLUETRAX_TRACE_HOPS] = { 0 };
+  unsigned char *hops = record + 1 + offsetof(bluetrax_trace_t, hop);
+
+  memcpy(hops + BLUETRAX_HOP_INGEST * sizeof(int64_t), &now, sizeof(now));
+  if (c->slot == NULL)
+    return;
+  memcpy(hop, hops, BLUETRAX_HOP_VISIBLE * sizeof(int64_t));
+  begin_update(c->slot);
+  bluetrax_latency_add_trace(c->slot->latency, hop, BLUETRAX_HOP_INGEST);
+  end_update(c->slot);
+}
+
+/**
+ * Write out the whole records in buf, keeping any partial record at the end.
+ *
+ * @return 0 if no errors; -1 if the connection should be dropped
+ */
+static int write_records(connection_t *c) {
+  size_t offset = 0, last = 0, size;
+  unsigned long records = c->records;
+  struct timeval time;
+  int64_t now = 0;
+  ssize_t n;
+
+  while (offset < c->held) {
+    size = bluetrax_scan_record_size(c->buf[offset]);
+    if (size == 0) {
+      syslog(LOG_ERR, "%s: unknown record type %d", c->sensor,
+          c->buf[offset]);
+      return -1;
+    }
+    if (offset + 1 + size > c->held)
+      break;
+    if (c->buf[offset] == BLUETRAX_TRACE) {
+      if (now == 0)
+        now = bluetrax_trace_now();
+      stamp_trace(c, c->buf + offset, now);
+    }
+    last = offset;
+    offset += 1 + size;
+    ++c->records;
+  }
+
+  size = 0;
+  while (size < offset) {
+    n = write(c->out_fd, c->buf + size, offset - size);
+    if (n < 0) {
+      syslog(LOG_ERR, "%s: write: %s: %m", c->sensor, c->path);
+      return -1;
+    }
+    size += n;
+  }
+
+  if (offset > 0 && c->slot) {
+    /* every record starts with its time */
+    memcpy(&time, c->buf + last + 1, sizeof(time));
+    begin_update(c->slot);
+    c->slot->records += c->records - records;
+    c->slot->bytes += offset;
+    c->slot->last_sec = time.tv_sec;
+    c->slot->last_usec = time.tv_usec;
+    end_update(c->slot);
+  }
+
+  c->held -= offset;
+  memmove(c->buf, c->buf + offset, c->held);
+  return 0;
+}
+
+/**
+ * Take n more bytes of data that have been read into a connection's buf:
+ * write the records and give back the credit.
+ */
+static void take(collector_t *collector, connection_t *c, size_t n) {
+  c->taken += n;
+  if (c->taken > c->granted) {
+    syslog(LOG_ERR, "%s: sent %llu bytes with credit for only %llu",
+        c->sensor, (unsigned long long)c->taken,
+        (unsigned long long)c->granted);
+    drop_connection(c);
+    return;
+  }
+
+  if (write_records(c)) {
+    drop_connection(c);
+    return;
+  }
+
+  c->unsent += n;
+  if (send_credit(collector, c))
+    drop_connection(c);
+}
+
+/**
+ * Give a connection its turn: take up to a quantum of its data.
+ */
+static void serve(collector_t *collector, connection_t *c) {
+  size_t space;
+  ssize_t n;
+  int rc;
+
+  collector->vclock = c->vtime;
+
+  space = c->out_fd < 0 ? MAX_HELLO - c->held : QUANTUM;
+  n = recv(c->fd, c->buf + c->held, space, MSG_DONTWAIT);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      c->ready = 0;
+      return;
+    }
+    syslog(LOG_ERR, "%s: recv: %m", c->sensor[0] ? c->sensor : "?");
+    drop_connection(c);
+    return;
+  }
+  if (n == 0) {
+    if (c->held > 0)
+      syslog(LOG_WARNING, "%s: dropping partial record at end",
+          c->sensor[0] ? c->sensor : "?");
+    drop_connection(c);
+    return;
+  }
+  c->held += n;
+  c->vtime += (double)n / c->weight;
+
+  if (c->out_fd < 0) {
+    rc = read_hello(collector, c);
+    if (rc <= 0) {
+      if (rc < 0)
+        drop_connection(c);
+      return;
+    }
+    n = c->held;
+  }
+
+  take(collector, c, n);
+}
+
+/**
+ * Start serving a connection.
+ *
+ * @return NULL on error, in which case fd has been closed
+ */
+static connection_t *add_connection(collector_t *collector, int fd) {
+  struct epoll_event event;
+  connection_t *c;
+  int one = 1;
+
+  c = calloc(1, sizeof(*c));
+  if (c == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    close(fd);
+    return NULL;
+  }
+  c->fd = fd;
+  c->out_fd = -1;
+  c->weight = 1;
+  c->start = time(NULL);
+  /* notice sensors that vanish without closing */
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = c;
+  if (epoll_ctl(collector->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+    syslog(LOG_ERR, "epoll_ctl: %m");
+    close(fd);
+    free(c);
+    return NULL;
+  }
+  c->next = collector->connections;
+  collector->connections = c;
+  return c;
+}
+
+static void accept_connections(collector_t *collector) {
+  int fd;
+
+  for (;;) {
+    fd = accept4(collector->listen_fds[collector->worker], NULL, NULL,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        syslog(LOG_ERR, "accept: %m");
+      return;
+    }
+    add_connection(collector, fd);
+  }
+}
+
+/**
+ * Take the connections that other workers have passed on to this one.
+ */
+static void receive_handoffs(collector_t *collector) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  connection_t *c;
+  unsigned char buf[MAX_HELLO];
+  ssize_t n;
+  int fd;
+
+  for (;;) {
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    n = recvmsg(collector->handoff_fds[2 * collector->worker], &msg,
+        MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        syslog(LOG_ERR, "recvmsg: %m");
+      return;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+      syslog(LOG_ERR, "handoff without a connection");
+      continue;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    c = add_connection(collector, fd);
+    if (c == NULL)
+      continue;
+
+    /* the other worker has read the hello, and perhaps more */
+    memcpy(c->buf, buf, n);
+    c->held = n;
+    if (read_hello(collector, c) <= 0) {
+      drop_connection(c);
+      continue;
+    }
+    if (c->held > 0)
+      take(collector, c, c->held);
+    c->vtime = collector->vclock;
+    c->ready = 1;
+  }
+}
+
+/**
+ * Free the connections that have been dropped.
+ */
+static void reap_connections(collector_t *collector) {
+  connection_t **link = &collector->connections, *c;
+
+  while ((c = *link) != NULL) {
+    if (!c->closing) {
+      link = &c->next;
+      continue;
+    }
+    *link = c->next;
+    if (c->out_fd >= 0) {
+      syslog(LOG_INFO, "%s: %s connection closed after %lu records",
+          c->sensor, c->live ? "live" : "backfill", c->records);
+      count_connection(c, -1);
+      close(c->out_fd);
+    }
+    /* the socket may still be open in another worker, which would keep it in
+     * this one's epoll set */
+    epoll_ctl(collector->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+  }
+}
+
+static void reopen_outputs(collector_t *collector) {
+  connection_t *c;
+  int fd;
+
+  for (c = collector->connections; c; c = c->next) {
+    if (!c->live || c->out_fd < 0)
+      continue;
+    fd = open_output(c->path, 0);
+    if (fd < 0) {
+      syslog(LOG_ERR, "%s: failed to reopen %s: %m", c->sensor, c->path);
+      continue;
+    }
+    close(c->out_fd);
+    c->out_fd = fd;
+  }
+}
+
+/**
+ * The connection with data waiting that has had the least service for its
+ * weight.
+ */
+static connection_t *next_turn(collector_t *collector) {
+  connection_t *c, *best = NULL;
+
+  for (c = collector->connections; c; c = c->next) {
+    if (c->ready && !c->closing && (best == NULL || c->vtime < best->vtime))
+      best = c;
+  }
+  return best;
+}
+
+static int run(collector_t *collector, sigset_t *waitset) {
+  struct epoll_event events[MAX_EVENTS];
+  connection_t *c, *turn = NULL;
+  int i, n;
+
+  while (!request_stop) {
+    /* don't wait if there is more to do, but check for new data each turn,
+     * so that a live connection doesn't wait behind a busy one */
+    n = epoll_pwait(collector->epoll_fd, events, MAX_EVENTS,
+        turn ? 0 : -1, waitset);
+    if (n < 0) {
+      if (errno == EINTR)
+        n = 0;
+      else {
+        syslog(LOG_ERR, "epoll_pwait: %m");
+        return EXIT_FAILURE;
+      }
+    }
+
+    for (i = 0; i < n; ++i) {
+      if (events[i].data.ptr == &listen_tag) {
+        accept_connections(collector);
+        continue;
+      }
+      if (events[i].data.ptr == &handoff_tag) {
+        receive_handoffs(collector);
+        continue;
+      }
+      c = events[i].data.ptr;
+      if ((events[i].events & EPOLLOUT) && send_credit(collector, c))
+        drop_connection(c);
+      if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->ready) {
+        /* a connection that was idle can't use up service it didn't take */
+        if (c->vtime < collector->vclock)
+          c->vtime = collector->vclock;
+        c->ready = 1;
+      }
+    }
+
+    if (request_reopen) {
+      request_reopen = 0;
+      reopen_outputs(collector);
+    }
+
+    turn = next_turn(collector);
+    if (turn)
+      serve(collector, turn);
+    reap_connections(collector);
+    turn = next_turn(collector);
+  }
+
+  for (c = collector->connections; c; c = c->next)
+    drop_connection(c);
+  reap_connections(collector);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Check that no one is listening on an address, not even with SO_REUSEPORT,
+ * which would otherwise let us share the port without knowing it, e.g. with a
+ * collector for another directory.
+ *
+ * @return 0 if the address is free
+ */
+static int check_port_free(struct addrinfo *a) {
+  int fd, one = 1, rc;
+
+  fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+  if (fd < 0)
+    return 0;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  rc = bind(fd, a->ai_addr, a->ai_addrlen);
+  close(fd);
+  return rc < 0 && errno == EADDRINUSE ? -1 : 0;
+}
+
+/**
+ * Open a listening socket on the port.
+ *
+ * @param first true for the first worker's socket, in which case the port must
+ *        not be in use already
+ *
+ * @return socket, or -1 on error
+ */
+static int open_listener(const char *host, const char *port, int first) {
+  struct addrinfo hints, *addrs, *a;
+  int fd = -1, one = 1, rc;
+
+  bzero(&hints, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  rc = getaddrinfo(host, port, &hints, &addrs);
+  if (rc) {
+    syslog(LOG_ERR, "getaddrinfo: %s", gai_strerror(rc));
+    return -1;
+  }
+
+  for (a = addrs; a; a = a->ai_next) {
+    if (first && check_port_free(a)) {
+      syslog(LOG_ERR, "port %s is already in use, e.g. by another collector",
+          port);
+      freeaddrinfo(addrs);
+      return -1;
+    }
+    fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+        a->ai_protocol);
+    if (fd < 0)
+      continue;
+    /* each worker has a socket of its own on the port */
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (0 == bind(fd, a->ai_addr, a->ai_addrlen) && 0 == listen(fd, 128))
+      break;
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    syslog(LOG_ERR, "failed to listen on port %s: %m", port);
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+/**
+ * Run worker number i, which serves the connections to its own socket and
+ * those passed on to it.
+ *
+ * @return exit status
+ */
+static int run_worker(collector_t *collector, int i, sigset_t *waitset) {
+  catalog_slot_t *slot;
+  struct epoll_event event;
+  int j;
+
+  collector->worker = i;
+  for (j = 0; j < collector->num_workers; ++j) {
+    if (j != i) {
+      close(collector->listen_fds[j]);
+      close(collector->handoff_fds[2 * j]);
+    }
+  }
+
+  /* clear the entries left by this worker's predecessor, if it died */
+  for (j = 0; j < CATALOG_SLOTS; ++j) {
+    slot = &collector->catalog->slots[j];
+    if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_NAMED ||
+        slot->worker != i)
+      continue;
+    if (slot->seq & 1)
+      __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    begin_update(slot);
+    slot->live = slot->backfill = 0;
+    end_update(slot);
+  }
+
+  collector->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (collector->epoll_fd < 0) {
+    syslog(LOG_ERR, "epoll_create1: %m");
+    return EXIT_FAILURE;
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = &listen_tag;
+  if (epoll_ctl(collector->epoll_fd, EPOLL_CTL_ADD, collector->listen_fds[i],
+        &event)) {
+    syslog(LOG_ERR, "epoll_ctl: %m");
+    return EXIT_FAILURE;
+  }
+  event.data.ptr = &handoff_tag;
+  if (epoll_ctl(collector->epoll_fd, EPOLL_CTL_ADD,
+        collector->handoff_fds[2 * i], &event)) {
+    syslog(LOG_ERR, "epoll_ctl: %m");
+    return EXIT_FAILURE;
+  }
+
+  return run(collector, waitset);
+}
+
+static pid_t start_worker(collector_t *collector, int i, sigset_t *waitset) {
+  pid_t pid;
+
+  pid = fork();
+  if (pid < 0)
+    syslog(LOG_ERR, "fork: %m");
+  else if (pid == 0)
+    exit(run_worker(collector, i, waitset));
+  return pid;
+}
+
+/**
+ * Start the workers, and start them again if they die, until asked to stop.
+ *
+ * @return exit status
+ */
+static int run_workers(collector_t *collector, sigset_t *waitset) {
+  pid_t *pids, pid;
+  int i, status;
+
+  pids = calloc(collector->num_workers, sizeof(pid_t));
+  if (pids == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < collector->num_workers; ++i) {
+    pids[i] = start_worker(collector, i, waitset);
+    if (pids[i] < 0)
+      request_stop = 1;
+  }
+
+  while (!request_stop) {
+    sigsuspend(waitset);
+
+    if (request_reopen) {
+      request_reopen = 0;
+      for (i = 0; i < collector->num_workers; ++i)
+        if (pids[i] > 0)
+          kill(pids[i], SIGHUP);
+    }
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (i = 0; i < collector->num_workers; ++i) {
+        if (pids[i] != pid)
+          continue;
+        pids[i] = 0;
+        if (request_stop)
+          break;
+        if (WIFSIGNALED(status))
+          syslog(LOG_ERR, "worker %d killed by signal %d; restarting", i,
+              WTERMSIG(status));
+        else
+          syslog(LOG_ERR, "worker %d exited with status %d; restarting", i,
+              WEXITSTATUS(status));
+        sleep(RESTART_DELAY);
+        pids[i] = start_worker(collector, i, waitset);
+      }
+    }
+  }
+
+  for (i = 0; i < collector->num_workers; ++i)
+    if (pids[i] > 0)
+      kill(pids[i], SIGTERM);
+  while (wait(NULL) > 0)
+    ;
+  free(pids);
+  return EXIT_SUCCESS;
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s [options]\n\n"
+    "Collect records from sensors over TCP into a file per sensor.\n\n"
+    "--dir d: directory for the files; default is the current directory\n"
+    "--listen host: address to listen on; default is all addresses\n"
+    "--port p: port to listen on; default " DEFAULT_PORT "\n"
+    "--live-weight w: share of the collector for a live connection, compared\n"
+    "  to one for a backfill connection; default %d\n"
+    "--window n: bytes of credit each sensor can have outstanding; default %d\n"
+    "--workers n: number of worker processes; default is the number of CPUs\n"
+    "--status: print the catalog of sensors for --dir, and exit\n"
+    "--latency: print histograms of the sensors' latencies for --dir, from\n"
+    "  their trace records, and exit\n"
+    "--verbose: log a message for each connection\n"
+    "--help: displays this message\n", argv[0], DEFAULT_LIVE_WEIGHT,
+    DEFAULT_WINDOW);
+}
+
+int main(int argc, char **argv)
+{
+  collector_t collector;
+  sigset_t waitset;
+  const char *host = NULL, *port = DEFAULT_PORT;
+  int opt, verbose = 0, status = 0, latency = 0, i;
+
+  static struct option options[] =
+  {
+    {"dir",         required_argument, 0, 'd'},
+    {"listen",      required_argument, 0, 'l'},
+    {"port",        required_argument, 0, 'p'},
+    {"live-weight", required_argument, 0, 'w'},
+    {"window",      required_argument, 0, 'W'},
+    {"workers",     required_argument, 0, 'j'},
+    {"status",      no_argument,       0, 's'},
+    {"latency",     no_argument,       0, 'L'},
+    {"verbose",     no_argument,       0, 'v'},
+    {"help",        no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  bzero(&collector, sizeof(collector));
+  collector.dir = ".";
+  collector.window = DEFAULT_WINDOW;
+  collector.live_weight = DEFAULT_LIVE_WEIGHT;
+  collector.num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (collector.num_workers < 1)
+    collector.num_workers = 1;
+
+  while ((opt=getopt_long(argc, argv, "+d:l:p:w:W:j:sLvh", options, NULL))
+      != -1) {
+    switch (opt) {
+    case 'd':
+      collector.dir = optarg;
+      break;
+    case 'l':
+      host = optarg;
+      break;
+    case 'p':
+      port = optarg;
+      break;
+    case 'w':
+      collector.live_weight = atoi(optarg);
+      break;
+    case 'W':
+      collector.window = atoi(optarg);
+      break;
+    case 'j':
+      collector.num_workers = atoi(optarg);
+      break;
+    case 's':
+      status = 1;
+      break;
+    case 'L':
+      latency = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc || collector.live_weight < 1 ||
+      collector.window < (int)MAX_RECORD_SIZE || collector.num_workers < 1) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  if (status)
+    return print_catalog(collector.dir);
+  if (latency)
+    return print_latency(collector.dir);
+  if (!verbose)
+    setlogmask(LOG_UPTO(LOG_NOTICE));
+
+  if (!setup_signals(&waitset)) {
+    syslog(LOG_ERR, "failed to set up signals: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  collector.catalog = open_catalog(collector.dir, 1, collector.num_workers);
+  collector.listen_fds = calloc(collector.num_workers, sizeof(int));
+  collector.handoff_fds = calloc(2 * collector.num_workers, sizeof(int));
+  if (collector.catalog == NULL || collector.listen_fds == NULL ||
+      collector.handoff_fds == NULL)
+    exit(EXIT_FAILURE);
+
+  /* the sockets are made here, so a worker that is started again gets the
+   * same ones */
+  for (i = 0; i < collector.num_workers; ++i) {
+    collector.listen_fds[i] = open_listener(host, port, i == 0);
+    if (collector.listen_fds[i] < 0)
+      exit(EXIT_FAILURE);
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+          &collector.handoff_fds[2 * i])) {
+      syslog(LOG_ERR, "socketpair: %m");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return run_workers(&collector, &waitset);
+}
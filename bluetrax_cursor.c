@@ -0,0 +1,295 @@
+/* 64 bit offsets, for files over 2GB on 32 bit systems */
+#define _FILE_OFFSET_BITS 64
+#include "bluetrax_cursor.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+/**
+ * The index has an entry for every this many records. Blocks do not span
+ * files, so the last block in each file may be shorter.
+ */
+#define BLOCK_RECORDS 1024
+
+/**
+ * Number of decoded blocks to keep in memory.
+ */
+#define CACHE_BLOCKS 8
+
+typedef struct {
+  int            file;
+  off_t          offset;
+  size_t         first_record;   /* position of its first record in the set */
+  size_t         num_records;
+  struct timeval time;           /* of its first record */
+} block_index_t;
+
+typedef struct {
+  size_t                 block;
+  unsigned long          last_used;   /* 0 if the entry is unused */
+  bluetrax_scan_record_t records[BLOCK_RECORDS];
+} cached_block_t;
+
+struct bluetrax_cursor {
+  FILE          **files;
+  int             num_files;
+  block_index_t  *blocks;
+  size_t          num_blocks;
+  size_t          max_blocks;
+  size_t          num_records;
+  size_t          position;      /* of the next record forward */
+  unsigned long   clock;
+  cached_block_t  cache[CACHE_BLOCKS];
+};
+
+/**
+ * Add an index entry for a block that starts with record at offset in file.
+ *
+ * @return 0 if no errors
+ */
+static int add_block(bluetrax_cursor_t *cursor, int file, off_t offset,
+    bluetrax_scan_record_t *record) {
+  block_index_t *blocks, *block;
+
+  if (cursor->num_blocks == cursor->max_blocks) {
+    cursor->max_blocks = cursor->max_blocks ? 2 * cursor->max_blocks : 256;
+    blocks = realloc(cursor->blocks, cursor->max_blocks * sizeof(*blocks));
+    if (blocks == NULL)
+      return -1;
+    cursor->blocks = blocks;
+  }
+
+  block = &cursor->blocks[cursor->num_blocks++];
+  block->file = file;
+  block->offset = offset;
+  block->first_record = cursor->num_records;
+  block->num_records = 0;
+  block->time = record->data.complete.time;
+  return 0;
+}
+
+/**
+ * Read through a file, adding its blocks to the index.
+ *
+ * @return 0 if no errors
+ */
+static int index_file(bluetrax_cursor_t *cursor, int file) {
+  bluetrax_scan_record_t record;
+  block_index_t *block = NULL;
+  off_t offset = 0;
+  int rc;
+
+  while (1 == (rc = bluetrax_read_scan_record(cursor->files[file], &record))) {
+    if (block == NULL || block->num_records == BLOCK_RECORDS) {
+      if (add_block(cursor, file, offset, &record))
+        return -1;
+      block = &cursor->blocks[cursor->num_blocks - 1];
+    }
+    ++block->num_records;
+    ++cursor->num_records;
+    offset += 1 + bluetrax_scan_record_size(record.type);
+  }
+
+  if (rc < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (ferror(cursor->files[file]))
+    return -1;
+  return 0;
+}
+
+bluetrax_cursor_t *bluetrax_cursor_open(char **paths, int num_paths) {
+  bluetrax_cursor_t *cursor;
+  int i;
+
+  cursor = calloc(1, sizeof(*cursor));
+  if (cursor == NULL)
+    return NULL;
+
+  cursor->files = calloc(num_paths, sizeof(FILE *));
+  if (cursor->files == NULL) {
+    bluetrax_cursor_close(cursor);
+    return NULL;
+  }
+
+  for (i = 0; i < num_paths; ++i) {
+    cursor->files[i] = fopen(paths[i], "r");
+    if (cursor->files[i] == NULL) {
+      bluetrax_cursor_close(cursor);
+      return NULL;
+    }
+    ++cursor->num_files;
+
+    if (index_file(cursor, i)) {
+      bluetrax_cursor_close(cursor);
+      return NULL;
+    }
+  }
+
+  return cursor;
+}
+
+void bluetrax_cursor_close(bluetrax_cursor_t *cursor) {
+  int i, saved_errno = errno;
+
+  if (cursor == NULL)
+    return;
+
+  for (i = 0; i < cursor->num_files; ++i)
+    fclose(cursor->files[i]);
+  free(cursor->files);
+  free(cursor->blocks);
+  free(cursor);
+  errno = saved_errno;
+}
+
+size_t bluetrax_cursor_size(bluetrax_cursor_t *cursor) {
+  return cursor->num_records;
+}
+
+/**
+ * The block that holds the record at position, which must be in range.
+ */
+static size_t find_block(bluetrax_cursor_t *cursor, size_t position) {
+  size_t lo = 0, hi = cursor->num_blocks, mid;
+
+  /* last block with first_record <= position */
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (cursor->blocks[mid].first_record <= position)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * Get the decoded records for a block, from the cache if possible; otherwise,
+ * read them into the least recently used cache entry.
+ *
+ * @return NULL on error
+ */
+static bluetrax_scan_record_t *get_block(bluetrax_cursor_t *cursor,
+    size_t b) {
+  block_index_t *block = &cursor->blocks[b];
+  cached_block_t *entry = &cursor->cache[0];
+  FILE *file = cursor->files[block->file];
+  size_t i;
+
+  for (i = 0; i < CACHE_BLOCKS; ++i) {
+    if (cursor->cache[i].last_used && cursor->cache[i].block == b) {
+      entry = &cursor->cache[i];
+      entry->last_used = ++cursor->clock;
+      return entry->records;
+    }
+    if (cursor->cache[i].last_used < entry->last_used)
+      entry = &cursor->cache[i];
+  }
+
+  entry->last_used = 0;
+  if (fseeko(file, block->offset, SEEK_SET))
+    return NULL;
+  for (i = 0; i < block->num_records; ++i) {
+    if (1 != bluetrax_read_scan_record(file, &entry->records[i])) {
+      /* the file has changed since it was indexed */
+      errno = ferror(file) ? errno : EIO;
+      return NULL;
+    }
+  }
+
+  entry->block = b;
+  entry->last_used = ++cursor->clock;
+  return entry->records;
+}
+
+int bluetrax_cursor_seek(bluetrax_cursor_t *cursor, struct timeval time) {
+  bluetrax_scan_record_t *records;
+  struct timeval record_time;
+  size_t lo = 0, hi = cursor->num_blocks, mid;
+
+  if (cursor->num_blocks == 0 ||
+      !timercmp(&cursor->blocks[0].time, &time, <)) {
+    cursor->position = 0;
+    return 0;
+  }
+
+  /* last block that starts before time; the record is in it or just after */
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (timercmp(&cursor->blocks[mid].time, &time, <))
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  records = get_block(cursor, lo);
+  if (records == NULL)
+    return -1;
+
+  /* first record in the block at or after time */
+  hi = cursor->blocks[lo].num_records;
+  for (mid = 0; mid < hi; ++mid) {
+    record_time = records[mid].data.complete.time;
+    if (!timercmp(&record_time, &time, <))
+      break;
+  }
+
+  cursor->position = cursor->blocks[lo].first_record + mid;
+  return 0;
+}
+
+/**
+ * Copy up to max records starting at position.
+ *
+ * @return number of records copied, or -1 on error
+ */
+static int read_records(bluetrax_cursor_t *cursor, size_t position,
+    bluetrax_scan_record_t *records, int max) {
+  bluetrax_scan_record_t *block_records;
+  block_index_t *block;
+  size_t b, i, n;
+  int count = 0;
+
+  while (count < max && position < cursor->num_records) {
+    b = find_block(cursor, position);
+    block = &cursor->blocks[b];
+    block_records = get_block(cursor, b);
+    if (block_records == NULL)
+      return -1;
+
+    i = position - block->first_record;
+    n = block->num_records - i;
+    if (n > (size_t)(max - count))
+      n = max - count;
+    memcpy(records + count, block_records + i, n * sizeof(*records));
+    count += n;
+    position += n;
+  }
+
+  return count;
+}
+
+int bluetrax_cursor_next(bluetrax_cursor_t *cursor,
+    bluetrax_scan_record_t *records, int max) {
+  int count = read_records(cursor, cursor->position, records, max);
+
+  if (count > 0)
+    cursor->position += count;
+  return count;
+}
+
+int bluetrax_cursor_prev(bluetrax_cursor_t *cursor,
+    bluetrax_scan_record_t *records, int max) {
+  size_t start;
+  int count;
+
+  start = cursor->position > (size_t)max ? cursor->position - max : 0;
+  count = read_records(cursor, start, records, cursor->position - start);
+  if (count > 0)
+    cursor->position = start;
+  return count;
+}
@@ -0,0 +1,62 @@
+#ifndef _BLUETRAX_CURSOR_H_
+#define _BLUETRAX_CURSOR_H_
+
+#include "bluetrax.h"
+
+/**
+ * A cursor over the records in a set of files written by bluetrax_scan, e.g. a
+ * file and its rotated predecessors, taken in the given order. Records are
+ * assumed to be in time order, as bluetrax_scan writes them.
+ *
+ * Opening the set reads through it once to build a sparse index, with the
+ * offset and time of the first record of every block of records. Seeking by
+ * time is then a binary search on the index, and the blocks around the cursor
+ * are decoded into a small cache, so moving around nearby is served from
+ * memory.
+ *
+ * A cursor is not thread safe; use one per thread.
+ */
+typedef struct bluetrax_cursor bluetrax_cursor_t;
+
+/**
+ * Open a cursor on the given files, positioned before the first record.
+ *
+ * A partial record at the end of the last file is ignored, because it may
+ * still be being written; an unknown record type in any file is an error.
+ *
+ * @return NULL on error, with errno set (EINVAL for an unknown record type)
+ */
+bluetrax_cursor_t *bluetrax_cursor_open(char **paths, int num_paths);
+
+void bluetrax_cursor_close(bluetrax_cursor_t *cursor);
+
+/**
+ * Number of records in the set.
+ */
+size_t bluetrax_cursor_size(bluetrax_cursor_t *cursor);
+
+/**
+ * Move the cursor to just before the first record at or after time.
+ *
+ * @return 0 if no errors; -1 on error, with errno set
+ */
+int bluetrax_cursor_seek(bluetrax_cursor_t *cursor, struct timeval time);
+
+/**
+ * Read up to max records forward from the cursor, and move it past them.
+ *
+ * @return number of records read; 0 at the end; -1 on error, with errno set
+ */
+int bluetrax_cursor_next(bluetrax_cursor_t *cursor,
+    bluetrax_scan_record_t *records, int max);
+
+/**
+ * Read up to max records backward from the cursor, and move it back before
+ * them. The records are stored in file order, so records[0] is the earliest.
+ *
+ * @return number of records read; 0 at the start; -1 on error, with errno set
+ */
+int bluetrax_cursor_prev(bluetrax_cursor_t *cursor,
+    bluetrax_scan_record_t *records, int max);
+
+#endif /* guard */
@@ -0,0 +1,963 @@
+/*
+ * Keep a derived dataset of detections from many sensors up to date as
+ * capture files arrive, grow, are replaced or go away, without recomputing it
+ * all; e.g. when a spool from a sensor that was offline is uploaded late.
+ *
+ * The inputs are capture files (segments) named by sensor, as bluetrax_collect
+ * writes them: the sensor of data/s1 and data/s1.backfill.20120102T030405 is
+ * s1. The output, in --dir, is partitioned by time window (--window) and by
+ * device shard (--shards, by a hash of the address). Each partition is a CSV
+ * file, window-shard.csv, with lines
+ *   device,time,sensor
+ * sorted by device and then time, as for bluetrax_paths.
+ *
+ * Each run is given all of the segments, e.g. all of the files in data, and
+ * compares them with the manifest in --dir, which has the segments from the
+ * last run and the partitions that each of them contributed to:
+ * - a new segment is read and its records are added to their partitions;
+ * - a segment that has grown (checked by the bytes just before where the last
+ *   run stopped) has just its new records read and added;
+ * - a segment that has been replaced, or is no longer given, has its records
+ *   removed from the partitions that depended on it;
+ * - all other segments and partitions are left alone.
+ * Then only the partitions that changed are rebuilt, and their paths are
+ * written to stdout, one per line, for the next stage (e.g. bluetrax_paths)
+ * to pick up; a partition that no longer has any records is removed, but its
+ * path is still written. So a run takes time in proportion to the new data
+ * and the partitions it affects, rather than to all of the data.
+ *
+ * The records for each partition are kept, unsorted, in a slice file in --dir,
+ * tagged with the segment they came from, so a partition can be rebuilt
+ * without reading any segment again. The manifest is replaced in one step
+ * (rename) once the slices are written, and it lists the partitions still to
+ * be rebuilt until they have been, so an interrupted run is finished by the
+ * next one.
+ *
+ * The batches with trace records (from bluetrax_scan --trace) are visible
+ * once the partitions have been rebuilt, so each run stamps them then and
+ * logs histograms of their latencies, for each hop from the scan to here.
+ */
+#include "bluetrax.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define DEFAULT_WINDOW 3600
+
+#define DEFAULT_SHARDS 16
+
+#define MAX_SHARDS 1024
+
+/**
+ * Number of bytes before the end of what has been read from a segment that
+ * are hashed, to check that a segment that has grown has only been appended to.
+ */
+#define TAIL_SIZE 32
+
+#define MANIFEST_NAME "manifest"
+
+#define LOCK_NAME "lock"
+
+/**
+ * A record in a slice file.
+ */
+typedef struct {
+  uint32_t segment;     /* id of the segment it came from */
+  int64_t  time;        /* microseconds since the epoch */
+  bdaddr_t bdaddr;
+} __attribute__ ((packed)) slice_record_t;
+
+typedef struct {
+  unsigned   id;
+  uint64_t   dev;
+  uint64_t   ino;
+  uint64_t   offset;    /* of the end of the last record read */
+  uint64_t   tail;      /* hash of the TAIL_SIZE bytes before offset */
+  char      *sensor;
+  char      *path;
+  int        given;     /* in this run's arguments */
+  int        removed;   /* replaced or no longer given */
+} segment_t;
+
+typedef struct {
+  int64_t         window;   /* start, in seconds since the epoch */
+  int             shard;
+  unsigned        generation; /* of the slice file */
+  uint64_t        length;   /* of the slice file, in bytes */
+  int             dirty;    /* to be rebuilt */
+  int             prune;    /* has records from removed segments */
+  unsigned       *segments; /* ids of the segments it depends on */
+  int             num_segments;
+  int             max_segments;
+  slice_record_t *pending;  /* new records, not yet in the slice file */
+  size_t          num_pending;
+  size_t          max_pending;
+} partition_t;
+
+static const char *dir;
+static long window_size = DEFAULT_WINDOW;
+static int num_shards = DEFAULT_SHARDS;
+static unsigned next_id = 1;
+
+static segment_t *segments;
+static int num_segments, max_segments;
+
+static partition_t *partitions;
+static int num_partitions, max_partitions;
+
+/**
+ * Hops of the trace records read in this run.
+ */
+typedef int64_t trace_hops_t[BLUETRAX_TRACE_HOPS];
+static trace_hops_t *traces;
+static int num_traces, max_traces;
+
+/**
+ * Open addressing hash table from (window, shard) to partition index + 1.
+ */
+static int *partition_table;
+static size_t table_size;
+
+/**
+ * FNV-1a, for the tails of segments.
+ */
+static uint64_t hash_bytes(const unsigned char *data, size_t size) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (i = 0; i < size; ++i) {
+    h ^= data[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static void *grow_array(void *array, int *max, size_t item_size) {
+  int new_max = *max ? 2 * *max : 16;
+  void *new_array = realloc(array, new_max * item_size);
+
+  if (new_array == NULL) {
+    syslog(LOG_ERR, "out of memory");
+    exit(EXIT_FAILURE);
+  }
+  *max = new_max;
+  return new_array;
+}
+
+static char *copy_string(const char *s) {
+  char *copy = strdup(s);
+
+  if (copy == NULL) {
+    syslog(LOG_ERR, "out of memory");
+    exit(EXIT_FAILURE);
+  }
+  return copy;
+}
+
+static size_t table_slot(int64_t window, int shard) {
+  uint64_t h = (uint64_t)window * 0x9e3779b97f4a7c15ULL ^ (uint64_t)shard;
+
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+  return h & (table_size - 1);
+}
+
+static void rebuild_table(void) {
+  size_t slot;
+  int i;
+
+  free(partition_table);
+  table_size = 64;
+  while (table_size < 2 * (size_t)num_partitions + 2)
+    table_size *= 2;
+  partition_table = calloc(table_size, sizeof(int));
+  if (partition_table == NULL) {
+    syslog(LOG_ERR, "out of memory");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < num_partitions; ++i) {
+    slot = table_slot(partitions[i].window, partitions[i].shard);
+    while (partition_table[slot])
+      slot = (slot + 1) & (table_size - 1);
+    partition_table[slot] = i + 1;
+  }
+}
+
+/**
+ * The partition for a window and shard, adding it if need be.
+ */
+static partition_t *get_partition(int64_t window, int shard) {
+  partition_t *partition;
+  size_t slot;
+  int i;
+
+  if (table_size == 0 || 2 * (size_t)num_partitions + 2 > table_size)
+    rebuild_table();
+
+  slot = table_slot(window, shard);
+  while ((i = partition_table[slot])) {
+    if (partitions[i - 1].window == window && partitions[i - 1].shard == shard)
+      return &partitions[i - 1];
+    slot = (slot + 1) & (table_size - 1);
+  }
+
+  if (num_partitions == max_partitions)
+    partitions = grow_array(partitions, &max_partitions, sizeof(partition_t));
+  partition = &partitions[num_partitions++];
+  bzero(partition, sizeof(*partition));
+  partition->window = window;
+  partition->shard = shard;
+  partition_table[slot] = num_partitions;
+  return partition;
+}
+
+static void add_dependency(partition_t *partition, unsigned id) {
+  int i;
+
+  for (i = partition->num_segments - 1; i >= 0; --i)
+    if (partition->segments[i] == id)
+      return;
+  if (partition->num_segments == partition->max_segments)
+    partition->segments = grow_array(partition->segments,
+        &partition->max_segments, sizeof(unsigned));
+  partition->segments[partition->num_segments++] = id;
+}
+
+static segment_t *add_segment(void) {
+  segment_t *segment;
+
+  if (num_segments == max_segments)
+    segments = grow_array(segments, &max_segments, sizeof(segment_t));
+  segment = &segments[num_segments++];
+  bzero(segment, sizeof(*segment));
+  return segment;
+}
+
+/**
+ * Segments are added in order of id, so they can be found by bisection.
+ *
+ * @return NULL if there is no segment with the id
+ */
+static segment_t *find_segment(unsigned id) {
+  int lo = 0, hi = num_segments - 1, mid;
+
+  while (lo <= hi) {
+    mid = lo + (hi - lo) / 2;
+    if (segments[mid].id == id)
+      return &segments[mid];
+    if (segments[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return NULL;
+}
+
+static void make_path(char *path, const char *name) {
+  snprintf(path, PATH_MAX, "%s/%s", dir, name);
+}
+
+static void partition_path(char *path, partition_t *partition,
+    const char *suffix) {
+  char name[64];
+
+  snprintf(name, sizeof(name), "%" PRId64 "-%02d%s", partition->window,
+      partition->shard, suffix);
+  make_path(path, name);
+}
+
+static void slice_path(char *path, partition_t *partition,
+    unsigned generation) {
+  char suffix[32];
+
+  snprintf(suffix, sizeof(suffix), ".%u.slice", generation);
+  partition_path(path, partition, suffix);
+}
+
+/**
+ * The sensor for a segment: its file name, without any .backfill suffix.
+ */
+static void sensor_name(const char *path, char *sensor, size_t size) {
+  const char *name = strrchr(path, '/');
+  char *backfill;
+
+  snprintf(sensor, size, "%s", name ? name + 1 : path);
+  backfill = strstr(sensor, ".backfill.");
+  if (backfill)
+    *backfill = 0;
+}
+
+/**
+ * Read the manifest, if there is one.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int read_manifest(void) {
+  char path[PATH_MAX], line[3 * PATH_MAX], *p;
+  unsigned long long dev, ino, offset, tail, length;
+  long long window;
+  long manifest_window;
+  unsigned id, generation;
+  int shard, dirty, shards, n, line_number = 0;
+  segment_t *segment;
+  partition_t *partition;
+  FILE *file;
+
+  make_path(path, MANIFEST_NAME);
+  file = fopen(path, "r");
+  if (file == NULL)
+    return errno == ENOENT ? 0 : -1;
+
+  while (fgets(line, sizeof(line), file)) {
+    ++line_number;
+    line[strcspn(line, "\n")] = 0;
+    if (line[0] == '#' || line[0] == 0)
+      continue;
+    if (3 == sscanf(line, "config,%ld,%d,%u", &manifest_window, &shards,
+          &next_id)) {
+      if (manifest_window != window_size || shards != num_shards) {
+        syslog(LOG_ERR, "%s was made with --window=%ld --shards=%d",
+            dir, manifest_window, shards);
+        fclose(file);
+        return -1;
+      }
+    } else if (5 == sscanf(line, "segment,%u,%llu,%llu,%llu,%llx,%n", &id,
+          &dev, &ino, &offset, &tail, &n) && (p = strchr(line + n, ','))) {
+      segment = add_segment();
+      segment->id = id;
+      segment->dev = dev;
+      segment->ino = ino;
+      segment->offset = offset;
+      segment->tail = tail;
+      *p = 0;
+      segment->sensor = copy_string(line + n);
+      segment->path = copy_string(p + 1);
+    } else if (5 == sscanf(line, "partition,%lld,%d,%u,%llu,%d", &window,
+          &shard, &generation, &length, &dirty)) {
+      partition = get_partition(window, shard);
+      partition->generation = generation;
+      partition->length = length;
+      partition->dirty = dirty;
+    } else if (3 == sscanf(line, "dep,%lld,%d,%u", &window, &shard, &id)) {
+      add_dependency(get_partition(window, shard), id);
+    } else {
+      syslog(LOG_ERR, "%s: bad line %d", path, line_number);
+      fclose(file);
+      return -1;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+/**
+ * Replace the manifest with the current state.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int write_manifest(void) {
+  char path[PATH_MAX], tmp_path[PATH_MAX + 8];
+  partition_t *partition;
+  FILE *file;
+  int i, j;
+
+  make_path(path, MANIFEST_NAME);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    syslog(LOG_ERR, "%s: %m", tmp_path);
+    return -1;
+  }
+
+  fprintf(file, "# written by bluetrax_detections; do not edit\n");
+  fprintf(file, "config,%ld,%d,%u\n", window_size, num_shards, next_id);
+  for (i = 0; i < num_segments; ++i) {
+    if (segments[i].removed)
+      continue;
+    fprintf(file, "segment,%u,%llu,%llu,%llu,%llx,%s,%s\n", segments[i].id,
+        (unsigned long long)segments[i].dev,
+        (unsigned long long)segments[i].ino,
+        (unsigned long long)segments[i].offset,
+        (unsigned long long)segments[i].tail, segments[i].sensor,
+        segments[i].path);
+  }
+  for (i = 0; i < num_partitions; ++i) {
+    partition = &partitions[i];
+    if (partition->length == 0 && !partition->dirty)
+      continue;
+    fprintf(file, "partition,%" PRId64 ",%d,%u,%llu,%d\n", partition->window,
+        partition->shard, partition->generation,
+        (unsigned long long)partition->length, partition->dirty);
+    for (j = 0; j < partition->num_segments; ++j)
+      fprintf(file, "dep,%" PRId64 ",%d,%u\n", partition->window,
+          partition->shard, partition->segments[j]);
+  }
+
+  if (fflush(file) || fsync(fileno(file))) {
+    syslog(LOG_ERR, "%s: %m", tmp_path);
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  if (rename(tmp_path, path)) {
+    syslog(LOG_ERR, "rename %s: %m", tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Undo anything an interrupted run did after the manifest was last written:
+ * cut slice files back to their length in the manifest, and remove files that
+ * it doesn't refer to.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int recover(void) {
+  char path[PATH_MAX], expected[PATH_MAX];
+  long long window;
+  unsigned generation;
+  partition_t *partition;
+  struct dirent *entry;
+  struct stat st;
+  int shard, n;
+  DIR *d;
+
+  d = opendir(dir);
+  if (d == NULL) {
+    syslog(LOG_ERR, "%s: %m", dir);
+    return -1;
+  }
+  while ((entry = readdir(d))) {
+    n = strlen(entry->d_name);
+    if (n > 4 && 0 == strcmp(entry->d_name + n - 4, ".tmp") &&
+        (0 == strncmp(entry->d_name, MANIFEST_NAME, strlen(MANIFEST_NAME)) ||
+         2 == sscanf(entry->d_name, "%lld-%d", &window, &shard))) {
+      make_path(path, entry->d_name);
+      unlink(path);
+      continue;
+    }
+    n = 0;
+    if (3 != sscanf(entry->d_name, "%lld-%d.%u.slice%n", &window, &shard,
+          &generation, &n) || n == 0 || entry->d_name[n] != 0)
+      continue;
+
+    make_path(path, entry->d_name);
+    partition = get_partition(window, shard);
+    slice_path(expected, partition, partition->generation);
+    if (partition->length == 0 || strcmp(path, expected) != 0) {
+      unlink(path);
+      continue;
+    }
+    if (stat(path, &st) == 0 && (uint64_t)st.st_size > partition->length &&
+        truncate(path, partition->length)) {
+      syslog(LOG_ERR, "truncate %s: %m", path);
+      closedir(d);
+      return -1;
+    }
+  }
+  closedir(d);
+  return 0;
+}
+
+/**
+ * Hash of the TAIL_SIZE bytes (or as many as there are) before offset.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int read_tail(FILE *file, uint64_t offset, uint64_t *tail) {
+  unsigned char buf[TAIL_SIZE];
+  size_t size = offset < TAIL_SIZE ? offset : TAIL_SIZE;
+
+  if (fseeko(file, offset - size, SEEK_SET) ||
+      size != fread(buf, 1, size, file))
+    return -1;
+  *tail = hash_bytes(buf, size);
+  return 0;
+}
+
+static void add_pending(partition_t *partition, slice_record_t *record) {
+  size_t max;
+
+  if (partition->num_pending == partition->max_pending) {
+    max = partition->max_pending ? 2 * partition->max_pending : 256;
+    partition->pending = realloc(partition->pending,
+        max * sizeof(slice_record_t));
+    if (partition->pending == NULL) {
+      syslog(LOG_ERR, "out of memory");
+      exit(EXIT_FAILURE);
+    }
+    partition->max_pending = max;
+  }
+  partition->pending[partition->num_pending++] = *record;
+}
+
+/**
+ * Read the records in a segment from its offset on into the partitions. A
+ * partial record at the end is left for next time.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int read_segment(segment_t *segment, FILE *file) {
+  bluetrax_scan_record_t record;
+  slice_record_t slice;
+  partition_t *partition = NULL;
+  int64_t window;
+  int shard, rc;
+
+  if (fseeko(file, segment->offset, SEEK_SET)) {
+    syslog(LOG_ERR, "%s: %m", segment->path);
+    return -1;
+  }
+
+  while (1 == (rc = bluetrax_read_scan_record(file, &record))) {
+    segment->offset = ftello(file);
+    if (record.type == EVT_INQUIRY_COMPLETE)
+      continue;
+    if (record.type == BLUETRAX_TRACE) {
+      if (num_traces == max_traces)
+        traces = grow_array(traces, &max_traces, sizeof(trace_hops_t));
+      bzero(traces[num_traces], sizeof(trace_hops_t));
+      memcpy(traces[num_traces], record.data.trace.hop,
+          sizeof(record.data.trace.hop));
+      ++num_traces;
+      continue;
+    }
+
+    /* a result with rssi starts like a result */
+    slice.segment = segment->id;
+    slice.time = (int64_t)record.data.result.time.tv_sec * 1000000 +
+      record.data.result.time.tv_usec;
+    bacpy(&slice.bdaddr, &record.data.result.bdaddr);
+
+    window = record.data.result.time.tv_sec;
+    window -= ((window % window_size) + window_size) % window_size;
+    shard = bluetrax_hash_bdaddr(&slice.bdaddr) % num_shards;
+
+    /* consecutive records are usually in the same partition */
+    if (partition == NULL || partition->window != window ||
+        partition->shard != shard)
+      partition = get_partition(window, shard);
+    add_pending(partition, &slice);
+    add_dependency(partition, segment->id);
+  }
+
+  if (rc < 0) {
+    syslog(LOG_ERR, "%s: unknown record type at offset %llu", segment->path,
+        (unsigned long long)segment->offset);
+    return -1;
+  }
+  if (read_tail(file, segment->offset, &segment->tail)) {
+    syslog(LOG_ERR, "%s: %m", segment->path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Bring a segment that is given in this run up to date: read what is new in
+ * it, or all of it if it is new or has been replaced.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int update_segment(const char *path) {
+  char sensor[NAME_MAX + 1];
+  segment_t *segment = NULL, *old = NULL;
+  uint64_t tail;
+  struct stat st;
+  FILE *file;
+  int i, rc;
+
+  sensor_name(path, sensor, sizeof(sensor));
+  if (strchr(sensor, ',') || strchr(path, '\n')) {
+    syslog(LOG_ERR, "%s: sensor names and paths can't have commas or "
+        "newlines", path);
+    return -1;
+  }
+
+  file = fopen(path, "r");
+  if (file == NULL || fstat(fileno(file), &st)) {
+    syslog(LOG_ERR, "%s: %m", path);
+    if (file)
+      fclose(file);
+    return -1;
+  }
+
+  for (i = 0; i < num_segments; ++i) {
+    if (!segments[i].removed && segments[i].dev == st.st_dev &&
+        segments[i].ino == st.st_ino) {
+      old = &segments[i];
+      break;
+    }
+  }
+
+  if (old && old->given) {
+    /* given twice */
+    fclose(file);
+    return 0;
+  }
+
+  if (old && strcmp(old->sensor, sensor) == 0 &&
+      (uint64_t)st.st_size >= old->offset &&
+      0 == read_tail(file, old->offset, &tail) && tail == old->tail) {
+    /* unchanged, or appended to */
+    segment = old;
+    if (strcmp(segment->path, path) != 0) {
+      free(segment->path);
+      segment->path = copy_string(path);
+    }
+  } else {
+    if (old)
+      old->removed = 1;   /* replaced; old may move */
+    segment = add_segment();
+    segment->id = next_id++;
+    segment->dev = st.st_dev;
+    segment->ino = st.st_ino;
+    segment->sensor = copy_string(sensor);
+    segment->path = copy_string(path);
+  }
+  segment->given = 1;
+
+  rc = (uint64_t)st.st_size > segment->offset ?
+    read_segment(segment, file) : 0;
+  fclose(file);
+  return rc;
+}
+
+/**
+ * Append the pending records to a partition's slice file, first dropping the
+ * records from removed segments, if it has any. Dropping them means writing a
+ * new generation of the file; the old one stays until the manifest moves on.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int write_slice(partition_t *partition) {
+  char path[PATH_MAX], new_path[PATH_MAX];
+  slice_record_t records[1024];
+  segment_t *segment;
+  FILE *in = NULL, *out;
+  size_t n, i, kept;
+  unsigned generation = partition->generation;
+  int j;
+
+  if (partition->prune) {
+    /* the dependencies on removed segments go too */
+    for (j = kept = 0; j < partition->num_segments; ++j) {
+      segment = find_segment(partition->segments[j]);
+      if (segment && !segment->removed)
+        partition->segments[kept++] = partition->segments[j];
+    }
+    partition->num_segments = kept;
+
+    if (partition->length > 0) {
+      slice_path(path, partition, partition->generation);
+      in = fopen(path, "r");
+      if (in == NULL) {
+        syslog(LOG_ERR, "%s: %m", path);
+        return -1;
+      }
+    }
+    ++generation;
+  }
+
+  slice_path(new_path, partition, generation);
+  out = fopen(new_path, partition->prune ? "w" : "a");
+  if (out == NULL) {
+    syslog(LOG_ERR, "%s: %m", new_path);
+    if (in)
+      fclose(in);
+    return -1;
+  }
+
+  kept = partition->prune ? 0 : partition->length / sizeof(slice_record_t);
+  while (in && (n = fread(records, sizeof(slice_record_t),
+          sizeof(records) / sizeof(records[0]), in)) > 0) {
+    for (i = 0; i < n; ++i) {
+      segment = find_segment(records[i].segment);
+      if (segment && !segment->removed) {
+        fwrite(&records[i], sizeof(slice_record_t), 1, out);
+        ++kept;
+      }
+    }
+  }
+  if (in)
+    fclose(in);
+
+  fwrite(partition->pending, sizeof(slice_record_t), partition->num_pending,
+      out);
+  kept += partition->num_pending;
+  if (fflush(out) || ferror(out) || fsync(fileno(out))) {
+    syslog(LOG_ERR, "%s: %m", new_path);
+    fclose(out);
+    return -1;
+  }
+  fclose(out);
+
+  partition->generation = generation;
+  partition->length = kept * sizeof(slice_record_t);
+  partition->dirty = 1;
+  free(partition->pending);
+  partition->pending = NULL;
+  partition->num_pending = partition->max_pending = 0;
+  return 0;
+}
+
+static int compare_slice_records(const void *a, const void *b) {
+  const slice_record_t *x = a, *y = b;
+  const segment_t *sx, *sy;
+  int i;
+
+  /* in the order that the addresses are written */
+  for (i = 5; i >= 0; --i)
+    if (x->bdaddr.b[i] != y->bdaddr.b[i])
+      return x->bdaddr.b[i] < y->bdaddr.b[i] ? -1 : 1;
+  if (x->time != y->time)
+    return x->time < y->time ? -1 : 1;
+  if (x->segment == y->segment)
+    return 0;
+  sx = find_segment(x->segment);
+  sy = find_segment(y->segment);
+  return strcmp(sx->sensor, sy->sensor);
+}
+
+/**
+ * Write a partition's CSV file from its slice, or remove it if it is empty.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int rebuild_partition(partition_t *partition) {
+  char path[PATH_MAX], tmp_path[PATH_MAX + 8], addr[18];
+  slice_record_t *records = NULL;
+  size_t n = partition->length / sizeof(slice_record_t), i;
+  FILE *file;
+
+  partition_path(path, partition, ".csv");
+  if (n == 0) {
+    if (unlink(path) && errno != ENOENT) {
+      syslog(LOG_ERR, "unlink %s: %m", path);
+      return -1;
+    }
+    return 0;
+  }
+
+  records = malloc(n * sizeof(slice_record_t));
+  if (records == NULL) {
+    syslog(LOG_ERR, "out of memory");
+    return -1;
+  }
+  slice_path(tmp_path, partition, partition->generation);
+  file = fopen(tmp_path, "r");
+  if (file == NULL || n != fread(records, sizeof(slice_record_t), n, file)) {
+    syslog(LOG_ERR, "%s: %s", tmp_path, file ? "truncated" : strerror(errno));
+    if (file)
+      fclose(file);
+    free(records);
+    return -1;
+  }
+  fclose(file);
+
+  qsort(records, n, sizeof(slice_record_t), compare_slice_records);
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+  file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    syslog(LOG_ERR, "%s: %m", tmp_path);
+    free(records);
+    return -1;
+  }
+  for (i = 0; i < n; ++i) {
+    ba2str(&records[i].bdaddr, addr);
+    fprintf(file, "%s,%" PRId64 ".%06d,%s\n", addr,
+        records[i].time / 1000000, (int)(records[i].time % 1000000),
+        find_segment(records[i].segment)->sensor);
+  }
+  free(records);
+  if (fflush(file) || ferror(file)) {
+    syslog(LOG_ERR, "%s: %m", tmp_path);
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  if (rename(tmp_path, path)) {
+    syslog(LOG_ERR, "rename %s: %m", tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Stamp the trace records read in this run as visible, and log the latency
+ * histograms.
+ */
+static void report_latency(void) {
+  bluetrax_latency_t latency[BLUETRAX_TRACE_HOPS];
+  char summary[128];
+  int64_t now = bluetrax_trace_now();
+  int i;
+
+  bzero(latency, sizeof(latency));
+  for (i = 0; i < num_traces; ++i) {
+    traces[i][BLUETRAX_HOP_VISIBLE] = now;
+    bluetrax_latency_add_trace(latency, traces[i], BLUETRAX_HOP_VISIBLE);
+  }
+  for (i = 0; i < BLUETRAX_TRACE_HOPS; ++i) {
+    if (bluetrax_latency_count(&latency[i]) == 0)
+      continue;
+    bluetrax_latency_format(&latency[i], summary, sizeof(summary));
+    syslog(LOG_NOTICE, "latency: %s: %s", bluetrax_hop_name(i), summary);
+  }
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s [options] file...\n\n"
+    "Update device,time,sensor partitions in --dir from capture files named\n"
+    "by sensor (e.g. the files written by bluetrax_collect), recomputing only\n"
+    "the partitions that depend on files that are new or have changed. Writes\n"
+    "the paths of the partitions that changed.\n\n"
+    "--dir d: directory for the partitions (required)\n"
+    "--window s: partition by time windows of s seconds; default %d\n"
+    "--shards n: partition by device into n shards; default %d\n"
+    "--help: displays this message\n", argv[0], DEFAULT_WINDOW,
+    DEFAULT_SHARDS);
+}
+
+int main(int argc, char **argv)
+{
+  char path[PATH_MAX], old_path[PATH_MAX];
+  partition_t *partition;
+  unsigned *old_generations;
+  int opt, lock_fd, i, j;
+
+  static struct option options[] =
+  {
+    {"dir",    required_argument, 0, 'd'},
+    {"window", required_argument, 0, 'w'},
+    {"shards", required_argument, 0, 's'},
+    {"help",   no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  while ((opt=getopt_long(argc, argv, "+d:w:s:h", options, NULL)) != -1) {
+    switch (opt) {
+    case 'd':
+      dir = optarg;
+      break;
+    case 'w':
+      window_size = atol(optarg);
+      if (window_size < 1) {
+        fprintf(stderr, "bad window: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 's':
+      num_shards = atoi(optarg);
+      if (num_shards < 1 || num_shards > MAX_SHARDS) {
+        fprintf(stderr, "bad shards: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (dir == NULL) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    syslog(LOG_ERR, "mkdir %s: %m", dir);
+    exit(EXIT_FAILURE);
+  }
+
+  /* only one run at a time per directory */
+  make_path(path, LOCK_NAME);
+  lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB)) {
+    syslog(LOG_ERR, "failed to lock %s: %m", path);
+    exit(EXIT_FAILURE);
+  }
+
+  if (read_manifest() || recover())
+    exit(EXIT_FAILURE);
+
+  for (i = optind; i < argc; ++i)
+    if (update_segment(argv[i]))
+      exit(EXIT_FAILURE);
+
+  /* segments that were not given are gone, along with their records */
+  for (i = 0; i < num_segments; ++i)
+    if (!segments[i].given)
+      segments[i].removed = 1;
+  for (i = 0; i < num_partitions; ++i) {
+    partition = &partitions[i];
+    for (j = 0; j < partition->num_segments; ++j)
+      if (find_segment(partition->segments[j]) == NULL ||
+          find_segment(partition->segments[j])->removed)
+        partition->prune = 1;
+  }
+
+  /* the old generations of pruned slices are removed once the manifest no
+   * longer refers to them */
+  old_generations = calloc(num_partitions + 1, sizeof(unsigned));
+  if (old_generations == NULL) {
+    syslog(LOG_ERR, "out of memory");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < num_partitions; ++i) {
+    partition = &partitions[i];
+    old_generations[i] = partition->generation;
+    if ((partition->prune || partition->num_pending > 0) &&
+        write_slice(partition))
+      exit(EXIT_FAILURE);
+  }
+
+  if (write_manifest())
+    exit(EXIT_FAILURE);
+
+  for (i = 0; i < num_partitions; ++i) {
+    partition = &partitions[i];
+    if (partition->generation != old_generations[i]) {
+      slice_path(old_path, partition, old_generations[i]);
+      unlink(old_path);
+    }
+    if (partition->length == 0 && partition->dirty) {
+      slice_path(path, partition, partition->generation);
+      unlink(path);
+    }
+  }
+  free(old_generations);
+
+  for (i = 0; i < num_partitions; ++i) {
+    partition = &partitions[i];
+    if (!partition->dirty)
+      continue;
+    if (rebuild_partition(partition))
+      exit(EXIT_FAILURE);
+    partition->dirty = 0;
+    partition_path(path, partition, ".csv");
+    printf("%s\n", path);
+  }
+
+  if (write_manifest())
+    exit(EXIT_FAILURE);
+  report_latency();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,507 @@
+/*
+ * Data quality scores for a fleet of scanners.
+ *
+ * Each sensor is a file written by bluetrax_scan. For each one, this program
+ * keeps a small state file with the offset up to which the capture has been
+ * read and some running statistics, so each run reads only the records that
+ * have been appended since the last run; running it every minute for dozens of
+ * sensors is cheap.
+ *
+ * The statistics, and what they are used for, are:
+ * - inquiry cycle (the time between 'complete' records): an exponentially
+ *   weighted mean and variance, for the regularity of the cycle; a cycle that
+ *   is much longer than the mean is counted as a gap instead
+ * - gaps: the fraction of each hour that the sensor was not scanning, whether
+ *   due to a gap in the cycle or because there were no records at all
+ * - detection rate: detections per inquiry cycle in each hour, compared with
+ *   a profile of the same hour of the week (UTC) over the last few weeks; this
+ *   catches an adapter that is still cycling but no longer detecting much
+ * - bad records: times that go backwards, and data that can't be decoded
+ *
+ * Output is CSV, one line per sensor; the score is from 0 (dead) to 100.
+ */
+#include "bluetrax.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define HOURS_PER_WEEK (7*24)
+
+/**
+ * Identifies (and versions) the state file format. Version 1 state files
+ * have no identity for the capture file; see read_state.
+ */
+#define HEALTH_STATE_MAGIC 0x32485442 /* "BTH2" */
+#define HEALTH_STATE_MAGIC_V1 0x31485442 /* "BTH1" */
+
+/**
+ * Number of bytes before the offset read up to that are kept in the state, to
+ * check that a file that has grown has only been appended to.
+ */
+#define TAIL_SIZE 32
+
+/**
+ * An inquiry cycle more than this many times longer than the mean is a gap.
+ */
+#define GAP_FACTOR 3
+
+/**
+ * Weight given to the most recent cycle, hour and week in the moving averages
+ * for the cycle time, gap fraction and weekly profile, respectively.
+ */
+#define CYCLE_ALPHA (1.0/64)
+#define GAP_ALPHA (1.0/24)
+#define PROFILE_ALPHA (1.0/4)
+
+/**
+ * Weekly profile buckets need this many weeks of data before they are used.
+ */
+#define PROFILE_MIN_WEEKS 2
+
+/**
+ * Running statistics for one sensor; saved in its state file between runs.
+ */
+typedef struct {
+  uint32_t magic;
+  uint32_t corrupt;           /* data at offset can't be decoded */
+  uint64_t offset;            /* bytes of the capture file read so far */
+  uint64_t num_cycles;
+  uint64_t bad_records;
+  double   last_time;         /* of any record */
+  double   last_complete;
+  double   cycle_mean;
+  double   cycle_var;
+  double   gap_fraction;
+  double   rate_z;            /* for the last complete hour */
+  int64_t  hour;              /* being accumulated; hours since the epoch */
+  uint32_t hour_detections;
+  uint32_t hour_cycles;
+  double   hour_gap;          /* seconds */
+  uint32_t profile_weeks[HOURS_PER_WEEK];
+  double   profile_mean[HOURS_PER_WEEK];
+  double   profile_var[HOURS_PER_WEEK];
+  /* which capture file offset is in; not in version 1 */
+  uint64_t dev;
+  uint64_t ino;
+  uint32_t tail_size;
+  unsigned char tail[TAIL_SIZE];
+} health_state_t;
+
+/**
+ * Hour of the week (UTC), with Monday 00:00 to 01:00 as hour 0.
+ */
+static int hour_of_week(int64_t hour) {
+  /* 1 January 1970 was a Thursday */
+  return (int)(((hour / 24 + 3) % 7) * 24 + hour % 24);
+}
+
+/**
+ * Update an exponentially weighted mean and variance. Until there are 1/alpha
+ * observations, this is just the sample mean and (population) variance.
+ */
+static void update_moments(double *mean, double *var, uint64_t n,
+    double alpha, double x)
+{
+  double a = n < 1/alpha ? 1.0 / (n + 1) : alpha;
+  double d = x - *mean;
+
+  *mean += a * d;
+  *var = (1 - a) * (*var + a * d * d);
+}
+
+/**
+ * Fold the hour being accumulated into the statistics and start the next one.
+ * Hours that were skipped over entirely count as all gap.
+ */
+static void next_hour(health_state_t *state, int64_t hour) {
+  int how;
+  double rate, gap;
+  int64_t skipped;
+
+  if (state->hour_cycles > 0) {
+    how = hour_of_week(state->hour);
+    rate = (double)state->hour_detections / state->hour_cycles;
+
+    if (state->profile_weeks[how] >= PROFILE_MIN_WEEKS) {
+      state->rate_z = (rate - state->profile_mean[how]) /
+        sqrt(state->profile_var[how] + 1);
+    } else {
+      state->rate_z = 0;
+    }
+    update_moments(&state->profile_mean[how], &state->profile_var[how],
+        state->profile_weeks[how], PROFILE_ALPHA, rate);
+    ++state->profile_weeks[how];
+
+    gap = state->hour_gap / 3600;
+    state->gap_fraction += GAP_ALPHA * ((gap < 1 ? gap : 1) -
+        state->gap_fraction);
+  }
+
+  /* after a week, the weights have all but decayed anyway */
+  skipped = hour - state->hour - 1;
+  if (state->hour > 0 && skipped > 0) {
+    if (skipped > HOURS_PER_WEEK)
+      skipped = HOURS_PER_WEEK;
+    while (skipped--)
+      state->gap_fraction += GAP_ALPHA * (1 - state->gap_fraction);
+  }
+
+  state->hour = hour;
+  state->hour_detections = 0;
+  state->hour_cycles = 0;
+  state->hour_gap = 0;
+}
+
+/**
+ * Update the statistics with one record.
+ */
+static void add_record(health_state_t *state, bluetrax_scan_record_t *record) {
+  double t, cycle, hour_start;
+  int64_t hour;
+
+  if (record->type == BLUETRAX_TRACE)
+    return;
+
+  t = record->data.complete.time.tv_sec +
+    record->data.complete.time.tv_usec / 1e6;
+
+  /* allow a little slack for the dummy record at the start of each scan */
+  if (t < state->last_time - 1) {
+    ++state->bad_records;
+    return;
+  }
+  state->last_time = t;
+
+  hour = (int64_t)(t / 3600);
+  if (hour != state->hour)
+    next_hour(state, hour);
+
+  if (record->type != EVT_INQUIRY_COMPLETE) {
+    ++state->hour_detections;
+    return;
+  }
+
+  if (state->last_complete > 0) {
+    cycle = t - state->last_complete;
+    if (state->num_cycles > 1 && cycle > GAP_FACTOR * state->cycle_mean) {
+      /* only the part of the gap in this hour; earlier hours were skipped */
+      hour_start = hour * 3600.0;
+      state->hour_gap += t - hour_start < cycle ? t - hour_start : cycle;
+    } else {
+      update_moments(&state->cycle_mean, &state->cycle_var, state->num_cycles,
+          CYCLE_ALPHA, cycle);
+      ++state->num_cycles;
+    }
+  }
+  state->last_complete = t;
+  ++state->hour_cycles;
+}
+
+/**
+ * Read the state file for a sensor; if there isn't one, start from scratch.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int read_state(const char *state_path, health_state_t *state) {
+  FILE *file;
+  size_t n;
+
+  bzero(state, sizeof(*state));
+  state->magic = HEALTH_STATE_MAGIC;
+
+  file = fopen(state_path, "r");
+  if (file == NULL)
+    return errno == ENOENT ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  /* a version 1 state file is the same without the identity at the end,
+   * which is left as zero; its statistics are kept */
+  n = fread(state, 1, sizeof(*state), file);
+  if (n == offsetof(health_state_t, dev) &&
+      state->magic == HEALTH_STATE_MAGIC_V1) {
+    state->magic = HEALTH_STATE_MAGIC;
+  } else if (n != sizeof(*state) || state->magic != HEALTH_STATE_MAGIC) {
+    syslog(LOG_WARNING, "%s: bad state file; starting again", state_path);
+    bzero(state, sizeof(*state));
+    state->magic = HEALTH_STATE_MAGIC;
+  }
+
+  fclose(file);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Write the state file for a sensor; it is replaced atomically, so a run that
+ * is interrupted can't leave a partial state file behind.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int write_state(const char *state_path, health_state_t *state) {
+  char tmp_path[FILENAME_MAX + 4];
+  FILE *file;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state_path);
+  file = fopen(tmp_path, "w");
+  if (file == NULL)
+    return EXIT_FAILURE;
+
+  if (1 != fwrite(state, sizeof(*state), 1, file)) {
+    fclose(file);
+    return EXIT_FAILURE;
+  }
+  if (0 != fclose(file))
+    return EXIT_FAILURE;
+
+  return 0 == rename(tmp_path, state_path) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Read the bytes just before offset in a file.
+ *
+ * @return number of bytes read (fewer than TAIL_SIZE only at the start of
+ *         the file); -1 on error
+ */
+static int read_tail(int fd, uint64_t offset, unsigned char *tail) {
+  size_t size = offset < TAIL_SIZE ? offset : TAIL_SIZE;
+
+  if (size > 0 && (ssize_t)size != pread(fd, tail, size, offset - size))
+    return -1;
+  return size;
+}
+
+/**
+ * Whether the capture file is still the one that the state has read up to
+ * offset in, with only appends since: the same device and inode, and the same
+ * bytes before offset. A version 1 state has no identity, so for that, only
+ * check that the file is no shorter.
+ */
+static int same_capture(int fd, struct stat *st, health_state_t *state) {
+  unsigned char tail[TAIL_SIZE];
+
+  if (st->st_size < state->offset)
+    return 0;
+  if (state->dev == 0 && state->ino == 0)
+    return 1;
+  return state->dev == (uint64_t)st->st_dev &&
+    state->ino == (uint64_t)st->st_ino &&
+    read_tail(fd, state->offset, tail) == (int)state->tail_size &&
+    0 == memcmp(tail, state->tail, state->tail_size);
+}
+
+/**
+ * Read the new records in a capture file.
+ *
+ * If the file is not the one that we read up to offset in last time, or has
+ * been changed other than by appending to it, it has been rotated or
+ * truncated, so we start again from the beginning of it.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int update_state(const char *capture_path, health_state_t *state) {
+  FILE *file;
+  struct stat st;
+  bluetrax_scan_record_t record;
+  int rc;
+
+  file = fopen(capture_path, "r");
+  if (file == NULL)
+    return EXIT_FAILURE;
+
+  if (0 != fstat(fileno(file), &st)) {
+    fclose(file);
+    return EXIT_FAILURE;
+  }
+  if (!same_capture(fileno(file), &st, state)) {
+    state->offset = 0;
+    state->corrupt = 0;
+  }
+
+  if (!state->corrupt && 0 == fseeko(file, state->offset, SEEK_SET)) {
+    while (1 == (rc = bluetrax_read_scan_record(file, &record))) {
+      add_record(state, &record);
+      state->offset += 1 + bluetrax_scan_record_size(record.type);
+    }
+    if (rc < 0) {
+      syslog(LOG_ERR, "%s: unknown record type %d at offset %llu",
+          capture_path, record.type, (unsigned long long)state->offset);
+      state->corrupt = 1;
+    }
+  }
+
+  rc = ferror(file) ? EXIT_FAILURE : EXIT_SUCCESS;
+  if (rc == EXIT_SUCCESS) {
+    state->dev = st.st_dev;
+    state->ino = st.st_ino;
+    rc = read_tail(fileno(file), state->offset, state->tail);
+    state->tail_size = rc < 0 ? 0 : rc;
+    rc = rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+  fclose(file);
+  return rc;
+}
+
+/**
+ * Append s to path[n], with '%' and '/' escaped as %25 and %2F.
+ *
+ * @return new length; size or more if it did not fit
+ */
+static size_t append_escaped(char *path, size_t size, size_t n,
+    const char *s) {
+  for (; *s && n < size; ++s)
+    n += *s == '/' ? snprintf(path + n, size - n, "%%2F") :
+      *s == '%' ? snprintf(path + n, size - n, "%%25") :
+      snprintf(path + n, size - n, "%c", *s);
+  return n;
+}
+
+/**
+ * Name the state file for a capture in the state directory after the
+ * capture's absolute path, escaped, so that captures with the same name in
+ * different directories have their own states.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int state_dir_path(const char *state_dir, const char *capture_path,
+    char *path, size_t size) {
+  char cwd[FILENAME_MAX];
+  size_t n;
+
+  n = snprintf(path, size, "%s/", state_dir);
+  if (capture_path[0] != '/') {
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+      return EXIT_FAILURE;
+    n = append_escaped(path, size, n, cwd);
+    n = append_escaped(path, size, n, "/");
+  }
+  n = append_escaped(path, size, n, capture_path);
+  if (n < size)
+    n += snprintf(path + n, size - n, ".health");
+  if (n >= size) {
+    errno = ENAMETOOLONG;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Score a sensor from 0 to 100 and write a line of output.
+ *
+ * @param now current time, in seconds since the epoch
+ */
+static void write_score(const char *name, health_state_t *state, double now) {
+  double score = 100, silent, cv;
+
+  /* nothing from the sensor for several cycles (or at all) */
+  silent = state->last_time > 0 ? now - state->last_time : -1;
+  if (silent < 0 || (silent > 60 && silent > GAP_FACTOR * state->cycle_mean))
+    score -= 50;
+
+  score -= 30 * state->gap_fraction;
+
+  if (fabs(state->rate_z) > 3)
+    score -= fmin(20, 5 * (fabs(state->rate_z) - 2));
+
+  /* the random delay between inquiries gives a CV of a few percent */
+  cv = state->cycle_mean > 0 ? sqrt(state->cycle_var) / state->cycle_mean : 0;
+  if (cv > 0.1)
+    score -= fmin(15, 100 * (cv - 0.1));
+
+  if (state->corrupt)
+    score -= 50;
+  else if (state->bad_records > 0)
+    score -= 5;
+
+  printf("%s,%.0f,%.0f,%.3f,%.2f,%.3f,%llu,%d\n", name,
+      score > 0 ? score : 0, silent, state->gap_fraction, state->rate_z, cv,
+      (unsigned long long)state->bad_records, state->corrupt);
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s [options] file...\n\n"
+    "Score data quality for each file written by bluetrax_scan.\n\n"
+    "--state-dir dir: where to keep state files, named after the absolute\n"
+    "  path of each file, with / as %%2F; by default, the state for file is\n"
+    "  kept in file.health\n"
+    "--now t: score as of t seconds since the epoch; default is the current\n"
+    "  time\n"
+    "--help: displays this message\n", argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+  const char *state_dir = NULL;
+  char state_path[FILENAME_MAX];
+  double now = time(NULL);
+  health_state_t state;
+  int opt, i, rc = EXIT_SUCCESS;
+
+  static struct option options[] =
+  {
+    {"state-dir", required_argument, 0, 's'},
+    {"now",       required_argument, 0, 'n'},
+    {"help",      no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while ((opt=getopt_long(argc, argv, "+s:n:h", options, NULL)) != -1) {
+    switch (opt) {
+    case 's':
+      state_dir = optarg;
+      break;
+    case 'n':
+      now = atof(optarg);
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind == argc) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  puts("sensor,score,silent_s,gap_fraction,rate_z,cycle_cv,bad_records,"
+      "corrupt");
+
+  for (i = optind; i < argc; ++i) {
+    if (!state_dir) {
+      snprintf(state_path, sizeof(state_path), "%s.health", argv[i]);
+    } else if (state_dir_path(state_dir, argv[i], state_path,
+          sizeof(state_path)) != EXIT_SUCCESS) {
+      syslog(LOG_ERR, "%s: can't name state file: %m", argv[i]);
+      rc = EXIT_FAILURE;
+      continue;
+    }
+
+    if (read_state(state_path, &state) != EXIT_SUCCESS) {
+      syslog(LOG_ERR, "%s: failed to read state: %m", state_path);
+      rc = EXIT_FAILURE;
+      continue;
+    }
+    if (update_state(argv[i], &state) != EXIT_SUCCESS) {
+      syslog(LOG_ERR, "%s: failed to read: %m", argv[i]);
+      rc = EXIT_FAILURE;
+    }
+    if (write_state(state_path, &state) != EXIT_SUCCESS) {
+      syslog(LOG_ERR, "%s: failed to write state: %m", state_path);
+      rc = EXIT_FAILURE;
+    }
+
+    write_score(argv[i], &state, now);
+  }
+
+  return rc;
+}
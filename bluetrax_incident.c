@@ -0,0 +1,384 @@
+/*
+ * Streaming incident detection on travel time links.
+ *
+ * Reads matches, one per line, in CSV format:
+ *   link,time,travel_time
+ * where link is a name for the pair of sensors (e.g. "A-B"), time is when the
+ * device was seen at the second sensor, in seconds since the epoch, and
+ * travel_time is in seconds. Lines that don't parse (e.g. a header) are
+ * skipped.
+ *
+ * For each link, it keeps a baseline travel time for each time of day, as an
+ * exponentially weighted mean and mean absolute deviation; outliers are clipped
+ * before they are used to update the baseline, so one slow vehicle does not
+ * move it much. A match is high if its travel time is more than --threshold
+ * deviations above the baseline. When matches on a link have been high for at
+ * least --delay seconds (and at least --min-matches matches), it writes an
+ * alert; when the next normal match arrives, it writes a clear:
+ *   alert,link,since,time,travel_time,baseline,score
+ *   clear,link,time
+ *
+ * The state for each link is a fixed size, and each match takes constant time,
+ * so it can keep up with tens of thousands of links on one core.
+ */
+#include "bluetrax.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+/**
+ * Baselines are kept for this many bins of the (local) day.
+ */
+#define TIME_OF_DAY_BINS 48
+
+#define MAX_LINK_NAME 48
+
+/**
+ * Deviations are at least this fraction of the baseline, so a link with very
+ * consistent travel times does not alert on tiny changes.
+ */
+#define MIN_DEVIATION_FRACTION 0.05
+
+/**
+ * Ratio of standard deviation to mean absolute deviation for a normal
+ * distribution (approximately).
+ */
+#define MEAN_ABS_DEV_TO_SD 1.25
+
+typedef struct {
+  char     name[MAX_LINK_NAME];
+  double   since;          /* time of the first of the current high matches */
+  double   last_time;
+  uint32_t num_high;
+  int      alert;
+  float    mean[TIME_OF_DAY_BINS];
+  float    deviation[TIME_OF_DAY_BINS];
+  uint16_t count[TIME_OF_DAY_BINS];
+} link_t;
+
+/**
+ * Links, and an open addressing hash table of indexes into them, keyed on name.
+ * The table is at most half full.
+ */
+typedef struct {
+  link_t  *links;
+  size_t   num_links;
+  size_t   max_links;
+  int32_t *table;
+  size_t   table_size;   /* a power of 2 */
+} links_t;
+
+typedef struct {
+  double alpha;
+  double threshold;
+  double delay;
+  int    min_matches;
+  int    min_count;
+} params_t;
+
+/**
+ * FNV-1a hash.
+ */
+static uint32_t hash_name(const char *name) {
+  uint32_t h = 2166136261u;
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/**
+ * Find the slot in the table for name: either the one that has it, or the
+ * empty one where it should go.
+ */
+static int32_t *find_slot(links_t *links, const char *name) {
+  size_t mask = links->table_size - 1;
+  size_t i = hash_name(name) & mask;
+
+  while (links->table[i] >= 0 &&
+      strcmp(links->links[links->table[i]].name, name) != 0)
+    i = (i + 1) & mask;
+
+  return &links->table[i];
+}
+
+/**
+ * Double the size of the hash table and rehash.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int grow_table(links_t *links) {
+  int32_t *old_table = links->table;
+  size_t old_size = links->table_size, i;
+
+  links->table_size = old_size ? 2 * old_size : 1024;
+  links->table = malloc(links->table_size * sizeof(int32_t));
+  if (links->table == NULL)
+    return EXIT_FAILURE;
+  memset(links->table, 0xff, links->table_size * sizeof(int32_t));
+
+  for (i = 0; i < old_size; ++i) {
+    if (old_table[i] >= 0)
+      *find_slot(links, links->links[old_table[i]].name) = old_table[i];
+  }
+  free(old_table);
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Find the link with the given name, adding it if it is new.
+ *
+ * @return NULL if out of memory
+ */
+static link_t *find_link(links_t *links, const char *name) {
+  int32_t *slot;
+  link_t *link;
+
+  if (2 * (links->num_links + 1) > links->table_size &&
+      grow_table(links) != EXIT_SUCCESS)
+    return NULL;
+
+  slot = find_slot(links, name);
+  if (*slot >= 0)
+    return &links->links[*slot];
+
+  if (links->num_links == links->max_links) {
+    links->max_links = links->max_links ? 2 * links->max_links : 1024;
+    link = realloc(links->links, links->max_links * sizeof(link_t));
+    if (link == NULL)
+      return NULL;
+    links->links = link;
+  }
+
+  link = &links->links[links->num_links];
+  bzero(link, sizeof(*link));
+  /* parse_match checks that the name fits */
+  memcpy(link->name, name, strlen(name) + 1);
+  *slot = links->num_links++;
+
+  return link;
+}
+
+/**
+ * Bin for the local time of day.
+ */
+static int time_of_day_bin(double t) {
+  time_t sec = (time_t)t;
+  struct tm tm;
+
+  localtime_r(&sec, &tm);
+  return (tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec) *
+    TIME_OF_DAY_BINS / (24 * 3600);
+}
+
+/**
+ * Update the baseline in bin b with travel time x. The deviation from the
+ * baseline is clipped, once the bin has enough data, to limit the effect of
+ * outliers.
+ */
+static void update_baseline(link_t *link, int b, double x, params_t *params) {
+  double a, e, limit;
+
+  if (link->count[b] == 0) {
+    link->mean[b] = x;
+    link->deviation[b] = x * MIN_DEVIATION_FRACTION;
+  } else {
+    a = 1.0 / (link->count[b] + 1);
+    if (a < params->alpha)
+      a = params->alpha;
+
+    e = x - link->mean[b];
+    if (link->count[b] >= params->min_count) {
+      limit = params->threshold * link->deviation[b];
+      if (e > limit)
+        e = limit;
+      else if (e < -limit)
+        e = -limit;
+    }
+
+    link->mean[b] += a * e;
+    link->deviation[b] += a * (fabs(e) - link->deviation[b]);
+  }
+
+  if (link->count[b] < UINT16_MAX)
+    ++link->count[b];
+}
+
+/**
+ * Process one match.
+ */
+static void add_match(link_t *link, double t, double x, params_t *params) {
+  int b = time_of_day_bin(t);
+  double deviation, score = 0;
+
+  if (link->count[b] >= params->min_count) {
+    deviation = link->deviation[b];
+    if (deviation < MIN_DEVIATION_FRACTION * link->mean[b])
+      deviation = MIN_DEVIATION_FRACTION * link->mean[b];
+    score = (x - link->mean[b]) / (MEAN_ABS_DEV_TO_SD * deviation);
+  }
+
+  /* a run of high matches is broken by a long enough silence */
+  if (!link->alert && t - link->last_time > params->delay)
+    link->num_high = 0;
+  link->last_time = t;
+
+  if (score > params->threshold) {
+    if (link->num_high++ == 0)
+      link->since = t;
+
+    if (!link->alert && link->num_high >= params->min_matches &&
+        t - link->since >= params->delay) {
+      link->alert = 1;
+      printf("alert,%s,%.0f,%.0f,%.1f,%.1f,%.1f\n", link->name, link->since,
+          t, x, link->mean[b], score);
+      fflush(stdout);
+    }
+    /* don't learn from the incident */
+    return;
+  }
+
+  if (link->alert) {
+    link->alert = 0;
+    printf("clear,%s,%.0f\n", link->name, t);
+    fflush(stdout);
+  }
+  link->num_high = 0;
+
+  update_baseline(link, b, x, params);
+}
+
+/**
+ * Parse a line of input.
+ *
+ * @return 1 if the line is a valid match
+ */
+static int parse_match(char *line, char **name, double *t, double *x) {
+  char *p, *end;
+
+  *name = line;
+  p = strchr(line, ',');
+  if (p == NULL || p == line || p - line >= MAX_LINK_NAME)
+    return 0;
+  *p++ = '\0';
+
+  *t = strtod(p, &end);
+  if (end == p || *end != ',')
+    return 0;
+  p = end + 1;
+
+  *x = strtod(p, &end);
+  if (end == p || *x <= 0)
+    return 0;
+
+  return 1;
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s [options]\n\n"
+    "Read link,time,travel_time lines and write alerts for incidents.\n\n"
+    "--file file: name of file to read; if omitted, reads stdin\n"
+    "--threshold k: a match is high if it is more than k deviations above\n"
+    "  the baseline; default 3\n"
+    "--delay s: alert when matches have been high for s seconds; default 300\n"
+    "--min-matches n: and there have been at least n high matches; default 3\n"
+    "--alpha a: weight of each new match in the baseline; default 0.05\n"
+    "--warm-up n: matches in a time of day bin before it is used; default 10\n"
+    "--help: displays this message\n", argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+  FILE *file = stdin;
+  char line[256], *name;
+  double t, x;
+  unsigned long num_matches = 0, num_skipped = 0;
+  links_t links;
+  link_t *link;
+  params_t params = { 0.05, 3, 300, 3, 10 };
+  int opt;
+
+  static struct option options[] =
+  {
+    {"file",        required_argument, 0, 'f'},
+    {"threshold",   required_argument, 0, 'k'},
+    {"delay",       required_argument, 0, 'd'},
+    {"min-matches", required_argument, 0, 'm'},
+    {"alpha",       required_argument, 0, 'a'},
+    {"warm-up",     required_argument, 0, 'w'},
+    {"help",        no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while ((opt=getopt_long(argc, argv, "+f:k:d:m:a:w:h", options, NULL)) != -1) {
+    switch (opt) {
+    case 'f':
+      file = fopen(optarg, "r");
+      if (file == NULL) {
+        perror("failed to open input file");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'k':
+      params.threshold = atof(optarg);
+      break;
+    case 'd':
+      params.delay = atof(optarg);
+      break;
+    case 'm':
+      params.min_matches = atoi(optarg);
+      break;
+    case 'a':
+      params.alpha = atof(optarg);
+      if (params.alpha <= 0 || params.alpha > 1) {
+        fprintf(stderr, "bad alpha: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'w':
+      params.min_count = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  bzero(&links, sizeof(links));
+
+  while (fgets(line, sizeof(line), file)) {
+    if (!parse_match(line, &name, &t, &x)) {
+      ++num_skipped;
+      continue;
+    }
+
+    link = find_link(&links, name);
+    if (link == NULL) {
+      syslog(LOG_ERR, "out of memory after %lu links", links.num_links);
+      exit(EXIT_FAILURE);
+    }
+
+    add_match(link, t, x, &params);
+    ++num_matches;
+  }
+
+  syslog(LOG_INFO, "%lu matches on %lu links; skipped %lu lines",
+      num_matches, (unsigned long)links.num_links, num_skipped);
+
+  return EXIT_SUCCESS;
+}
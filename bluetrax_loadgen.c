@@ -0,0 +1,536 @@
+/*
+ * Synthetic load generator for stress testing the capture path.
+ *
+ * Runs bluetrax_scan (or the command given after the options) with
+ * --source=socket, and sends it synthetic HCI frames over that socket: inquiry
+ * results with and without RSSI, LE advertising reports, which the scanner
+ * should ignore, and an inquiry complete every --cycle frames. Frames are sent
+ * in bursts of random size, averaging --burst frames, at an average of --rate
+ * frames per second; the rate is multiplied by --step every --duration
+ * seconds until it passes --max-rate.
+ *
+ * Each inquiry response has a sequence number in its address. The scanner's
+ * output comes back through a pipe, and for each response this finds when it
+ * was sent, for the latency through the capture path. Frames are counted as
+ * dropped if the socket was full when they were sent, and as lost if they were
+ * sent but never came out.
+ *
+ * It writes one CSV line per step:
+ *   offered,achieved,sent,dropped,lost,p50_us,p99_us,max_us
+ * where offered and achieved are in frames per second, the counts are of
+ * inquiry result frames, and latencies are approximate (within 10%). At the
+ * end, it logs the first rates at which latency passed --latency-limit and at
+ * which frames were dropped or lost.
+ */
+#include "bluetrax.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/**
+ * Send times are kept for this many of the most recent inquiry results.
+ * Results that come back after this many more have been sent are counted as
+ * lost.
+ */
+#define RING_SIZE (1 << 20)
+
+/**
+ * Latencies are counted in buckets of 1/8 of a power of 2 microseconds.
+ */
+#define HISTOGRAM_BUCKETS 256
+
+#define MAX_STEPS 64
+
+/**
+ * How long to wait for the scanner to bind its socket, in seconds.
+ */
+#define START_TIMEOUT 5
+
+typedef struct {
+  uint64_t seq;
+  int64_t  sent_nsec;
+  int      step;
+} sent_frame_t;
+
+typedef struct {
+  double        offered;
+  double        achieved;
+  unsigned long sent;
+  unsigned long dropped;
+  unsigned long received;
+  unsigned long histogram[HISTOGRAM_BUCKETS];
+  double        max_usec;
+} step_t;
+
+typedef struct {
+  pthread_mutex_t lock;
+  sent_frame_t   *ring;
+  step_t          steps[MAX_STEPS];
+  FILE           *scan_output;
+} loadgen_t;
+
+static int64_t now_nsec(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int histogram_bucket(double usec) {
+  int b;
+
+  if (usec < 1)
+    return 0;
+  b = 1 + (int)(log2(usec) * 8);
+  return b < HISTOGRAM_BUCKETS ? b : HISTOGRAM_BUCKETS - 1;
+}
+
+/**
+ * Latency at quantile q of a step, as the upper end of its bucket.
+ */
+static double histogram_quantile(step_t *step, double q) {
+  unsigned long target = (unsigned long)ceil(q * step->received), count = 0;
+  int b;
+
+  for (b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+    count += step->histogram[b];
+    if (count >= target && count > 0)
+      return b == 0 ? 1 : exp2(b / 8.0);
+  }
+  return 0;
+}
+
+/**
+ * Reader thread: read the scanner's output, and match each inquiry response to
+ * the time it was sent.
+ */
+static void *read_scan_output(void *arg) {
+  loadgen_t *g = arg;
+  bluetrax_scan_record_t record;
+  bdaddr_t *bdaddr;
+  sent_frame_t *sent;
+  step_t *step;
+  uint64_t seq;
+  double usec;
+  int i, rc;
+
+  while (1 == (rc = bluetrax_read_scan_record(g->scan_output, &record))) {
+    switch (record.type) {
+      case EVT_INQUIRY_RESULT:
+        bdaddr = &record.data.result.bdaddr;
+        break;
+      case EVT_INQUIRY_RESULT_WITH_RSSI:
+        bdaddr = &record.data.result_with_rssi.bdaddr;
+        break;
+      default:
+        continue;
+    }
+
+    seq = 0;
+    for (i = 5; i >= 0; --i)
+      seq = seq << 8 | bdaddr->b[i];
+
+    /* the sender fills in the entry before the frame goes out, and the frame
+     * has been through a socket and a pipe since then */
+    pthread_mutex_lock(&g->lock);
+    sent = &g->ring[seq % RING_SIZE];
+    if (sent->seq == seq) {
+      step = &g->steps[sent->step];
+      usec = (now_nsec() - sent->sent_nsec) / 1e3;
+      ++step->received;
+      ++step->histogram[histogram_bucket(usec)];
+      if (usec > step->max_usec)
+        step->max_usec = usec;
+    }
+    pthread_mutex_unlock(&g->lock);
+  }
+
+  if (rc < 0)
+    syslog(LOG_ERR, "unsupported tag in scanner output: %d", record.type);
+  return NULL;
+}
+
+/**
+ * Build a frame, starting with the packet type byte.
+ *
+ * @param n index of the frame; determines its type
+ *
+ * @param seq sequence number for inquiry results; incremented if the frame is
+ *        an inquiry result
+ *
+ * @return length of the frame
+ */
+static int build_frame(unsigned char *buf, unsigned long n, int cycle,
+    uint64_t *seq) {
+  static const uint8_t dev_classes[][3] = {
+    { 0x0c, 0x02, 0x5a }, /* smart phone */
+    { 0x04, 0x04, 0x24 }, /* headset */
+    { 0x08, 0x04, 0x20 }, /* hands-free */
+    { 0x0c, 0x01, 0x1c }  /* laptop */
+  };
+  hci_event_hdr *hdr = (hci_event_hdr *)(buf + 1);
+  inquiry_info *info;
+  inquiry_info_with_rssi *info_rssi;
+  bdaddr_t *bdaddr;
+  unsigned char *p = buf + 1 + HCI_EVENT_HDR_SIZE;
+  int i;
+
+  buf[0] = HCI_EVENT_PKT;
+
+  if (n % cycle == cycle - 1) {
+    hdr->evt = EVT_INQUIRY_COMPLETE;
+    hdr->plen = 1;
+    p[0] = 0; /* status */
+    return 1 + HCI_EVENT_HDR_SIZE + hdr->plen;
+  }
+
+  if (n % 8 == 7) {
+    /* LE advertising report with 10 bytes of data */
+    hdr->evt = EVT_LE_META_EVENT;
+    hdr->plen = 22;
+    bzero(p, hdr->plen);
+    p[0] = 0x02; /* advertising report */
+    p[1] = 1;    /* number of reports */
+    p[4] = n;    /* address */
+    p[10] = 10;  /* data length */
+    p[21] = -60; /* rssi */
+    return 1 + HCI_EVENT_HDR_SIZE + hdr->plen;
+  }
+
+  p[0] = 1; /* number of responses */
+  if (n % 8 == 6) {
+    hdr->evt = EVT_INQUIRY_RESULT;
+    hdr->plen = 1 + sizeof(inquiry_info);
+    info = (inquiry_info *)(p + 1);
+    bzero(info, sizeof(*info));
+    bdaddr = &info->bdaddr;
+    memcpy(info->dev_class, dev_classes[n % 4], 3);
+  } else {
+    hdr->evt = EVT_INQUIRY_RESULT_WITH_RSSI;
+    hdr->plen = 1 + sizeof(inquiry_info_with_rssi);
+    info_rssi = (inquiry_info_with_rssi *)(p + 1);
+    bzero(info_rssi, sizeof(*info_rssi));
+    bdaddr = &info_rssi->bdaddr;
+    memcpy(info_rssi->dev_class, dev_classes[n % 4], 3);
+    info_rssi->rssi = -40 - (int)(n % 50);
+  }
+
+  for (i = 0; i < 6; ++i)
+    bdaddr->b[i] = *seq >> (8 * i);
+  ++*seq;
+
+  return 1 + HCI_EVENT_HDR_SIZE + hdr->plen;
+}
+
+/**
+ * Start the scanner with its output on a pipe.
+ *
+ * @return pid of the scanner, or -1 on error
+ */
+static pid_t start_scanner(char **command, const char *socket_path,
+    FILE **scan_output) {
+  char **argv, source_arg[sizeof(((struct sockaddr_un *)0)->sun_path) + 16];
+  int fds[2], argc;
+  pid_t pid;
+
+  for (argc = 0; command[argc]; ++argc)
+    ;
+  argv = calloc(argc + 2, sizeof(char *));
+  if (argv == NULL || pipe(fds) < 0)
+    return -1;
+  memcpy(argv, command, argc * sizeof(char *));
+  snprintf(source_arg, sizeof(source_arg), "--source=%s", socket_path);
+  argv[argc] = source_arg;
+
+  pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    execvp(argv[0], argv);
+    syslog(LOG_ERR, "exec %s: %m", argv[0]);
+    _exit(EXIT_FAILURE);
+  }
+  free(argv);
+  close(fds[1]);
+  if (pid < 0)
+    return -1;
+
+  *scan_output = fdopen(fds[0], "r");
+  return *scan_output ? pid : -1;
+}
+
+/**
+ * Wait until the scanner is listening on its socket.
+ *
+ * @return 0 when it is
+ */
+static int wait_for_scanner(int sd, struct sockaddr_un *addr) {
+  unsigned char buf[1 + HCI_EVENT_HDR_SIZE + 1];
+  uint64_t seq = 0;
+  int i, len = build_frame(buf, 0, 1, &seq);
+
+  for (i = 0; i < START_TIMEOUT * 100; ++i) {
+    if (sendto(sd, buf, len, 0, (struct sockaddr *)addr, sizeof(*addr)) == len)
+      return 0;
+    if (errno != ENOENT && errno != ECONNREFUSED)
+      return -1;
+    usleep(10000);
+  }
+  errno = ETIMEDOUT;
+  return -1;
+}
+
+/**
+ * Send frames for one step at the given rate. Bursts are uniform from 1 to
+ * 2 * burst - 1 frames, and each is followed by a pause that keeps the mean
+ * rate.
+ */
+static void run_step(loadgen_t *g, int sd, struct sockaddr_un *addr, int s,
+    double rate, double duration, int burst, int cycle, unsigned long *n,
+    uint64_t *seq) {
+  unsigned char buf[HCI_MAX_FRAME_SIZE];
+  step_t *step = &g->steps[s];
+  sent_frame_t *sent;
+  unsigned long num_frames = (unsigned long)(rate * duration), i = 0;
+  int64_t start = now_nsec(), due = start;
+  struct timespec target;
+  uint64_t before;
+  int size, j, len;
+
+  step->offered = rate;
+  while (i < num_frames) {
+    size = 1 + rand() % (2 * burst - 1);
+    for (j = 0; j < size && i < num_frames; ++j, ++i) {
+      before = *seq;
+      len = build_frame(buf, (*n)++, cycle, seq);
+      if (*seq != before) {
+        pthread_mutex_lock(&g->lock);
+        sent = &g->ring[before % RING_SIZE];
+        sent->seq = before;
+        sent->step = s;
+        sent->sent_nsec = now_nsec();
+        ++step->sent;
+        pthread_mutex_unlock(&g->lock);
+      }
+      if (sendto(sd, buf, len, MSG_DONTWAIT, (struct sockaddr *)addr,
+            sizeof(*addr)) != len && *seq != before) {
+        pthread_mutex_lock(&g->lock);
+        ++step->dropped;
+        g->ring[before % RING_SIZE].seq = UINT64_MAX;
+        pthread_mutex_unlock(&g->lock);
+      }
+    }
+
+    due += (int64_t)(size * 1e9 / rate);
+    target.tv_sec = due / 1000000000LL;
+    target.tv_nsec = due % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL)
+        == EINTR)
+      ;
+  }
+
+  step->achieved = num_frames / ((now_nsec() - start) / 1e9);
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s [options] [command...]\n\n"
+    "Run command (default: ./bluetrax_scan --flush) with --source=socket,\n"
+    "send it synthetic frames at increasing rates, and measure its latency\n"
+    "and drops.\n\n"
+    "--socket path: socket for the scanner to read from; default\n"
+    "  /tmp/bluetrax_loadgen.pid\n"
+    "--rate n: frames per second in the first step; default 1000\n"
+    "--max-rate n: stop after the step that passes n; default 500000\n"
+    "--step x: multiply the rate by x for each step; default 2\n"
+    "--duration s: length of each step, in seconds; default 2\n"
+    "--burst n: mean number of frames per burst; default 16\n"
+    "--cycle n: send an inquiry complete every n frames; default 100\n"
+    "--drain ms: wait this long after each step for output; default 500\n"
+    "--latency-limit ms: latency begins when the 99th percentile passes\n"
+    "  this; default 10\n"
+    "--help: displays this message\n", argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+  static char *default_command[] = { "./bluetrax_scan", "--flush", NULL };
+  char default_socket[64];
+  const char *socket_path = NULL;
+  char **command = default_command;
+  double rate = 1000, max_rate = 500000, step_factor = 2, duration = 2;
+  double latency_limit = 10, p50, p99, latency_rate = 0, drop_rate = 0;
+  int burst = 16, cycle = 100, drain = 500, s, opt, sd, status;
+  unsigned long n = 0, lost;
+  uint64_t seq = 0;
+  struct sockaddr_un addr;
+  pthread_t reader;
+  loadgen_t g;
+  pid_t pid;
+  step_t *step;
+
+  static struct option options[] =
+  {
+    {"socket",        required_argument, 0, 'S'},
+    {"rate",          required_argument, 0, 'r'},
+    {"max-rate",      required_argument, 0, 'm'},
+    {"step",          required_argument, 0, 'x'},
+    {"duration",      required_argument, 0, 'd'},
+    {"burst",         required_argument, 0, 'b'},
+    {"cycle",         required_argument, 0, 'c'},
+    {"drain",         required_argument, 0, 'w'},
+    {"latency-limit", required_argument, 0, 'l'},
+    {"help",          no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while ((opt=getopt_long(argc, argv, "+S:r:m:x:d:b:c:w:l:h", options, NULL))
+      != -1) {
+    switch (opt) {
+    case 'S':
+      socket_path = optarg;
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'm':
+      max_rate = atof(optarg);
+      break;
+    case 'x':
+      step_factor = atof(optarg);
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'b':
+      burst = atoi(optarg);
+      break;
+    case 'c':
+      cycle = atoi(optarg);
+      break;
+    case 'w':
+      drain = atoi(optarg);
+      break;
+    case 'l':
+      latency_limit = atof(optarg);
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (rate <= 0 || max_rate < rate || step_factor <= 1 || duration <= 0 ||
+      burst < 1 || cycle < 2 || drain < 0) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+  if (optind < argc)
+    command = argv + optind;
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  if (socket_path == NULL) {
+    snprintf(default_socket, sizeof(default_socket),
+        "/tmp/bluetrax_loadgen.%d", (int)getpid());
+    socket_path = default_socket;
+  }
+  bzero(&addr, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "socket path too long: %s\n", socket_path);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  bzero(&g, sizeof(g));
+  pthread_mutex_init(&g.lock, NULL);
+  g.ring = calloc(RING_SIZE, sizeof(sent_frame_t));
+  if (g.ring == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    exit(EXIT_FAILURE);
+  }
+  memset(g.ring, 0xff, RING_SIZE * sizeof(sent_frame_t));
+
+  sd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (sd < 0) {
+    syslog(LOG_ERR, "socket: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  pid = start_scanner(command, socket_path, &g.scan_output);
+  if (pid < 0) {
+    syslog(LOG_ERR, "failed to start scanner: %m");
+    exit(EXIT_FAILURE);
+  }
+  if (wait_for_scanner(sd, &addr) < 0) {
+    syslog(LOG_ERR, "scanner is not reading %s: %m", socket_path);
+    kill(pid, SIGTERM);
+    exit(EXIT_FAILURE);
+  }
+  if (0 != pthread_create(&reader, NULL, read_scan_output, &g)) {
+    syslog(LOG_ERR, "pthread_create: %m");
+    kill(pid, SIGTERM);
+    exit(EXIT_FAILURE);
+  }
+
+  puts("offered,achieved,sent,dropped,lost,p50_us,p99_us,max_us");
+  for (s = 0; s < MAX_STEPS; ++s, rate *= step_factor) {
+    if (rate > max_rate)
+      rate = max_rate;
+    run_step(&g, sd, &addr, s, rate, duration, burst, cycle, &n, &seq);
+    usleep(drain * 1000);
+
+    pthread_mutex_lock(&g.lock);
+    step = &g.steps[s];
+    lost = step->sent - step->dropped - step->received;
+    p50 = histogram_quantile(step, 0.5);
+    p99 = histogram_quantile(step, 0.99);
+    printf("%.0f,%.0f,%lu,%lu,%lu,%.0f,%.0f,%.0f\n", step->offered,
+        step->achieved, step->sent, step->dropped, lost, p50, p99,
+        step->max_usec);
+    fflush(stdout);
+    if (latency_rate == 0 && p99 > latency_limit * 1000)
+      latency_rate = step->offered;
+    if (drop_rate == 0 && step->dropped + lost > 0)
+      drop_rate = step->offered;
+    pthread_mutex_unlock(&g.lock);
+
+    if (rate >= max_rate)
+      break;
+  }
+
+  kill(pid, SIGTERM);
+  pthread_join(reader, NULL);
+  waitpid(pid, &status, 0);
+  close(sd);
+
+  if (latency_rate > 0)
+    syslog(LOG_NOTICE, "latency passes %.1fms at %.0f frames/s",
+        latency_limit, latency_rate);
+  else
+    syslog(LOG_NOTICE, "latency stays under %.1fms", latency_limit);
+  if (drop_rate > 0)
+    syslog(LOG_NOTICE, "drops begin at %.0f frames/s", drop_rate);
+  else
+    syslog(LOG_NOTICE, "no drops");
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+    syslog(LOG_ERR, "scanner exited abnormally");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,406 @@
+#define _GNU_SOURCE /* for program_invocation_short_name */
+#include "bluetrax_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Number of messages the ring holds; must be a power of 2.
+ */
+#define LOG_RING_SIZE 256
+
+/**
+ * Longest message; longer ones are truncated.
+ */
+#define LOG_MESSAGE_SIZE 240
+
+/**
+ * How often the background thread checks for requests to stop or reopen the
+ * file when there are no messages, in microseconds.
+ */
+#define LOG_POLL_USEC 200000
+
+/**
+ * How long bluetrax_log_close waits for the background thread to ship the
+ * last messages, in seconds; if syslog is stuck, it gives up.
+ */
+#define LOG_CLOSE_TIMEOUT 2
+
+/**
+ * A rate limited message is logged at most LOG_LIMIT_BURST times in each
+ * LOG_LIMIT_INTERVAL seconds.
+ */
+#define LOG_LIMIT_BURST 10
+#define LOG_LIMIT_INTERVAL 60
+
+/**
+ * A slot in the ring. The ring is a bounded multiple producer queue: each slot
+ * has a sequence number that says whether it is free for the producer that
+ * claims position pos (sequence == pos) or has been filled for the consumer
+ * (sequence == pos + 1).
+ */
+typedef struct {
+  size_t         sequence;
+  int            priority;
+  struct timeval time;
+  char           message[LOG_MESSAGE_SIZE];
+} log_entry_t;
+
+static log_entry_t ring[LOG_RING_SIZE];
+static size_t enqueue_pos;
+static size_t dequeue_pos;        /* only used by the background thread */
+static unsigned long dropped;
+static int mask = 0xff;           /* as for setlogmask */
+
+static int running;
+static int stopping;
+static int reopening;
+static pthread_t thread;
+static sem_t wakeup;               /* posted for each message */
+static int initialized;           /* wakeup and atexit, done by the first open */
+static const char *log_path;
+static int log_fd = -1;           /* -1 when shipping to syslog */
+
+/**
+ * Claim a slot in the ring.
+ *
+ * @return the slot, or NULL if the ring is full
+ */
+static log_entry_t *claim_entry(size_t *pos_out) {
+  size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED), seq;
+  log_entry_t *entry;
+  long diff;
+
+  for (;;) {
+    entry = &ring[pos & (LOG_RING_SIZE - 1)];
+    seq = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+    diff = (long)seq - (long)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  *pos_out = pos;
+  return entry;
+}
+
+/**
+ * Publish a filled slot, and wake the background thread.
+ */
+static void publish_entry(log_entry_t *entry, size_t pos) {
+  __atomic_store_n(&entry->sequence, pos + 1, __ATOMIC_RELEASE);
+
+  /* this makes a system call only if the thread is waiting */
+  sem_post(&wakeup);
+}
+
+static void vlog_entry(int priority, const char *format, va_list args) {
+  log_entry_t *entry;
+  size_t pos;
+
+  entry = claim_entry(&pos);
+  if (entry == NULL) {
+    __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  entry->priority = priority;
+  gettimeofday(&entry->time, NULL);
+  vsnprintf(entry->message, sizeof(entry->message), format, args);
+  publish_entry(entry, pos);
+}
+
+/**
+ * Send a message to syslog or write it to the file. The file is written with
+ * write rather than stdio, so there is nothing left buffered for exit to flush
+ * if the thread is stuck.
+ */
+static void ship(int priority, struct timeval time, const char *message) {
+  char line[LOG_MESSAGE_SIZE + 128], stamp[32];
+  struct tm tm;
+  int len;
+
+  if (log_fd < 0) {
+    syslog(priority, "%s", message);
+    return;
+  }
+
+  localtime_r(&time.tv_sec, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+  len = snprintf(line, sizeof(line), "%s.%06ld %s[%d]: %s\n", stamp,
+      (long)time.tv_usec, program_invocation_short_name, (int)getpid(),
+      message);
+  if (len >= (int)sizeof(line))
+    len = sizeof(line) - 1;
+  if (write(log_fd, line, len) != len) {
+    /* nowhere better to report it */
+  }
+}
+
+/**
+ * Ship all of the messages in the ring.
+ *
+ * @return number of messages shipped
+ */
+static int drain(void) {
+  log_entry_t *entry;
+  struct timeval now;
+  unsigned long n;
+  char message[64];
+  int count = 0;
+
+  for (;;) {
+    entry = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != dequeue_pos + 1)
+      break;
+    ship(entry->priority, entry->time, entry->message);
+    __atomic_store_n(&entry->sequence, dequeue_pos + LOG_RING_SIZE,
+        __ATOMIC_RELEASE);
+    ++dequeue_pos;
+    ++count;
+  }
+
+  n = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+  if (n > 0) {
+    gettimeofday(&now, NULL);
+    snprintf(message, sizeof(message), "log ring full; dropped %lu messages",
+        n);
+    ship(LOG_WARNING, now, message);
+  }
+
+  return count;
+}
+
+static int open_file(const char *path) {
+  return open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+}
+
+static void reopen_file(void) {
+  int fd;
+
+  if (log_path == NULL)
+    return;
+  fd = open_file(log_path);
+  if (fd < 0) {
+    syslog(LOG_ERR, "failed to reopen log file: %s: %m", log_path);
+    return;
+  }
+  close(log_fd);
+  log_fd = fd;
+}
+
+static void *run_logger(void *arg) {
+  struct timespec deadline;
+
+  for (;;) {
+    if (__atomic_exchange_n(&reopening, 0, __ATOMIC_ACQUIRE))
+      reopen_file();
+    if (drain() == 0) {
+      if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+        break;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += LOG_POLL_USEC * 1000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++deadline.tv_sec;
+      }
+      sem_timedwait(&wakeup, &deadline);
+    }
+  }
+  /* later messages go straight to syslog, which this thread no longer
+   * holds; ship any that came in meanwhile */
+  __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+  drain();
+  return NULL;
+}
+
+int bluetrax_log_open(const char *path) {
+  sigset_t all, old;
+  size_t i;
+  int rc;
+
+  if (running)
+    return 0;
+
+  for (i = 0; i < LOG_RING_SIZE; ++i)
+    ring[i].sequence = i;
+  enqueue_pos = dequeue_pos = 0;
+  stopping = 0;
+  /* when opened again after a close, e.g. after a failed re-exec, the
+   * semaphore is still good, and may only have stale posts, which just wake
+   * the thread once for nothing */
+  if (!initialized) {
+    if (sem_init(&wakeup, 0, 0))
+      return -1;
+    atexit(bluetrax_log_close);
+    initialized = 1;
+  }
+
+  if (path) {
+    log_fd = open_file(path);
+    if (log_fd < 0)
+      return -1;
+    log_path = path;
+  }
+
+  /* signals are for the main thread to handle */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  rc = pthread_create(&thread, NULL, run_logger, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0) {
+    if (log_fd >= 0)
+      close(log_fd);
+    log_fd = -1;
+    errno = rc;
+    return -1;
+  }
+
+  __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void bluetrax_log_close(void) {
+  struct timespec deadline;
+
+  /* not if we have already given up on a stuck thread */
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) ||
+      __atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+    return;
+
+  /* the thread stops routing messages through the ring when it exits */
+  __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+  sem_post(&wakeup);
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += LOG_CLOSE_TIMEOUT;
+  if (pthread_timedjoin_np(thread, NULL, &deadline) != 0) {
+    /* the thread is stuck shipping a message, maybe in syslog, holding its
+     * lock; leave it, and keep using the ring, so we don't get stuck too */
+    pthread_detach(thread);
+    return;
+  }
+
+  if (log_fd >= 0)
+    close(log_fd);
+  log_fd = -1;
+  log_path = NULL;
+}
+
+void bluetrax_log_reopen(void) {
+  __atomic_store_n(&reopening, 1, __ATOMIC_RELEASE);
+}
+
+int bluetrax_log_setmask(int new_mask) {
+  int old_mask = mask;
+
+  if (new_mask != 0) {
+    __atomic_store_n(&mask, new_mask, __ATOMIC_RELAXED);
+    setlogmask(new_mask);
+  }
+  return old_mask;
+}
+
+static void vlog(int priority, const char *format, va_list args) {
+  int saved_errno = errno;
+
+  if (!(LOG_MASK(LOG_PRI(priority)) &
+        __atomic_load_n(&mask, __ATOMIC_RELAXED)))
+    return;
+
+  if (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    vlog_entry(priority, format, args);
+  else
+    vsyslog(priority, format, args);
+  errno = saved_errno;
+}
+
+void bluetrax_log(int priority, const char *format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  vlog(priority, format, args);
+  va_end(args);
+}
+
+void bluetrax_log_signal(int priority, const char *message) {
+  log_entry_t *entry;
+  struct timespec now;
+  size_t pos, len;
+  int saved_errno = errno;
+
+  if (!(LOG_MASK(LOG_PRI(priority)) &
+        __atomic_load_n(&mask, __ATOMIC_RELAXED)))
+    return;
+
+  len = strlen(message);
+  if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+    if (write(STDERR_FILENO, message, len) < 0 ||
+        write(STDERR_FILENO, "\n", 1) < 0) {
+      /* nowhere better to report it */
+    }
+    errno = saved_errno;
+    return;
+  }
+
+  entry = claim_entry(&pos);
+  if (entry == NULL) {
+    __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+    errno = saved_errno;
+    return;
+  }
+  if (len >= sizeof(entry->message))
+    len = sizeof(entry->message) - 1;
+  entry->priority = priority;
+  clock_gettime(CLOCK_REALTIME, &now);
+  entry->time.tv_sec = now.tv_sec;
+  entry->time.tv_usec = now.tv_nsec / 1000;
+  memcpy(entry->message, message, len);
+  entry->message[len] = 0;
+  publish_entry(entry, pos);
+  errno = saved_errno;
+}
+
+void bluetrax_log_limited(bluetrax_log_limit_t *limit, int priority,
+    const char *format, ...) {
+  long now = time(NULL), window;
+  unsigned long suppressed;
+  va_list args;
+
+  /* the first caller in a new window resets the limit; races between threads
+   * can only let a few extra messages through */
+  window = __atomic_load_n(&limit->window, __ATOMIC_RELAXED);
+  if (now - window >= LOG_LIMIT_INTERVAL &&
+      __atomic_compare_exchange_n(&limit->window, &window, now, 0,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&limit->count, 0, __ATOMIC_RELAXED);
+    suppressed = __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+    if (suppressed > 0)
+      bluetrax_log(priority, "suppressed %lu messages like: %s", suppressed,
+          format);
+  }
+
+  if (__atomic_fetch_add(&limit->count, 1, __ATOMIC_RELAXED) >=
+      LOG_LIMIT_BURST) {
+    __atomic_add_fetch(&limit->suppressed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  va_start(args, format);
+  vlog(priority, format, args);
+  va_end(args);
+}
@@ -0,0 +1,98 @@
+#ifndef _BLUETRAX_LOG_H_
+#define _BLUETRAX_LOG_H_
+
+#include <syslog.h>
+
+/* __attribute__ is gcc-specific */
+#ifndef __GNUC__
+#  define  __attribute__(x)  /* nothing */
+#endif
+
+/**
+ * Logging that never blocks the caller, for use on the capture path.
+ *
+ * Messages are formatted by the caller (including %m) into a fixed size ring
+ * in memory, and a background thread ships them to syslog or to a file. If
+ * syslog stalls, only that thread waits; once the ring is full, new messages
+ * are dropped and counted, and the count is logged when there is room again.
+ * Adding to the ring takes no locks, so it is safe from several threads. It is
+ * not safe from a signal handler, because the message is formatted with
+ * vsnprintf; use bluetrax_log_signal there.
+ *
+ * Until bluetrax_log_open is called (and after bluetrax_log_close), messages
+ * go straight to syslog, so these functions can be used from startup on.
+ */
+
+/**
+ * Start the background thread. The caller should already have called openlog,
+ * if logging to syslog.
+ *
+ * @param path file to append messages to, or NULL to send them to syslog
+ *
+ * @return 0 if no errors; -1 on error, with errno set
+ */
+int bluetrax_log_open(const char *path);
+
+/**
+ * Ship any messages still in the ring and stop the background thread, waiting
+ * at most a couple of seconds if it is stuck. If it is, it may be holding
+ * syslog's lock, so messages still go to the ring (and are dropped once it is
+ * full) until the thread gets going again and exits. This is registered with
+ * atexit by bluetrax_log_open, so it need not be called.
+ */
+void bluetrax_log_close(void);
+
+/**
+ * Reopen the log file, if there is one, e.g. after it has been rotated. The
+ * file is reopened by the background thread, before it ships more messages.
+ */
+void bluetrax_log_reopen(void);
+
+/**
+ * Set the priorities to log, as for setlogmask, which this also calls.
+ *
+ * @return the previous mask
+ */
+int bluetrax_log_setmask(int mask);
+
+/**
+ * Log a message, as for syslog.
+ */
+void bluetrax_log(int priority, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+/**
+ * Log a message that is already formatted, from a signal handler; this only
+ * makes async-signal-safe calls. When the background thread is not running,
+ * the message goes to stderr rather than to syslog.
+ */
+void bluetrax_log_signal(int priority, const char *message);
+
+/**
+ * State for rate limiting the messages from one place in the code; see
+ * BLUETRAX_LOG_LIMITED.
+ */
+typedef struct {
+  long          window;       /* start of the current window, in seconds */
+  unsigned long count;        /* messages in the current window */
+  unsigned long suppressed;   /* messages dropped in the current window */
+} bluetrax_log_limit_t;
+
+/**
+ * Log a message, unless there have already been too many with the same limit
+ * recently; the number suppressed is logged when the limit resets.
+ */
+void bluetrax_log_limited(bluetrax_log_limit_t *limit, int priority,
+    const char *format, ...)
+  __attribute__((format(printf, 3, 4)));
+
+/**
+ * Log a message with a rate limit for the place where this is used, for
+ * messages that could repeat for every frame.
+ */
+#define BLUETRAX_LOG_LIMITED(priority, ...) do {                      \
+    static bluetrax_log_limit_t limit_;                               \
+    bluetrax_log_limited(&limit_, (priority), __VA_ARGS__);           \
+  } while (0)
+
+#endif /* guard */
@@ -0,0 +1,1050 @@
+/*
+ * Route inference for device trajectories.
+ *
+ * Reads a road graph (--graph), in CSV format:
+ *   edge,from,to,length,speed
+ *   sensor,node
+ * where from, to and node are node names, length is in metres and speed, the
+ * free flow speed, is in km/h; edges are one way, so a two way road needs an
+ * edge each way. Sensor lines mark the nodes that have sensors.
+ *
+ * Then reads trajectories, one detection per line, in CSV format:
+ *   device,time,sensor
+ * where time is in seconds since the epoch. Consecutive lines for the same
+ * device make up its trajectory, and should be in time order (e.g. sort by
+ * device and then time). Repeated detections at one sensor are merged.
+ *
+ * For each pair of consecutive sensors, the candidate routes are the --k
+ * shortest paths (by free flow time) between them, which are computed once per
+ * pair and cached. Each candidate is scored on:
+ * - timing: the log of the ratio of the observed travel time to the path's
+ *   free flow time, which is penalised much more for being too fast than for
+ *   being too slow, since vehicles stop but rarely speed much
+ * - detour: slower paths are less likely than the fastest
+ * - missed sensors: a path through a sensor that did not see the device is
+ *   less likely, by the chance that a sensor misses a passing device
+ * and the best one is chosen. The sensors pin down the route at each
+ * detection, so the best route for the trajectory is the best path for each
+ * pair in turn. A trajectory is split into trips where the gap is longer than
+ * --max-gap or no path fits the travel time.
+ *
+ * Output is one line per trip:
+ *   device,start,end,route,score
+ * where route is the node names separated by spaces and score is the log
+ * likelihood; or with --flows, one line per route with the number of trips:
+ *   route,trips
+ *
+ * Trajectories are processed on --threads threads; the output is the same as
+ * for one thread.
+ */
+#include "bluetrax.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+
+#define MAX_NAME 64
+
+#define MAX_K 16
+
+/**
+ * Penalty on the log likelihood for a path that can't be taken in the observed
+ * time; a path with this score is not used.
+ */
+#define IMPLAUSIBLE -1e9
+
+typedef struct {
+  int    to;
+  double time;     /* free flow time, in seconds */
+} edge_t;
+
+typedef struct {
+  char name[MAX_NAME];
+  int  is_sensor;
+  int  first_edge;
+  int  num_edges;
+} node_t;
+
+typedef struct {
+  int   *nodes;
+  int    num_nodes;
+  double time;
+} path_t;
+
+/**
+ * The k shortest paths between a pair of nodes.
+ */
+typedef struct {
+  int     from;
+  int     to;
+  int     num_paths;
+  path_t  paths[MAX_K];
+} pair_paths_t;
+
+/**
+ * Road graph in compressed sparse row form, with a hash table from node names
+ * to indexes.
+ */
+typedef struct {
+  node_t  *nodes;
+  int      num_nodes;
+  int      max_nodes;
+  edge_t  *edges;
+  int      num_edges;
+  int32_t *table;
+  size_t   table_size;
+} graph_t;
+
+/**
+ * Cache of k shortest paths for each pair of sensors, in an open addressing
+ * hash table, shared by the worker threads.
+ */
+typedef struct {
+  pthread_rwlock_t lock;
+  pair_paths_t   **table;
+  size_t           table_size;   /* a power of 2 */
+  size_t           size;
+} path_cache_t;
+
+typedef struct {
+  double sigma_slow;
+  double sigma_fast;
+  double detour;
+  double log_miss;
+  double max_gap;
+  int    k;
+} params_t;
+
+typedef struct {
+  int    sensor;
+  double first;   /* first and last detection at the sensor */
+  double last;
+} detection_t;
+
+typedef struct {
+  char         device[MAX_NAME];
+  detection_t *detections;
+  int          num_detections;
+  char        *output;        /* filled in by a worker */
+  size_t       output_size;
+} trajectory_t;
+
+/**
+ * An entry in the search's heap: a node, with its distance when it was pushed.
+ */
+typedef struct {
+  double key;
+  int    node;
+} heap_entry_t;
+
+/**
+ * Per thread scratch space for shortest path searches.
+ */
+typedef struct {
+  double *dist;
+  int    *prev;
+  char   *banned;
+  heap_entry_t *heap;
+  int     heap_size;
+  int    *banned_edges;   /* pairs of (from, to) */
+  int     num_banned_edges;
+  int     max_banned_edges;
+} search_t;
+
+typedef struct {
+  graph_t       *graph;
+  path_cache_t  *cache;
+  params_t      *params;
+  trajectory_t  *trajectories;
+  size_t         num_trajectories;
+  size_t         next;        /* next trajectory to process */
+  pthread_mutex_t lock;
+} work_t;
+
+static void *xmalloc(size_t size) {
+  void *p = malloc(size);
+  if (p == NULL) {
+    syslog(LOG_ERR, "malloc: %m");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static void *xrealloc(void *p, size_t size) {
+  p = realloc(p, size);
+  if (p == NULL) {
+    syslog(LOG_ERR, "realloc: %m");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+/**
+ * FNV-1a hash.
+ */
+static uint32_t hash_name(const char *name) {
+  uint32_t h = 2166136261u;
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static int32_t *find_node_slot(graph_t *g, const char *name) {
+  size_t mask = g->table_size - 1, i = hash_name(name) & mask;
+
+  while (g->table[i] >= 0 && strcmp(g->nodes[g->table[i]].name, name) != 0)
+    i = (i + 1) & mask;
+  return &g->table[i];
+}
+
+/**
+ * @return index of the node, or -1 if there is none with that name
+ */
+static int find_node(graph_t *g, const char *name) {
+  return g->table_size ? *find_node_slot(g, name) : -1;
+}
+
+/**
+ * Find a node, adding it if it is new.
+ */
+static int add_node(graph_t *g, const char *name) {
+  int32_t *old_table = g->table, *slot;
+  size_t old_size = g->table_size, i;
+
+  if (strlen(name) >= MAX_NAME)
+    return -1;
+
+  if (2 * (g->num_nodes + 1) > g->table_size) {
+    g->table_size = old_size ? 2 * old_size : 1024;
+    g->table = xmalloc(g->table_size * sizeof(int32_t));
+    memset(g->table, 0xff, g->table_size * sizeof(int32_t));
+    for (i = 0; i < old_size; ++i) {
+      if (old_table[i] >= 0)
+        *find_node_slot(g, g->nodes[old_table[i]].name) = old_table[i];
+    }
+    free(old_table);
+  }
+
+  slot = find_node_slot(g, name);
+  if (*slot >= 0)
+    return *slot;
+
+  if (g->num_nodes == g->max_nodes) {
+    g->max_nodes = g->max_nodes ? 2 * g->max_nodes : 1024;
+    g->nodes = xrealloc(g->nodes, g->max_nodes * sizeof(node_t));
+  }
+  bzero(&g->nodes[g->num_nodes], sizeof(node_t));
+  strcpy(g->nodes[g->num_nodes].name, name);
+  *slot = g->num_nodes;
+  return g->num_nodes++;
+}
+
+static int compare_edge_from(const void *a, const void *b) {
+  const int *x = a, *y = b;
+  return x[0] - y[0];
+}
+
+/**
+ * Read the graph file.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int read_graph(const char *path, graph_t *g) {
+  FILE *file = fopen(path, "r");
+  char line[512], *fields[6], *p;
+  double length, speed;
+  struct { int from; int to; double time; } *raw = NULL;
+  int num_raw = 0, max_raw = 0, n, i, from, to;
+  unsigned long line_number = 0;
+
+  if (file == NULL) {
+    syslog(LOG_ERR, "%s: %m", path);
+    return EXIT_FAILURE;
+  }
+
+  bzero(g, sizeof(*g));
+  while (fgets(line, sizeof(line), file)) {
+    ++line_number;
+    line[strcspn(line, "\r\n")] = '\0';
+    for (n = 0, p = line; n < 6 && p; ++n) {
+      fields[n] = p;
+      p = strchr(p, ',');
+      if (p)
+        *p++ = '\0';
+    }
+
+    if (n == 2 && 0 == strcmp(fields[0], "sensor")) {
+      i = add_node(g, fields[1]);
+      if (i < 0)
+        goto bad_line;
+      g->nodes[i].is_sensor = 1;
+    } else if (n == 5 && 0 == strcmp(fields[0], "edge")) {
+      from = add_node(g, fields[1]);
+      to = add_node(g, fields[2]);
+      length = atof(fields[3]);
+      speed = atof(fields[4]);
+      if (from < 0 || to < 0 || length <= 0 || speed <= 0)
+        goto bad_line;
+      if (num_raw == max_raw) {
+        max_raw = max_raw ? 2 * max_raw : 1024;
+        raw = xrealloc(raw, max_raw * sizeof(*raw));
+      }
+      raw[num_raw].from = from;
+      raw[num_raw].to = to;
+      raw[num_raw].time = length / (speed / 3.6);
+      ++num_raw;
+    } else if (line[0] != '\0') {
+      goto bad_line;
+    }
+  }
+  fclose(file);
+
+  /* sort edges by from node; the struct starts with from */
+  qsort(raw, num_raw, sizeof(*raw), compare_edge_from);
+  g->edges = xmalloc((num_raw + 1) * sizeof(edge_t));
+  g->num_edges = num_raw;
+  for (i = 0; i < num_raw; ++i) {
+    if (g->nodes[raw[i].from].num_edges++ == 0)
+      g->nodes[raw[i].from].first_edge = i;
+    g->edges[i].to = raw[i].to;
+    g->edges[i].time = raw[i].time;
+  }
+  free(raw);
+
+  syslog(LOG_INFO, "graph: %d nodes, %d edges", g->num_nodes, g->num_edges);
+  return EXIT_SUCCESS;
+
+bad_line:
+  syslog(LOG_ERR, "%s:%lu: bad line", path, line_number);
+  fclose(file);
+  free(raw);
+  return EXIT_FAILURE;
+}
+
+static void search_init(search_t *s, graph_t *g) {
+  int num_nodes = g->num_nodes;
+
+  bzero(s, sizeof(*s));
+  s->dist = xmalloc(num_nodes * sizeof(double));
+  s->prev = xmalloc(num_nodes * sizeof(int));
+  s->banned = calloc(num_nodes, 1);
+  /* each edge is relaxed at most once per search, plus the source */
+  s->heap = xmalloc((g->num_edges + 1) * sizeof(heap_entry_t));
+  if (s->banned == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void search_free(search_t *s) {
+  free(s->dist);
+  free(s->prev);
+  free(s->banned);
+  free(s->heap);
+  free(s->banned_edges);
+}
+
+static int edge_banned(search_t *s, int from, int to) {
+  int i;
+
+  for (i = 0; i < s->num_banned_edges; ++i) {
+    if (s->banned_edges[2 * i] == from && s->banned_edges[2 * i + 1] == to)
+      return 1;
+  }
+  return 0;
+}
+
+static void ban_edge(search_t *s, int from, int to) {
+  if (s->num_banned_edges == s->max_banned_edges) {
+    s->max_banned_edges = s->max_banned_edges ? 2 * s->max_banned_edges : 16;
+    s->banned_edges = xrealloc(s->banned_edges,
+        2 * s->max_banned_edges * sizeof(int));
+  }
+  s->banned_edges[2 * s->num_banned_edges++] = from;
+  s->banned_edges[2 * s->num_banned_edges - 1] = to;
+}
+
+/*
+ * Binary min heap of nodes, with duplicates instead of decrease-key. Each entry
+ * keeps the distance it was pushed with, which the heap is ordered on; an entry
+ * whose key is more than the node's distance by the time it is popped is
+ * stale, and is skipped.
+ */
+static void heap_push(search_t *s, int node) {
+  heap_entry_t entry;
+  int i = s->heap_size++, parent;
+
+  entry.key = s->dist[node];
+  entry.node = node;
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (s->heap[parent].key <= entry.key)
+      break;
+    s->heap[i] = s->heap[parent];
+    i = parent;
+  }
+  s->heap[i] = entry;
+}
+
+static heap_entry_t heap_pop(search_t *s) {
+  heap_entry_t top = s->heap[0], last = s->heap[--s->heap_size];
+  int i = 0, child;
+
+  while ((child = 2 * i + 1) < s->heap_size) {
+    if (child + 1 < s->heap_size &&
+        s->heap[child + 1].key < s->heap[child].key)
+      ++child;
+    if (last.key <= s->heap[child].key)
+      break;
+    s->heap[i] = s->heap[child];
+    i = child;
+  }
+  s->heap[i] = last;
+  return top;
+}
+
+/**
+ * Fastest path from source to target by free flow time, avoiding banned nodes
+ * and edges.
+ *
+ * @return 1 if there is a path, which is stored in path (without its own
+ *         storage; the caller copies it)
+ */
+static int shortest_path(graph_t *g, search_t *s, int source, int target,
+    path_t *path) {
+  heap_entry_t top;
+  int u, v, e, n;
+  double d;
+  char *done = s->banned; /* reuse: 1 = banned, 2 = done */
+
+  for (u = 0; u < g->num_nodes; ++u) {
+    s->dist[u] = HUGE_VAL;
+    s->prev[u] = -1;
+  }
+  s->dist[source] = 0;
+  s->heap_size = 0;
+  heap_push(s, source);
+
+  while (s->heap_size > 0) {
+    top = heap_pop(s);
+    u = top.node;
+    if ((done[u] & 2) || top.key > s->dist[u])
+      continue;
+    done[u] |= 2;
+    if (u == target)
+      break;
+    for (e = g->nodes[u].first_edge;
+        e < g->nodes[u].first_edge + g->nodes[u].num_edges; ++e) {
+      v = g->edges[e].to;
+      if (done[v] || edge_banned(s, u, v))
+        continue;
+      d = s->dist[u] + g->edges[e].time;
+      if (d < s->dist[v]) {
+        s->dist[v] = d;
+        s->prev[v] = u;
+        heap_push(s, v);
+      }
+    }
+  }
+
+  for (u = 0; u < g->num_nodes; ++u)
+    done[u] &= 1;
+
+  if (s->dist[target] == HUGE_VAL)
+    return 0;
+
+  for (n = 1, u = target; u != source; u = s->prev[u])
+    ++n;
+  path->nodes = xrealloc(path->nodes, n * sizeof(int));
+  path->num_nodes = n;
+  for (u = target; n > 0; u = s->prev[u])
+    path->nodes[--n] = u;
+  path->time = s->dist[target];
+  return 1;
+}
+
+/**
+ * Free flow time of a path from its edges.
+ */
+static void measure_path(graph_t *g, path_t *path) {
+  double time;
+  int i, e, u;
+
+  path->time = 0;
+  for (i = 0; i + 1 < path->num_nodes; ++i) {
+    /* the fastest, if there are parallel edges */
+    u = path->nodes[i];
+    time = HUGE_VAL;
+    for (e = g->nodes[u].first_edge;
+        e < g->nodes[u].first_edge + g->nodes[u].num_edges; ++e) {
+      if (g->edges[e].to == path->nodes[i + 1] && g->edges[e].time < time)
+        time = g->edges[e].time;
+    }
+    path->time += time;
+  }
+}
+
+static int same_path(path_t *a, path_t *b) {
+  return a->num_nodes == b->num_nodes &&
+    0 == memcmp(a->nodes, b->nodes, a->num_nodes * sizeof(int));
+}
+
+/**
+ * Yen's algorithm for the k fastest loopless paths from source to target.
+ */
+static void k_shortest_paths(graph_t *g, search_t *s, int source, int target,
+    int k, pair_paths_t *result) {
+  path_t *candidates = NULL, spur, *last, *best;
+  int num_candidates = 0, max_candidates = 0, i, j, c, root_len;
+
+  bzero(result, sizeof(*result));
+  result->from = source;
+  result->to = target;
+  bzero(&spur, sizeof(spur));
+
+  if (!shortest_path(g, s, source, target, &result->paths[0]))
+    return;
+  measure_path(g, &result->paths[0]);
+  result->num_paths = 1;
+
+  while (result->num_paths < k) {
+    last = &result->paths[result->num_paths - 1];
+
+    for (i = 0; i + 1 < last->num_nodes; ++i) {
+      /* spur from node i, with the root path up to it fixed */
+      root_len = i + 1;
+      s->num_banned_edges = 0;
+      for (j = 0; j < result->num_paths; ++j) {
+        if (result->paths[j].num_nodes > root_len &&
+            0 == memcmp(result->paths[j].nodes, last->nodes,
+              root_len * sizeof(int)))
+          ban_edge(s, result->paths[j].nodes[i], result->paths[j].nodes[i + 1]);
+      }
+      for (j = 0; j < i; ++j)
+        s->banned[last->nodes[j]] = 1;
+
+      if (shortest_path(g, s, last->nodes[i], target, &spur)) {
+        /* every candidate is kept, as any of them may be among the k */
+        if (num_candidates == max_candidates) {
+          max_candidates = max_candidates ? 2 * max_candidates : 4 * MAX_K;
+          candidates = xrealloc(candidates,
+              max_candidates * sizeof(path_t));
+        }
+        best = &candidates[num_candidates];
+        best->num_nodes = root_len - 1 + spur.num_nodes;
+        best->nodes = xmalloc(best->num_nodes * sizeof(int));
+        memcpy(best->nodes, last->nodes, (root_len - 1) * sizeof(int));
+        memcpy(best->nodes + root_len - 1, spur.nodes,
+            spur.num_nodes * sizeof(int));
+        measure_path(g, best);
+
+        for (c = 0; c < num_candidates; ++c) {
+          if (same_path(&candidates[c], best))
+            break;
+        }
+        for (j = 0; c == num_candidates && j < result->num_paths; ++j) {
+          if (same_path(&result->paths[j], best))
+            c = -1;
+        }
+        if (c == num_candidates)
+          ++num_candidates;
+        else
+          free(best->nodes);
+      }
+
+      for (j = 0; j < i; ++j)
+        s->banned[last->nodes[j]] = 0;
+    }
+    s->num_banned_edges = 0;
+
+    if (num_candidates == 0)
+      break;
+
+    for (c = 1, i = 0; c < num_candidates; ++c) {
+      if (candidates[c].time < candidates[i].time)
+        i = c;
+    }
+    result->paths[result->num_paths++] = candidates[i];
+    candidates[i] = candidates[--num_candidates];
+  }
+
+  for (c = 0; c < num_candidates; ++c)
+    free(candidates[c].nodes);
+  free(candidates);
+  free(spur.nodes);
+}
+
+static size_t pair_hash(int from, int to) {
+  return (uint32_t)from * 2654435761u ^ (uint32_t)to * 40503u;
+}
+
+static pair_paths_t *cache_find(path_cache_t *cache, int from, int to) {
+  size_t mask = cache->table_size - 1, i = pair_hash(from, to) & mask;
+  pair_paths_t *p;
+
+  while ((p = cache->table[i]) != NULL) {
+    if (p->from == from && p->to == to)
+      return p;
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+/**
+ * Insert, unless another thread got there first; the caller holds the write
+ * lock.
+ *
+ * @return the cached entry
+ */
+static pair_paths_t *cache_insert(path_cache_t *cache, pair_paths_t *entry) {
+  pair_paths_t **old_table = cache->table, *p;
+  size_t old_size = cache->table_size, i, mask;
+
+  p = cache_find(cache, entry->from, entry->to);
+  if (p)
+    return p;
+
+  if (2 * (cache->size + 1) > cache->table_size) {
+    cache->table_size *= 2;
+    cache->table = calloc(cache->table_size, sizeof(pair_paths_t *));
+    if (cache->table == NULL) {
+      syslog(LOG_ERR, "calloc: %m");
+      exit(EXIT_FAILURE);
+    }
+    mask = cache->table_size - 1;
+    for (i = 0; i < old_size; ++i) {
+      if ((p = old_table[i]) == NULL)
+        continue;
+      size_t j = pair_hash(p->from, p->to) & mask;
+      while (cache->table[j])
+        j = (j + 1) & mask;
+      cache->table[j] = p;
+    }
+    free(old_table);
+  }
+
+  mask = cache->table_size - 1;
+  i = pair_hash(entry->from, entry->to) & mask;
+  while (cache->table[i])
+    i = (i + 1) & mask;
+  cache->table[i] = entry;
+  ++cache->size;
+  return entry;
+}
+
+/**
+ * The k shortest paths between two sensors, from the cache if possible.
+ */
+static pair_paths_t *get_paths(work_t *w, search_t *s, int from, int to) {
+  pair_paths_t *p, *entry;
+  int i;
+
+  pthread_rwlock_rdlock(&w->cache->lock);
+  p = cache_find(w->cache, from, to);
+  pthread_rwlock_unlock(&w->cache->lock);
+  if (p)
+    return p;
+
+  /* compute without the lock, so other threads can carry on */
+  entry = xmalloc(sizeof(*entry));
+  k_shortest_paths(w->graph, s, from, to, w->params->k, entry);
+
+  pthread_rwlock_wrlock(&w->cache->lock);
+  p = cache_insert(w->cache, entry);
+  pthread_rwlock_unlock(&w->cache->lock);
+
+  if (p != entry) {
+    for (i = 0; i < entry->num_paths; ++i)
+      free(entry->paths[i].nodes);
+    free(entry);
+  }
+  return p;
+}
+
+/**
+ * Log likelihood of a path for a leg with observed travel time dt (excluding
+ * the likelihood of the leg's end points, which is the same for every path).
+ */
+static double score_path(graph_t *g, params_t *params, path_t *path,
+    path_t *shortest, double dt) {
+  double r, score;
+  int i;
+
+  if (dt <= 0)
+    dt = 1;
+  r = log(dt / path->time);
+  if (r >= 0)
+    score = -r * r / (2 * params->sigma_slow * params->sigma_slow);
+  else
+    score = -r * r / (2 * params->sigma_fast * params->sigma_fast);
+  if (r < -4 * params->sigma_fast)
+    return IMPLAUSIBLE;
+
+  score -= params->detour * (path->time / shortest->time - 1);
+
+  for (i = 1; i + 1 < path->num_nodes; ++i) {
+    if (g->nodes[path->nodes[i]].is_sensor)
+      score += params->log_miss;
+  }
+  return score;
+}
+
+/**
+ * Append a trip to the trajectory's output.
+ */
+static void write_trip(FILE *out, graph_t *g, trajectory_t *t, double start,
+    double end, int *route, int route_len, double score) {
+  int i;
+
+  fprintf(out, "%s,%.0f,%.0f,", t->device, start, end);
+  for (i = 0; i < route_len; ++i)
+    fprintf(out, "%s%s", i ? " " : "", g->nodes[route[i]].name);
+  fprintf(out, ",%.2f\n", score);
+}
+
+/**
+ * Infer the route for each trip in a trajectory.
+ */
+static void infer_routes(work_t *w, search_t *s, trajectory_t *t) {
+  graph_t *g = w->graph;
+  detection_t *a, *b;
+  pair_paths_t *pp;
+  path_t *best;
+  int *route = NULL, route_len = 0, max_route = 0, i, j, p;
+  double score, best_score, trip_score = 0, start = 0;
+  FILE *out;
+
+  out = open_memstream(&t->output, &t->output_size);
+  if (out == NULL) {
+    syslog(LOG_ERR, "open_memstream: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i + 1 < t->num_detections; ++i) {
+    a = &t->detections[i];
+    b = &t->detections[i + 1];
+
+    best = NULL;
+    best_score = IMPLAUSIBLE;
+    if (b->first - a->last <= w->params->max_gap) {
+      pp = get_paths(w, s, a->sensor, b->sensor);
+      for (p = 0; p < pp->num_paths; ++p) {
+        score = score_path(g, w->params, &pp->paths[p], &pp->paths[0],
+            b->first - a->last);
+        if (score > best_score) {
+          best_score = score;
+          best = &pp->paths[p];
+        }
+      }
+    }
+
+    if (best == NULL) {
+      /* end the current trip, if any */
+      if (route_len > 1)
+        write_trip(out, g, t, start, a->last, route, route_len, trip_score);
+      route_len = 0;
+      continue;
+    }
+
+    if (route_len == 0) {
+      start = a->first;
+      trip_score = 0;
+    }
+    if (route_len + best->num_nodes > max_route) {
+      max_route = 2 * (route_len + best->num_nodes);
+      route = xrealloc(route, max_route * sizeof(int));
+    }
+    /* the first node of the path is the last node of the route so far */
+    for (j = route_len ? 1 : 0; j < best->num_nodes; ++j)
+      route[route_len++] = best->nodes[j];
+    trip_score += best_score;
+  }
+
+  if (route_len > 1)
+    write_trip(out, g, t, start, t->detections[t->num_detections - 1].first,
+        route, route_len, trip_score);
+
+  fclose(out);
+  free(route);
+}
+
+static void *run_worker(void *arg) {
+  work_t *w = arg;
+  search_t s;
+  size_t i;
+
+  search_init(&s, w->graph);
+  for (;;) {
+    pthread_mutex_lock(&w->lock);
+    i = w->next++;
+    pthread_mutex_unlock(&w->lock);
+    if (i >= w->num_trajectories)
+      break;
+    infer_routes(w, &s, &w->trajectories[i]);
+  }
+  search_free(&s);
+  return NULL;
+}
+
+/**
+ * Read trajectories from the input.
+ *
+ * @return number of trajectories
+ */
+static size_t read_trajectories(FILE *file, graph_t *g,
+    trajectory_t **trajectories) {
+  char line[256], *device, *p, *end;
+  size_t num = 0, max = 0;
+  unsigned long num_unknown = 0, num_bad = 0;
+  trajectory_t *t = NULL;
+  detection_t *d;
+  double time;
+  int sensor;
+
+  *trajectories = NULL;
+  while (fgets(line, sizeof(line), file)) {
+    device = line;
+    p = strchr(line, ',');
+    if (p == NULL || p - line >= MAX_NAME) {
+      ++num_bad;
+      continue;
+    }
+    *p++ = '\0';
+    time = strtod(p, &end);
+    if (end == p || *end != ',') {
+      ++num_bad;
+      continue;
+    }
+    p = end + 1;
+    p[strcspn(p, "\r\n")] = '\0';
+    sensor = find_node(g, p);
+    if (sensor < 0) {
+      ++num_unknown;
+      continue;
+    }
+
+    if (t == NULL || strcmp(t->device, device) != 0) {
+      if (num == max) {
+        max = max ? 2 * max : 1024;
+        *trajectories = xrealloc(*trajectories, max * sizeof(trajectory_t));
+      }
+      t = &(*trajectories)[num++];
+      bzero(t, sizeof(*t));
+      strcpy(t->device, device);
+    }
+
+    d = t->num_detections ? &t->detections[t->num_detections - 1] : NULL;
+    if (d && d->sensor == sensor) {
+      d->last = time;
+      continue;
+    }
+    /* grow by powers of 2 */
+    if ((t->num_detections & (t->num_detections - 1)) == 0)
+      t->detections = xrealloc(t->detections,
+          (t->num_detections ? 2 * t->num_detections : 1) *
+          sizeof(detection_t));
+    d = &t->detections[t->num_detections++];
+    d->sensor = sensor;
+    d->first = d->last = time;
+  }
+
+  if (num_bad || num_unknown)
+    syslog(LOG_WARNING, "skipped %lu bad lines and %lu unknown sensors",
+        num_bad, num_unknown);
+  return num;
+}
+
+static int compare_flows(const void *a, const void *b) {
+  const char *const *x = a, *const *y = b;
+  return strcmp(*x, *y);
+}
+
+/**
+ * Count trips by route and write route,trips lines.
+ */
+static void write_flows(trajectory_t *trajectories, size_t num) {
+  char **routes = NULL, *line, *p, *q;
+  size_t num_routes = 0, max_routes = 0, i, n;
+
+  for (i = 0; i < num; ++i) {
+    for (line = trajectories[i].output; line && *line; line = p + 1) {
+      p = strchr(line, '\n');
+      *p = '\0';
+      /* route is the fourth field */
+      q = strchr(strchr(strchr(line, ',') + 1, ',') + 1, ',') + 1;
+      *strrchr(q, ',') = '\0';
+      if (num_routes == max_routes) {
+        max_routes = max_routes ? 2 * max_routes : 1024;
+        routes = xrealloc(routes, max_routes * sizeof(char *));
+      }
+      routes[num_routes++] = q;
+    }
+  }
+
+  qsort(routes, num_routes, sizeof(char *), compare_flows);
+  puts("route,trips");
+  for (i = 0; i < num_routes; i += n) {
+    for (n = 1; i + n < num_routes && 0 == strcmp(routes[i], routes[i + n]);
+        ++n)
+      ;
+    printf("%s,%lu\n", routes[i], (unsigned long)n);
+  }
+  free(routes);
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s --graph=file [options]\n\n"
+    "Read device,time,sensor lines and write the most likely route for each\n"
+    "trip.\n\n"
+    "--graph file: road graph, with edge,from,to,length_m,speed_kmh and\n"
+    "  sensor,node lines\n"
+    "--file file: name of file to read; if omitted, reads stdin\n"
+    "--k n: number of candidate paths between each pair of sensors;\n"
+    "  default 4, at most %d\n"
+    "--sigma-slow s: spread (log) of travel times slower than free flow;\n"
+    "  default 0.5\n"
+    "--sigma-fast s: spread (log) of travel times faster than free flow;\n"
+    "  default 0.15\n"
+    "--detour x: penalty per unit of extra free flow time relative to the\n"
+    "  fastest path; default 1\n"
+    "--detection p: chance that a sensor detects a passing device; default 0.7\n"
+    "--max-gap s: split trips where a device is not seen for s seconds;\n"
+    "  default 3600\n"
+    "--flows: write route,trips lines instead of one line per trip\n"
+    "--threads n: number of worker threads; default 1\n"
+    "--help: displays this message\n", argv[0], MAX_K);
+}
+
+int main(int argc, char **argv)
+{
+  FILE *file = stdin;
+  const char *graph_path = NULL;
+  params_t params = { 0.5, 0.15, 1, 0, 3600, 4 };
+  double detection = 0.7;
+  int opt, num_threads = 1, flows = 0, i;
+  graph_t graph;
+  path_cache_t cache;
+  work_t work;
+  pthread_t *threads;
+  size_t t;
+
+  static struct option options[] =
+  {
+    {"graph",      required_argument, 0, 'g'},
+    {"file",       required_argument, 0, 'f'},
+    {"k",          required_argument, 0, 'k'},
+    {"sigma-slow", required_argument, 0, 's'},
+    {"sigma-fast", required_argument, 0, 'S'},
+    {"detour",     required_argument, 0, 'D'},
+    {"detection",  required_argument, 0, 'p'},
+    {"max-gap",    required_argument, 0, 'm'},
+    {"flows",      no_argument,       0, 'F'},
+    {"threads",    required_argument, 0, 'j'},
+    {"help",       no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while ((opt=getopt_long(argc, argv, "+g:f:k:s:S:D:p:m:Fj:h", options, NULL))
+      != -1) {
+    switch (opt) {
+    case 'g':
+      graph_path = optarg;
+      break;
+    case 'f':
+      file = fopen(optarg, "r");
+      if (file == NULL) {
+        perror("failed to open input file");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'k':
+      params.k = atoi(optarg);
+      break;
+    case 's':
+      params.sigma_slow = atof(optarg);
+      break;
+    case 'S':
+      params.sigma_fast = atof(optarg);
+      break;
+    case 'D':
+      params.detour = atof(optarg);
+      break;
+    case 'p':
+      detection = atof(optarg);
+      break;
+    case 'm':
+      params.max_gap = atof(optarg);
+      break;
+    case 'F':
+      flows = 1;
+      break;
+    case 'j':
+      num_threads = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc || graph_path == NULL || params.k < 1 ||
+      params.k > MAX_K || params.sigma_slow <= 0 || params.sigma_fast <= 0 ||
+      detection < 0 || detection >= 1 || num_threads < 1) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+  params.log_miss = log(1 - detection);
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  if (read_graph(graph_path, &graph) != EXIT_SUCCESS)
+    return EXIT_FAILURE;
+
+  bzero(&cache, sizeof(cache));
+  pthread_rwlock_init(&cache.lock, NULL);
+  cache.table_size = 1024;
+  cache.table = calloc(cache.table_size, sizeof(pair_paths_t *));
+
+  bzero(&work, sizeof(work));
+  pthread_mutex_init(&work.lock, NULL);
+  work.graph = &graph;
+  work.cache = &cache;
+  work.params = &params;
+  work.num_trajectories = read_trajectories(file, &graph, &work.trajectories);
+
+  threads = calloc(num_threads, sizeof(pthread_t));
+  if (cache.table == NULL || threads == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    return EXIT_FAILURE;
+  }
+  for (i = 0; i < num_threads; ++i) {
+    if (0 != pthread_create(&threads[i], NULL, run_worker, &work)) {
+      syslog(LOG_ERR, "pthread_create: %m");
+      return EXIT_FAILURE;
+    }
+  }
+  for (i = 0; i < num_threads; ++i)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  if (flows) {
+    write_flows(work.trajectories, work.num_trajectories);
+  } else {
+    puts("device,start,end,route,score");
+    for (t = 0; t < work.num_trajectories; ++t)
+      fwrite(work.trajectories[t].output, 1, work.trajectories[t].output_size,
+          stdout);
+  }
+
+  syslog(LOG_INFO, "%lu trajectories; %lu sensor pairs cached",
+      (unsigned long)work.num_trajectories, (unsigned long)cache.size);
+
+  return EXIT_SUCCESS;
+}
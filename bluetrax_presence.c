@@ -0,0 +1,559 @@
+/*
+ * Compact per-cycle presence encoding.
+ *
+ * Most devices that are detected in one inquiry cycle were also detected in
+ * the one before, so rather than a record for every detection, this stores,
+ * for each cycle (up to and including an 'inquiry complete' record), only the
+ * devices that arrived or departed since the previous cycle, and the changes
+ * in signal strength of the ones that stayed.
+ *
+ * A device is present in a cycle if it was detected at least once in it; its
+ * class is that of its first detection in the cycle, and its RSSI is the
+ * strongest in the cycle (or none, if no detection in the cycle had an RSSI).
+ * A device whose class, or whether it has an RSSI, changes is stored as a
+ * departure and an arrival. Decoding gives exactly this presence for every
+ * cycle; only the times of the individual detections are lost.
+ *
+ * --encode reads bluetrax_scan output and writes the encoding; it writes each
+ * cycle as soon as it completes, so it can run in a pipe from bluetrax_scan.
+ * --decode reads the encoding and writes one CSV line per device per cycle:
+ *   time,bdaddr,class,rssi
+ * where time is the end of the cycle, class is the class of device in hex, and
+ * rssi is empty if there was none.
+ *
+ * Format: the magic number, then one block per cycle:
+ *   tag: 'C' for a cycle that ended with an 'inquiry complete' record, or 'E'
+ *     for the records after the last one, at the end of the input; for 'E',
+ *     the time is that of the last record
+ *   time: microseconds since the epoch, as a signed difference from the
+ *     previous block's time (0 for the first)
+ *   departures: count, then for each, the gap from the previous departure's
+ *     index (or -1) to its index in the previous cycle's devices, in order
+ *   arrivals: count, then for each, bdaddr (6 bytes), class (3 bytes) and
+ *     rssi (1 byte; -128 for none)
+ *   RSSI changes: count, then for each, the gap from the previous change's
+ *     index (or -1) to the device's index among the devices that stayed, in
+ *     order, and the signed change
+ * Devices are ordered by address. Counts, gaps and times are unsigned LEB128
+ * varints; signed values are zigzag encoded first.
+ */
+#include "bluetrax.h"
+
+#include <getopt.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+/**
+ * Identifies (and versions) the encoding.
+ */
+#define PRESENCE_MAGIC 0x52505442 /* "BTPR" */
+
+/**
+ * Marks a device with no RSSI.
+ */
+#define NO_RSSI -128
+
+
+typedef struct {
+  uint64_t addr;          /* bdaddr, most significant byte first */
+  uint32_t order;         /* order of detection, for a stable sort */
+  uint8_t  dev_class[3];
+  int8_t   rssi;
+} device_t;
+
+/**
+ * A growable array of devices.
+ */
+typedef struct {
+  device_t *devices;
+  size_t    num_devices;
+  size_t    max_devices;
+} device_set_t;
+
+/**
+ * A growable array of indexes and values, for departures and RSSI changes.
+ */
+typedef struct {
+  size_t   *index;
+  int      *value;
+  size_t    size;
+  size_t    max_size;
+} index_list_t;
+
+static void add_device(device_set_t *set, device_t *device) {
+  device_t *devices;
+
+  if (set->num_devices == set->max_devices) {
+    set->max_devices = set->max_devices ? 2 * set->max_devices : 256;
+    devices = realloc(set->devices, set->max_devices * sizeof(device_t));
+    if (devices == NULL) {
+      syslog(LOG_ERR, "realloc: %m");
+      exit(EXIT_FAILURE);
+    }
+    set->devices = devices;
+  }
+  set->devices[set->num_devices++] = *device;
+}
+
+static void add_index(index_list_t *list, size_t index, int value) {
+  if (list->size == list->max_size) {
+    list->max_size = list->max_size ? 2 * list->max_size : 256;
+    list->index = realloc(list->index, list->max_size * sizeof(size_t));
+    list->value = realloc(list->value, list->max_size * sizeof(int));
+    if (list->index == NULL || list->value == NULL) {
+      syslog(LOG_ERR, "realloc: %m");
+      exit(EXIT_FAILURE);
+    }
+  }
+  list->index[list->size] = index;
+  list->value[list->size++] = value;
+}
+
+static int compare_detections(const void *a, const void *b) {
+  const device_t *x = a, *y = b;
+
+  if (x->addr != y->addr)
+    return x->addr < y->addr ? -1 : 1;
+  return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/**
+ * Sort the detections in a cycle by address and merge those of each device,
+ * keeping the class of the first and the strongest RSSI.
+ */
+static void merge_detections(device_set_t *set) {
+  device_t *d, *last;
+  size_t i, n = 0;
+
+  qsort(set->devices, set->num_devices, sizeof(device_t), compare_detections);
+
+  for (i = 0; i < set->num_devices; ++i) {
+    d = &set->devices[i];
+    last = n > 0 ? &set->devices[n - 1] : NULL;
+    if (last && last->addr == d->addr) {
+      if (d->rssi != NO_RSSI && (last->rssi == NO_RSSI || d->rssi > last->rssi))
+        last->rssi = d->rssi;
+    } else {
+      set->devices[n++] = *d;
+    }
+  }
+  set->num_devices = n;
+}
+
+/**
+ * True if b can be stored as an RSSI change to a.
+ */
+static int same_device(device_t *a, device_t *b) {
+  return a->addr == b->addr &&
+    0 == memcmp(a->dev_class, b->dev_class, 3) &&
+    (a->rssi == NO_RSSI) == (b->rssi == NO_RSSI);
+}
+
+static uint64_t zigzag(int64_t x) {
+  return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+}
+
+static int64_t unzigzag(uint64_t x) {
+  return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+static void write_varint(FILE *out, uint64_t x) {
+  while (x >= 0x80) {
+    putc((x & 0x7f) | 0x80, out);
+    x >>= 7;
+  }
+  putc(x, out);
+}
+
+/**
+ * @return 0 if no errors
+ */
+static int read_varint(FILE *in, uint64_t *x) {
+  int c, shift = 0;
+
+  *x = 0;
+  do {
+    c = getc(in);
+    if (c == EOF || shift > 63)
+      return -1;
+    *x |= (uint64_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 0;
+}
+
+/**
+ * Write indexes as gaps from the previous one (or -1), with their values if
+ * with_values is set.
+ */
+static void write_index_list(FILE *out, index_list_t *list, int with_values) {
+  size_t k, next = 0;
+
+  write_varint(out, list->size);
+  for (k = 0; k < list->size; ++k) {
+    write_varint(out, list->index[k] - next);
+    next = list->index[k] + 1;
+    if (with_values)
+      write_varint(out, zigzag(list->value[k]));
+  }
+}
+
+/**
+ * @return 0 if no errors
+ */
+static int read_index_list(FILE *in, index_list_t *list, int with_values) {
+  uint64_t size, gap, value = 0;
+  size_t k, next = 0;
+
+  list->size = 0;
+  if (read_varint(in, &size))
+    return -1;
+  for (k = 0; k < size; ++k) {
+    if (read_varint(in, &gap) || (with_values && read_varint(in, &value)))
+      return -1;
+    add_index(list, next + gap, unzigzag(value));
+    next += gap + 1;
+  }
+  return 0;
+}
+
+/**
+ * Encoder and decoder state: the devices in the previous and current cycles,
+ * and scratch space for the block in between.
+ */
+typedef struct {
+  device_set_t  sets[2];
+  device_set_t *prev;
+  device_set_t *cur;
+  device_set_t  arrivals;
+  index_list_t  departures;
+  index_list_t  changes;
+  int64_t       time;
+} presence_t;
+
+static void presence_init(presence_t *p) {
+  bzero(p, sizeof(*p));
+  p->prev = &p->sets[0];
+  p->cur = &p->sets[1];
+}
+
+static void presence_free(presence_t *p) {
+  free(p->sets[0].devices);
+  free(p->sets[1].devices);
+  free(p->arrivals.devices);
+  free(p->departures.index);
+  free(p->departures.value);
+  free(p->changes.index);
+  free(p->changes.value);
+}
+
+/**
+ * Make the current cycle the previous one, and start a new one.
+ */
+static void next_cycle(presence_t *p) {
+  device_set_t *tmp = p->prev;
+
+  p->prev = p->cur;
+  p->cur = tmp;
+  p->cur->num_devices = 0;
+}
+
+/**
+ * Write the block for the current cycle, which ended at time.
+ */
+static void write_cycle(FILE *out, presence_t *p, int tag, int64_t time) {
+  device_t *a, *b;
+  size_t i = 0, j = 0, stayed = 0;
+  int n;
+
+  merge_detections(p->cur);
+
+  p->arrivals.num_devices = 0;
+  p->departures.size = 0;
+  p->changes.size = 0;
+  while (i < p->prev->num_devices || j < p->cur->num_devices) {
+    a = i < p->prev->num_devices ? &p->prev->devices[i] : NULL;
+    b = j < p->cur->num_devices ? &p->cur->devices[j] : NULL;
+    if (b == NULL || (a && a->addr < b->addr)) {
+      add_index(&p->departures, i++, 0);
+    } else if (a == NULL || b->addr < a->addr) {
+      add_device(&p->arrivals, b);
+      ++j;
+    } else if (same_device(a, b)) {
+      if (a->rssi != b->rssi)
+        add_index(&p->changes, stayed, b->rssi - a->rssi);
+      ++stayed;
+      ++i;
+      ++j;
+    } else {
+      add_index(&p->departures, i++, 0);
+      add_device(&p->arrivals, b);
+      ++j;
+    }
+  }
+
+  putc(tag, out);
+  write_varint(out, zigzag(time - p->time));
+  p->time = time;
+
+  write_index_list(out, &p->departures, 0);
+  write_varint(out, p->arrivals.num_devices);
+  for (j = 0; j < p->arrivals.num_devices; ++j) {
+    b = &p->arrivals.devices[j];
+    for (n = 5; n >= 0; --n)
+      putc((b->addr >> (8 * n)) & 0xff, out);
+    fwrite(b->dev_class, 1, 3, out);
+    putc((uint8_t)b->rssi, out);
+  }
+  write_index_list(out, &p->changes, 1);
+
+  fflush(out);
+  next_cycle(p);
+}
+
+/**
+ * Read the block for a cycle, after its tag, and rebuild the current cycle
+ * from it and the previous one.
+ *
+ * @return 0 if no errors
+ */
+static int read_cycle(FILE *in, presence_t *p) {
+  unsigned char buf[10];
+  uint64_t x, num_arrivals;
+  device_t arrival, *a;
+  size_t i, j, k, d, stayed;
+  int n;
+
+  if (read_varint(in, &x) || read_index_list(in, &p->departures, 0) ||
+      read_varint(in, &num_arrivals))
+    return -1;
+  p->time += unzigzag(x);
+
+  p->arrivals.num_devices = 0;
+  bzero(&arrival, sizeof(arrival));
+  for (k = 0; k < num_arrivals; ++k) {
+    if (10 != fread(buf, 1, 10, in))
+      return -1;
+    arrival.addr = 0;
+    for (n = 0; n < 6; ++n)
+      arrival.addr = arrival.addr << 8 | buf[n];
+    memcpy(arrival.dev_class, buf + 6, 3);
+    arrival.rssi = (int8_t)buf[9];
+    add_device(&p->arrivals, &arrival);
+  }
+
+  if (read_index_list(in, &p->changes, 1))
+    return -1;
+
+  /* merge the devices that stayed, with their changes, and the arrivals */
+  p->cur->num_devices = 0;
+  for (i = 0, j = 0, d = 0, k = 0, stayed = 0;
+      i < p->prev->num_devices || j < p->arrivals.num_devices;) {
+    if (i < p->prev->num_devices && d < p->departures.size &&
+        p->departures.index[d] == i) {
+      ++d;
+      ++i;
+      continue;
+    }
+    if (i == p->prev->num_devices || (j < p->arrivals.num_devices &&
+          p->arrivals.devices[j].addr < p->prev->devices[i].addr)) {
+      add_device(p->cur, &p->arrivals.devices[j++]);
+      continue;
+    }
+    add_device(p->cur, &p->prev->devices[i++]);
+    if (k < p->changes.size && p->changes.index[k] == stayed) {
+      a = &p->cur->devices[p->cur->num_devices - 1];
+      a->rssi += p->changes.value[k++];
+    }
+    ++stayed;
+  }
+
+  if (d != p->departures.size || k != p->changes.size)
+    return -1;
+  return 0;
+}
+
+/**
+ * Read bluetrax_scan records and write the encoding.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int encode(FILE *in, FILE *out) {
+  bluetrax_scan_record_t record;
+  presence_t p;
+  device_t device;
+  uint8_t *b;
+  uint32_t magic = PRESENCE_MAGIC;
+  unsigned long num_records = 0, num_cycles = 0;
+  int64_t time = 0;
+  int rc, i;
+
+  presence_init(&p);
+  fwrite(&magic, sizeof(magic), 1, out);
+
+  while (1 == (rc = bluetrax_read_scan_record(in, &record))) {
+    time = (int64_t)record.data.complete.time.tv_sec * 1000000 +
+      record.data.complete.time.tv_usec;
+    switch (record.type) {
+      case EVT_INQUIRY_COMPLETE:
+        write_cycle(out, &p, 'C', time);
+        ++num_cycles;
+        continue;
+      case EVT_INQUIRY_RESULT:
+        b = record.data.result.bdaddr.b;
+        memcpy(device.dev_class, record.data.result.dev_class, 3);
+        device.rssi = NO_RSSI;
+        break;
+      case EVT_INQUIRY_RESULT_WITH_RSSI:
+        b = record.data.result_with_rssi.bdaddr.b;
+        memcpy(device.dev_class, record.data.result_with_rssi.dev_class, 3);
+        device.rssi = record.data.result_with_rssi.rssi;
+        /* -128 is out of range for an RSSI; don't let it read as none */
+        if (device.rssi == NO_RSSI)
+          device.rssi = NO_RSSI + 1;
+        break;
+      default:
+        continue;
+    }
+    device.addr = 0;
+    for (i = 5; i >= 0; --i)
+      device.addr = device.addr << 8 | b[i];
+    device.order = num_records++;
+    add_device(p.cur, &device);
+  }
+
+  if (p.cur->num_devices > 0)
+    write_cycle(out, &p, 'E', time);
+  presence_free(&p);
+
+  if (rc < 0) {
+    syslog(LOG_ERR, "unsupported tag: %d", record.type);
+    return EXIT_FAILURE;
+  } else if (ferror(in) || record.type != EOF) {
+    syslog(LOG_ERR, "fread record: %m");
+    return EXIT_FAILURE;
+  }
+
+  syslog(LOG_INFO, "encoded %lu detections in %lu cycles", num_records,
+      num_cycles);
+  return ferror(out) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Write the time, in the same format as bluetrax_scan_unpack.
+ */
+static void format_time(char *buf, size_t size, int64_t usec) {
+  time_t sec = usec / 1000000;
+  struct tm tm;
+  char fmt[64];
+
+  localtime_r(&sec, &tm);
+  strftime(fmt, sizeof(fmt), "%Y-%m-%d %H:%M:%S.%%06u", &tm);
+  snprintf(buf, size, fmt, (unsigned)(usec % 1000000));
+}
+
+/**
+ * Read the encoding and write the devices present in each cycle.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int decode(FILE *in, FILE *out) {
+  presence_t p;
+  device_t *d;
+  uint32_t magic;
+  char time_str[64];
+  size_t i;
+  int tag, rc = EXIT_SUCCESS;
+
+  if (1 != fread(&magic, sizeof(magic), 1, in) || magic != PRESENCE_MAGIC) {
+    syslog(LOG_ERR, "not a presence encoding");
+    return EXIT_FAILURE;
+  }
+
+  presence_init(&p);
+  fputs("time,bdaddr,class,rssi\n", out);
+
+  while ((tag = getc(in)) != EOF) {
+    if ((tag != 'C' && tag != 'E') || read_cycle(in, &p)) {
+      syslog(LOG_ERR, "bad or truncated cycle");
+      rc = EXIT_FAILURE;
+      break;
+    }
+
+    format_time(time_str, sizeof(time_str), p.time);
+    for (i = 0; i < p.cur->num_devices; ++i) {
+      d = &p.cur->devices[i];
+      fprintf(out, "%s,%02X:%02X:%02X:%02X:%02X:%02X,%02x%02x%02x,", time_str,
+          (int)(d->addr >> 40) & 0xff, (int)(d->addr >> 32) & 0xff,
+          (int)(d->addr >> 24) & 0xff, (int)(d->addr >> 16) & 0xff,
+          (int)(d->addr >> 8) & 0xff, (int)d->addr & 0xff,
+          d->dev_class[2], d->dev_class[1], d->dev_class[0]);
+      if (d->rssi != NO_RSSI)
+        fprintf(out, "%hhd", d->rssi);
+      fputc('\n', out);
+    }
+    next_cycle(&p);
+  }
+
+  presence_free(&p);
+  return rc;
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s --encode|--decode [--file=file]\n\n"
+    "Encode bluetrax_scan output as per-cycle arrivals, departures and RSSI\n"
+    "changes, or decode it to the devices present in each cycle.\n\n"
+    "--encode: read bluetrax_scan output and write the encoding\n"
+    "--decode: read the encoding and write time,bdaddr,class,rssi lines\n"
+    "--file file: name of file to read; if omitted, reads stdin\n"
+    "--help: displays this message\n", argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+  FILE *file = stdin;
+  int opt, mode = 0;
+
+  static struct option options[] =
+  {
+    {"encode", no_argument,       0, 'e'},
+    {"decode", no_argument,       0, 'd'},
+    {"file",   required_argument, 0, 'f'},
+    {"help",   no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while ((opt=getopt_long(argc, argv, "+edf:h", options, NULL)) != -1) {
+    switch (opt) {
+    case 'e':
+    case 'd':
+      mode = opt;
+      break;
+    case 'f':
+      file = fopen(optarg, "r");
+      if (file == NULL) {
+        perror("failed to open input file");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc || mode == 0) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  if (mode == 'e')
+    return encode(file, stdout);
+  return decode(file, stdout);
+}
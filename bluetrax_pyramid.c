@@ -0,0 +1,518 @@
+/*
+ * Multi-resolution counts for zoomable timelines.
+ *
+ * Builds a pyramid file for a file written by bluetrax_scan: for each of a
+ * few time resolutions (1s, 10s, 1m, 10m, 1h, 1d), an array of cells covering
+ * the whole days spanned by the capture, each with the number of detections in
+ * the cell and a HyperLogLog sketch of the devices detected. Finer levels get
+ * smaller sketches, since they see few devices per cell.
+ *
+ * The levels are stored as fixed size cells at fixed offsets, so a query just
+ * maps the file and reads the cells for its window, at the finest level that
+ * has no more than --cells cells in the window. Any window from a minute to a
+ * couple of years is answered from at most a few thousand cells.
+ *
+ * Queries write CSV: time,detections,uniques
+ * where time is the start of the cell, in seconds since the epoch, and uniques
+ * is the estimated number of distinct devices.
+ *
+ * With --coarsen, an existing pyramid is rewritten without its finer levels,
+ * which take most of the space, e.g. for old captures whose raw records are
+ * no longer kept. A dropped level has no cells, and queries use the finest
+ * level that is left instead.
+ */
+#include "bluetrax.h"
+#include "bluetrax_cursor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Identifies (and versions) the pyramid file format.
+ */
+#define PYRAMID_MAGIC 0x31505442 /* "BTP1" */
+
+#define NUM_LEVELS 6
+
+#define SECONDS_PER_DAY (24*3600)
+
+/**
+ * Records are read from the capture this many at a time.
+ */
+#define READ_BATCH_SIZE 1024
+
+/**
+ * Default maximum number of cells in a query.
+ */
+#define DEFAULT_MAX_CELLS 2000
+
+/**
+ * Resolution, in seconds, and log2 of the number of HyperLogLog registers for
+ * each level, from finest to coarsest. The relative error of the unique count
+ * is about 1.04 / sqrt(registers), but small counts are nearly exact.
+ */
+static const struct {
+  uint32_t resolution;
+  uint32_t hll_bits;
+} LEVELS[NUM_LEVELS] = {
+  { 1, 4 }, { 10, 6 }, { 60, 8 }, { 600, 8 }, { 3600, 10 }, { 86400, 10 }
+};
+
+/**
+ * Each cell is a uint32_t detection count followed by one byte per register.
+ */
+typedef struct {
+  uint32_t resolution;
+  uint32_t hll_bits;
+  uint64_t num_cells;   /* 0 if the level has been dropped by --coarsen */
+  uint64_t offset;      /* of the first cell, from the start of the file */
+} pyramid_level_t;
+
+typedef struct {
+  uint32_t        magic;
+  uint32_t        num_levels;
+  int64_t         origin;   /* start of the first cell in every level */
+  pyramid_level_t level[NUM_LEVELS];
+} pyramid_header_t;
+
+static size_t cell_size(const pyramid_level_t *level) {
+  return sizeof(uint32_t) + ((size_t)1 << level->hll_bits);
+}
+
+static unsigned char *cell_at(unsigned char *base, const pyramid_level_t *level,
+    uint64_t i) {
+  return base + level->offset + i * cell_size(level);
+}
+
+/**
+ * Lay out the levels for the whole days from first to last, in seconds since
+ * the epoch.
+ *
+ * @return size of the file
+ */
+static size_t layout(pyramid_header_t *header, int64_t first, int64_t last) {
+  int64_t span;
+  size_t offset = sizeof(pyramid_header_t);
+  long page = sysconf(_SC_PAGESIZE);
+  int l;
+
+  header->magic = PYRAMID_MAGIC;
+  header->num_levels = NUM_LEVELS;
+  header->origin = first - (first % SECONDS_PER_DAY + SECONDS_PER_DAY) %
+    SECONDS_PER_DAY;
+  span = (last - header->origin) / SECONDS_PER_DAY * SECONDS_PER_DAY +
+    SECONDS_PER_DAY;
+
+  for (l = 0; l < NUM_LEVELS; ++l) {
+    header->level[l].resolution = LEVELS[l].resolution;
+    header->level[l].hll_bits = LEVELS[l].hll_bits;
+    header->level[l].num_cells = span / LEVELS[l].resolution;
+    /* start each level on a page, so reading one level maps only that level */
+    offset = (offset + page - 1) / page * page;
+    header->level[l].offset = offset;
+    offset += header->level[l].num_cells * cell_size(&header->level[l]);
+  }
+
+  return offset;
+}
+
+/**
+ * Add a detection to the cells that cover it at every level.
+ */
+static void add_detection(unsigned char *base, pyramid_header_t *header,
+    int64_t t, bdaddr_t *bdaddr) {
+  pyramid_level_t *level;
+  unsigned char *cell;
+  uint64_t h = bluetrax_hash_bdaddr(bdaddr);
+  int l;
+
+  for (l = 0; l < NUM_LEVELS; ++l) {
+    level = &header->level[l];
+    cell = cell_at(base, level, (t - header->origin) / level->resolution);
+    ++*(uint32_t *)cell;
+    bluetrax_hll_add(cell + sizeof(uint32_t), level->hll_bits, h);
+  }
+}
+
+/**
+ * Build the pyramid for a capture file. It is written to a temporary file
+ * that then replaces the old pyramid, so queries never see a partial one.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int build_pyramid(char *capture_path, const char *pyramid_path) {
+  char tmp_path[FILENAME_MAX + 4];
+  bluetrax_cursor_t *cursor;
+  bluetrax_scan_record_t records[READ_BATCH_SIZE];
+  bdaddr_t *bdaddr;
+  pyramid_header_t header;
+  struct timeval end = { INT32_MAX, 0 };
+  unsigned char *base;
+  int64_t first, last, t;
+  size_t size;
+  int fd, i, n;
+
+  cursor = bluetrax_cursor_open(&capture_path, 1);
+  if (cursor == NULL) {
+    syslog(LOG_ERR, "%s: %m", capture_path);
+    return EXIT_FAILURE;
+  }
+  if (bluetrax_cursor_size(cursor) == 0) {
+    syslog(LOG_ERR, "%s: no records", capture_path);
+    bluetrax_cursor_close(cursor);
+    return EXIT_FAILURE;
+  }
+
+  /* the first and last records give the span */
+  if (bluetrax_cursor_seek(cursor, end) ||
+      1 != bluetrax_cursor_prev(cursor, records, 1)) {
+    syslog(LOG_ERR, "%s: %m", capture_path);
+    bluetrax_cursor_close(cursor);
+    return EXIT_FAILURE;
+  }
+  last = records[0].data.complete.time.tv_sec;
+  end.tv_sec = 0;
+  if (bluetrax_cursor_seek(cursor, end) ||
+      1 != bluetrax_cursor_next(cursor, records, 1)) {
+    syslog(LOG_ERR, "%s: %m", capture_path);
+    bluetrax_cursor_close(cursor);
+    return EXIT_FAILURE;
+  }
+  first = records[0].data.complete.time.tv_sec;
+  bluetrax_cursor_seek(cursor, end);
+
+  size = layout(&header, first, last);
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pyramid_path);
+  fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) < 0) {
+    syslog(LOG_ERR, "%s: %m", tmp_path);
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp_path);
+    }
+    bluetrax_cursor_close(cursor);
+    return EXIT_FAILURE;
+  }
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    syslog(LOG_ERR, "mmap: %m");
+    unlink(tmp_path);
+    bluetrax_cursor_close(cursor);
+    return EXIT_FAILURE;
+  }
+  memcpy(base, &header, sizeof(header));
+
+  while (0 < (n = bluetrax_cursor_next(cursor, records, READ_BATCH_SIZE))) {
+    for (i = 0; i < n; ++i) {
+      switch (records[i].type) {
+        case EVT_INQUIRY_RESULT:
+          bdaddr = &records[i].data.result.bdaddr;
+          break;
+        case EVT_INQUIRY_RESULT_WITH_RSSI:
+          bdaddr = &records[i].data.result_with_rssi.bdaddr;
+          break;
+        default:
+          continue;
+      }
+      /* out of order records outside the span of the first and last records
+       * are dropped */
+      t = records[i].data.complete.time.tv_sec;
+      if (t >= header.origin &&
+          t - header.origin < (int64_t)header.level[0].num_cells)
+        add_detection(base, &header, t, bdaddr);
+    }
+  }
+  bluetrax_cursor_close(cursor);
+
+  if (n < 0 || msync(base, size, MS_SYNC) < 0) {
+    syslog(LOG_ERR, "%s: %m", n < 0 ? capture_path : tmp_path);
+    munmap(base, size);
+    unlink(tmp_path);
+    return EXIT_FAILURE;
+  }
+  munmap(base, size);
+
+  if (0 != rename(tmp_path, pyramid_path)) {
+    syslog(LOG_ERR, "rename %s: %m", tmp_path);
+    unlink(tmp_path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Map a pyramid file and check its header.
+ *
+ * @return the mapping, with its size in size, or NULL on error
+ */
+static unsigned char *map_pyramid(const char *pyramid_path, size_t *size) {
+  pyramid_header_t *header;
+  pyramid_level_t *level;
+  unsigned char *base;
+  struct stat st;
+  int fd, l;
+
+  fd = open(pyramid_path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    syslog(LOG_ERR, "%s: %m", pyramid_path);
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+  if (st.st_size < sizeof(*header)) {
+    syslog(LOG_ERR, "%s: not a pyramid file", pyramid_path);
+    close(fd);
+    return NULL;
+  }
+  base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    syslog(LOG_ERR, "mmap: %m");
+    return NULL;
+  }
+
+  header = (pyramid_header_t *)base;
+  for (l = 0; l < NUM_LEVELS; ++l) {
+    level = &header->level[l];
+    if (header->magic != PYRAMID_MAGIC || header->num_levels != NUM_LEVELS ||
+        level->offset + level->num_cells * cell_size(level) > st.st_size)
+      break;
+  }
+  if (l < NUM_LEVELS || header->level[NUM_LEVELS - 1].num_cells == 0) {
+    syslog(LOG_ERR, "%s: not a pyramid file", pyramid_path);
+    munmap(base, st.st_size);
+    return NULL;
+  }
+
+  *size = st.st_size;
+  return base;
+}
+
+/**
+ * Write the cells that cover [start, end) at the finest level that needs no
+ * more than max_cells cells, of those that have not been dropped.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int query_pyramid(const char *pyramid_path, int64_t start, int64_t end,
+    uint64_t max_cells) {
+  pyramid_header_t *header;
+  pyramid_level_t *level;
+  unsigned char *base, *cell;
+  size_t size;
+  int64_t first, last, i;
+  int l;
+
+  base = map_pyramid(pyramid_path, &size);
+  if (base == NULL)
+    return EXIT_FAILURE;
+  header = (pyramid_header_t *)base;
+
+  for (l = 0; l < NUM_LEVELS - 1; ++l) {
+    if (header->level[l].num_cells > 0 &&
+        (end - start + header->level[l].resolution - 1) /
+        header->level[l].resolution <= max_cells)
+      break;
+  }
+  level = &header->level[l];
+
+  first = start - header->origin;
+  first = first < 0 ? 0 : first / level->resolution;
+  last = end - header->origin;
+  last = last < 0 ? 0 : (last + level->resolution - 1) / level->resolution;
+  if (last > level->num_cells)
+    last = level->num_cells;
+
+  puts("time,detections,uniques");
+  for (i = first; i < last; ++i) {
+    cell = cell_at(base, level, i);
+    printf("%lld,%u,%.0f\n",
+        (long long)(header->origin + i * level->resolution),
+        *(uint32_t *)cell, bluetrax_hll_estimate(cell + sizeof(uint32_t),
+          level->hll_bits));
+  }
+
+  munmap(base, size);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Rewrite a pyramid without the levels finer than min_resolution seconds; the
+ * coarsest level is always kept. As for build_pyramid, the new pyramid
+ * replaces the old one in one step.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int coarsen_pyramid(const char *pyramid_path, uint32_t min_resolution) {
+  char tmp_path[FILENAME_MAX + 4];
+  pyramid_header_t header, *old_header;
+  pyramid_level_t *level;
+  unsigned char *old_base, *base;
+  size_t old_size, size = sizeof(pyramid_header_t), level_size;
+  long page = sysconf(_SC_PAGESIZE);
+  int fd, l;
+
+  old_base = map_pyramid(pyramid_path, &old_size);
+  if (old_base == NULL)
+    return EXIT_FAILURE;
+  old_header = (pyramid_header_t *)old_base;
+
+  header = *old_header;
+  for (l = 0; l < NUM_LEVELS; ++l) {
+    level = &header.level[l];
+    if (level->resolution < min_resolution && l < NUM_LEVELS - 1)
+      level->num_cells = 0;
+    size = (size + page - 1) / page * page;
+    level->offset = size;
+    size += level->num_cells * cell_size(level);
+  }
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pyramid_path);
+  fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, size) < 0) {
+    syslog(LOG_ERR, "%s: %m", tmp_path);
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp_path);
+    }
+    munmap(old_base, old_size);
+    return EXIT_FAILURE;
+  }
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    syslog(LOG_ERR, "mmap: %m");
+    unlink(tmp_path);
+    munmap(old_base, old_size);
+    return EXIT_FAILURE;
+  }
+
+  memcpy(base, &header, sizeof(header));
+  for (l = 0; l < NUM_LEVELS; ++l) {
+    level_size = header.level[l].num_cells * cell_size(&header.level[l]);
+    memcpy(base + header.level[l].offset,
+        old_base + old_header->level[l].offset, level_size);
+  }
+  munmap(old_base, old_size);
+
+  if (msync(base, size, MS_SYNC) < 0) {
+    syslog(LOG_ERR, "%s: %m", tmp_path);
+    munmap(base, size);
+    unlink(tmp_path);
+    return EXIT_FAILURE;
+  }
+  munmap(base, size);
+
+  if (0 != rename(tmp_path, pyramid_path)) {
+    syslog(LOG_ERR, "rename %s: %m", tmp_path);
+    unlink(tmp_path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s [options] --file=capture\n\n"
+    "Build a pyramid of detection and unique device counts for a capture,\n"
+    "or, with --query, write the counts for a window.\n\n"
+    "--file file: capture written by bluetrax_scan\n"
+    "--pyramid file: pyramid file; default is the capture name plus .pyramid\n"
+    "--query: write the counts for a window instead of building the pyramid\n"
+    "--coarsen s: rewrite the pyramid without the levels finer than s\n"
+    "  seconds, instead of building it\n"
+    "--start t: start of the window, in seconds since the epoch; default 0\n"
+    "--end t: end of the window, in seconds since the epoch; default is the\n"
+    "  current time\n"
+    "--cells n: use the finest level with at most n cells in the window;\n"
+    "  default %d\n"
+    "--help: displays this message\n", argv[0], DEFAULT_MAX_CELLS);
+}
+
+int main(int argc, char **argv)
+{
+  char *capture_path = NULL, *pyramid_path = NULL;
+  char default_path[FILENAME_MAX];
+  int64_t start = 0, end = time(NULL);
+  long max_cells = DEFAULT_MAX_CELLS, coarsen = 0;
+  int opt, query = 0;
+
+  static struct option options[] =
+  {
+    {"file",    required_argument, 0, 'f'},
+    {"pyramid", required_argument, 0, 'p'},
+    {"query",   no_argument,       0, 'q'},
+    {"start",   required_argument, 0, 's'},
+    {"end",     required_argument, 0, 'e'},
+    {"cells",   required_argument, 0, 'c'},
+    {"coarsen", required_argument, 0, 'C'},
+    {"help",    no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while ((opt=getopt_long(argc, argv, "+f:p:qs:e:c:C:h", options, NULL)) != -1) {
+    switch (opt) {
+    case 'f':
+      capture_path = optarg;
+      break;
+    case 'p':
+      pyramid_path = optarg;
+      break;
+    case 'q':
+      query = 1;
+      break;
+    case 's':
+      start = atoll(optarg);
+      break;
+    case 'e':
+      end = atoll(optarg);
+      break;
+    case 'c':
+      max_cells = atol(optarg);
+      if (max_cells <= 0) {
+        fprintf(stderr, "bad number of cells: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'C':
+      coarsen = atol(optarg);
+      if (coarsen <= 0) {
+        fprintf(stderr, "bad resolution: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc || (capture_path == NULL && pyramid_path == NULL) ||
+      (!query && !coarsen && capture_path == NULL) || (query && coarsen)) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  if (pyramid_path == NULL) {
+    snprintf(default_path, sizeof(default_path), "%s.pyramid", capture_path);
+    pyramid_path = default_path;
+  }
+
+  if (query)
+    return query_pyramid(pyramid_path, start, end, max_cells);
+  if (coarsen)
+    return coarsen_pyramid(pyramid_path, coarsen);
+  return build_pyramid(capture_path, pyramid_path);
+}
@@ -0,0 +1,551 @@
+/*
+ * Counts of detections and distinct devices per time bucket over a set of
+ * capture files, e.g. all of the files for a sensor, or for a site; this is
+ * for dashboards that ask for the same counts every few seconds.
+ *
+ * Output is CSV, as for bluetrax_pyramid --query: time,detections,uniques
+ * where time is the start of the bucket, in seconds since the epoch, and
+ * uniques is the estimated number of distinct devices. Buckets are aligned to
+ * multiples of the bucket size since the epoch.
+ *
+ * Each file is a segment of the data, with its own partial result: the
+ * detection count and a HyperLogLog sketch of the devices for every bucket in
+ * the file. The partials are merged for the buckets in the window, which is
+ * why the unique counts are estimates; counts of up to a few dozen devices are
+ * nearly exact.
+ *
+ * With --cache, the partials are kept in a directory, keyed by a fingerprint
+ * of the query (the bucket size and the sketch size; not the window, which
+ * changes with every refresh) and the identity of the file (its device and
+ * inode). A later query with the same fingerprint uses the cached partial if
+ * the file has not changed. If the file has only grown, as the file that the
+ * scan or collector is writing does, it reads just the new records and adds
+ * them to the partial. A file that is replaced (e.g. renamed over by
+ * compaction or retention) has a new identity, so it gets a new partial, and
+ * new files, such as late backfill, just add new partials. So a repeated query
+ * takes time in proportion to the data added since the last one, plus the
+ * cells in its window.
+ *
+ * Partials are replaced in one step (rename), so queries can share a cache
+ * directory. Partials for files that no longer exist are never used again;
+ * entries can be removed at any time, e.g. those not used for a week with
+ *   find dir -atime +7 -delete
+ */
+#include "bluetrax.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Identifies (and versions) the format of the partials in the cache.
+ */
+#define PARTIAL_MAGIC 0x31515442 /* "BTQ1" */
+
+/**
+ * log2 of the number of HyperLogLog registers per bucket.
+ */
+#define HLL_BITS 8
+
+/**
+ * Each cell is a uint32_t detection count followed by one byte per register.
+ */
+#define CELL_SIZE (sizeof(uint32_t) + (1 << HLL_BITS))
+
+/**
+ * Number of bytes before the end of what a partial covers that are kept with
+ * it, to check that a file that has grown has only been appended to.
+ */
+#define TAIL_SIZE 32
+
+#define DEFAULT_BUCKET 60
+
+/**
+ * Most buckets that one file's records can span; records with times that are
+ * so far from the others that they would make it span more are dropped.
+ */
+#define MAX_CELLS (1 << 20)
+
+/**
+ * Header of a partial in the cache; the cells follow it.
+ */
+typedef struct {
+  uint32_t      magic;
+  uint32_t      bucket;
+  uint32_t      hll_bits;
+  uint32_t      tail_size;
+  uint64_t      dev;
+  uint64_t      ino;
+  uint64_t      offset;     /* of the end of the last record counted */
+  int64_t       first;      /* bucket number of the first cell */
+  uint64_t      num_cells;
+  unsigned char tail[TAIL_SIZE];
+} partial_header_t;
+
+/**
+ * A partial result for one file. The cells are either in the mapped cache
+ * entry, if the file has not changed, or on the heap.
+ */
+typedef struct {
+  partial_header_t header;
+  unsigned char   *cells;
+  uint64_t         max_cells;  /* space on the heap, in cells */
+  void            *map;        /* mapped cache entry, or NULL */
+  size_t           map_size;
+} partial_t;
+
+/**
+ * Bucket number of a time; buckets are aligned to the epoch.
+ */
+static int64_t bucket_of(int64_t t, uint32_t bucket) {
+  return t >= 0 ? t / bucket : -((-t + bucket - 1) / bucket);
+}
+
+/**
+ * Move the cells of a partial to the heap, so they can be changed.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int unmap_partial(partial_t *partial) {
+  unsigned char *cells;
+
+  if (partial->map == NULL)
+    return 0;
+  cells = malloc(partial->header.num_cells * CELL_SIZE + 1);
+  if (cells == NULL)
+    return -1;
+  memcpy(cells, partial->cells, partial->header.num_cells * CELL_SIZE);
+  munmap(partial->map, partial->map_size);
+  partial->map = NULL;
+  partial->cells = cells;
+  partial->max_cells = partial->header.num_cells;
+  return 0;
+}
+
+/**
+ * The cell for bucket b, making room for it if need be.
+ *
+ * @return NULL on error, with errno set (ERANGE if b is too far from the
+ *         other buckets)
+ */
+static unsigned char *partial_cell(partial_t *partial, int64_t b) {
+  partial_header_t *h = &partial->header;
+  uint64_t grow, max_cells;
+  unsigned char *cells;
+
+  if (h->num_cells > 0 && (b - h->first >= MAX_CELLS ||
+        (b < h->first && h->num_cells + (h->first - b) > MAX_CELLS))) {
+    errno = ERANGE;
+    return NULL;
+  }
+
+  if (h->num_cells == 0) {
+    h->first = b;
+  } else if (b < h->first) {
+    /* out of order records are rare, so make just enough room */
+    grow = h->first - b;
+    cells = calloc(h->num_cells + grow, CELL_SIZE);
+    if (cells == NULL)
+      return NULL;
+    memcpy(cells + grow * CELL_SIZE, partial->cells, h->num_cells * CELL_SIZE);
+    free(partial->cells);
+    partial->cells = cells;
+    partial->max_cells = h->num_cells + grow;
+    h->num_cells += grow;
+    h->first = b;
+  }
+
+  if (b - h->first >= (int64_t)h->num_cells) {
+    if (b - h->first >= (int64_t)partial->max_cells) {
+      max_cells = 2 * partial->max_cells;
+      if (max_cells < (uint64_t)(b - h->first + 1))
+        max_cells = b - h->first + 1;
+      cells = realloc(partial->cells, max_cells * CELL_SIZE);
+      if (cells == NULL)
+        return NULL;
+      partial->cells = cells;
+      partial->max_cells = max_cells;
+    }
+    memset(partial->cells + h->num_cells * CELL_SIZE, 0,
+        (b - h->first + 1 - h->num_cells) * CELL_SIZE);
+    h->num_cells = b - h->first + 1;
+  }
+
+  return partial->cells + (b - h->first) * CELL_SIZE;
+}
+
+/**
+ * Add the records in a file from the partial's offset on to the partial.
+ * A partial record at the end is left for next time.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int extend_partial(const char *path, partial_t *partial) {
+  bluetrax_scan_record_t record;
+  unsigned char *cell;
+  bdaddr_t *bdaddr;
+  unsigned long dropped = 0;
+  FILE *file;
+  int rc;
+
+  file = fopen(path, "r");
+  if (file == NULL || fseeko(file, partial->header.offset, SEEK_SET)) {
+    syslog(LOG_ERR, "%s: %m", path);
+    if (file)
+      fclose(file);
+    return -1;
+  }
+
+  while (1 == (rc = bluetrax_read_scan_record(file, &record))) {
+    partial->header.offset = ftello(file);
+    switch (record.type) {
+      case EVT_INQUIRY_RESULT:
+        bdaddr = &record.data.result.bdaddr;
+        break;
+      case EVT_INQUIRY_RESULT_WITH_RSSI:
+        bdaddr = &record.data.result_with_rssi.bdaddr;
+        break;
+      default:
+        continue;
+    }
+    cell = partial_cell(partial, bucket_of(record.data.complete.time.tv_sec,
+          partial->header.bucket));
+    if (cell == NULL && errno == ERANGE) {
+      ++dropped;
+      continue;
+    }
+    if (cell == NULL) {
+      syslog(LOG_ERR, "out of memory");
+      fclose(file);
+      return -1;
+    }
+    ++*(uint32_t *)cell;
+    bluetrax_hll_add(cell + sizeof(uint32_t), HLL_BITS,
+        bluetrax_hash_bdaddr(bdaddr));
+  }
+  fclose(file);
+
+  if (dropped)
+    syslog(LOG_WARNING, "%s: dropped %lu records with times far from the "
+        "others", path, dropped);
+  if (rc < 0) {
+    syslog(LOG_ERR, "%s: unknown record type at offset %llu", path,
+        (unsigned long long)partial->header.offset);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Read the bytes just before offset in a file.
+ *
+ * @return number of bytes read (fewer than TAIL_SIZE only at the start of
+ *         the file); -1 on error
+ */
+static int read_tail(int fd, uint64_t offset, unsigned char *tail) {
+  size_t size = offset < TAIL_SIZE ? offset : TAIL_SIZE;
+
+  if (size > 0 && (ssize_t)size != pread(fd, tail, size, offset - size))
+    return -1;
+  return size;
+}
+
+/**
+ * Map the cached partial for a file, if it is still good: the same
+ * fingerprint and file, and the file still has the bytes that the partial
+ * ends with.
+ *
+ * @return 0 if it was mapped; -1 if not
+ */
+static int map_cached(const char *cache_path, int fd, struct stat *st,
+    uint32_t bucket, partial_t *partial) {
+  partial_header_t *h;
+  unsigned char tail[TAIL_SIZE];
+  struct stat cache_st;
+  void *map;
+  int cache_fd;
+
+  cache_fd = open(cache_path, O_RDONLY);
+  if (cache_fd < 0)
+    return -1;
+  if (fstat(cache_fd, &cache_st) ||
+      cache_st.st_size < (off_t)sizeof(partial_header_t)) {
+    close(cache_fd);
+    return -1;
+  }
+  map = mmap(NULL, cache_st.st_size, PROT_READ, MAP_SHARED, cache_fd, 0);
+  close(cache_fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  h = map;
+  if (h->magic != PARTIAL_MAGIC || h->bucket != bucket ||
+      h->hll_bits != HLL_BITS || h->dev != (uint64_t)st->st_dev ||
+      h->ino != (uint64_t)st->st_ino ||
+      h->offset > (uint64_t)st->st_size ||
+      cache_st.st_size != (off_t)(sizeof(*h) + h->num_cells * CELL_SIZE) ||
+      read_tail(fd, h->offset, tail) != (int)h->tail_size ||
+      memcmp(tail, h->tail, h->tail_size)) {
+    munmap(map, cache_st.st_size);
+    return -1;
+  }
+
+  partial->header = *h;
+  partial->cells = (unsigned char *)map + sizeof(*h);
+  partial->map = map;
+  partial->map_size = cache_st.st_size;
+  return 0;
+}
+
+/**
+ * Write a partial to the cache, replacing the old one in one step.
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int write_cached(const char *cache_path, partial_t *partial) {
+  char tmp_path[PATH_MAX + 16];
+  FILE *file;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", cache_path, (int)getpid());
+  file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    syslog(LOG_ERR, "%s: %m", tmp_path);
+    return -1;
+  }
+  if (1 != fwrite(&partial->header, sizeof(partial->header), 1, file) ||
+      partial->header.num_cells != fwrite(partial->cells, CELL_SIZE,
+        partial->header.num_cells, file) ||
+      fclose(file)) {
+    syslog(LOG_ERR, "%s: %m", tmp_path);
+    unlink(tmp_path);
+    return -1;
+  }
+  if (rename(tmp_path, cache_path)) {
+    syslog(LOG_ERR, "rename %s: %m", tmp_path);
+    unlink(tmp_path);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Get the partial for a file: from the cache if it is there and the file
+ * has not changed; otherwise by reading the file, or the part that has been
+ * added since the cached partial.
+ *
+ * @param cache_dir NULL if not caching
+ *
+ * @return 0 if no errors; -1 on error
+ */
+static int get_partial(const char *path, const char *cache_dir,
+    uint32_t bucket, partial_t *partial) {
+  char cache_path[PATH_MAX];
+  struct stat st;
+  uint64_t offset;
+  int fd, rc;
+
+  bzero(partial, sizeof(*partial));
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) {
+    syslog(LOG_ERR, "%s: %m", path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  if (cache_dir) {
+    /* the fingerprint is the bucket size and the format, which includes the
+     * sketch size */
+    snprintf(cache_path, sizeof(cache_path), "%s/%08x-%u-%llx-%llx",
+        cache_dir, PARTIAL_MAGIC, bucket, (unsigned long long)st.st_dev,
+        (unsigned long long)st.st_ino);
+    if (0 == map_cached(cache_path, fd, &st, bucket, partial) &&
+        partial->header.offset == (uint64_t)st.st_size) {
+      close(fd);
+      return 0;
+    }
+  }
+
+  if (partial->map == NULL) {
+    partial->header.magic = PARTIAL_MAGIC;
+    partial->header.bucket = bucket;
+    partial->header.hll_bits = HLL_BITS;
+    partial->header.dev = st.st_dev;
+    partial->header.ino = st.st_ino;
+  }
+  offset = partial->header.offset;
+  if (unmap_partial(partial) || extend_partial(path, partial)) {
+    close(fd);
+    return -1;
+  }
+
+  /* if the partial can't be cached, the answer is still good */
+  if (cache_dir && partial->header.offset != offset) {
+    rc = read_tail(fd, partial->header.offset, partial->header.tail);
+    if (rc >= 0) {
+      partial->header.tail_size = rc;
+      write_cached(cache_path, partial);
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+static void free_partial(partial_t *partial) {
+  if (partial->map)
+    munmap(partial->map, partial->map_size);
+  else
+    free(partial->cells);
+}
+
+/**
+ * Merge the partials for the buckets from first up to last, and write the
+ * counts.
+ *
+ * @return EXIT_SUCCESS if no errors
+ */
+static int write_counts(partial_t *partials, int num_partials,
+    uint32_t bucket, int64_t first, int64_t last) {
+  partial_header_t *h;
+  unsigned char *merged, *in, *out;
+  int64_t b, from, to;
+  int i, r;
+
+  if (last <= first) {
+    puts("time,detections,uniques");
+    return EXIT_SUCCESS;
+  }
+  merged = calloc(last - first, CELL_SIZE);
+  if (merged == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < num_partials; ++i) {
+    h = &partials[i].header;
+    from = h->first > first ? h->first : first;
+    to = h->first + (int64_t)h->num_cells < last ?
+      h->first + (int64_t)h->num_cells : last;
+    for (b = from; b < to; ++b) {
+      in = partials[i].cells + (b - h->first) * CELL_SIZE;
+      out = merged + (b - first) * CELL_SIZE;
+      *(uint32_t *)out += *(uint32_t *)in;
+      for (r = sizeof(uint32_t); r < (int)CELL_SIZE; ++r)
+        if (out[r] < in[r])
+          out[r] = in[r];
+    }
+  }
+
+  puts("time,detections,uniques");
+  for (b = first; b < last; ++b) {
+    out = merged + (b - first) * CELL_SIZE;
+    printf("%lld,%u,%.0f\n", (long long)(b * bucket), *(uint32_t *)out,
+        bluetrax_hll_estimate(out + sizeof(uint32_t), HLL_BITS));
+  }
+  free(merged);
+  return EXIT_SUCCESS;
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s [options] file...\n\n"
+    "Write detection and unique device counts per time bucket for a set of\n"
+    "files written by bluetrax_scan.\n\n"
+    "--bucket s: bucket size, in seconds; default %d\n"
+    "--start t: start of the window, in seconds since the epoch\n"
+    "--end t: end of the window, in seconds since the epoch\n"
+    "  (the window is limited to the buckets with records)\n"
+    "--cache dir: keep the counts for each file in dir, so the next query\n"
+    "  only has to read what has been added since\n"
+    "--help: displays this message\n", argv[0], DEFAULT_BUCKET);
+}
+
+int main(int argc, char **argv)
+{
+  const char *cache_dir = NULL;
+  partial_t *partials;
+  int64_t start = INT64_MIN, end = INT64_MAX, first, last;
+  long bucket = DEFAULT_BUCKET;
+  int opt, num_partials, i, status;
+
+  static struct option options[] =
+  {
+    {"bucket", required_argument, 0, 'b'},
+    {"start",  required_argument, 0, 's'},
+    {"end",    required_argument, 0, 'e'},
+    {"cache",  required_argument, 0, 'c'},
+    {"help",   no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  while ((opt=getopt_long(argc, argv, "+b:s:e:c:h", options, NULL)) != -1) {
+    switch (opt) {
+    case 'b':
+      bucket = atol(optarg);
+      if (bucket <= 0) {
+        fprintf(stderr, "bad bucket size: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 's':
+      start = atoll(optarg);
+      break;
+    case 'e':
+      end = atoll(optarg);
+      break;
+    case 'c':
+      cache_dir = optarg;
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind == argc) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  num_partials = argc - optind;
+  partials = calloc(num_partials, sizeof(partial_t));
+  if (partials == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  first = INT64_MAX;
+  last = INT64_MIN;
+  for (i = 0; i < num_partials; ++i) {
+    if (get_partial(argv[optind + i], cache_dir, bucket, &partials[i]))
+      exit(EXIT_FAILURE);
+    if (partials[i].header.num_cells == 0)
+      continue;
+    if (partials[i].header.first < first)
+      first = partials[i].header.first;
+    if (partials[i].header.first + (int64_t)partials[i].header.num_cells > last)
+      last = partials[i].header.first + partials[i].header.num_cells;
+  }
+
+  /* the window is limited to the buckets with records */
+  if (start != INT64_MIN && bucket_of(start, bucket) > first)
+    first = bucket_of(start, bucket);
+  if (end != INT64_MAX && bucket_of(end - 1, bucket) + 1 < last)
+    last = bucket_of(end - 1, bucket) + 1;
+
+  status = write_counts(partials, num_partials, bucket, first, last);
+  for (i = 0; i < num_partials; ++i)
+    free_partial(&partials[i]);
+  free(partials);
+  return status;
+}
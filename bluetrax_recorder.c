@@ -0,0 +1,317 @@
+#include "bluetrax_recorder.h"
+#include "bluetrax_log.h"
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/hci.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Number of frames the ring holds; must be a power of 2.
+ */
+#define RECORDER_SIZE 4096
+
+/**
+ * Dumps are formatted into a buffer of this size on the stack, and written
+ * out whenever it fills up.
+ */
+#define DUMP_BUFFER_SIZE 4096
+
+typedef struct {
+  int64_t  received;    /* nanoseconds since the epoch */
+  int64_t  tstamp;      /* microseconds since the epoch */
+  int64_t  dispatch;    /* nanoseconds; -1 until the frame has been handled */
+  int64_t  write;       /* nanoseconds */
+  uint16_t len;
+  uint8_t  evt;         /* 0 if not an event packet */
+  uint8_t  source;
+} recorder_entry_t;
+
+static recorder_entry_t ring[RECORDER_SIZE];
+static unsigned long recorded;            /* frames recorded so far */
+static unsigned long last_dump = ULONG_MAX; /* recorded at the last dump */
+static char dump_path[PATH_MAX];
+static struct timespec dispatch_start;  /* of the last frame recorded */
+static int64_t last_progress;           /* monotonic nanoseconds; 0 if waiting */
+static int watchdog_stall_sec;
+
+static const struct {
+  int         signo;
+  const char *name;
+} fatal_signals[] = {
+  { SIGSEGV, "SIGSEGV" },
+  { SIGBUS, "SIGBUS" },
+  { SIGILL, "SIGILL" },
+  { SIGFPE, "SIGFPE" },
+  { SIGABRT, "SIGABRT" },
+};
+
+void bluetrax_recorder_frame(const struct timespec *received,
+    struct timeval tstamp, const unsigned char *buf, int len, int source) {
+  unsigned long n = __atomic_load_n(&recorded, __ATOMIC_RELAXED);
+  recorder_entry_t *entry = &ring[n & (RECORDER_SIZE - 1)];
+
+  entry->received = (int64_t)received->tv_sec * 1000000000 +
+    received->tv_nsec;
+  entry->tstamp = (int64_t)tstamp.tv_sec * 1000000 + tstamp.tv_usec;
+  entry->dispatch = -1;
+  entry->write = 0;
+  entry->len = len;
+  entry->evt = len > 1 && buf[0] == HCI_EVENT_PKT ? buf[1] : 0;
+  entry->source = source;
+  __atomic_store_n(&recorded, n + 1, __ATOMIC_RELEASE);
+
+  clock_gettime(CLOCK_MONOTONIC, &dispatch_start);
+  __atomic_store_n(&last_progress, (int64_t)dispatch_start.tv_sec *
+      1000000000 + dispatch_start.tv_nsec, __ATOMIC_RELAXED);
+}
+
+void bluetrax_recorder_dispatched(void) {
+  unsigned long n = __atomic_load_n(&recorded, __ATOMIC_RELAXED);
+  struct timespec now;
+
+  if (n == 0)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ring[(n - 1) & (RECORDER_SIZE - 1)].dispatch =
+    (int64_t)(now.tv_sec - dispatch_start.tv_sec) * 1000000000 +
+    (now.tv_nsec - dispatch_start.tv_nsec);
+  __atomic_store_n(&last_progress, (int64_t)now.tv_sec * 1000000000 +
+      now.tv_nsec, __ATOMIC_RELAXED);
+}
+
+void bluetrax_recorder_write(long write_nsec) {
+  unsigned long n = __atomic_load_n(&recorded, __ATOMIC_RELAXED);
+
+  if (n > 0)
+    ring[(n - 1) & (RECORDER_SIZE - 1)].write += write_nsec;
+  bluetrax_recorder_heartbeat();
+}
+
+void bluetrax_recorder_heartbeat(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  __atomic_store_n(&last_progress, (int64_t)now.tv_sec * 1000000000 +
+      now.tv_nsec, __ATOMIC_RELAXED);
+}
+
+void bluetrax_recorder_waiting(void) {
+  __atomic_store_n(&last_progress, 0, __ATOMIC_RELAXED);
+}
+
+typedef struct {
+  int    fd;
+  size_t size;
+  char   data[DUMP_BUFFER_SIZE];
+} dump_buffer_t;
+
+static void flush_dump(dump_buffer_t *out) {
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < out->size) {
+    n = write(out->fd, out->data + done, out->size - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;   /* nowhere to report it */
+    done += n;
+  }
+  out->size = 0;
+}
+
+static void put_bytes(dump_buffer_t *out, const char *s, size_t len) {
+  size_t n;
+
+  while (len > 0) {
+    if (out->size == sizeof(out->data))
+      flush_dump(out);
+    n = sizeof(out->data) - out->size;
+    if (n > len)
+      n = len;
+    memcpy(out->data + out->size, s, n);
+    out->size += n;
+    s += n;
+    len -= n;
+  }
+}
+
+static void put_string(dump_buffer_t *out, const char *s) {
+  put_bytes(out, s, strlen(s));
+}
+
+/**
+ * Write value / 10^decimals, with exactly that many decimal places; snprintf
+ * is not async-signal-safe, so this does it by hand.
+ */
+static void put_fixed(dump_buffer_t *out, int64_t value, int decimals) {
+  char digits[24], *p = digits + sizeof(digits);
+  uint64_t v = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  int i;
+
+  for (i = 0; v > 0 || i <= decimals; ++i) {
+    if (i == decimals && decimals > 0)
+      *--p = '.';
+    *--p = '0' + v % 10;
+    v /= 10;
+  }
+  if (value < 0)
+    *--p = '-';
+  put_bytes(out, p, digits + sizeof(digits) - p);
+}
+
+void bluetrax_recorder_dump(const char *reason) {
+  dump_buffer_t out;
+  recorder_entry_t *entry;
+  unsigned long n, i, first;
+  struct timespec now;
+  int saved_errno = errno;
+
+  n = __atomic_load_n(&recorded, __ATOMIC_ACQUIRE);
+  if (dump_path[0] == 0 ||
+      __atomic_exchange_n(&last_dump, n, __ATOMIC_ACQ_REL) == n)
+    return;
+
+  /* not through a symlink, which someone else may have put in our way */
+  out.fd = open(dump_path,
+      O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (out.fd < 0) {
+    errno = saved_errno;
+    return;
+  }
+  out.size = 0;
+
+  first = n > RECORDER_SIZE ? n - RECORDER_SIZE : 0;
+  clock_gettime(CLOCK_REALTIME, &now);
+  put_string(&out, "# ");
+  put_fixed(&out, (int64_t)now.tv_sec * 1000000000 + now.tv_nsec, 9);
+  put_string(&out, " pid ");
+  put_fixed(&out, getpid(), 0);
+  put_string(&out, ": ");
+  put_string(&out, reason);
+  put_string(&out, "; last ");
+  put_fixed(&out, n - first, 0);
+  put_string(&out, " of ");
+  put_fixed(&out, n, 0);
+  put_string(&out, " frames\n"
+      "received,tstamp,evt,len,source,dispatch_us,write_us\n");
+
+  for (i = first; i < n; ++i) {
+    entry = &ring[i & (RECORDER_SIZE - 1)];
+    put_fixed(&out, entry->received, 9);
+    put_bytes(&out, ",", 1);
+    put_fixed(&out, entry->tstamp, 6);
+    put_bytes(&out, ",", 1);
+    put_fixed(&out, entry->evt, 0);
+    put_bytes(&out, ",", 1);
+    put_fixed(&out, entry->len, 0);
+    put_bytes(&out, ",", 1);
+    put_fixed(&out, entry->source, 0);
+    put_bytes(&out, ",", 1);
+    if (entry->dispatch >= 0)
+      put_fixed(&out, entry->dispatch, 3);
+    put_bytes(&out, ",", 1);
+    put_fixed(&out, entry->write, 3);
+    put_bytes(&out, "\n", 1);
+  }
+
+  flush_dump(&out);
+  close(out.fd);
+  errno = saved_errno;
+}
+
+static void handle_fatal_signal(int signo) {
+  size_t i;
+
+  for (i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); ++i)
+    if (fatal_signals[i].signo == signo)
+      bluetrax_recorder_dump(fatal_signals[i].name);
+
+  /* the handler has been reset, so this gets the usual core dump */
+  raise(signo);
+}
+
+static void handle_dump_signal(int signo) {
+  bluetrax_recorder_dump("SIGUSR1");
+}
+
+/**
+ * The watchdog thread: look for a stall a few times per stall_sec.
+ */
+static void *run_watchdog(void *arg) {
+  struct timespec interval, now;
+  int64_t progress, reported = 0, stall_nsec;
+  char reason[64];
+
+  stall_nsec = watchdog_stall_sec * 1000000000LL;
+  interval.tv_sec = watchdog_stall_sec / 4 > 0 ? watchdog_stall_sec / 4 : 1;
+  interval.tv_nsec = 0;
+
+  for (;;) {
+    nanosleep(&interval, NULL);
+    progress = __atomic_load_n(&last_progress, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (progress == 0 || progress == reported ||
+        (int64_t)now.tv_sec * 1000000000 + now.tv_nsec - progress < stall_nsec)
+      continue;
+    reported = progress;
+    snprintf(reason, sizeof(reason), "stall: no progress for %d s",
+        watchdog_stall_sec);
+    bluetrax_log(LOG_ERR, "capture has made no progress for %d s; dumping "
+        "flight recorder", watchdog_stall_sec);
+    bluetrax_recorder_dump(reason);
+  }
+
+  return NULL;
+}
+
+int bluetrax_recorder_watchdog(int stall_sec) {
+  pthread_t thread;
+  sigset_t all, saved;
+  int rc;
+
+  watchdog_stall_sec = stall_sec;
+
+  /* signals are for the capture, so the thread takes none */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  rc = pthread_create(&thread, NULL, run_watchdog, NULL);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (rc) {
+    errno = rc;
+    return -1;
+  }
+  pthread_detach(thread);
+
+  return 0;
+}
+
+int bluetrax_recorder_open(const char *path) {
+  struct sigaction sa;
+  size_t i;
+
+  if (strlen(path) >= sizeof(dump_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(dump_path, path);
+
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = handle_fatal_signal;
+  sa.sa_flags = SA_RESETHAND | SA_NODEFER;
+  for (i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); ++i)
+    if (sigaction(fatal_signals[i].signo, &sa, NULL))
+      return -1;
+
+  sa.sa_handler = handle_dump_signal;
+  sa.sa_flags = SA_RESTART;
+  return sigaction(SIGUSR1, &sa, NULL);
+}
@@ -0,0 +1,105 @@
+#ifndef _BLUETRAX_RECORDER_H_
+#define _BLUETRAX_RECORDER_H_
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+
+/**
+ * Flight recorder for the capture path: a ring in memory with the timing of
+ * the last few thousand frames, which is written out as a text timeline when
+ * something goes wrong, for a post-mortem.
+ *
+ * For each frame, it keeps the time that it was read from the socket, the
+ * kernel's timestamp, the event code and length, the adapter it came from,
+ * how long it took to handle, and how long was spent writing output while or
+ * just after handling it. Recording a frame takes no locks or system calls,
+ * just a couple of reads of the (vDSO) clock, so it is always on.
+ *
+ * Frames must be recorded from only one thread at a time (the one that
+ * handles them). A dump may happen at any time, from any thread or from a
+ * signal handler; it uses only async-signal-safe calls. An entry that is being
+ * overwritten while it is dumped may come out torn, but that is only ever the
+ * oldest one in the ring.
+ */
+
+/**
+ * Set the file that dumps are appended to, and dump on fatal signals (SIGSEGV,
+ * SIGBUS, SIGILL, SIGFPE and SIGABRT) and on request (SIGUSR1). The file is
+ * only created when there is something to dump, and is not written if it is a
+ * symlink.
+ *
+ * @param path to append dumps to; copied
+ *
+ * @return 0 if no errors; -1 on error, with errno set
+ */
+int bluetrax_recorder_open(const char *path);
+
+/**
+ * Record a frame that is about to be handled; call
+ * bluetrax_recorder_dispatched when it has been. A frame that is still being
+ * handled when the ring is dumped has no dispatch time.
+ *
+ * @param received when the frame was read, on the real time clock
+ *
+ * @param tstamp the kernel's timestamp for the frame
+ *
+ * @param buf the frame, starting with the packet type byte
+ *
+ * @param len number of bytes in buf
+ *
+ * @param source index of the adapter that the frame came from
+ */
+void bluetrax_recorder_frame(const struct timespec *received,
+    struct timeval tstamp, const unsigned char *buf, int len, int source);
+
+/**
+ * Record that the last frame has been handled.
+ */
+void bluetrax_recorder_dispatched(void);
+
+/**
+ * Add time spent writing output to the last frame recorded, whether it was
+ * spent while handling the frame or afterwards.
+ *
+ * @param write_nsec in nanoseconds
+ */
+void bluetrax_recorder_write(long write_nsec);
+
+/**
+ * Note that the capture has made progress, e.g. it has come back from waiting
+ * for frames. Recording a frame, its dispatch, or time spent writing output
+ * also counts as progress. The watchdog takes the capture to be stalled if it
+ * goes without progress for too long other than while it waits.
+ */
+void bluetrax_recorder_heartbeat(void);
+
+/**
+ * Note that the capture is about to wait for frames, which may take any time
+ * without being a stall; the next progress ends the wait.
+ */
+void bluetrax_recorder_waiting(void);
+
+/**
+ * Start a thread that dumps the ring, and logs an error, if the capture goes
+ * for stall_sec without progress, e.g. because writing output has blocked.
+ * This catches stalls that the capture can't see for itself; it dumps once per
+ * stall.
+ *
+ * @param stall_sec seconds without progress that make a stall
+ *
+ * @return 0 if no errors; -1 on error, with errno set
+ */
+int bluetrax_recorder_watchdog(int stall_sec);
+
+/**
+ * Append the frames in the ring to the file, after a header line with the
+ * reason. If no frames have been recorded since the last dump, this does
+ * nothing, so a failure can be dumped where it is found and again on the way
+ * out without repeating itself. This is async-signal-safe.
+ *
+ * @param reason for the header; should not contain newlines
+ */
+void bluetrax_recorder_dump(const char *reason);
+
+#endif /* guard */
@@ -2,6 +2,10 @@
  * A periodic Bluetooth scanner.
  *
  * Notes:
+ * - the scanning itself is done by the capture engine in bluetrax_capture.c,
+ *   which other programs can also use in process; this program writes its
+ *   records to a file or stdout, and handles signals, logging, the flight
+ *   recorder and re-execution
  * - the scanner records 'Inquiry Response' messages in binary format; use
  *   bluetrax_scan_unpack to get the results in text (CSV) format
  * - in order to be compliant with the Bluetooth specification [BTSPEC], there
@@ -12,64 +16,130 @@
  *   times the --length argument passed to the scanner (default 8)
  * - the first 'complete' record is a dummy that marks the start of the scan,
  *   according to gettimeofday; all other timings come from the HCI socket
+ * - with --replay, frames are read from a file written by 'hcidump -w' instead
+ *   of from the HCI socket; this is for testing the capture path without a
+ *   Bluetooth device, e.g. with tools/bluetrax_soak
+ * - on SIGHUP, the scanner reopens its --file, so the file can be rotated
+ * - on SIGUSR2, the scanner re-executes its binary, e.g. after an upgrade,
+ *   passing the HCI sockets and the output file to the new process, which
+ *   carries on with the scan; the adapters stay in periodic inquiry mode, and
+ *   frames that arrive in the meantime wait in the sockets
+ * - with more than one --device, each adapter is read by its own thread, and
+ *   the frames from all of them are merged in time order into one output
+ * - with --source, frames are read from a local datagram socket instead of
+ *   from the HCI socket; this is for stress testing the capture path with
+ *   synthetic traffic, e.g. from bluetrax_loadgen
+ * - log messages go through bluetrax_log, which ships them from a background
+ *   thread, so logging never blocks the capture; messages that can repeat for
+ *   every frame are rate limited
+ * - the timing of the last few thousand frames is kept in bluetrax_recorder's
+ *   ring, and written out to the --flight-recorder file if the scan stalls,
+ *   stops after an error, crashes, or is sent SIGUSR1
+ * - with --trace, the scanner times each batch of records that it writes out
+ *   (i.e. up to each flush), from the kernel's timestamp for its first frame
+ *   to when that frame was handled and to when the batch was written, and
+ *   logs histograms of those latencies every hour; it also writes a trace
+ *   record (see bluetrax_trace_t) after a batch now and then, which the
+ *   programs downstream stamp with their own hops
  *
  * References:
  *   [BTSPEC] Bluetooth Specification Version 4.0 (Core_V4.0.pdf)
  *
- * Based on:
- * http://www.wensley.org.uk/c/inq/inq.c
- * http://svn.assembla.com/svn/linuxmce/trunk/0710/VIPShared/PhoneDetection_Bluetooth_Linux.cpp
- * 
  * NB run hciconfig hci0 inqmode 1 to get RSSI data*/
 #include "bluetrax.h"
+#include "bluetrax_capture.h"
+#include "bluetrax_log.h"
+#include "bluetrax_recorder.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <signal.h>
-#include <syslog.h>
-#include <sys/time.h>
+#include <string.h>
+#include <time.h>
 
 #include <bluetooth/hci_lib.h>
 
 /**
- * Assume something has gone wrong if the select blocks for longer than this, in
- * seconds.
+ * The capture, for the signal handler.
  */
-#define SELECT_TIMEOUT 5*60
+static bluetrax_capture_t *capture = NULL;
 
 /**
- * Global flag to stop the loop in run_scan when we get a signal.
+ * Global flag to note that we have been asked to stop, so that a second
+ * request can exit straight away.
  */
-static int request_stop_scan = 0xdeadbeef;
+static int stop_requested = 0;
+
+/**
+ * Global flag to reopen the output file when we get a SIGHUP.
+ */
+static int request_reopen_output = 0;
+
+/**
+ * Global flag to re-execute the scanner when we get a SIGUSR2.
+ */
+static int request_reexec = 0;
+
+/**
+ * Environment variable through which the scanner passes its descriptors to
+ * the process that it re-executes; see reexec.
+ */
+#define INHERIT_ENV "BLUETRAX_SCAN_INHERIT"
+
+/**
+ * If the capture goes this long without progress other than waiting for
+ * frames, e.g. because writing the output has blocked, dump the flight
+ * recorder; see bluetrax_recorder_watchdog.
+ */
+#define STALL_TIMEOUT 60
+
+/**
+ * Name of the output file, or NULL if writing to stdout.
+ */
+static const char *out_path = NULL;
 
 static void handle_signal(int signo) {
-  if (request_stop_scan != 1) {
+  if (signo == SIGHUP) {
+    request_reopen_output = 1;
+    return;
+  }
+
+  if (signo == SIGUSR2) {
+    /* stop the loop, but leave the scan running for the next process */
+    if (!stop_requested) {
+      bluetrax_log_signal(LOG_NOTICE, "re-executing due to SIGUSR2");
+      request_reexec = 1;
+      stop_requested = 1;
+      if (capture)
+        bluetrax_capture_stop(capture);
+    }
+    return;
+  }
+
+  if (!stop_requested) {
     /* first signal: try to stop normally */
-    syslog(LOG_NOTICE, "stopping due to signal %d", signo);
-    request_stop_scan = 1;
+    bluetrax_log_signal(LOG_NOTICE, signo == SIGINT ?
+        "stopping due to SIGINT" : "stopping due to SIGTERM");
+    stop_requested = 1;
+    if (capture)
+      bluetrax_capture_stop(capture);
   } else {
     /* second signal: something went wrong; exit now */
-    syslog(LOG_ERR, "multiple stop requests; exiting after signal %d", signo);
+    bluetrax_log_signal(LOG_ERR, "multiple stop requests; exiting");
+    bluetrax_recorder_dump("multiple stop requests");
     exit(EXIT_FAILURE);
   }
 }
 
 /**
- * Send HCI command to exit periodic inquiry mode.
- */
-static void stop_scan(int dev_sd) {
-  if (hci_send_cmd(dev_sd,
-        OGF_LINK_CTL, OCF_EXIT_PERIODIC_INQUIRY, 0, NULL) < 0) {
-    syslog(LOG_ERR, "failed to exit periodic inquiry state: %m");
-  }
-}
-
-/**
- * Set up signal handling. Stop scan on SIGINT or SIGTERM.
+ * Set up signal handling. Stop scan on SIGINT or SIGTERM; reopen the output
+ * file on SIGHUP; re-execute on SIGUSR2.
  *
  * We have to block these signals until we get into pselect (see the pselect man
- * page for why).
+ * page for why); the capture unblocks them while it waits.
  *
  * @return true if no errors
  */
@@ -84,378 +154,196 @@ static int setup_signals() {
     0 == sigemptyset(&blockset) &&
     0 == sigaddset(&blockset, SIGINT) &&
     0 == sigaddset(&blockset, SIGTERM) &&
+    0 == sigaddset(&blockset, SIGHUP) &&
+    0 == sigaddset(&blockset, SIGUSR2) &&
     0 == sigprocmask(SIG_BLOCK, &blockset, NULL) &&
     0 == sigemptyset(&sa.sa_mask) &&
     0 == sigaction(SIGINT, &sa, NULL) &&
-    0 == sigaction(SIGTERM, &sa, NULL);
+    0 == sigaction(SIGTERM, &sa, NULL) &&
+    0 == sigaction(SIGHUP, &sa, NULL) &&
+    0 == sigaction(SIGUSR2, &sa, NULL);
 }
 
 /**
- * Record an EVT_INQUIRY_RESULT message.
- *
- * Writes a byte with value EVT_INQUIRY_RESULT and then a
- * bluetrax_inquiry_result_t structure (in binary format) to out_file.
- *
- * Reference: [BTSPEC, volume 2, section 7.7.2, page 716]
- *
- * @param out_file to write record to
- *
- * @param time that the message was received
- *
- * @param hdr the event header
- *
- * @param data all data after the header; length is at least hdr->plen 
- *
- * @return EXIT_SUCCESS if no errors
+ * Sink batch callback: write records to the output file, without flushing it.
  */
-static int handle_inquiry_result(FILE *out_file,
-    struct timeval time, hci_event_hdr *hdr, unsigned char *data)
+static int write_records(void *arg, const unsigned char *records, size_t size)
 {
-  int num_rsp, i;
-  inquiry_info *info;
-  bluetrax_inquiry_result_t record;
-
-  if (hdr->plen <= 0) {
-    syslog(LOG_ERR, "handle_inquiry_result: bad plen: plen=%hhd", hdr->plen);
-    return EXIT_FAILURE;
+  if (1 != fwrite(records, size, 1, (FILE *)arg)) {
+    bluetrax_log(LOG_ERR, "write_records: fwrite: %m");
+    return -1;
   }
-
-  /* note: we never seem to get num_rsp > 1 here, but handle it anyway */
-  num_rsp = data[0];
-  syslog(LOG_DEBUG, "handle_inquiry_result: num_rsp=%d", num_rsp);
-
-  /* sanity check */
-  if (hdr->plen != num_rsp * sizeof(inquiry_info) + 1) {
-    syslog(LOG_ERR, "handle_inquiry_result: bad plen: num_rsp=%d, plen=%hhd",
-        num_rsp, hdr->plen);
-    return EXIT_FAILURE;
-  }
-
-  record.time = time;
-  info = (inquiry_info *)(data + 1);
-  for (i = 0; i < num_rsp; ++i) {
-    bacpy(&record.bdaddr, &info[i].bdaddr);
-    memcpy(&record.dev_class, info[i].dev_class, sizeof(record.dev_class));
-
-    /* write the event type and then the event record */
-    if (EVT_INQUIRY_RESULT != fputc(EVT_INQUIRY_RESULT, out_file)) {
-      syslog(LOG_ERR, "handle_inquiry_result: fputc: %m");
-      return EXIT_FAILURE;
-    }
-    if (1 != fwrite(&record, sizeof(record), 1, out_file)) {
-      syslog(LOG_ERR, "handle_inquiry_result: fwrite: %m");
-      return EXIT_FAILURE;
-    }
-  }
-
-  return EXIT_SUCCESS;
+  return 0;
 }
 
 /**
- * Called by run_scan when we receive a complete EVT_INQUIRY_RESULT_WITH_RSSI
- * message.
- *
- * Writes a byte with value EVT_INQUIRY_RESULT_WITH_RSSI and then a
- * bluetrax_inquiry_result_with_rssi_t structure (in binary format) to out_file.
- *
- * Reference: [BTSPEC, volume 2, section 7.7.33, page 756]
- *
- * @param out_file to write record to
- *
- * @param time that the message was received
- *
- * @param hdr the event header
- *
- * @param data all data after the header; length is at least hdr->plen 
- *
- * @return EXIT_SUCCESS if no errors
+ * Sink flush callback: flush the output file.
  */
-static int handle_inquiry_result_with_rssi(FILE *out_file,
-    struct timeval time, hci_event_hdr *hdr, unsigned char *data)
-{
-  int num_rsp, i;
-  inquiry_info_with_rssi *info;
-  bluetrax_inquiry_result_with_rssi_t record;
-
-  if (hdr->plen <= 0) {
-    syslog(LOG_ERR, "handle_inquiry_result_with_rssi: bad plen: plen=%hhd",
-        hdr->plen);
-    return EXIT_FAILURE;
-  }
-
-  /* note: we never seem to get num_rsp > 1 here, but handle it anyway */
-  num_rsp = data[0];
-  syslog(LOG_DEBUG, "handle_inquiry_result_with_rssi: num_rsp=%d", num_rsp);
-
-  /* sanity check */
-  if (hdr->plen != num_rsp * sizeof(inquiry_info_with_rssi) + 1) {
-    syslog(LOG_ERR,
-        "handle_inquiry_result_with_rssi: bad plen: num_rsp=%d, plen=%hhd",
-        num_rsp, hdr->plen);
-    return EXIT_FAILURE;
+static int flush_records(void *arg) {
+  if (0 != fflush((FILE *)arg)) {
+    bluetrax_log(LOG_ERR, "flush_records: fflush: %m");
+    return -1;
   }
+  return 0;
+}
 
-  record.time = time;
-  info = (inquiry_info_with_rssi *)(data + 1);
-  for (i = 0; i < num_rsp; ++i) {
-    bacpy(&record.bdaddr, &info[i].bdaddr);
-    memcpy(&record.dev_class, info[i].dev_class, sizeof(record.dev_class));
-    record.rssi = info[i].rssi;
-
-    /* write the event type and then the event record */
-    if (EVT_INQUIRY_RESULT_WITH_RSSI !=
-        fputc(EVT_INQUIRY_RESULT_WITH_RSSI, out_file)) {
-      syslog(LOG_ERR, "handle_inquiry_result_with_rssi: fputc: %m");
-      return EXIT_FAILURE;
-    }
-    if (1 != fwrite(&record, sizeof(record), 1, out_file)) {
-      syslog(LOG_ERR, "handle_inquiry_result_with_rssi: fwrite: %m");
-      return EXIT_FAILURE;
-    }
+/**
+ * Sink poll callback: reopen the output file, if there is one, after a
+ * SIGHUP. To rotate the output file, rename it and then send SIGHUP; the
+ * scanner then starts a new file with the old name.
+ */
+static int reopen_output(void *arg) {
+  if (!request_reopen_output)
+    return 0;
+  request_reopen_output = 0;
+  bluetrax_log_reopen();
+
+  if (out_path == NULL)
+    return 0;
+
+  bluetrax_log(LOG_NOTICE, "reopening output file");
+  if (bluetrax_capture_flush(capture))
+    return -1;
+  if (freopen(out_path, "a", (FILE *)arg) == NULL) {
+    bluetrax_log(LOG_ERR, "failed to reopen output file: %m");
+    return -1;
   }
 
-  return EXIT_SUCCESS;
+  return 0;
 }
 
 /**
- * Write a byte with value EVT_INQUIRY_COMPLETE and then a
- * bluetrax_inquiry_complete_t structure (in binary format) to out_file.
+ * Path of this binary, read at startup; a re-exec runs whatever binary has
+ * been installed at this path since.
  */
-static int write_inquiry_complete(FILE *out_file,
-    bluetrax_inquiry_complete_t record)
+static char exe_path[PATH_MAX];
+
+/**
+ * Replace this process with a new one, running the binary at exe_path with the
+ * same arguments, e.g. after an upgrade. The sockets and the output file are
+ * passed on, with their numbers in INHERIT_ENV, along with the time on the
+ * monotonic clock, so the new process can log how long the handover took. The
+ * adapters stay in periodic inquiry mode, and frames that arrive before the
+ * new process is ready wait in the sockets.
+ *
+ * The output must already have been flushed.
+ *
+ * @return only if the exec failed, in which case the scan can carry on
+ */
+static void reexec(char **args, const char *log_path, FILE *out_file)
 {
-  if (EVT_INQUIRY_COMPLETE != fputc(EVT_INQUIRY_COMPLETE, out_file)) {
-    syslog(LOG_ERR, "handle_inquiry_complete: fputc: %m");
-    return EXIT_FAILURE;
+  char inherit[256];
+  struct timespec now;
+  int sds[BLUETRAX_CAPTURE_MAX_DEVICES], num_sds;
+  int fds[BLUETRAX_CAPTURE_MAX_DEVICES + 1], num_fds = 0, i, len, saved_errno;
+
+  num_sds = bluetrax_capture_sockets(capture, sds);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fds[num_fds++] = fileno(out_file);
+  len = snprintf(inherit, sizeof(inherit), "%lld:%d:",
+      (long long)now.tv_sec * 1000000000LL + now.tv_nsec, fds[0]);
+  for (i = 0; i < num_sds; ++i) {
+    fds[num_fds++] = sds[i];
+    len += snprintf(inherit + len, sizeof(inherit) - len, "%s%d",
+        i > 0 ? "," : "", sds[i]);
   }
-  if (1 != fwrite(&record, sizeof(record), 1, out_file)) {
-    syslog(LOG_ERR, "handle_inquiry_complete: fwrite: %m");
-    return EXIT_FAILURE;
+
+  for (i = 0; i < num_fds; ++i)
+    fcntl(fds[i], F_SETFD, 0);
+  if (exe_path[0] == 0) {
+    errno = ENOENT;
+  } else if (0 == setenv(INHERIT_ENV, inherit, 1)) {
+    /* messages still in the log ring would be lost */
+    bluetrax_log_close();
+    execv(exe_path, args);
   }
 
-  return EXIT_SUCCESS;
+  /* still here, so carry on as we were */
+  saved_errno = errno;
+  unsetenv(INHERIT_ENV);
+  for (i = 0; i < num_fds; ++i)
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  if (bluetrax_log_open(log_path))
+    bluetrax_log(LOG_ERR, "failed to reopen log file: %m");
+  errno = saved_errno;
+  bluetrax_log(LOG_ERR, "failed to re-exec %s: %m", exe_path);
 }
 
 /**
- * Called by run_scan when we receive a complete EVT_INQUIRY_COMPLETE message.
- *
- * Writes a byte with value EVT_INQUIRY_COMPLETE and then a
- * bluetrax_inquiry_complete_t structure (in binary format) to out_file.
- *
- * Reference: [BTSPEC, volume 2, section 7.7.1, page 715]
+ * Take the descriptors passed by reexec, if this process is the result of one.
  *
- * @param out_file to write record to
+ * @param out_fd set to the output file's descriptor
  *
- * @param time that the message was received
+ * @param sds set to the sockets' descriptors
  *
- * @param hdr the event header
+ * @param reexec_nsec set to the time of the re-exec on the monotonic clock
  *
- * @param data all data after the header; length is at least hdr->plen 
- *
- * @return EXIT_SUCCESS if no errors
+ * @return number of sockets; 0 if this is not a re-exec; -1 if INHERIT_ENV is
+ *         not valid
  */
-static int handle_inquiry_complete(FILE *out_file,
-    struct timeval time, hci_event_hdr *hdr, unsigned char *data)
+static int inherit_descriptors(int *out_fd, int *sds, long long *reexec_nsec)
 {
-  int rc;
-  bluetrax_inquiry_complete_t record;
-
-  syslog(LOG_DEBUG, "inquiry complete");
-
-  /* sanity check */
-  if (hdr->plen != 1) {
-    syslog(LOG_ERR, "handle_inquiry_complete: bad plen: plen=%hhd", hdr->plen);
-    return EXIT_FAILURE;
-  }
-
-  /* check for errors; abort the scan if we get one */
-  errno = bt_error(data[0]);
-  if (errno != 0) {
-    syslog(LOG_ERR, "handle_inquiry_complete: error: %m");
-    return EXIT_FAILURE;
-  }
-
-  record.time = time;
-
-  rc = write_inquiry_complete(out_file, record);
-
-  return rc;
+  const char *inherit = getenv(INHERIT_ENV);
+  char *end;
+  int num_sds = 0, i;
+
+  if (inherit == NULL)
+    return 0;
+
+  *reexec_nsec = strtoll(inherit, &end, 10);
+  if (*end++ != ':')
+    return -1;
+  *out_fd = strtol(end, &end, 10);
+  if (*end++ != ':')
+    return -1;
+  do {
+    if (num_sds == BLUETRAX_CAPTURE_MAX_DEVICES)
+      return -1;
+    sds[num_sds++] = strtol(end, &end, 10);
+  } while (*end++ == ',');
+  if (end[-1] != '\0')
+    return -1;
+
+  /* so they don't leak into anything that we run, e.g. with --replay=- */
+  if (fcntl(*out_fd, F_SETFD, FD_CLOEXEC) < 0)
+    return -1;
+  for (i = 0; i < num_sds; ++i)
+    if (fcntl(sds[i], F_SETFD, FD_CLOEXEC) < 0)
+      return -1;
+
+  unsetenv(INHERIT_ENV);
+  return num_sds;
 }
 
 /**
- * Set up the socket so that we get the message that we are interested in, and
- * put the device into periodic inquiry mode.
+ * Log that the scan has resumed after a re-exec, and how long it took.
  */
-static int start_scan(int dev_sd, int scan_length) {
-  int opt;
-  struct hci_filter flt;
-  periodic_inquiry_cp info_data;
-  periodic_inquiry_cp *info = &info_data;
-
-  opt = 1;
-  if (setsockopt(dev_sd, SOL_HCI, HCI_TIME_STAMP, &opt, sizeof(opt)) < 0) {
-    syslog(LOG_ERR, "failed to request data timestamps: %m");
-    return EXIT_FAILURE;
-  }
-
-  hci_filter_clear(&flt);
-  hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
-  hci_filter_set_event(EVT_INQUIRY_RESULT, &flt);
-  hci_filter_set_event(EVT_INQUIRY_RESULT_WITH_RSSI, &flt);
-  hci_filter_set_event(EVT_INQUIRY_COMPLETE, &flt);
-  if (setsockopt(dev_sd, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
-    syslog(LOG_ERR, "failed to set hci filter: %m");
-    return EXIT_FAILURE;
-  }
-
-  /* no limit on number of responses per scan */
-  info->num_rsp = 0x00;
-
-  /* use the global inquiry access code (GIAC), which has 0x338b9e as its lower
-   * address part (LAP) */
-  info->lap[0] = 0x33;
-  info->lap[1] = 0x8b;
-  info->lap[2] = 0x9e;
-
-  /* note: according to [BTSPEC, volume 2, section 7.1.3], we must have
-   *   max_period > min_period > length
-   * so we set these values to give us the shortest random delay between scans
-   * that is permitted by the specification
-   */
-  info->length = scan_length;
-  info->min_period = info->length + 1;
-  info->max_period = info->min_period + 1;
-
-  if (hci_send_cmd(dev_sd, OGF_LINK_CTL,
-        OCF_PERIODIC_INQUIRY, PERIODIC_INQUIRY_CP_SIZE, info) < 0)
-  {
-    syslog(LOG_ERR, "failed to request periodic inquiry: %m");
-    return EXIT_FAILURE;
-  }
+static void log_resumed(int num_sds, long long reexec_nsec) {
+  struct timespec now;
 
-  return EXIT_SUCCESS;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  bluetrax_log(LOG_NOTICE, "resumed scan on %d socket(s) after re-exec in "
+      "%.3f ms", num_sds,
+      ((long long)now.tv_sec * 1000000000LL + now.tv_nsec - reexec_nsec) / 1e6);
 }
 
 /**
- * The main select loop.
+ * Run the capture until it is stopped, re-executing if asked to.
  *
- * @param flush flush output to disk (out_file) after every message; if 0, flush
- *        only when scan completes
+ * @return EXIT_SUCCESS if no errors
  */
-static int run_scan(int dev_sd, int scan_length, int flush, FILE *out_file) {
-  int rc, len, flush_after_this_message;
-  fd_set readfds_master, readfds;
-  struct timespec select_timeout;
-  sigset_t emptyset;
-  unsigned char buf[HCI_MAX_FRAME_SIZE];
-  unsigned char control_buf[1024]; /* arbitrary */
-  struct iovec iov;
-  struct msghdr msg;
-  struct cmsghdr *cmsg;
-  struct timeval tstamp;
-  hci_event_hdr *hdr; 
-  
-  /* set up arguments for select */
-  FD_ZERO(&readfds_master);
-  FD_SET(dev_sd, &readfds_master);
-
-  select_timeout.tv_sec = SELECT_TIMEOUT;
-  select_timeout.tv_nsec = 0;
-
-  sigemptyset(&emptyset);
-
-  /* set up arguments for recvmsg */
-  iov.iov_base = &buf;
-  iov.iov_len = sizeof(buf);
-  bzero(&msg, sizeof(msg));
-  msg.msg_iov = &iov;
-  msg.msg_iovlen = 1;
-  msg.msg_control = &control_buf;
-  msg.msg_controllen = sizeof(control_buf);
-
-  request_stop_scan = 0;
-  while (!request_stop_scan)
-  {
-    memcpy(&readfds, &readfds_master, sizeof(readfds_master));
-    rc = pselect(dev_sd + 1, &readfds, NULL, NULL, &select_timeout, &emptyset);
-
-    if (rc < 0 && errno != EINTR) {
-      syslog(LOG_ERR, "select failed: %m");
-      return EXIT_FAILURE;
-    } else if (rc == 0) {
-      syslog(LOG_ERR, "select timed out");
+static int run_until_stopped(char **args, const char *log_path,
+    FILE *out_file)
+{
+  for (;;) {
+    if (bluetrax_capture_run(capture))
       return EXIT_FAILURE;
-    } else if (rc > 0) {
-      if (rc != 1)
-        syslog(LOG_ERR, "only one fd in set but rc > 1");
-
-      /* OK; some data is ready */
-      len = recvmsg(dev_sd, &msg, 0);
-      if (len < 0 && errno != EINTR) {
-        syslog(LOG_ERR, "recvmsg: %m");
-        return EXIT_FAILURE;
-      } else if (len > HCI_EVENT_HDR_SIZE) {
-        /* process the message header to get a high-precision timestamp */
-        bzero(&tstamp, sizeof(tstamp));
-        cmsg = CMSG_FIRSTHDR(&msg);
-        while (cmsg) {
-          if (cmsg->cmsg_type == HCI_CMSG_TSTAMP) {
-            tstamp = *((struct timeval *) CMSG_DATA(cmsg));
-          }
-          cmsg = CMSG_NXTHDR(&msg, cmsg);
-        }
-
-        /* process the message itself */
-        if (buf[0] == HCI_EVENT_PKT) {
-          hdr = (hci_event_hdr *)(buf + 1);
-          syslog(LOG_DEBUG, "HCI_EVENT_PKT: evt=%hhd, plen=%hhd",
-            hdr->evt, hdr->plen);
-
-          /* check that we got all the data; if not, just call recvmsg again */
-          if (len == 1 + HCI_EVENT_HDR_SIZE + hdr->plen) {
-            /* flush either after each message or upon completion of a scan */
-            flush_after_this_message = flush;
-
-            /* dispatch on event */
-            switch(hdr->evt) {
-              case EVT_INQUIRY_RESULT:
-                rc = handle_inquiry_result(out_file, tstamp, hdr, buf + 3);
-                break;
-              case EVT_INQUIRY_RESULT_WITH_RSSI:
-                rc = handle_inquiry_result_with_rssi(out_file, tstamp, hdr,
-                    buf + 3);
-                break;
-              case EVT_INQUIRY_COMPLETE:
-                flush_after_this_message = 1;
-                rc = handle_inquiry_complete(out_file, tstamp, hdr, buf + 3);
-                break;
-              default:
-                rc = EXIT_SUCCESS;
-                syslog(LOG_WARNING, "unknown evt=%hhd", hdr->evt);
-                break;
-            } 
-
-            /* check for message processing failure */
-            if (rc != EXIT_SUCCESS)
-              break;
-
-            if (flush_after_this_message) {
-              fflush(out_file);
-            }
-          } else {
-            /* this is not an error; recvmsg may have read part of a message,
-             * and if we call it again, it is clever enough get the rest */
-            syslog(LOG_DEBUG, "partial read from recvmsg: len=%d, plen=%hhd",
-              len, hdr->plen);
-          }
-        } else {
-          syslog(LOG_WARNING, "got non-HCI_EVENT_PKT: buf[0]=%hhd", buf[0]);
-        }
-      }
-    }
+    if (!request_reexec)
+      return EXIT_SUCCESS;
+    reexec(args, log_path, out_file);
+    request_reexec = 0;
+    stop_requested = 0;
   }
-
-  return EXIT_SUCCESS;
 }
 
 static void print_usage(char **argv) {
@@ -463,8 +351,30 @@ static void print_usage(char **argv) {
     "Usage: %s [options]\n\n"
     "--length n: length of each scan is approx 1.28*n seconds; default 8\n"
     "--truncate: when --file is specified, truncate it at startup\n"
+    "  (but not when re-executed on SIGUSR2)\n"
     "--file file: name of file to write to; if omitted, writes to stdout\n"
     "--flush: flush output buffer after each HCI message\n"
+    "--replay file: read frames from a file written by hcidump -w instead of\n"
+    "  from the Bluetooth device; use - for stdin\n"
+    "--speed x: replay at x times real time; 0 for as fast as possible;\n"
+    "  default 1\n"
+    "--loops n: replay the file n times; default 1\n"
+    "--device dev: scan with this adapter (e.g. hci1); repeat to scan with\n"
+    "  several adapters at once, up to 8; use all for all adapters that are\n"
+    "  up (the first 8); default is the first available adapter\n"
+    "--reorder-window ms: with several adapters, hold records back for this\n"
+    "  long to put them in time order; default 100\n"
+    "--source path: read frames from a local datagram socket bound at path,\n"
+    "  instead of from a Bluetooth device; see bluetrax_loadgen\n"
+    "--log-file file: append log messages to file instead of sending them to\n"
+    "  syslog; reopened on SIGHUP\n"
+    "--flight-recorder file: append the timing of the last frames to file if\n"
+    "  the scan stalls or fails, or on SIGUSR1; not if it is a symlink;\n"
+    "  default is the --file, or else the --log-file, with .flight on the\n"
+    "  end, or /var/run/bluetrax_scan.pid.flight\n"
+    "--trace s: time each batch of records, log histograms of the latencies\n"
+    "  every hour, and write a trace record after a batch every s seconds\n"
+    "  (0 for every batch), for the programs downstream to add their times to\n"
     "--verbose: log debugging and info messages\n"
     "--verbose=0: log only errors\n"
     "--help: displays this message\n", argv[0]);
@@ -472,10 +382,17 @@ static void print_usage(char **argv) {
 
 int main(int argc, char **argv)
 {
-  int scan_length = 8, truncate = 0, verbose = -1, flush = 0;
+  int truncate = 0, verbose = -1;
   FILE * out_file = stdout;
-  int dev_id, dev_sd, opt, rc;
-  bluetrax_inquiry_complete_t record;
+  const char *log_path = NULL;
+  const char *recorder_path = NULL;
+  char default_recorder_path[PATH_MAX];
+  char **args = argv;
+  int opt, rc, out_fd = -1;
+  long long reexec_nsec = 0;
+  bluetrax_capture_config_t config;
+  bluetrax_capture_sink_t sink;
+  sigset_t emptyset;
 
   static struct option options[] =
   {
@@ -484,33 +401,32 @@ int main(int argc, char **argv)
     {"length",   required_argument, 0, 'l'},
     {"verbose",  optional_argument, 0, 'v'},
     {"flush",    no_argument,       0, 'u'},
+    {"replay",   required_argument, 0, 'r'},
+    {"speed",    required_argument, 0, 's'},
+    {"loops",    required_argument, 0, 'n'},
+    {"device",   required_argument, 0, 'd'},
+    {"reorder-window", required_argument, 0, 'w'},
+    {"source",   required_argument, 0, 'S'},
+    {"log-file", required_argument, 0, 'L'},
+    {"flight-recorder", required_argument, 0, 'R'},
+    {"trace",    required_argument, 0, 'T'},
     {"help",     no_argument,       0, 'h'},
     {0, 0, 0, 0}
   };
 
-  while ((opt=getopt_long(argc, argv, "+f:tl:vuh", options, NULL)) != -1) {
+  bluetrax_capture_config_init(&config);
+
+  while ((opt=getopt_long(argc, argv, "+f:tl:vur:s:n:d:w:S:L:R:T:h", options, NULL)) != -1) {
     switch (opt) {
     case 't':
-      if (out_file != stdout) {
-        syslog(LOG_ERR, "--truncate must be passed before --file");
-        exit(EXIT_FAILURE);
-      }
       truncate = 1;
       break;
     case 'f':
-      if (truncate) {
-        out_file = fopen(optarg, "w");
-      } else {
-        out_file = fopen(optarg, "a");
-      }
-      if (out_file == NULL) { 
-        syslog(LOG_ERR, "failed to open output file: %m");
-        exit(EXIT_FAILURE);
-      }
+      out_path = optarg;
       break;
     case 'l':
-      scan_length = atoi(optarg);
-      if (scan_length < 1 || scan_length > 100) { 
+      config.scan_length = atoi(optarg);
+      if (config.scan_length < 1 || config.scan_length > 100) { 
         fprintf(stderr, "bad scan length: %s\n", optarg);
         exit(EXIT_FAILURE);
       }
@@ -523,7 +439,72 @@ int main(int argc, char **argv)
       }
       break;
     case 'u':
-      flush = 1;
+      config.flush = 1;
+      break;
+    case 'r':
+      if (0 == strcmp(optarg, "-")) {
+        config.replay_file = stdin;
+      } else {
+        config.replay_file = fopen(optarg, "r");
+      }
+      if (config.replay_file == NULL) {
+        bluetrax_log(LOG_ERR, "failed to open replay file: %m");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 's':
+      config.speed = atof(optarg);
+      if (config.speed < 0) {
+        fprintf(stderr, "bad replay speed: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'n':
+      config.loops = atoi(optarg);
+      if (config.loops < 1) {
+        fprintf(stderr, "bad replay loops: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'd':
+      if (0 == strcmp(optarg, "all")) {
+        config.all_devices = 1;
+        break;
+      }
+      if (config.num_devices == BLUETRAX_CAPTURE_MAX_DEVICES) {
+        fprintf(stderr, "too many devices; at most %d\n",
+            BLUETRAX_CAPTURE_MAX_DEVICES);
+        exit(EXIT_FAILURE);
+      }
+      config.dev_ids[config.num_devices] = hci_devid(optarg);
+      if (config.dev_ids[config.num_devices] < 0) {
+        fprintf(stderr, "bad device: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      ++config.num_devices;
+      break;
+    case 'w':
+      config.reorder_window = atol(optarg) * 1000;
+      if (config.reorder_window < 0) {
+        fprintf(stderr, "bad reorder window: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'S':
+      config.source_path = optarg;
+      break;
+    case 'L':
+      log_path = optarg;
+      break;
+    case 'R':
+      recorder_path = optarg;
+      break;
+    case 'T':
+      config.trace_interval = (int64_t)(atof(optarg) * 1e6);
+      if (config.trace_interval < 0) {
+        fprintf(stderr, "bad trace interval: %s\n", optarg);
+        exit(EXIT_FAILURE);
+      }
       break;
     case 'h':
     default:
@@ -540,60 +521,91 @@ int main(int argc, char **argv)
     exit(EXIT_FAILURE);
   }
 
-  /* use syslog for logging */
+  /* use syslog for logging, or the log file; either way, messages are shipped
+   * by a background thread, so a stalled syslogd can't hold up the scan */
   openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
   switch(verbose) {
   case -1:
-    setlogmask(LOG_UPTO(LOG_NOTICE)); 
+    bluetrax_log_setmask(LOG_UPTO(LOG_NOTICE));
     break;
   case 0:
-    setlogmask(LOG_UPTO(LOG_ERR)); 
+    bluetrax_log_setmask(LOG_UPTO(LOG_ERR));
     break;
   /* else: verbose output: log everything */
   }
+  if (bluetrax_log_open(log_path)) {
+    bluetrax_log(LOG_ERR, "failed to open log file: %m");
+    return EXIT_FAILURE;
+  }
 
   if (!setup_signals()) {
-    syslog(LOG_ERR, "setup_signals: %m");
+    bluetrax_log(LOG_ERR, "setup_signals: %m");
     return EXIT_FAILURE;
   }
 
-  /* use the default bluetooth device */
-  dev_id = hci_get_route(NULL);
-  if (dev_id < 0) {
-    syslog(LOG_ERR, "hci_get_route: %m");
+  if (recorder_path == NULL) {
+    if (out_path)
+      snprintf(default_recorder_path, sizeof(default_recorder_path),
+          "%s.flight", out_path);
+    else if (log_path)
+      snprintf(default_recorder_path, sizeof(default_recorder_path),
+          "%s.flight", log_path);
+    else
+      snprintf(default_recorder_path, sizeof(default_recorder_path),
+          "/var/run/bluetrax_scan.%d.flight", (int)getpid());
+    recorder_path = default_recorder_path;
+  }
+  if (bluetrax_recorder_open(recorder_path) ||
+      bluetrax_recorder_watchdog(STALL_TIMEOUT)) {
+    bluetrax_log(LOG_ERR, "failed to set up flight recorder: %m");
     return EXIT_FAILURE;
   }
 
-  dev_sd = hci_open_dev(dev_id);
-  if (dev_sd < 0) {
-    syslog(LOG_ERR, "hci_open_dev: %m");
+  /* a re-exec runs whatever binary is at this path by then */
+  if (readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1) < 0)
+    bluetrax_log(LOG_WARNING, "readlink /proc/self/exe: %m; can't re-exec");
+
+  config.num_sockets = inherit_descriptors(&out_fd, config.sockets,
+      &reexec_nsec);
+  if (config.num_sockets < 0) {
+    bluetrax_log(LOG_ERR, "bad %s from re-exec", INHERIT_ENV);
+    return EXIT_FAILURE;
+  }
+  if (config.num_sockets > 0)
+    out_file = fdopen(out_fd, "a");
+  else if (out_path)
+    out_file = fopen(out_path, truncate ? "w" : "a");
+  if (out_file == NULL) {
+    bluetrax_log(LOG_ERR, "failed to open output file: %m");
     return EXIT_FAILURE;
   }
 
-  rc = start_scan(dev_sd, scan_length);
-  if (rc == EXIT_SUCCESS) {
-    /* write a fake 'complete' record with the start time of the first scan */
-    gettimeofday(&record.time, NULL);
-    rc = write_inquiry_complete(out_file, record);
+  /* there's nothing to hand over from a replay */
+  if (config.replay_file)
+    signal(SIGUSR2, SIG_IGN);
 
-    if (rc == EXIT_SUCCESS)
-      rc = run_scan(dev_sd, scan_length, flush, out_file);
+  /* signals are handled only while the capture waits */
+  sigemptyset(&emptyset);
+  config.wait_mask = &emptyset;
 
-    stop_scan(dev_sd);
-  }
+  bzero(&sink, sizeof(sink));
+  sink.batch = write_records;
+  sink.flush = flush_records;
+  sink.poll = reopen_output;
+  sink.arg = out_file;
+
+  capture = bluetrax_capture_start(&config, &sink);
+  if (capture == NULL)
+    return EXIT_FAILURE;
+  if (config.num_sockets > 0)
+    log_resumed(config.num_sockets, reexec_nsec);
 
-  /* recovery:
-   * restart bluetooth
-   * I've seen toggling inqmode bring it back to life on my laptop after a
-   * period in which nothing was being detected; I've now seem this twice
-   * on my netbook: run
-   * hciconfig hci0 inqmode 0
-   * hciconfig hci0 inqmode 1
-   * and it seems to be happy again. It was detecting only some devices (a GPS
-   * logger but not my phone or computer) */
+  rc = run_until_stopped(args, log_path, out_file);
+  if (rc != EXIT_SUCCESS)
+    bluetrax_recorder_dump(config.replay_file ? "replay failed" :
+        "scan failed");
 
-  hci_close_dev(dev_sd);
+  bluetrax_capture_close(capture);
 
   return rc;
 }
-
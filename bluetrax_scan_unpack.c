@@ -1,17 +1,54 @@
 #include "bluetrax.h"
+#include "bluetrax_cursor.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <time.h>
 #include <syslog.h>
+#include <sys/time.h>
 
 /**
- * Write fields for the device class bytes. We're not very interested in the
- * services byte, so they just get printed as a number.
+ * With --threads, the input is read in chunks of up to this many bytes, which
+ * are cut back to the last whole record; each chunk is formatted as a batch.
+ */
+#define BATCH_SIZE (64*1024)
+
+/**
+ * With --threads, each formatter thread can have up to this many batches read,
+ * being formatted or waiting to be written at a time.
+ */
+#define BATCHES_PER_THREAD 4
+
+/**
+ * With --start or --end, records are read from the cursor this many at a time.
+ */
+#define RANGE_BATCH_SIZE 256
+
+/**
+ * With --codes, the class of device is written as a code instead of as names.
+ * The code is just the major and minor class bytes, (major << 8) | minor, so
+ * the same class has the same code in every file.
+ */
+#define NUM_CLASS_CODES 65536
+
+/**
+ * Set of class codes, one bit each.
+ */
+typedef struct {
+  uint64_t bits[NUM_CLASS_CODES / 64];
+} class_codes_t;
+
+/**
+ * Write the major and minor device class names, as two fields (without a
+ * trailing comma); both are empty if the major class is not known.
  *
  * Based on cmd_class from:
  * http://lxr.post-tech.com/source/external/bluetooth/bluez/tools/hciconfig.c
  */
-static void write_dev_class(uint8_t dev_class[3]) {
+static void write_class_names(FILE *out, uint8_t major, uint8_t minor) {
   static const char *major_devices[] = { "Miscellaneous",
                                          "Computer",
                                          "Phone",
@@ -20,28 +57,68 @@ static void write_dev_class(uint8_t dev_class[3]) {
                                          "Peripheral",
                                          "Imaging",
                                          "Uncategorized" };
-  uint8_t service = dev_class[2];
-  uint8_t major = dev_class[1];
-  uint8_t minor = dev_class[0];
-
-  printf("%hhd,", service);
 
   if ((major & 0x1f) >= sizeof(major_devices) / sizeof(*major_devices)) {
-    fputs(",,", stdout);
+    fputs(",", out);
   } else {
-    printf("%s,%s,", major_devices[major & 0x1f], 
+    fprintf(out, "%s,%s", major_devices[major & 0x1f], 
         bluetrax_get_minor_device_name(major, minor));
   }
 }
 
+static int class_code(uint8_t dev_class[3]) {
+  return dev_class[1] << 8 | dev_class[0];
+}
+
+static int has_class_code(class_codes_t *codes, int code) {
+  return (codes->bits[code / 64] >> (code % 64)) & 1;
+}
+
+static void add_class_code(class_codes_t *codes, int code) {
+  codes->bits[code / 64] |= (uint64_t)1 << (code % 64);
+}
+
+/**
+ * Write the dictionary line that gives the names for a class code:
+ *   #class,code,major,minor
+ */
+static void write_class_entry(FILE *out, int code) {
+  fprintf(out, "#class,%d,", code);
+  write_class_names(out, code >> 8, code & 0xff);
+  fputc('\n', out);
+}
+
+/**
+ * Write fields for the device class bytes. We're not very interested in the
+ * services byte, so they just get printed as a number.
+ *
+ * If codes is not NULL, the class is written as one code field, rather than as
+ * the major and minor names, and the code is added to codes.
+ */
+static void write_dev_class(FILE *out, uint8_t dev_class[3],
+    class_codes_t *codes) {
+  int code;
+
+  fprintf(out, "%hhd,", dev_class[2]);
+
+  if (codes) {
+    code = class_code(dev_class);
+    add_class_code(codes, code);
+    fprintf(out, "%d,", code);
+  } else {
+    write_class_names(out, dev_class[1], dev_class[0]);
+    fputc(',', out);
+  }
+}
+
 /**
  * Write a bluetooth device address (a MAC address) as a string.
  */
-static void write_bdaddr(bdaddr_t bdaddr) {
+static void write_bdaddr(FILE *out, bdaddr_t bdaddr) {
   char addr[18] = { 0 };
 
   ba2str(&bdaddr, addr);
-  printf("%s,", addr);
+  fprintf(out, "%s,", addr);
 }
 
 /**
@@ -51,98 +128,539 @@ static void write_bdaddr(bdaddr_t bdaddr) {
  * Based on
  * http://stackoverflow.com/questions/1551597
  */
-static void write_timeval(struct timeval *tv) {
+static void write_timeval(FILE *out, struct timeval tv) {
   char fmt[64];
-  struct tm *tm;
+  struct tm tm;
 
-  if((tm = localtime(&tv->tv_sec)) == NULL) {
+  if(localtime_r(&tv.tv_sec, &tm) == NULL) {
     syslog(LOG_ERR, "write_timeval: localtime: %m");
     exit(EXIT_FAILURE);
   }
     
-  strftime(fmt, sizeof fmt, "%Y-%m-%d %H:%M:%S.%%06u,", tm);
-  printf(fmt, tv->tv_usec);
+  strftime(fmt, sizeof fmt, "%Y-%m-%d %H:%M:%S.%%06u,", &tm);
+  fprintf(out, fmt, tv.tv_usec);
+}
+
+/**
+ * Write the CSV header line.
+ */
+static void write_header(FILE *out, int codes) {
+  if (codes)
+    fputs("type,time,bdaddr,services,class,rssi\n", out);
+  else
+    fputs("type,time,bdaddr,services,major,minor,rssi\n", out);
+}
+
+/**
+ * Write a record in human-readable form, on one line. If codes is not NULL,
+ * the class is written as a code; see write_dev_class.
+ */
+static void write_scan_record(FILE *out, bluetrax_scan_record_t *record,
+    class_codes_t *codes) {
+  switch(record->type) {
+    case EVT_INQUIRY_COMPLETE:
+      fputs("complete,", out);
+      write_timeval(out, record->data.complete.time);
+      fputs(codes ? ",,,\n" : ",,,,\n", out);
+      break;
+    case EVT_INQUIRY_RESULT:
+      fputs("inquiry,", out);
+      write_timeval(out, record->data.result.time);
+      write_bdaddr(out, record->data.result.bdaddr);
+      write_dev_class(out, record->data.result.dev_class, codes);
+      fputs(",\n", out);
+      break;
+    case EVT_INQUIRY_RESULT_WITH_RSSI:
+      fputs("inquiry,", out);
+      write_timeval(out, record->data.result_with_rssi.time);
+      write_bdaddr(out, record->data.result_with_rssi.bdaddr);
+      write_dev_class(out, record->data.result_with_rssi.dev_class,
+          codes);
+      fprintf(out, "%hhd\n", record->data.result_with_rssi.rssi);
+      break;
+  }
+}
+
+/**
+ * The class bytes of a record, if it has them.
+ *
+ * @return NULL if the record has no class
+ */
+static uint8_t *record_dev_class(bluetrax_scan_record_t *record) {
+  switch(record->type) {
+    case EVT_INQUIRY_RESULT:
+      return record->data.result.dev_class;
+    case EVT_INQUIRY_RESULT_WITH_RSSI:
+      return record->data.result_with_rssi.dev_class;
+  }
+  return NULL;
+}
+
+/**
+ * Write a record, as for write_scan_record, for a reader that goes through the
+ * records in order. If written is not NULL, the class is written as a code,
+ * and the code's dictionary line is written first if it is not in written.
+ */
+static void write_record_line(FILE *out, bluetrax_scan_record_t *record,
+    class_codes_t *written) {
+  uint8_t *dev_class;
+  int code;
+
+  if (written && (dev_class = record_dev_class(record)) != NULL) {
+    code = class_code(dev_class);
+    if (!has_class_code(written, code))
+      write_class_entry(out, code);
+  }
+  write_scan_record(out, record, written);
+}
+
+/**
+ * An empty set of class codes, if codes is set.
+ *
+ * @return NULL if codes is not set
+ */
+static class_codes_t *new_class_codes(int codes) {
+  class_codes_t *set;
+
+  if (!codes)
+    return NULL;
+
+  set = calloc(1, sizeof(class_codes_t));
+  if (set == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    exit(EXIT_FAILURE);
+  }
+  return set;
 }
 
 /**
 * Read binary stream from the bluetrax_scan program and print them in
 * human-readable form, one per line.
+*
+* With codes set, the class is written as a code, and each code's dictionary
+* line is written just before the first record that uses it.
 */
-static void binary_to_text(FILE *file) {
-  int tag;
-  bluetrax_inquiry_complete_t inquiry_complete;
-  bluetrax_inquiry_result_t inquiry_result;
-  bluetrax_inquiry_result_with_rssi_t inquiry_result_with_rssi;
-
-  puts("type,time,bdaddr,services,major,minor,rssi");
-
-  /* read in the tag; this tells us how much more to read */
-  while (EOF != (tag = fgetc(file))) {
-    switch(tag) {
-      case EVT_INQUIRY_COMPLETE:
-        if (1 != fread(&inquiry_complete, sizeof inquiry_complete, 1, file)) {
-          syslog(LOG_ERR, "fread inquiry_complete: %m");
-          exit(EXIT_FAILURE);
-        }
-        
-        fputs("complete,", stdout);
-        write_timeval(&inquiry_complete.time);
-        fputs(",,,,\n", stdout);
+static void binary_to_text(FILE *file, int codes) {
+  int rc;
+  bluetrax_scan_record_t record;
+  class_codes_t *written = new_class_codes(codes);
+
+  write_header(stdout, codes);
+
+  while (1 == (rc = bluetrax_read_scan_record(file, &record))) {
+    write_record_line(stdout, &record, written);
+    fflush(stdout);
+  }
+  free(written);
+
+  if (rc < 0) {
+    syslog(LOG_ERR, "unsupported tag: %d", record.type);
+    exit(EXIT_FAILURE);
+  } else if (ferror(file) || record.type != EOF) {
+    syslog(LOG_ERR, "fread record: %m");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Write the records in a file from time start up to (but not including) time
+ * end. This uses a cursor to seek to the start, so it only formats the records
+ * in the range; opening the cursor still reads through the file once, to index
+ * it.
+ */
+static void range_to_text(char *path, struct timeval start,
+    struct timeval end, int codes) {
+  bluetrax_cursor_t *cursor;
+  bluetrax_scan_record_t records[RANGE_BATCH_SIZE];
+  struct timeval time;
+  class_codes_t *written = new_class_codes(codes);
+  int i, n;
+
+  cursor = bluetrax_cursor_open(&path, 1);
+  if (cursor == NULL) {
+    syslog(LOG_ERR, "bluetrax_cursor_open: %s: %m", path);
+    exit(EXIT_FAILURE);
+  }
+  if (bluetrax_cursor_seek(cursor, start)) {
+    syslog(LOG_ERR, "bluetrax_cursor_seek: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  write_header(stdout, codes);
+
+  while (0 < (n = bluetrax_cursor_next(cursor, records, RANGE_BATCH_SIZE))) {
+    for (i = 0; i < n; ++i) {
+      time = records[i].data.complete.time;
+      if (!timercmp(&time, &end, <))
+        break;
+      write_record_line(stdout, &records[i], written);
+    }
+    if (i < n)
+      break;
+  }
+  if (n < 0) {
+    syslog(LOG_ERR, "bluetrax_cursor_next: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  free(written);
+  bluetrax_cursor_close(cursor);
+}
+
+/**
+ * Parse a time in seconds since the epoch, which may have a fractional part;
+ * it is rounded to the nearest microsecond, since e.g. 0.1 is a little less
+ * than that as a double.
+ *
+ * @return 0 if the time is valid
+ */
+static int parse_time(const char *str, struct timeval *tv) {
+  char *end;
+  double t = strtod(str, &end);
+  long long usec;
+
+  if (end == str || *end != '\0' || t < 0)
+    return -1;
+  usec = llround(t * 1e6);
+  tv->tv_sec = (time_t)(usec / 1000000);
+  tv->tv_usec = (suseconds_t)(usec % 1000000);
+  return 0;
+}
+
+/**
+ * The first use of a class code in a batch: where the text of the first record
+ * with that code starts.
+ */
+typedef struct {
+  int    code;
+  size_t offset;
+} class_use_t;
+
+/**
+ * A chunk of input, cut at a record boundary, and its formatted text.
+ */
+typedef struct {
+  enum { BATCH_EMPTY, BATCH_READ, BATCH_FORMATTING, BATCH_FORMATTED } state;
+  unsigned long seq;
+  size_t size;
+  unsigned char data[BATCH_SIZE];
+  char *text;
+  size_t text_size;
+  class_codes_t classes;       /* with --codes, the codes used in the batch */
+  class_use_t *uses;           /* and their first uses, in order */
+  size_t num_uses, max_uses;
+} batch_t;
+
+/**
+ * State shared by the reader, formatter and writer threads. Batches go round
+ * the ring in order of seq; a single lock is enough, because threads only
+ * take it once per batch.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  batch_t *batches;
+  size_t num_batches;
+  unsigned long num_read;      /* batches read so far */
+  unsigned long next_format;   /* next batch to be formatted */
+  int done_reading;
+  int failed;
+  int in_fd;
+  int codes;
+} pipeline_t;
 
+/**
+ * Reader thread: read chunks of input and cut each one back to the last whole
+ * record, carrying the remainder over into the next chunk. A read from a pipe
+ * returns what is available, so a batch is passed on as soon as the input
+ * stalls, rather than waiting for it to fill up.
+ */
+static void *read_batches(void *arg) {
+  pipeline_t *p = arg;
+  batch_t *batch;
+  unsigned char carry[BLUETRAX_MAX_RECORD_SIZE];
+  size_t carry_size = 0, size, i, record_size;
+  ssize_t len;
+  int eof = 0;
+
+  while (!eof) {
+    pthread_mutex_lock(&p->lock);
+    batch = &p->batches[p->num_read % p->num_batches];
+    while (batch->state != BATCH_EMPTY)
+      pthread_cond_wait(&p->changed, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+
+    memcpy(batch->data, carry, carry_size);
+    size = carry_size;
+    i = 0;
+    while (i == 0) {
+      len = read(p->in_fd, batch->data + size, BATCH_SIZE - size);
+      if (len < 0 && errno == EINTR)
+        continue;
+      if (len < 0) {
+        syslog(LOG_ERR, "read: %m");
+        p->failed = 1;
+        eof = 1;
         break;
-      case EVT_INQUIRY_RESULT:
-        if (1 != fread(&inquiry_result, sizeof inquiry_result, 1, file)) {
-          syslog(LOG_ERR, "fread inquiry_result: %m");
-          exit(EXIT_FAILURE);
+      }
+      if (len == 0) {
+        if (size > 0) {
+          syslog(LOG_ERR, "truncated record at end of input");
+          p->failed = 1;
         }
-        
-        fputs("inquiry,", stdout);
-        write_timeval(&inquiry_result.time);
-        write_bdaddr(inquiry_result.bdaddr);
-        write_dev_class(inquiry_result.dev_class);
-        puts(",");
+        eof = 1;
         break;
-      case EVT_INQUIRY_RESULT_WITH_RSSI:
-        if (1 != fread(&inquiry_result_with_rssi,
-              sizeof inquiry_result_with_rssi, 1, file))
-        {
-          syslog(LOG_ERR, "fread inquiry_result_with_rssi: %m");
-          exit(EXIT_FAILURE);
+      }
+      size += len;
+
+      /* find the last record boundary */
+      for (;;) {
+        record_size = bluetrax_scan_record_size(batch->data[i]);
+        if (record_size == 0) {
+          syslog(LOG_ERR, "unsupported tag: %d", batch->data[i]);
+          p->failed = 1;
+          eof = 1;
+          size = i;
+          break;
         }
-        
-        fputs("inquiry,", stdout);
-        write_timeval(&inquiry_result_with_rssi.time);
-        write_bdaddr(inquiry_result_with_rssi.bdaddr);
-        write_dev_class(inquiry_result_with_rssi.dev_class);
-        printf("%hhd\n", inquiry_result_with_rssi.rssi);
+        if (i + 1 + record_size > size)
+          break;
+        i += 1 + record_size;
+        if (i == size)
+          break;
+      }
+      if (eof)
+        break;
+    }
+
+    carry_size = size - i;
+    memcpy(carry, batch->data + i, carry_size);
+
+    pthread_mutex_lock(&p->lock);
+    if (i > 0) {
+      batch->size = i;
+      batch->seq = p->num_read++;
+      batch->state = BATCH_READ;
+    }
+    p->done_reading = eof;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+  }
+
+  return NULL;
+}
+
+/**
+ * Note the first use of a class code in a batch, at offset in its text.
+ */
+static void add_class_use(batch_t *batch, int code, long offset) {
+  class_use_t *uses;
+
+  if (batch->num_uses == batch->max_uses) {
+    batch->max_uses = batch->max_uses ? 2 * batch->max_uses : 64;
+    uses = realloc(batch->uses, batch->max_uses * sizeof(class_use_t));
+    if (uses == NULL) {
+      syslog(LOG_ERR, "realloc: %m");
+      exit(EXIT_FAILURE);
+    }
+    batch->uses = uses;
+  }
+  batch->uses[batch->num_uses].code = code;
+  batch->uses[batch->num_uses].offset = offset;
+  ++batch->num_uses;
+}
+
+/**
+ * Formatter thread: take batches in order and format them into text, noting
+ * where each class code is first used, with --codes.
+ */
+static void *format_batches(void *arg) {
+  pipeline_t *p = arg;
+  batch_t *batch;
+  bluetrax_scan_record_t record;
+  uint8_t *dev_class;
+  FILE *out;
+  size_t i, size;
+
+  for (;;) {
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+      batch = &p->batches[p->next_format % p->num_batches];
+      if (batch->state == BATCH_READ && batch->seq == p->next_format)
         break;
-      default:
-        syslog(LOG_ERR, "unsupported tag: %d", tag);
-        exit(EXIT_FAILURE);
+      if (p->done_reading && p->next_format == p->num_read) {
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+      }
+      pthread_cond_wait(&p->changed, &p->lock);
+    }
+    batch->state = BATCH_FORMATTING;
+    ++p->next_format;
+    pthread_mutex_unlock(&p->lock);
+
+    out = open_memstream(&batch->text, &batch->text_size);
+    if (out == NULL) {
+      syslog(LOG_ERR, "open_memstream: %m");
+      exit(EXIT_FAILURE);
+    }
+    if (p->codes) {
+      bzero(&batch->classes, sizeof(batch->classes));
+      batch->num_uses = 0;
     }
+    for (i = 0; i < batch->size; i += 1 + size) {
+      record.type = batch->data[i];
+      size = bluetrax_scan_record_size(record.type);
+      memcpy(&record.data, batch->data + i + 1, size);
+      if (p->codes && (dev_class = record_dev_class(&record)) != NULL &&
+          !has_class_code(&batch->classes, class_code(dev_class)))
+        add_class_use(batch, class_code(dev_class), ftell(out));
+      write_scan_record(out, &record, p->codes ? &batch->classes : NULL);
+    }
+    fclose(out);
+
+    pthread_mutex_lock(&p->lock);
+    batch->state = BATCH_FORMATTED;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+/**
+ * Write a formatted batch, with the dictionary line for each code that is not
+ * yet in written just before the first record that uses it, as binary_to_text
+ * does, and add the codes to written.
+ */
+static void write_batch_text(FILE *out, batch_t *batch,
+    class_codes_t *written) {
+  size_t start = 0, i;
+
+  for (i = 0; i < batch->num_uses; ++i) {
+    if (has_class_code(written, batch->uses[i].code))
+      continue;
+    fwrite(batch->text + start, 1, batch->uses[i].offset - start, out);
+    start = batch->uses[i].offset;
+    write_class_entry(out, batch->uses[i].code);
+    add_class_code(written, batch->uses[i].code);
+  }
+  fwrite(batch->text + start, 1, batch->text_size - start, out);
+}
+
+/**
+ * As for binary_to_text, but with a reader thread that cuts the input into
+ * batches, num_threads threads that format them, and this thread writing out
+ * the formatted batches in order. This does not need to seek, so it works on
+ * pipes.
+ *
+ * With codes set, the formatters can't tell which codes are new, so this thread
+ * puts in the dictionary lines for the codes that are new, where each is first
+ * used, and the output is the same as without threads.
+ */
+static void binary_to_text_pipelined(FILE *file, int num_threads, int codes) {
+  pipeline_t p;
+  pthread_t reader, *formatters;
+  batch_t *batch;
+  class_codes_t written;
+  unsigned long seq;
+  int i, done;
+
+  bzero(&p, sizeof(p));
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.changed, NULL);
+  p.in_fd = fileno(file);
+  p.codes = codes;
+  p.num_batches = BATCHES_PER_THREAD * num_threads;
+  p.batches = calloc(p.num_batches, sizeof(batch_t));
+  formatters = calloc(num_threads, sizeof(pthread_t));
+  if (p.batches == NULL || formatters == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    exit(EXIT_FAILURE);
+  }
 
+  if (0 != pthread_create(&reader, NULL, read_batches, &p)) {
+    syslog(LOG_ERR, "pthread_create: %m");
+    exit(EXIT_FAILURE);
+  }
+  for (i = 0; i < num_threads; ++i) {
+    if (0 != pthread_create(&formatters[i], NULL, format_batches, &p)) {
+      syslog(LOG_ERR, "pthread_create: %m");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  bzero(&written, sizeof(written));
+  write_header(stdout, codes);
+
+  for (seq = 0;; ++seq) {
+    pthread_mutex_lock(&p.lock);
+    batch = &p.batches[seq % p.num_batches];
+    while (!(done = p.done_reading && seq == p.num_read) &&
+        !(batch->state == BATCH_FORMATTED && batch->seq == seq))
+      pthread_cond_wait(&p.changed, &p.lock);
+    pthread_mutex_unlock(&p.lock);
+    if (done)
+      break;
+
+    if (codes)
+      write_batch_text(stdout, batch, &written);
+    else
+      fwrite(batch->text, 1, batch->text_size, stdout);
     fflush(stdout);
+    free(batch->text);
+    batch->text = NULL;
+
+    pthread_mutex_lock(&p.lock);
+    batch->state = BATCH_EMPTY;
+    pthread_cond_broadcast(&p.changed);
+    pthread_mutex_unlock(&p.lock);
   }
+
+  pthread_join(reader, NULL);
+  for (i = 0; i < num_threads; ++i)
+    pthread_join(formatters[i], NULL);
+  free(formatters);
+  for (i = 0; i < p.num_batches; ++i)
+    free(p.batches[i].uses);
+  free(p.batches);
+
+  if (p.failed)
+    exit(EXIT_FAILURE);
 }
 
 static void print_usage(char **argv) {
-  fprintf(stderr, "Usage: %s [--file=file] [--help]\n\n"
+  fprintf(stderr,
+    "Usage: %s [--file=file] [--threads=n] [--codes] [--start=t] [--end=t]\n"
+    "  [--help]\n\n"
     "--file file: name of file to read; if omitted, reads stdin\n"
+    "--threads n: format records on n threads, while another thread reads\n"
+    "  the input; default 0 (read and format on the main thread)\n"
+    "--codes: write the class as a code, (major << 8) | minor, instead of as\n"
+    "  major and minor names; the names for each code are written once, on a\n"
+    "  #class,code,major,minor line before the first record that uses it\n"
+    "--start t: write only records at or after time t, in seconds since the\n"
+    "  epoch; seeks in the file rather than formatting all of it (needs\n"
+    "  --file)\n"
+    "--end t: write only records before time t (needs --file)\n"
     "--help: displays this message\n", argv[0]);
 }
 
 int main(int argc, char **argv) { 
   FILE *file = stdin;
-  int opt;
+  char *path = NULL;
+  struct timeval start = { 0, 0 }, end = { 0, 0 };
+  int opt, num_threads = 0, codes = 0, range = 0;
 
   static struct option options[] =
   {
     {"help", no_argument,       0, 'h'},
     {"file", required_argument, 0, 'f'},
+    {"threads", required_argument, 0, 'j'},
+    {"codes", no_argument,       0, 'c'},
+    {"start", required_argument, 0, 's'},
+    {"end", required_argument, 0, 'e'},
     {0, 0, 0, 0}
   };
 
-  while ((opt=getopt_long(argc, argv, "+f:h", options, NULL)) != -1) {
+  while ((opt=getopt_long(argc, argv, "+f:j:cs:e:h", options, NULL)) != -1) {
     switch (opt) {
     case 'f':
       file = fopen(optarg, "r");
@@ -150,6 +668,25 @@ int main(int argc, char **argv) {
         perror("failed to open input file");
         exit(1);
       }
+      path = optarg;
+      break;
+    case 'j':
+      num_threads = atoi(optarg);
+      if (num_threads < 0) {
+        fprintf(stderr, "bad number of threads: %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'c':
+      codes = 1;
+      break;
+    case 's':
+    case 'e':
+      if (parse_time(optarg, opt == 's' ? &start : &end)) {
+        fprintf(stderr, "bad time: %s\n", optarg);
+        exit(1);
+      }
+      range = 1;
       break;
     case 'h':
     default:
@@ -168,7 +705,20 @@ int main(int argc, char **argv) {
 
   openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
 
-  binary_to_text(file);
+  if (range && (path == NULL || num_threads > 0)) {
+    fprintf(stderr, "--start and --end need --file, and not --threads\n");
+    exit(1);
+  }
+
+  if (range) {
+    if (end.tv_sec == 0 && end.tv_usec == 0)
+      end.tv_sec = LONG_MAX;
+    range_to_text(path, start, end, codes);
+  } else if (num_threads > 0) {
+    binary_to_text_pipelined(file, num_threads, codes);
+  } else {
+    binary_to_text(file, codes);
+  }
 
   return 0;
 }
@@ -0,0 +1,630 @@
+/*
+ * Find the records for particular devices in capture files, without an index.
+ *
+ * The files are mapped into memory and split into chunks, which are searched
+ * on several threads. Rather than decoding every record, the search looks for
+ * the bytes of the addresses anywhere in the file, which it can do 16 bytes at
+ * a time with SSE2 where that is available, and then checks that each hit
+ * falls where an address would be in a record, by checking the record's type
+ * byte and time and those of the next few records. The basic scan format has
+ * fixed size records, so hits there are checked just by their offsets.
+ *
+ * Addresses are given either in full (00:11:22:33:44:55) or as an OUI prefix
+ * (00:11:22), which matches all devices from one manufacturer.
+ *
+ * Output is one line per matching record, in file order:
+ *   file,offset,time,bdaddr,class,rssi
+ * where offset is that of the record in the file, class is the three class
+ * bytes in hex, and class and rssi are empty if the record does not have them.
+ */
+#include "bluetrax.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Files are searched in chunks of this size, so big files are split across
+ * threads.
+ */
+#define CHUNK_SIZE (8 << 20)
+
+/**
+ * With more distinct anchors than this, it is faster to look each position up
+ * in a bitmap than to compare against every anchor.
+ */
+#define MAX_SIMD_ANCHORS 8
+
+/**
+ * Number of records after a hit whose framing must also check out.
+ */
+#define CHECK_RECORDS 3
+
+/**
+ * Offset of the address in the scan records with addresses, after the type
+ * byte; the time comes first.
+ */
+#define SCAN_BDADDR_OFFSET (1 + sizeof(struct timeval))
+
+/**
+ * The candidates for a match are found by looking for two bytes of the
+ * address: the first two (in file order) for a full address, which are the
+ * most varied, or the first two of the OUI for a prefix.
+ */
+typedef struct {
+  uint8_t bytes[2];
+  int     offset;   /* of the two bytes in the address */
+} anchor_t;
+
+typedef struct {
+  uint8_t  *addrs;          /* sorted full addresses, 6 bytes each */
+  size_t    num_addrs;
+  uint8_t  *ouis;           /* sorted prefixes, 3 bytes each */
+  size_t    num_ouis;
+  anchor_t  anchors[MAX_SIMD_ANCHORS];
+  int       num_anchors;      /* may be more than MAX_SIMD_ANCHORS */
+  uint8_t   addr_bitmap[65536 / 8];   /* of anchor bytes for full addresses */
+  uint8_t   oui_bitmap[65536 / 8];    /* and for prefixes */
+} patterns_t;
+
+typedef struct {
+  const char    *path;
+  const uint8_t *data;
+  size_t         size;
+} mapped_file_t;
+
+typedef struct {
+  int    file;
+  size_t offset;
+} hit_t;
+
+typedef struct {
+  hit_t  *hits;
+  size_t  num_hits;
+  size_t  max_hits;
+} hits_t;
+
+typedef struct {
+  patterns_t     *patterns;
+  mapped_file_t  *files;
+  int             num_files;
+  int             basic;
+  int             file;       /* next chunk to search */
+  size_t          offset;
+  pthread_mutex_t lock;
+} search_t;
+
+/**
+ * Parse a full address or OUI prefix in the usual colon separated form. The
+ * bytes are stored in the order they appear in a bdaddr_t, which is the
+ * reverse of the string.
+ *
+ * @return number of bytes (6 or 3), or 0 if the string is not valid
+ */
+static int parse_addr(const char *str, uint8_t addr[6]) {
+  unsigned int b[6];
+  char end;
+  int n, i;
+
+  n = sscanf(str, "%2x:%2x:%2x:%2x:%2x:%2x%c",
+      &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &end);
+  if (n != 6 && n != 3)
+    return 0;
+  if (n == 3 && strlen(str) != 8)
+    return 0;
+  for (i = 0; i < n; ++i)
+    addr[5 - i] = b[i];
+  return n;
+}
+
+static int compare_addrs(const void *a, const void *b) {
+  return memcmp(a, b, 6);
+}
+
+static int compare_ouis(const void *a, const void *b) {
+  return memcmp(a, b, 3);
+}
+
+static void set_bit(uint8_t *bitmap, const uint8_t bytes[2]) {
+  int i = bytes[0] | bytes[1] << 8;
+  bitmap[i >> 3] |= 1 << (i & 7);
+}
+
+static int test_bit(const uint8_t *bitmap, const uint8_t *bytes) {
+  int i = bytes[0] | bytes[1] << 8;
+  return bitmap[i >> 3] & (1 << (i & 7));
+}
+
+/**
+ * Add an anchor, unless it is already there. Once there are too many, they
+ * are only counted, and the bitmaps are used instead.
+ */
+static void add_anchor(patterns_t *patterns, const uint8_t bytes[2],
+    int offset) {
+  int i;
+
+  if (patterns->num_anchors > MAX_SIMD_ANCHORS) {
+    ++patterns->num_anchors;
+    return;
+  }
+  for (i = 0; i < patterns->num_anchors; ++i) {
+    if (patterns->anchors[i].offset == offset &&
+        0 == memcmp(patterns->anchors[i].bytes, bytes, 2))
+      return;
+  }
+  if (patterns->num_anchors < MAX_SIMD_ANCHORS) {
+    memcpy(patterns->anchors[patterns->num_anchors].bytes, bytes, 2);
+    patterns->anchors[patterns->num_anchors].offset = offset;
+  }
+  ++patterns->num_anchors;
+}
+
+/**
+ * Add an address or prefix to the patterns.
+ *
+ * @return 0 if it is valid
+ */
+static int add_pattern(patterns_t *patterns, const char *str) {
+  uint8_t addr[6];
+  uint8_t **list;
+  size_t *num;
+  int n;
+
+  n = parse_addr(str, addr);
+  if (n == 0)
+    return -1;
+
+  list = n == 6 ? &patterns->addrs : &patterns->ouis;
+  num = n == 6 ? &patterns->num_addrs : &patterns->num_ouis;
+  *list = realloc(*list, (*num + 1) * n);
+  if (*list == NULL) {
+    syslog(LOG_ERR, "realloc: %m");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(*list + *num * n, n == 6 ? addr : addr + 3, n);
+  ++*num;
+
+  if (n == 6) {
+    set_bit(patterns->addr_bitmap, addr);
+    add_anchor(patterns, addr, 0);
+  } else {
+    set_bit(patterns->oui_bitmap, addr + 3);
+    add_anchor(patterns, addr + 3, 3);
+  }
+  return 0;
+}
+
+/**
+ * Read addresses from a file, one per line.
+ *
+ * @return 0 if no errors
+ */
+static int read_patterns(const char *path, patterns_t *patterns) {
+  FILE *file = fopen(path, "r");
+  char line[64];
+  unsigned long line_number = 0;
+
+  if (file == NULL) {
+    syslog(LOG_ERR, "%s: %m", path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    ++line_number;
+    line[strcspn(line, " \t\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
+    if (add_pattern(patterns, line)) {
+      syslog(LOG_ERR, "%s:%lu: bad address", path, line_number);
+      fclose(file);
+      return -1;
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+/**
+ * Whether the address at addr is one of the patterns.
+ */
+static int match_addr(patterns_t *patterns, const uint8_t *addr) {
+  return (patterns->num_addrs && bsearch(addr, patterns->addrs,
+        patterns->num_addrs, 6, compare_addrs)) ||
+    (patterns->num_ouis && bsearch(addr + 3, patterns->ouis,
+        patterns->num_ouis, 3, compare_ouis));
+}
+
+/**
+ * Whether there is a plausible scan record at offset: a known type byte, a
+ * time with a valid microseconds part, and room for the record in the file.
+ *
+ * @return size of the record including its type byte, or 0 if not plausible
+ */
+static size_t check_scan_record(const uint8_t *data, size_t size,
+    size_t offset) {
+  struct timeval time;
+  size_t record_size;
+
+  record_size = bluetrax_scan_record_size(data[offset]);
+  if (record_size == 0 || offset + 1 + record_size > size)
+    return 0;
+  memcpy(&time, data + offset + 1, sizeof(time));
+  if (time.tv_usec < 0 || time.tv_usec >= 1000000)
+    return 0;
+  return 1 + record_size;
+}
+
+/**
+ * Whether an address at offset is part of a record.
+ *
+ * @return offset of the record, or -1 if the address is not in a record
+ */
+static long frame_hit(search_t *search, const mapped_file_t *file,
+    size_t offset) {
+  size_t record, next, n;
+  int i;
+
+  if (search->basic) {
+    record = offset - offsetof(bluetrax_record_t, bdaddr);
+    if (offset < offsetof(bluetrax_record_t, bdaddr) ||
+        record % sizeof(bluetrax_record_t) != 0 ||
+        record + sizeof(bluetrax_record_t) > file->size)
+      return -1;
+    return record;
+  }
+
+  if (offset < SCAN_BDADDR_OFFSET)
+    return -1;
+  record = offset - SCAN_BDADDR_OFFSET;
+  if (file->data[record] != EVT_INQUIRY_RESULT &&
+      file->data[record] != EVT_INQUIRY_RESULT_WITH_RSSI)
+    return -1;
+  next = record;
+  for (i = 0; i <= CHECK_RECORDS && next < file->size; ++i) {
+    n = check_scan_record(file->data, file->size, next);
+    if (n == 0) {
+      /* a partial record at the end of a file that is still being written */
+      if (i > 0 && bluetrax_scan_record_size(file->data[next]) &&
+          next + 1 + bluetrax_scan_record_size(file->data[next]) > file->size)
+        break;
+      return -1;
+    }
+    next += n;
+  }
+  return record;
+}
+
+static void add_hit(hits_t *hits, int file, size_t offset) {
+  if (hits->num_hits == hits->max_hits) {
+    hits->max_hits = hits->max_hits ? 2 * hits->max_hits : 1024;
+    hits->hits = realloc(hits->hits, hits->max_hits * sizeof(hit_t));
+    if (hits->hits == NULL) {
+      syslog(LOG_ERR, "realloc: %m");
+      exit(EXIT_FAILURE);
+    }
+  }
+  hits->hits[hits->num_hits].file = file;
+  hits->hits[hits->num_hits].offset = offset;
+  ++hits->num_hits;
+}
+
+/**
+ * Check a candidate address position and record it if it is a hit.
+ */
+static void check_candidate(search_t *search, int f, long addr,
+    hits_t *hits) {
+  const mapped_file_t *file = &search->files[f];
+  long record;
+
+  if (addr < 0 || addr + 6 > (long)file->size ||
+      !match_addr(search->patterns, file->data + addr))
+    return;
+  record = frame_hit(search, file, addr);
+  if (record >= 0)
+    add_hit(hits, f, record);
+}
+
+/**
+ * Check the position for either kind of anchor, using the bitmaps.
+ */
+static void check_position(search_t *search, int f, size_t i, hits_t *hits) {
+  const uint8_t *data = search->files[f].data;
+
+  if (test_bit(search->patterns->addr_bitmap, data + i))
+    check_candidate(search, f, i, hits);
+  if (test_bit(search->patterns->oui_bitmap, data + i))
+    check_candidate(search, f, (long)i - 3, hits);
+}
+
+/**
+ * Search for anchors starting in [start, end) in a file.
+ */
+static void search_chunk(search_t *search, int f, size_t start, size_t end,
+    hits_t *hits) {
+  const mapped_file_t *file = &search->files[f];
+  size_t i = start;
+
+  /* anchors are two bytes, so the last byte can't start one */
+  if (end > file->size - 1)
+    end = file->size - 1;
+
+#ifdef __SSE2__
+  if (search->patterns->num_anchors <= MAX_SIMD_ANCHORS) {
+    patterns_t *patterns = search->patterns;
+    __m128i first[MAX_SIMD_ANCHORS], second[MAX_SIMD_ANCHORS], v0, v1;
+    unsigned int mask;
+    int k;
+
+    for (k = 0; k < patterns->num_anchors; ++k) {
+      first[k] = _mm_set1_epi8(patterns->anchors[k].bytes[0]);
+      second[k] = _mm_set1_epi8(patterns->anchors[k].bytes[1]);
+    }
+
+    /* positions i..i+15 need bytes up to i+16 */
+    for (; i + 16 <= end; i += 16) {
+      v0 = _mm_loadu_si128((const __m128i *)(file->data + i));
+      v1 = _mm_loadu_si128((const __m128i *)(file->data + i + 1));
+      for (k = 0; k < patterns->num_anchors; ++k) {
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v0, first[k]),
+              _mm_cmpeq_epi8(v1, second[k])));
+        while (mask) {
+          check_candidate(search, f,
+              (long)(i + __builtin_ctz(mask)) - patterns->anchors[k].offset,
+              hits);
+          mask &= mask - 1;
+        }
+      }
+    }
+  }
+#endif
+
+  for (; i < end; ++i)
+    check_position(search, f, i, hits);
+}
+
+static void *run_worker(void *arg) {
+  search_t *search = arg;
+  hits_t *hits = calloc(1, sizeof(hits_t));
+  size_t start;
+  int f;
+
+  if (hits == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&search->lock);
+    while (search->file < search->num_files &&
+        search->offset >= search->files[search->file].size) {
+      ++search->file;
+      search->offset = 0;
+    }
+    f = search->file;
+    start = search->offset;
+    search->offset += CHUNK_SIZE;
+    pthread_mutex_unlock(&search->lock);
+
+    if (f >= search->num_files)
+      break;
+    search_chunk(search, f, start, start + CHUNK_SIZE, hits);
+  }
+  return hits;
+}
+
+static int compare_hits(const void *a, const void *b) {
+  const hit_t *x = a, *y = b;
+
+  if (x->file != y->file)
+    return x->file - y->file;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static void write_time(struct timeval tv) {
+  char fmt[64];
+  struct tm tm;
+
+  if (localtime_r(&tv.tv_sec, &tm) == NULL) {
+    syslog(LOG_ERR, "write_time: localtime: %m");
+    exit(EXIT_FAILURE);
+  }
+  strftime(fmt, sizeof fmt, "%Y-%m-%d %H:%M:%S.%%06u,", &tm);
+  printf(fmt, (unsigned int)tv.tv_usec);
+}
+
+/**
+ * Write the line for a record.
+ */
+static void write_hit(search_t *search, hit_t *hit) {
+  const mapped_file_t *file = &search->files[hit->file];
+  bluetrax_scan_record_t record;
+  bluetrax_record_t basic;
+  char addr[18] = { 0 };
+  uint8_t *dev_class;
+
+  printf("%s,%lu,", file->path, (unsigned long)hit->offset);
+
+  if (search->basic) {
+    memcpy(&basic, file->data + hit->offset, sizeof(basic));
+    printf("%ld,", (long)basic.time);
+    ba2str(&basic.bdaddr, addr);
+    printf("%s,,\n", addr);
+    return;
+  }
+
+  record.type = file->data[hit->offset];
+  memcpy(&record.data, file->data + hit->offset + 1,
+      bluetrax_scan_record_size(record.type));
+  write_time(record.data.result.time);
+  ba2str(&record.data.result.bdaddr, addr);
+  dev_class = record.data.result.dev_class;
+  printf("%s,%02x%02x%02x,", addr, dev_class[2], dev_class[1], dev_class[0]);
+  if (record.type == EVT_INQUIRY_RESULT_WITH_RSSI)
+    printf("%hhd", record.data.result_with_rssi.rssi);
+  putchar('\n');
+}
+
+/**
+ * Map a file into memory.
+ *
+ * @return 0 if no errors
+ */
+static int map_file(const char *path, mapped_file_t *file) {
+  struct stat st;
+  int fd;
+
+  file->path = path;
+  file->data = NULL;
+  file->size = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    syslog(LOG_ERR, "%s: %m", path);
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  file->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file->data == MAP_FAILED) {
+    syslog(LOG_ERR, "%s: mmap: %m", path);
+    file->data = NULL;
+    return -1;
+  }
+  file->size = st.st_size;
+  madvise((void *)file->data, file->size, MADV_SEQUENTIAL);
+  return 0;
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s [options] file...\n\n"
+    "Find records for the given devices in bluetrax_scan output files.\n\n"
+    "--addr a: full address (00:11:22:33:44:55) or OUI prefix (00:11:22) to\n"
+    "  find; can be given more than once\n"
+    "--list file: file of addresses or prefixes to find, one per line\n"
+    "--basic: files are from bluetrax_basic_scan\n"
+    "--threads n: number of threads; default is the number of CPUs\n"
+    "--help: displays this message\n", argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+  static patterns_t patterns;
+  search_t search;
+  hits_t all, *hits;
+  pthread_t *threads;
+  int opt, num_threads, basic = 0, i, status = EXIT_SUCCESS;
+  size_t h;
+
+  static struct option options[] =
+  {
+    {"addr",    required_argument, 0, 'a'},
+    {"list",    required_argument, 0, 'l'},
+    {"basic",   no_argument,       0, 'b'},
+    {"threads", required_argument, 0, 'j'},
+    {"help",    no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+
+  num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1)
+    num_threads = 1;
+
+  while ((opt=getopt_long(argc, argv, "+a:l:bj:h", options, NULL)) != -1) {
+    switch (opt) {
+    case 'a':
+      if (add_pattern(&patterns, optarg)) {
+        syslog(LOG_ERR, "bad address: %s", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'l':
+      if (read_patterns(optarg, &patterns))
+        exit(EXIT_FAILURE);
+      break;
+    case 'b':
+      basic = 1;
+      break;
+    case 'j':
+      num_threads = atoi(optarg);
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind == argc || num_threads < 1 ||
+      patterns.num_addrs + patterns.num_ouis == 0) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  qsort(patterns.addrs, patterns.num_addrs, 6, compare_addrs);
+  qsort(patterns.ouis, patterns.num_ouis, 3, compare_ouis);
+
+  bzero(&search, sizeof(search));
+  search.patterns = &patterns;
+  search.basic = basic;
+  search.num_files = argc - optind;
+  search.files = calloc(search.num_files, sizeof(mapped_file_t));
+  threads = calloc(num_threads, sizeof(pthread_t));
+  if (search.files == NULL || threads == NULL) {
+    syslog(LOG_ERR, "calloc: %m");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_init(&search.lock, NULL);
+
+  for (i = 0; i < search.num_files; ++i) {
+    if (map_file(argv[optind + i], &search.files[i]))
+      status = EXIT_FAILURE;
+  }
+
+  for (i = 0; i < num_threads; ++i) {
+    if (0 != pthread_create(&threads[i], NULL, run_worker, &search)) {
+      syslog(LOG_ERR, "pthread_create: %m");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  bzero(&all, sizeof(all));
+  for (i = 0; i < num_threads; ++i) {
+    pthread_join(threads[i], (void **)&hits);
+    for (h = 0; h < hits->num_hits; ++h)
+      add_hit(&all, hits->hits[h].file, hits->hits[h].offset);
+    free(hits->hits);
+    free(hits);
+  }
+  free(threads);
+
+  /* a record can match both a full address and a prefix */
+  qsort(all.hits, all.num_hits, sizeof(hit_t), compare_hits);
+  puts("file,offset,time,bdaddr,class,rssi");
+  for (h = 0; h < all.num_hits; ++h) {
+    if (h > 0 && 0 == compare_hits(&all.hits[h - 1], &all.hits[h]))
+      continue;
+    write_hit(&search, &all.hits[h]);
+  }
+
+  return status;
+}
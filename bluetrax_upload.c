@@ -0,0 +1,400 @@
+/*
+ * Send records written by bluetrax_scan to bluetrax_collect.
+ *
+ * For live records, run it on the output of the scan, e.g.
+ *   bluetrax_scan | bluetrax_upload --host=collector --sensor=s1
+ * or on the scan's output file with --follow. To upload a spool of records
+ * kept while the collector could not be reached, use --backfill, so the live
+ * records from other sensors are not held up behind it.
+ *
+ * The collector sends credit for the bytes it is ready to take, and this
+ * never sends more than that; when it runs out, it waits for more. At the end,
+ * it logs how many bytes the collector has taken.
+ *
+ * It stamps the send hop on the trace records from bluetrax_scan --trace as
+ * they go out, and logs histograms of the latencies every hour and at the end.
+ * To find them, it follows the records through the stream; it does not hold
+ * any back, so a record may be split between sends, and its stamp with it.
+ */
+#include "bluetrax.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+
+#define DEFAULT_PORT "7711"
+
+/**
+ * Most bytes to send at once.
+ */
+#define CHUNK_SIZE (64 << 10)
+
+/**
+ * How often to look for more data at the end of the file with --follow, in
+ * milliseconds.
+ */
+#define FOLLOW_POLL_MS 200
+
+/**
+ * How often to log the latency histograms, in microseconds.
+ */
+#define LATENCY_REPORT_INTERVAL (3600 * 1000000LL)
+
+/**
+ * Where the stream is, in terms of records, so that trace records can be
+ * stamped as they go by.
+ */
+typedef struct {
+  int           type;       /* of the current record */
+  size_t        size;       /* of the current record, with its type byte */
+  size_t        done;       /* bytes of it already seen */
+  int           lost;       /* hit an unknown type; stop looking */
+  unsigned char trace[1 + sizeof(bluetrax_trace_t)]; /* the current trace */
+  int64_t       send;       /* stamp for it */
+  bluetrax_latency_t latency[BLUETRAX_TRACE_HOPS];
+  int64_t       last_report;
+} tracer_t;
+
+static volatile sig_atomic_t request_stop = 0;
+
+static void handle_signal(int signo) {
+  request_stop = 1;
+}
+
+static int setup_signals(void) {
+  struct sigaction sa;
+
+  sa.sa_handler = handle_signal;
+  sa.sa_flags = 0;
+
+  return
+    0 == sigemptyset(&sa.sa_mask) &&
+    0 == sigaction(SIGINT, &sa, NULL) &&
+    0 == sigaction(SIGTERM, &sa, NULL) &&
+    SIG_ERR != signal(SIGPIPE, SIG_IGN);
+}
+
+static int connect_collector(const char *host, const char *port) {
+  struct addrinfo hints, *addrs, *a;
+  int fd = -1, rc;
+
+  bzero(&hints, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  rc = getaddrinfo(host, port, &hints, &addrs);
+  if (rc) {
+    syslog(LOG_ERR, "getaddrinfo: %s: %s", host, gai_strerror(rc));
+    return -1;
+  }
+
+  for (a = addrs; a; a = a->ai_next) {
+    fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+    if (fd < 0)
+      continue;
+    if (0 == connect(fd, a->ai_addr, a->ai_addrlen))
+      break;
+    close(fd);
+    fd = -1;
+  }
+  if (fd < 0)
+    syslog(LOG_ERR, "failed to connect to %s port %s: %m", host, port);
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+static int send_all(int fd, const void *data, size_t size) {
+  const char *p = data;
+  ssize_t n;
+
+  while (size > 0) {
+    n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR && !request_stop)
+        continue;
+      return -1;
+    }
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/**
+ * Read credit from the collector, waiting at most timeout milliseconds (-1 to
+ * wait for it).
+ *
+ * @return 0 if no errors (even if there was no credit); -1 if the collector
+ *         closed the connection or on error
+ */
+static int read_credit(int fd, uint64_t *credit, int timeout) {
+  static unsigned char buf[sizeof(uint32_t)];
+  static size_t held;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  uint32_t grant;
+  ssize_t n;
+
+  for (;;) {
+    n = poll(&pfd, 1, timeout);
+    if (n < 0)
+      return errno == EINTR ? 0 : -1;
+    if (n == 0)
+      return 0;
+    n = recv(fd, buf + held, sizeof(buf) - held, MSG_DONTWAIT);
+    if (n < 0)
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    if (n == 0) {
+      errno = ECONNRESET;
+      return -1;
+    }
+    held += n;
+    if (held == sizeof(buf)) {
+      memcpy(&grant, buf, sizeof(grant));
+      *credit += ntohl(grant);
+      held = 0;
+    }
+    /* take whatever else is there, but don't wait for it */
+    timeout = 0;
+  }
+}
+
+static void report_latency(tracer_t *tracer) {
+  char summary[128];
+  int hop;
+
+  for (hop = 0; hop < BLUETRAX_TRACE_HOPS; ++hop) {
+    if (bluetrax_latency_count(&tracer->latency[hop]) == 0)
+      continue;
+    bluetrax_latency_format(&tracer->latency[hop], summary, sizeof(summary));
+    syslog(LOG_NOTICE, "latency: %s: %s", bluetrax_hop_name(hop), summary);
+  }
+  bzero(tracer->latency, sizeof(tracer->latency));
+}
+
+/**
+ * Stamp the send hop on any trace records in the n bytes in buf, which are
+ * about to be sent; they carry on from the bytes passed last time.
+ */
+static void stamp_traces(tracer_t *tracer, unsigned char *buf, size_t n) {
+  const size_t send_offset = 1 + offsetof(bluetrax_trace_t, hop) +
+    BLUETRAX_HOP_SEND * sizeof(int64_t);
+  int64_t hop[BLUETRAX_TRACE_HOPS] = { 0 };
+  size_t i = 0, span, from, to;
+
+  while (i < n && !tracer->lost) {
+    if (tracer->done == tracer->size) {
+      tracer->type = buf[i];
+      tracer->size = 1 + bluetrax_scan_record_size(tracer->type);
+      tracer->done = 0;
+      if (tracer->size == 1) {
+        syslog(LOG_WARNING, "unknown record type %d; not stamping traces",
+            tracer->type);
+        tracer->lost = 1;
+        break;
+      }
+      if (tracer->type == BLUETRAX_TRACE)
+        tracer->send = bluetrax_trace_now();
+    }
+
+    span = tracer->size - tracer->done;
+    if (span > n - i)
+      span = n - i;
+    if (tracer->type == BLUETRAX_TRACE) {
+      /* the part of the send stamp that falls in this span */
+      from = tracer->done > send_offset ? tracer->done : send_offset;
+      to = tracer->done + span < send_offset + sizeof(int64_t) ?
+        tracer->done + span : send_offset + sizeof(int64_t);
+      if (from < to)
+        memcpy(buf + i + (from - tracer->done),
+            (unsigned char *)&tracer->send + (from - send_offset), to - from);
+      memcpy(tracer->trace + tracer->done, buf + i, span);
+    }
+    tracer->done += span;
+    i += span;
+
+    if (tracer->type == BLUETRAX_TRACE && tracer->done == tracer->size) {
+      memcpy(hop, tracer->trace + 1 + offsetof(bluetrax_trace_t, hop),
+          BLUETRAX_HOP_VISIBLE * sizeof(int64_t));
+      bluetrax_latency_add_trace(tracer->latency, hop, BLUETRAX_HOP_SEND);
+      if (tracer->last_report == 0)
+        tracer->last_report = tracer->send;
+      else if (tracer->send - tracer->last_report >= LATENCY_REPORT_INTERVAL) {
+        report_latency(tracer);
+        tracer->last_report = tracer->send;
+      }
+    }
+  }
+}
+
+static void print_usage(char **argv) {
+  fprintf(stderr,
+    "Usage: %s [options]\n\n"
+    "Send records to bluetrax_collect.\n\n"
+    "--host h: collector to send to (required)\n"
+    "--port p: collector's port; default " DEFAULT_PORT "\n"
+    "--sensor s: name of this sensor (required)\n"
+    "--file f: file to send; if omitted, reads stdin\n"
+    "--follow: at the end of the file, wait for more, as for tail -f\n"
+    "--backfill: the records are old, so should not hold up live ones\n"
+    "--help: displays this message\n", argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+  static char buf[CHUNK_SIZE];
+  const char *host = NULL, *port = DEFAULT_PORT, *sensor = NULL;
+  const char *path = NULL;
+  uint64_t credit = 0, sent = 0, window;
+  char hello[128];
+  tracer_t tracer;
+  int opt, follow = 0, backfill = 0, in_fd = STDIN_FILENO, fd;
+  int status = EXIT_SUCCESS;
+  size_t want;
+  ssize_t n;
+
+  static struct option options[] =
+  {
+    {"host",     required_argument, 0, 'H'},
+    {"port",     required_argument, 0, 'p'},
+    {"sensor",   required_argument, 0, 's'},
+    {"file",     required_argument, 0, 'f'},
+    {"follow",   no_argument,       0, 'F'},
+    {"backfill", no_argument,       0, 'b'},
+    {"help",     no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  openlog(NULL, LOG_PID | LOG_PERROR | LOG_CONS, LOG_USER);
+  bzero(&tracer, sizeof(tracer));
+
+  while ((opt=getopt_long(argc, argv, "+H:p:s:f:Fbh", options, NULL)) != -1) {
+    switch (opt) {
+    case 'H':
+      host = optarg;
+      break;
+    case 'p':
+      port = optarg;
+      break;
+    case 's':
+      sensor = optarg;
+      break;
+    case 'f':
+      path = optarg;
+      break;
+    case 'F':
+      follow = 1;
+      break;
+    case 'b':
+      backfill = 1;
+      break;
+    case 'h':
+    default:
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc || host == NULL || sensor == NULL ||
+      strchr(sensor, ' ') || strchr(sensor, '\n')) {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  if (path) {
+    in_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (in_fd < 0) {
+      syslog(LOG_ERR, "failed to open %s: %m", path);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (!setup_signals()) {
+    syslog(LOG_ERR, "failed to set up signals: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  fd = connect_collector(host, port);
+  if (fd < 0)
+    exit(EXIT_FAILURE);
+  snprintf(hello, sizeof(hello), "BTX1 %s %s\n", sensor,
+      backfill ? "backfill" : "live");
+  if (send_all(fd, hello, strlen(hello))) {
+    syslog(LOG_ERR, "send: %m");
+    exit(EXIT_FAILURE);
+  }
+
+  /* the first credit is the window; after that, the collector gives back
+   * credit for what it takes */
+  while (credit == 0 && !request_stop) {
+    if (read_credit(fd, &credit, -1)) {
+      syslog(LOG_ERR, "collector closed the connection: %m");
+      exit(EXIT_FAILURE);
+    }
+  }
+  window = credit;
+
+  while (!request_stop) {
+    if (sent == credit) {
+      if (read_credit(fd, &credit, -1)) {
+        syslog(LOG_ERR, "collector closed the connection: %m");
+        status = EXIT_FAILURE;
+        break;
+      }
+      continue;
+    }
+
+    want = credit - sent < sizeof(buf) ? credit - sent : sizeof(buf);
+    n = read(in_fd, buf, want);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      syslog(LOG_ERR, "read: %m");
+      status = EXIT_FAILURE;
+      break;
+    }
+    if (n == 0) {
+      if (!follow)
+        break;
+      /* take credit while waiting, so it's there when the data is */
+      if (read_credit(fd, &credit, FOLLOW_POLL_MS)) {
+        syslog(LOG_ERR, "collector closed the connection: %m");
+        status = EXIT_FAILURE;
+        break;
+      }
+      continue;
+    }
+
+    stamp_traces(&tracer, (unsigned char *)buf, n);
+    if (send_all(fd, buf, n)) {
+      syslog(LOG_ERR, "send: %m");
+      status = EXIT_FAILURE;
+      break;
+    }
+    sent += n;
+    if (read_credit(fd, &credit, 0)) {
+      syslog(LOG_ERR, "collector closed the connection: %m");
+      status = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  /* wait for the collector to take the rest and close the connection */
+  if (status == EXIT_SUCCESS) {
+    shutdown(fd, SHUT_WR);
+    while (0 == read_credit(fd, &credit, -1) && !request_stop)
+      ;
+  }
+  syslog(LOG_NOTICE, "sent %llu bytes; collector has taken %llu",
+      (unsigned long long)sent, (unsigned long long)(credit - window));
+  report_latency(&tracer);
+  close(fd);
+  return status;
+}